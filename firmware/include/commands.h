@@ -24,21 +24,10 @@
 #include <stdint.h>
 
 /*
- * Command definition
+ * The opcodes and the constants shared with the host are defined in
+ * protocol/commands.def, protocol.h is generated from it.
  */
-#define CMD_GET_VERSION   0x80
-#define CMD_GET_STATUS    0x81
-#define CMD_SETUP_IOPORT  0x82    // PORTxCFG and OEx
-#define CMD_SET_IOPORT    0x83    // write OUTx
-#define CMD_GET_IOPORT    0x84    // read INx
-#define CMD_READ_EEPROM   0x85    // read from EEPROM
-#define CMD_WRITE_EEPROM  0x86    // write to EEPROM
-#define CMD_READ_XDATA    0x87    // read from XDATA
-#define CMD_WRITE_XDATA   0x88    // write to XDATA
-#define CMD_READ_I2C      0x89    // generic read at I2C bus
-#define CMD_WRITE_I2C     0x8A    // generic write at I2C bus
-// TODO: other peripherals (UART, ...), external memory, ...
-// 0xA0 .. 0xAF are reserved by Anchor / Cypress
+#include "protocol.h"
 
 /* Command: GetVersion ******************************************************/
 typedef struct {
@@ -47,15 +36,51 @@ typedef struct {
   // devices, ... and fill these fields in GetVersion() in commands.c ...
 } TGetVersion;
 
-#define FIRMWARE_VERSION 0x0001   // 0x00 . 0x01 -> 0.1
+#define FIRMWARE_VERSION 0x0002   // 0x00 . 0x02 -> 0.2
+
+/* Command: GetCaps *********************************************************/
+/**
+ * Capability descriptor, exactly one EP2 IN packet
+ *
+ * The host reads it on connect to know which commands the firmware supports
+ * and with which limits. Old firmware doesn't answer CMD_GET_CAPS at all.
+ */
+typedef struct {
+  uint8_t  Size;         // sizeof(TGetCaps), later versions may append fields
+  uint8_t  Protocol;     // PROTOCOL_VERSION
+  uint16_t Firmware;     // FIRMWARE_VERSION
+  uint8_t  FirstOpcode;  // CAPS_FIRST_OPCODE
+  uint8_t  NumOpcodes;   // CAPS_NUM_OPCODES
+  uint8_t  Opcodes[(CAPS_NUM_OPCODES+7)/8];  // bit n: FirstOpcode+n supported
+  uint8_t  EPIn;         // endpoint addresses of the data phase
+  uint8_t  EPOut;
+  uint8_t  EPPoll;       // I2C polling records
+  uint8_t  PacketSize;   // size of the endpoint buffers
+  uint8_t  PollEntries;  // POLL_MAX_ENTRIES
+  uint8_t  PollLength;   // POLL_MAX_LENGTH
+  uint8_t  I2CSpeeds;    // CAPS_I2C_*
+  uint16_t MaxLength[CAPS_NUM_OPCODES];  // max. wValue if it is a length or
+                                         // packet count, 0 otherwise
+} TGetCaps;
 
 /* Command: GetStatus *******************************************************/
 typedef struct {
-  uint8_t  MyStatus;     // dummy field
+  uint16_t I2CNacks;     // I2C transfers not acknowledged since reset
+  uint16_t I2CBusErrors; // I2C bus errors since reset
   // ... add further fields with various status information and fill these
   // fields in GetStatus() in commands.c ...
 } TGetStatus;
 
+/* Command: Source, Sink, Echo, LinkStatus *********************************/
+typedef struct {
+  uint32_t Bytes;        // bytes transferred so far
+  uint32_t BitErrors;    // sink: bits which differ from the pattern
+  uint16_t Checksum;     // sink: sum of all received bytes
+  uint16_t Frames;       // SOF frames from the start to the last packet
+  uint8_t  Pattern;      // LINK_PATTERN_*
+  uint8_t  Done;         // all packets were transferred
+} TLinkStatus;
+
 /* Common *******************************************************************/
 
 void command_loop(void);
@@ -24,11 +24,29 @@
 
 typedef enum {I2C_OK,I2C_BUSY,I2C_BERROR,I2C_NACK} I2C_Status;
 
+/**
+ * Segment of a scatter-gather chain
+ *
+ * A transfer can be composed of several segments, e.g. an address header in a
+ * local variable and the payload in an endpoint buffer, without copying them
+ * into one buffer first.
+ */
+typedef struct {
+  __xdata uint8_t* ptr;
+  uint8_t          length;
+} I2C_Segment;
+
+extern uint16_t i2c_nacks;     // number of transfers not acknowledged
+extern uint16_t i2c_berrors;   // number of bus errors
+
 void i2c_init();
-I2C_Status i2c_start_read (uint8_t addr, uint8_t length, __xdata uint8_t* ptr);
-I2C_Status i2c_start_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr);
+I2C_Status i2c_start_read (uint8_t addr, __xdata I2C_Segment* seg, uint8_t count);
+I2C_Status i2c_start_write(uint8_t addr, __xdata I2C_Segment* seg, uint8_t count);
+I2C_Status i2c_readv (uint8_t addr, __xdata I2C_Segment* seg, uint8_t count);
+I2C_Status i2c_writev(uint8_t addr, __xdata I2C_Segment* seg, uint8_t count);
 I2C_Status i2c_read (uint8_t addr, uint8_t length, __xdata uint8_t* ptr);
 I2C_Status i2c_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr);
+I2C_Status i2c_status();
 
 #endif  // __I2C_H
 
@@ -0,0 +1,75 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __POLL_H
+#define __POLL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define POLL_MAX_ENTRIES  8     // size of the polling table
+#define POLL_MAX_LENGTH   16    // maximum number of bytes read per entry
+#define POLL_FLUSH_MS     10    // maximum age of a partly filled packet
+
+/* Flags of a polling table entry */
+#define POLL_NO_REG       0x01  // don't write a register address before reading
+
+/**
+ * Entry of the polling table as sent by the host with CMD_POLL_SETUP
+ */
+typedef struct {
+  uint8_t  Addr;         // 7-bit I2C slave address
+  uint8_t  Reg;          // register address, written before each read
+  uint8_t  Len;          // number of bytes to read, 1..POLL_MAX_LENGTH
+  uint8_t  Flags;        // POLL_* flags
+  uint16_t Period;       // sampling period in ms (USB frames)
+} TPollEntry;
+
+/**
+ * Record header in the EP4 IN packets, followed by Len data bytes
+ */
+typedef struct {
+  uint8_t  Id;           // index of the entry in the polling table
+  uint8_t  Status;       // I2C_Status of the transfer
+  uint16_t Time;         // timestamp in ms (USB frames) when the read started
+} TPollRecord;
+
+/**
+ * Response to CMD_POLL_CONTROL with POLL_CTRL_STATUS
+ */
+typedef struct {
+  uint8_t  Running;      // 1 if polling is active
+  uint8_t  Count;        // number of entries in the polling table
+  uint16_t Overruns;     // samples dropped because EP4 IN was still full
+} TPollStatus;
+
+/* Sub-commands for CMD_POLL_CONTROL (in wValue) */
+#define POLL_CTRL_STOP    0
+#define POLL_CTRL_START   1
+#define POLL_CTRL_CLEAR   2
+#define POLL_CTRL_STATUS  3
+
+void poll_init(void);
+bool poll_add(__xdata TPollEntry* entry);
+void poll_control(uint8_t ctrl);
+void poll_task(void);
+void poll_sync(void);
+uint16_t poll_now(void);
+
+#endif  // __POLL_H
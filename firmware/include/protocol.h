@@ -0,0 +1,95 @@
+/* generated by protocol/genproto.awk from protocol/commands.def, don't edit */
+
+#ifndef __PROTOCOL_H
+#define __PROTOCOL_H
+
+#include <stdint.h>
+
+#define PROTOCOL_VERSION     1    // incremented on incompatible changes
+#define CAPS_FIRST_OPCODE    0x80
+#define CAPS_NUM_OPCODES     24   // 0x80 .. 0x97
+#define CAPS_I2C_100KHZ      0x01 // I2C clock rates
+#define CAPS_I2C_400KHZ      0x02
+#define LINK_PATTERN_COUNTER 0x00 // byte n of the stream is n & 0xFF
+#define LINK_PATTERN_PRBS    0x01 // 8 bit Galois LFSR (0xB8), seed 0x01
+#define LINK_PATTERN_NONE    0xFF // no data generation and checking
+#define LINK_PACKET_SIZE     64
+#define RLE_FILL             0x80 // control byte of a fill run: (c & 0x7F)+1 times the next byte
+#define RLE_MAX_RUN          128  // a literal run (c < 0x80) has c+1 data bytes
+
+/*
+ * Command definition
+ */
+#define CMD_GET_VERSION    0x80
+#define CMD_GET_STATUS     0x81
+#define CMD_SETUP_IOPORT   0x82    // PORTxCFG and OEx
+#define CMD_SET_IOPORT     0x83    // write OUTx
+#define CMD_GET_IOPORT     0x84    // read INx
+#define CMD_READ_EEPROM    0x85    // read from EEPROM
+#define CMD_WRITE_EEPROM   0x86    // write to EEPROM
+#define CMD_READ_XDATA     0x87    // read from XDATA
+#define CMD_WRITE_XDATA    0x88    // write to XDATA
+#define CMD_READ_I2C       0x89    // generic read at I2C bus
+#define CMD_WRITE_I2C      0x8A    // generic write at I2C bus
+#define CMD_POLL_SETUP     0x8B    // append entry to I2C polling table
+#define CMD_POLL_CONTROL   0x8C    // start/stop/clear/query I2C polling
+#define CMD_READ_EEPROM16  0x8D    // read from 16 bit address EEPROM
+#define CMD_WRITE_EEPROM16 0x8E    // write to 16 bit address EEPROM
+#define CMD_SOURCE         0x8F    // link test: send a pattern on EP2 IN
+#define CMD_SINK           0x90    // link test: consume data from EP2 OUT
+#define CMD_ECHO           0x91    // link test: loop EP2 OUT back to EP2 IN
+#define CMD_LINK_STATUS    0x92    // link test: counters of the last test
+#define CMD_GET_CAPS       0x93    // binary capability descriptor
+#define CMD_RLE_XDATA      0x94    // write run-length encoded data to XDATA
+#define CMD_RLE_EEPROM16   0x95    // write run-length encoded data to the 16 bit address EEPROM
+
+#define CMD_TABLE_FIRST   0x80
+#define CMD_TABLE_SIZE    22
+
+// bit n: CAPS_FIRST_OPCODE+n is supported
+#define CAPS_OPCODES      0x3FFFFFUL
+// initializer of TGetCaps.MaxLength
+#define CAPS_MAX_LENGTH   { 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0040, 0x0010, 0xFFFF, 0xFFFF, 0x0040, 0x0040, 0x0000, 0x0000, 0x0040, 0x0020, 0xFFFF, 0xFFFF, 0xFFFF, 0x0000, 0x0000, 0xFFFF, 0xFFFF, 0, 0 }
+
+/**
+ * Handlers of a command, see HandleCmd(), HandleIn() and HandleOut()
+ */
+typedef void (*TCmdHandler)(void);
+
+typedef struct {
+  TCmdHandler Setup;    // command arrived on EP0
+  TCmdHandler In;       // host fetched an EP2 IN packet
+  TCmdHandler Out;      // EP2 OUT packet arrived
+} TCmdEntry;
+
+extern const __code TCmdEntry CmdTable[CMD_TABLE_SIZE];
+
+// handlers, defined in commands.c
+void GetVersion(void);
+void GetStatus(void);
+void SetupIOPort(void);
+void SetIOPort(void);
+void GetIOPort(void);
+void ReadEEPROM(void);
+void ArmOut(void);
+void WriteEEPROM(void);
+void ReadXDATA(void);
+void WriteXDATA(void);
+void ReadI2C(void);
+void WriteI2C(void);
+void PollSetup(void);
+void PollControl(void);
+void ReadEEPROM16(void);
+void WriteEEPROM16(void);
+void SourceStart(void);
+void Source(void);
+void LinkArm(void);
+void Sink(void);
+void EchoIn(void);
+void Echo(void);
+void LinkStatus(void);
+void GetCaps(void);
+void RleStart(void);
+void WriteRLE(void);
+
+#endif  // __PROTOCOL_H
@@ -169,6 +169,7 @@ struct setup_data {
 extern volatile bool Semaphore_Command;
 extern volatile bool Semaphore_EP2_out;
 extern volatile bool Semaphore_EP2_in;
+extern volatile uint16_t usb_sof_count;
 extern volatile __xdata __at 0x7FE8 struct setup_data setup_data;
 
 /*
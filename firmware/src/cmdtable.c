@@ -0,0 +1,31 @@
+/* generated by protocol/genproto.awk from protocol/commands.def, don't edit */
+
+#include "protocol.h"
+
+/**
+ * Dispatch table, indexed by opcode - CMD_TABLE_FIRST
+ */
+const __code TCmdEntry CmdTable[CMD_TABLE_SIZE] = {
+  /* 0x80 GET_VERSION     */ { GetVersion, 0, 0 },
+  /* 0x81 GET_STATUS      */ { GetStatus, 0, 0 },
+  /* 0x82 SETUP_IOPORT    */ { SetupIOPort, 0, 0 },
+  /* 0x83 SET_IOPORT      */ { SetIOPort, 0, 0 },
+  /* 0x84 GET_IOPORT      */ { GetIOPort, 0, 0 },
+  /* 0x85 READ_EEPROM     */ { ReadEEPROM, 0, 0 },
+  /* 0x86 WRITE_EEPROM    */ { ArmOut, 0, WriteEEPROM },
+  /* 0x87 READ_XDATA      */ { ReadXDATA, ReadXDATA, 0 },
+  /* 0x88 WRITE_XDATA     */ { ArmOut, 0, WriteXDATA },
+  /* 0x89 READ_I2C        */ { ReadI2C, 0, 0 },
+  /* 0x8A WRITE_I2C       */ { ArmOut, 0, WriteI2C },
+  /* 0x8B POLL_SETUP      */ { ArmOut, 0, PollSetup },
+  /* 0x8C POLL_CONTROL    */ { PollControl, 0, 0 },
+  /* 0x8D READ_EEPROM16   */ { ReadEEPROM16, 0, 0 },
+  /* 0x8E WRITE_EEPROM16  */ { ArmOut, 0, WriteEEPROM16 },
+  /* 0x8F SOURCE          */ { SourceStart, Source, 0 },
+  /* 0x90 SINK            */ { LinkArm, 0, Sink },
+  /* 0x91 ECHO            */ { LinkArm, EchoIn, Echo },
+  /* 0x92 LINK_STATUS     */ { LinkStatus, 0, 0 },
+  /* 0x93 GET_CAPS        */ { GetCaps, 0, 0 },
+  /* 0x94 RLE_XDATA       */ { RleStart, 0, WriteRLE },
+  /* 0x95 RLE_EEPROM16    */ { RleStart, 0, WriteRLE },
+};
@@ -24,21 +24,27 @@
 #include "common.h"
 #include "usb.h"
 #include "i2c.h"
+#include "poll.h"
 #include "io.h"
 
 // I2C addresses
 #define I2C_ADDR_EEPROM 0x50   // 24C00
+#define I2C_ADDR_EEPROM16 0x51 // 24LC64 or larger, two address bytes (A0=1)
+
+#define EEPROM16_PAGE_SIZE 32  // 24LC64
+#define EEPROM_POLL_MAX    255 // max. number of acknowledge polls after a write
 
 // local copy of the information we got in the SETUPDAT packet
 volatile uint8_t  Command;
 volatile uint16_t CmdIndex;
 volatile uint16_t CmdValue;
+uint8_t           CmdSlot = CMD_TABLE_SIZE;  // index in CmdTable
 
 /****************************************************************************/
 /***  GetVersion  ***********************************************************/
 /****************************************************************************/
 
-const char __code const * Version = "EZ-Tools 0.1";
+const char __code const * Version = "EZ-Tools 0.2";
 
 void GetVersion() {
   uint8_t b;
@@ -55,6 +61,49 @@ void GetVersion() {
   IN2BC = b;
 }
 
+/****************************************************************************/
+/***  GetCaps  **************************************************************/
+/****************************************************************************/
+
+const __code TGetCaps Caps = {
+  /* Size        */ sizeof(TGetCaps),
+  /* Protocol    */ PROTOCOL_VERSION,
+  /* Firmware    */ FIRMWARE_VERSION,
+  /* FirstOpcode */ CAPS_FIRST_OPCODE,
+  /* NumOpcodes  */ CAPS_NUM_OPCODES,
+  /* Opcodes     */ { CAPS_OPCODES & 0xFF, (CAPS_OPCODES >> 8) & 0xFF, (CAPS_OPCODES >> 16) & 0xFF },
+  /* EPIn        */ 0x82,
+  /* EPOut       */ 0x02,
+  /* EPPoll      */ 0x84,
+  /* PacketSize  */ 64,
+  /* PollEntries */ POLL_MAX_ENTRIES,
+  /* PollLength  */ POLL_MAX_LENGTH,
+  /* I2CSpeeds   */ CAPS_I2C_100KHZ,
+  /* MaxLength   */ CAPS_MAX_LENGTH
+};
+
+void GetCaps() {
+  __code uint8_t* Src;
+  uint8_t i;
+  Src = (__code uint8_t*)&Caps;
+  for (i = 0; i < sizeof(TGetCaps); i++)
+    IN2BUF[i] = Src[i];
+  IN2BC = sizeof(TGetCaps);
+}
+
+/****************************************************************************/
+/***  GetStatus  ************************************************************/
+/****************************************************************************/
+
+// the counters are little endian, they wrap around at 0xFFFF
+void GetStatus() {
+  __xdata TGetStatus* Status;
+  Status = (__xdata TGetStatus*)IN2BUF;
+  Status->I2CNacks     = i2c_nacks;
+  Status->I2CBusErrors = i2c_berrors;
+  IN2BC = sizeof(TGetStatus);
+}
+
 /****************************************************************************/
 /***  SetupIOPort  **********************************************************/
 /****************************************************************************/
@@ -124,6 +173,16 @@ void GetIOPort() {
   }
 }
 
+/****************************************************************************/
+/***  ArmOut  ***************************************************************/
+/****************************************************************************/
+
+// commands with a data phase from the host: wait for EP2 OUT, the rest is
+// done by the Out handler
+void ArmOut() {
+  OUT2BC = 0;
+}
+
 /****************************************************************************/
 /***  ReadEEPROM  ***********************************************************/
 /****************************************************************************/
@@ -156,31 +215,114 @@ void ReadEEPROM() {
 /***  WriteEEPROM  **********************************************************/
 /****************************************************************************/
 
-typedef struct {
-  uint8_t Addr;
-  uint8_t Data[16];   // maximum 16 bytes per page
-} WriteEEPROM_t;
-
 // CmdIndex: Start Address
 // CmdValue: Length
 void WriteEEPROM() {
-  __xdata WriteEEPROM_t Data;
+  __xdata uint8_t     Addr;
+  __xdata I2C_Segment Seg[2];
   uint8_t Len;
   uint8_t i;
+  uint16_t Nacks;
   // get parameters
-  Data.Addr = CmdIndex & 0x00FF;
-  Len       = CmdValue & 0x00FF;
+  Addr = CmdIndex & 0x00FF;
+  Len  = CmdValue & 0x00FF;
   // 1 <= Length <= 16 (page size)
   if (Len == 0) return;
-  if (((Data.Addr & 0x000F)+Len) > 16) return;
-  // copy data
-  for (i = 0; i < Len; i++)
-    Data.Data[i] = OUT2BUF[i];
-  // send address and data  
-  if (i2c_write(I2C_ADDR_EEPROM,1+Len,(__xdata uint8_t*)&Data) != I2C_OK) {
+  if (((Addr & 0x000F)+Len) > 16) return;
+  // send address and data directly from the endpoint buffer
+  Seg[0].ptr    = &Addr;
+  Seg[0].length = 1;
+  Seg[1].ptr    = OUT2BUF;
+  Seg[1].length = Len;
+  if (i2c_writev(I2C_ADDR_EEPROM,Seg,2) != I2C_OK) {
     // ERROR
     return;
   }
+  // acknowledge polling: the next command may access the EEPROM immediately
+  Nacks = i2c_nacks;
+  for (i = 0; i < EEPROM_POLL_MAX; i++)
+    if (i2c_writev(I2C_ADDR_EEPROM,Seg,0) == I2C_OK)
+      break;
+  // the NACKs while the EEPROM is busy are expected, don't count them, but
+  // an EEPROM which never acknowledges again is counted as one failure
+  if (i < EEPROM_POLL_MAX)
+    i2c_nacks = Nacks;
+  else
+    i2c_nacks = Nacks + 1;
+}
+
+/****************************************************************************/
+/***  ReadEEPROM16  *********************************************************/
+/****************************************************************************/
+
+// CmdIndex: Start Address
+// CmdValue: Length
+void ReadEEPROM16() {
+  __xdata uint8_t Addr[2];
+  uint8_t Len;
+  // get parameters
+  Addr[0] = CmdIndex >> 8;     // high byte first
+  Addr[1] = CmdIndex & 0x00FF;
+  Len     = CmdValue & 0x00FF;
+  // 1 <= Length <= 64 (because of IN2BUF)
+  if (Len == 0) return;
+  if (Len > 64) return;
+  // send start address
+  if (i2c_write(I2C_ADDR_EEPROM16,2,Addr) != I2C_OK) {
+    // ERROR
+    return;
+  }
+  // read
+  if (i2c_read(I2C_ADDR_EEPROM16,Len,IN2BUF) != I2C_OK) {
+    // ERROR
+    return;
+  }
+  IN2BC = Len;
+}
+
+/****************************************************************************/
+/***  WriteEEPROM16  ********************************************************/
+/****************************************************************************/
+
+// After the page was sent, the EEPROM is polled until it acknowledges again,
+// i.e. until its write cycle has finished. Therefore the host can send the
+// next page immediately without any delays.
+static void EE16WritePage(uint16_t Start, __xdata uint8_t* Buf, uint8_t Len) {
+  __xdata uint8_t     Addr[2];
+  __xdata I2C_Segment Seg[2];
+  uint8_t i;
+  uint16_t Nacks;
+  // 1 <= Length <= 32 (page size)
+  if (Len == 0) return;
+  if (((Start & (EEPROM16_PAGE_SIZE-1))+Len) > EEPROM16_PAGE_SIZE) return;
+  Addr[0] = Start >> 8;     // high byte first
+  Addr[1] = Start & 0x00FF;
+  Seg[0].ptr    = Addr;
+  Seg[0].length = 2;
+  Seg[1].ptr    = Buf;
+  Seg[1].length = Len;
+  if (i2c_writev(I2C_ADDR_EEPROM16,Seg,2) != I2C_OK) {
+    // ERROR
+    return;
+  }
+  // acknowledge polling: wait until the write cycle has finished
+  Nacks = i2c_nacks;
+  for (i = 0; i < EEPROM_POLL_MAX; i++)
+    if (i2c_writev(I2C_ADDR_EEPROM16,Seg,0) == I2C_OK)
+      break;
+  // the NACKs while the EEPROM is busy are expected, don't count them, but
+  // an EEPROM which never acknowledges again is counted as one failure
+  if (i < EEPROM_POLL_MAX)
+    i2c_nacks = Nacks;
+  else
+    i2c_nacks = Nacks + 1;
+}
+
+// CmdIndex: Start Address
+// CmdValue: Length
+void WriteEEPROM16() {
+  // send address and data directly from the endpoint buffer
+  EE16WritePage(CmdIndex,OUT2BUF,CmdValue & 0x00FF);
 }
 
 /****************************************************************************/
@@ -239,6 +381,84 @@ void WriteXDATA() {
   OUT2BC = 0;
 }
 
+/****************************************************************************/
+/***  WriteRLE  *************************************************************/
+/****************************************************************************/
+
+// CmdIndex: Start Address
+// CmdValue: Length of the decoded data
+//
+// The data is a sequence of runs, each starts with a control byte c:
+//   c <  RLE_FILL: literal, c+1 data bytes follow
+//   c >= RLE_FILL: fill, the next byte is repeated (c & 0x7F)+1 times
+// Runs may span several packets. RLE_XDATA writes the decoded bytes to
+// XDATA, RLE_EEPROM16 collects them in a page buffer for EE16WritePage.
+
+#define RLE_CONTROL 0   // next byte is a control byte
+#define RLE_LITERAL 1   // RleCount literal bytes follow
+#define RLE_REPEAT  2   // next byte is repeated RleCount times
+
+uint8_t RleState;
+uint8_t RleCount;
+__xdata uint8_t RlePage[EEPROM16_PAGE_SIZE];
+uint8_t RlePageLen;
+
+void RleStart() {
+  RleState   = RLE_CONTROL;
+  RlePageLen = 0;
+  OUT2BC = 0;
+}
+
+static void RlePut(uint8_t b) {
+  if (CmdValue == 0) return;   // more data than announced
+  CmdValue--;
+  if (Command == CMD_RLE_XDATA) {
+    *(uint8_t __xdata*)CmdIndex = b;
+    CmdIndex++;
+    return;
+  }
+  RlePage[RlePageLen++] = b;
+  // write at the end of a page and at the end of the data
+  if ((((CmdIndex + RlePageLen) & (EEPROM16_PAGE_SIZE-1)) == 0) || (CmdValue == 0)) {
+    EE16WritePage(CmdIndex,RlePage,RlePageLen);
+    CmdIndex  += RlePageLen;
+    RlePageLen = 0;
+  }
+}
+
+void WriteRLE() {
+  uint8_t Len;
+  uint8_t i;
+  uint8_t b;
+
+  Len = OUT2BC;
+  for (i = 0; i < Len; i++) {
+    b = OUT2BUF[i];
+    switch (RleState) {
+      case RLE_CONTROL: {
+        RleCount = (b & 0x7F) + 1;
+        RleState = (b & RLE_FILL) ? RLE_REPEAT : RLE_LITERAL;
+        break;
+      }
+      case RLE_LITERAL: {
+        RlePut(b);
+        if (--RleCount == 0)
+          RleState = RLE_CONTROL;
+        break;
+      }
+      case RLE_REPEAT: {
+        do {
+          RlePut(b);
+        } while (--RleCount);
+        RleState = RLE_CONTROL;
+        break;
+      }
+    }
+  }
+
+  OUT2BC = 0;
+}
+
 /****************************************************************************/
 /***  ReadI2C  **************************************************************/
 /****************************************************************************/
@@ -284,6 +504,168 @@ void WriteI2C() {
   }
 }
 
+/****************************************************************************/
+/***  PollSetup  ************************************************************/
+/****************************************************************************/
+
+// OUT2BUF: TPollEntry
+void PollSetup() {
+  if (OUT2BC != sizeof(TPollEntry)) return;
+  if (!poll_add((__xdata TPollEntry*)OUT2BUF)) {
+    // ERROR
+    return;
+  }
+}
+
+/****************************************************************************/
+/***  PollControl  **********************************************************/
+/****************************************************************************/
+
+// CmdValue: POLL_CTRL_*
+void PollControl() {
+  poll_control(CmdValue & 0x00FF);
+}
+
+/****************************************************************************/
+/***  Link Test  ************************************************************/
+/****************************************************************************/
+
+/**
+ * Source, sink and echo measure the raw bulk transport without any handler
+ * cost. CmdValue holds the number of LINK_PACKET_SIZE byte packets still to
+ * transfer, the counters are returned by LinkStatus.
+ */
+__xdata TLinkStatus Link;
+uint8_t             LinkState;     // next counter value or LFSR state
+uint16_t            LinkSof;       // SOF count at the start of the test
+
+// number of set bits of a nibble
+const uint8_t __code BitCount[16] = { 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4 };
+
+/**
+ * Get the next byte of the pattern
+ */
+static uint8_t LinkNext() {
+  uint8_t b;
+  b = LinkState;
+  if (Link.Pattern == LINK_PATTERN_PRBS)
+    LinkState = (LinkState >> 1) ^ ((LinkState & 1) ? 0xB8 : 0x00);
+  else
+    LinkState++;
+  return b;
+}
+
+/**
+ * Count a packet, the test is done after the last one
+ */
+static void LinkPacket(uint8_t Len) {
+  Link.Bytes += Len;
+  Link.Frames = poll_now() - LinkSof;
+  CmdValue--;
+  if (CmdValue == 0)
+    Link.Done = 1;
+}
+
+// CmdIndex: LINK_PATTERN_*
+// CmdValue: number of packets
+void LinkStart() {
+  Link.Bytes     = 0;
+  Link.BitErrors = 0;
+  Link.Checksum  = 0;
+  Link.Frames    = 0;
+  Link.Pattern   = CmdIndex & 0x00FF;
+  Link.Done      = (CmdValue == 0);
+  LinkState = (Link.Pattern == LINK_PATTERN_PRBS) ? 0x01 : 0x00;
+  LinkSof = poll_now();
+}
+
+/**
+ * Commit the next packet to EP2 IN
+ *
+ * With LINK_PATTERN_NONE the buffer is not touched at all, i.e. this is the
+ * fastest possible way to generate IN packets.
+ */
+void Source() {
+  uint8_t i;
+  if (CmdValue == 0) return;
+  if (Link.Pattern != LINK_PATTERN_NONE)
+    for (i = 0; i < LINK_PACKET_SIZE; i++)
+      IN2BUF[i] = LinkNext();
+  IN2BC = LINK_PACKET_SIZE;
+  LinkPacket(LINK_PACKET_SIZE);
+}
+
+// CmdIndex: LINK_PATTERN_*
+// CmdValue: number of packets
+void SourceStart() {
+  LinkStart();
+  Source();
+}
+
+// CmdIndex: LINK_PATTERN_*
+// CmdValue: number of packets
+void LinkArm() {
+  LinkStart();
+  OUT2BC = 0;
+}
+
+/**
+ * Consume a packet from EP2 OUT, sum it up and compare it to the pattern
+ */
+void Sink() {
+  uint8_t Len;
+  uint8_t i;
+  uint8_t b;
+  if (CmdValue == 0) return;
+  Len = OUT2BC;
+  for (i = 0; i < Len; i++) {
+    b = OUT2BUF[i];
+    Link.Checksum += b;
+    if (Link.Pattern != LINK_PATTERN_NONE) {
+      b ^= LinkNext();
+      Link.BitErrors += BitCount[b & 0x0F] + BitCount[b >> 4];
+    }
+  }
+  LinkPacket(Len);
+  // re-arm EP2 OUT for the next packet
+  if (CmdValue != 0)
+    OUT2BC = 0;
+}
+
+/**
+ * Copy a packet from EP2 OUT to EP2 IN
+ *
+ * EP2 OUT is re-armed in EchoIn() after the host fetched the packet.
+ */
+void Echo() {
+  uint8_t Len;
+  uint8_t i;
+  if (CmdValue == 0) return;
+  Len = OUT2BC;
+  for (i = 0; i < Len; i++)
+    IN2BUF[i] = OUT2BUF[i];
+  IN2BC = Len;
+  LinkPacket(Len);
+}
+
+/**
+ * The host fetched the echoed packet, ready for the next one
+ */
+void EchoIn() {
+  if (CmdValue != 0)
+    OUT2BC = 0;
+}
+
+/**
+ * Return the counters of the current or last link test
+ */
+void LinkStatus() {
+  uint8_t i;
+  for (i = 0; i < sizeof(TLinkStatus); i++)
+    IN2BUF[i] = ((__xdata uint8_t*)&Link)[i];
+  IN2BC = sizeof(TLinkStatus);
+}
+
 /****************************************************************************/
 /***  Command Handler  ******************************************************/
 /****************************************************************************/
@@ -292,8 +674,13 @@ void WriteI2C() {
  * Command Handler
  *
  * This function is executed from command_loop() if its semaphore is set.
+ *
+ * The handlers are looked up in CmdTable, which is generated from
+ * protocol/commands.def. The index is kept for HandleIn() and HandleOut(),
+ * CMD_TABLE_SIZE means no command is active.
  */
 void HandleCmd() {
+  TCmdHandler Handler;
   if ((setup_data.bmRequestType & ~USB_DIR_IN) != (USB_REQ_TYPE_VENDOR | USB_RECIP_DEVICE)) {
     return;
   }
@@ -301,57 +688,14 @@ void HandleCmd() {
   Command  = setup_data.bRequest;
   CmdIndex = setup_data.wIndex;
   CmdValue = setup_data.wValue;
-  switch (Command) {
-    case CMD_GET_VERSION: { // Get Version ////////////////////////////////////
-      GetVersion();
-      break;
-    }
-    case CMD_SETUP_IOPORT: {   // PORTxCFG and OEx ////////////////////////////
-      SetupIOPort();
-      break;
-    }
-    case CMD_SET_IOPORT: {     // write OUTx //////////////////////////////////
-      SetIOPort();
-      break;
-    }
-    case CMD_GET_IOPORT: {     // read INx ////////////////////////////////////
-      GetIOPort();
-      break;
-    }
-    case CMD_READ_EEPROM: {    // read from EEPROM ////////////////////////////
-      ReadEEPROM();
-      break;
-    }
-    case CMD_WRITE_EEPROM: {   // write to EEPROM /////////////////////////////
-      // arm EP2
-      OUT2BC = 0;
-      // wait for EP2 Sempaphore, rest is done in HandleOut()
-      break;
-    }
-    case CMD_READ_XDATA: {     // read from XDATA memory //////////////////////
-      ReadXDATA();
-      break;
-    }
-    case CMD_WRITE_XDATA: {    // write to XDATA memory ///////////////////////
-      // arm EP2
-      OUT2BC = 0;
-      // wait for EP2 Sempaphore, rest is done in HandleOut()
-      break;
-    }
-    case CMD_READ_I2C: {       // generic read at I2C bus /////////////////////
-      ReadI2C();
-      break;
-    }
-    case CMD_WRITE_I2C: {      // generic write at I2C bus ////////////////////
-      // arm EP2
-      OUT2BC = 0;
-      // wait for EP2 Sempaphore, rest is done in HandleOut()
-      break;
-    }
-    default: {
-      break;
-    }
+  CmdSlot  = Command - CMD_TABLE_FIRST;   // wraps around below CMD_TABLE_FIRST
+  if (CmdSlot >= CMD_TABLE_SIZE) {
+    CmdSlot = CMD_TABLE_SIZE;
+    return;
   }
+  Handler = CmdTable[CmdSlot].Setup;
+  if (Handler)
+    Handler();
 }
 
 /**
@@ -360,15 +704,12 @@ void HandleCmd() {
  * This function is executed from main() if its semaphore is set.
  */
 void HandleIn() {
-  switch (Command) {
-    case CMD_READ_XDATA: {     // read from XDATA memory //////////////////////
-      ReadXDATA();
-      break;
-    }
-    default: {
-      break;
-    }
-  }
+  TCmdHandler Handler;
+  if (CmdSlot >= CMD_TABLE_SIZE)
+    return;
+  Handler = CmdTable[CmdSlot].In;
+  if (Handler)
+    Handler();
 }
 
 /**
@@ -377,23 +718,12 @@ void HandleIn() {
  * This function is executed from main() if its semaphore is set.
  */
 void HandleOut() {
-  switch (Command) {
-    case CMD_WRITE_EEPROM: {   // write to EEPROM /////////////////////////////
-      WriteEEPROM();
-      break;
-    }
-    case CMD_WRITE_XDATA: {    // write to XDATA memory ///////////////////////
-      WriteXDATA();
-      break;
-    }
-    case CMD_WRITE_I2C: {      // generic write at I2C bus ////////////////////
-      WriteI2C();
-      break;
-    }
-    default: {
-      break;
-    }
-  }
+  TCmdHandler Handler;
+  if (CmdSlot >= CMD_TABLE_SIZE)
+    return;
+  Handler = CmdTable[CmdSlot].Out;
+  if (Handler)
+    Handler();
 }
 
 /**
@@ -409,18 +739,23 @@ void command_loop(void) {
   while (true) {
     // got a command packet?
     if (Semaphore_Command) {
+      poll_sync();   // the handlers might use the I2C bus
       HandleCmd();
       Semaphore_Command = false;
     }
     // got an EP2 IN interrupt?
     if (Semaphore_EP2_in) {
+      poll_sync();
       HandleIn();
       Semaphore_EP2_in = false;
     }
     // got an EP2 OUT interrupt?
     if (Semaphore_EP2_out) {
+      poll_sync();
       HandleOut();
       Semaphore_EP2_out = false;
     }
+    // periodic I2C reads
+    poll_task();
   }
 }
@@ -35,9 +35,32 @@ typedef enum {
 } I2C_State;
 
 volatile static I2C_State        i2c_state;
-volatile static uint8_t          i2c_length;
-volatile static __xdata uint8_t* i2c_ptr;
-volatile static uint8_t          i2c_count;
+volatile static uint8_t          i2c_length;   // total length of all segments
+volatile static uint8_t          i2c_count;    // bytes transferred so far
+volatile static __xdata uint8_t* i2c_ptr;      // position in current segment
+volatile static uint8_t          i2c_left;     // bytes left in current segment
+volatile static __xdata I2C_Segment* i2c_seg;  // next segment of the chain
+volatile static uint8_t          i2c_segs;     // number of remaining segments
+
+// single segment for i2c_read() and i2c_write()
+static __xdata I2C_Segment i2c_single;
+
+// error counters since reset, reported by GetStatus()
+uint16_t i2c_nacks;
+uint16_t i2c_berrors;
+
+/**
+ * Load the next non-empty segment of the chain
+ *
+ * This is a macro because it is used in the ISR too.
+ */
+#define I2C_NEXT_SEGMENT()                  \
+  while ((i2c_left == 0) && (i2c_segs)) {   \
+    i2c_ptr  = i2c_seg->ptr;                \
+    i2c_left = i2c_seg->length;             \
+    i2c_seg++;                              \
+    i2c_segs--;                             \
+  }
 
 // Forward Declarations
 
@@ -60,53 +83,94 @@ void i2c_init() {
 }
 
 /**
- * Initiate an I2C read transfer
+ * Prepare the segment chain of a transfer
  *
+ * Sums up the total length and loads the first non-empty segment.
+ */
+static void i2c_setup_chain(__xdata I2C_Segment* seg, uint8_t count) {
+  uint8_t i;
+
+  i2c_length = 0;
+  for (i = 0; i < count; i++)
+    i2c_length += seg[i].length;
+  i2c_count = 0;
+  i2c_seg   = seg;
+  i2c_segs  = count;
+  i2c_left  = 0;
+  I2C_NEXT_SEGMENT();
+}
+
+/**
+ * Initiate an I2C read transfer
  *
+ * The received bytes are scattered to the segments of the chain in the given
+ * order. The chain must stay valid until the transfer has finished.
  */
-I2C_Status i2c_start_read (uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
+I2C_Status i2c_start_read (uint8_t addr, __xdata I2C_Segment* seg, uint8_t count) {
   // wait previous transfer to finish
   i2c_wait_stop();
   // return if a transfer is still active
   if (i2c_state != stIdle)
     return I2C_BUSY;
 
+  // store information about the transfer
+  i2c_setup_chain(seg,count);
+  i2c_state  = stRecvFirst;
   // set the start bit and send address byte
   I2CS  = I2C_START;
   I2DAT = (addr << 1) | 0x01;   // LSB=1 -> read transfer
-  // store information about the transfer
-  i2c_state  = stRecvFirst;
-  i2c_length = length;
-  i2c_ptr    = ptr;
-  i2c_count  = 0;
-  
+
   return I2C_OK;
 }
 
 /**
  * Initiate an I2C write transfer
  *
- *
+ * The bytes of all segments of the chain are gathered and sent in the given
+ * order, e.g. a header from a local variable followed by the payload directly
+ * from an endpoint buffer. The chain must stay valid until the transfer has
+ * finished. If the total length is 0, only the address byte is sent, e.g. to
+ * poll whether an EEPROM has finished its write cycle.
  */
-I2C_Status i2c_start_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
+I2C_Status i2c_start_write(uint8_t addr, __xdata I2C_Segment* seg, uint8_t count) {
   // wait previous transfer to finish
   i2c_wait_stop();
   // return if a transfer is still active
   if (i2c_state != stIdle)
     return I2C_BUSY;
 
+  // store information about the transfer
+  i2c_setup_chain(seg,count);
+  i2c_state  = (i2c_length ? stSending : stStop);
   // set the start bit and send address byte
   I2CS  = I2C_START;
   I2DAT = (addr << 1) | 0x00;   // LSB=0 -> write transfer
-  // store information about the transfer
-  i2c_state  = stSending;
-  i2c_length = length;
-  i2c_ptr    = ptr;
-  i2c_count  = 0;
-  
+
   return I2C_OK;
 }
 
+/**
+ * Perform an I2C read transfer into a segment chain
+ *
+ * This function initiates an I2C read transfer and waits until it has
+ * finished.
+ */
+I2C_Status i2c_readv (uint8_t addr, __xdata I2C_Segment* seg, uint8_t count) {
+  i2c_start_read(addr,seg,count);
+  return i2c_wait_finished();
+}
+
+/**
+ * Perform an I2C write transfer from a segment chain
+ *
+ * This function initiates an I2C write transfer and waits until it has
+ * finished.
+ */
+I2C_Status i2c_writev(uint8_t addr, __xdata I2C_Segment* seg, uint8_t count) {
+  i2c_start_write(addr,seg,count);
+  return i2c_wait_finished();
+}
+
 /**
  * Perform an I2C read transfer
  *
@@ -114,8 +178,9 @@ I2C_Status i2c_start_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
  * finished.
  */
 I2C_Status i2c_read (uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
-  i2c_start_read(addr,length,ptr);
-  return i2c_wait_finished();
+  i2c_single.ptr    = ptr;
+  i2c_single.length = length;
+  return i2c_readv(addr,&i2c_single,1);
 }
 
 /**
@@ -125,8 +190,33 @@ I2C_Status i2c_read (uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
  * finished.
  */
 I2C_Status i2c_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
-  i2c_start_write(addr,length,ptr);
-  return i2c_wait_finished();
+  i2c_single.ptr    = ptr;
+  i2c_single.length = length;
+  return i2c_writev(addr,&i2c_single,1);
+}
+
+/**
+ * Query the status of the current transfer without waiting
+ *
+ * Returns I2C_BUSY while a transfer started with i2c_start_read() or
+ * i2c_start_write() is still in progress. Otherwise the result of the
+ * transfer is returned and the driver is ready for the next transfer.
+ */
+I2C_Status i2c_status() {
+  switch (i2c_state) {
+    case stIdle:
+      return I2C_OK;
+    case stBusError:
+      i2c_state = stIdle;
+      i2c_berrors++;
+      return I2C_BERROR;
+    case stNAck:
+      i2c_state = stIdle;
+      i2c_nacks++;
+      return I2C_NACK;
+    default:
+      return I2C_BUSY;
+  }
 }
 
 /*****************************************************************************/
@@ -148,20 +238,11 @@ static void i2c_wait_stop() {
  * Wait until the current transfer is finished and return its status
  */
 static I2C_Status i2c_wait_finished() {
-  while (true) {
-    switch (i2c_state) {
-      case stIdle:
-        return I2C_OK;
-      case stBusError:
-        i2c_state = stIdle;
-        return I2C_BERROR;
-      case stNAck:
-        i2c_state = stIdle;
-        return I2C_NACK;
-      default:
-        // do nothing, just continue waiting
-    }
-  }
+  I2C_Status status;
+  do {
+    status = i2c_status();
+  } while (status == I2C_BUSY);
+  return status;
 }
 
 /*****************************************************************************/
@@ -211,11 +292,17 @@ void i2c_isr(void)      __interrupt I2C_VECTOR {
         i2c_state = stIdle;
       }
       // store the received byte
-      i2c_ptr[i2c_count++] = I2DAT;
+      *i2c_ptr++ = I2DAT;
+      i2c_count++;
+      i2c_left--;
+      I2C_NEXT_SEGMENT();
       break;
     case stSending:
       // send next byte
-      I2DAT = i2c_ptr[i2c_count++];
+      I2DAT = *i2c_ptr++;
+      i2c_count++;
+      i2c_left--;
+      I2C_NEXT_SEGMENT();
       // if last byte was sent, next state is stop
       if (i2c_count == i2c_length)
         i2c_state = stStop;
@@ -22,6 +22,7 @@
 #include "io.h"
 #include "usb.h"
 #include "i2c.h"
+#include "poll.h"
 #include "commands.h"
 
 /**
@@ -73,6 +74,7 @@ int main(void) {
   // IOs are not initialized
   usb_init();
   i2c_init();
+  poll_init();
 
   /* Globally enable interrupts */
   EA = 1;
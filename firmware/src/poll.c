@@ -0,0 +1,289 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Autonomous periodic I2C register reads
+ *
+ * The host fills a table of I2C register reads, each with its own period.
+ * When started, poll_task() (called from command_loop()) issues the reads
+ * through the interrupt driven I2C driver and packs timestamped records into
+ * EP4 IN packets. The timebase is the USB Start Of Frame counter, i.e. 1ms.
+ *
+ * Each record consists of a TPollRecord header followed by the data bytes.
+ * A packet is committed to the USB core when the next record doesn't fit or
+ * when its first record is older than POLL_FLUSH_MS. If the host didn't fetch
+ * the previous packet yet, the sample is dropped and counted as overrun.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "reg_ezusb.h"
+#include "usb.h"
+#include "i2c.h"
+#include "poll.h"
+
+/**
+ * State of the polling engine
+ */
+typedef enum {
+  psIdle,
+  psAddress,     // writing the register address
+  psData         // reading the data bytes
+} Poll_State;
+
+static __xdata TPollEntry poll_table[POLL_MAX_ENTRIES];
+static __xdata uint16_t   poll_due[POLL_MAX_ENTRIES];
+static uint8_t            poll_count;
+static bool               poll_running;
+static Poll_State         poll_state;
+static uint8_t            poll_current;    // entry of the active transfer
+static uint8_t            poll_offset;     // fill level of IN4BUF
+static uint16_t           poll_first;      // timestamp of the first record in IN4BUF
+static uint16_t           poll_overruns;
+static __xdata I2C_Segment poll_seg;       // segment of the active transfer
+
+/*****************************************************************************/
+/***  Internal Functions  ****************************************************/
+/*****************************************************************************/
+
+/**
+ * Hand the packet in IN4BUF over to the USB core
+ */
+static void poll_flush() {
+  if (poll_offset == 0)
+    return;
+  IN4BC = poll_offset;
+  poll_offset = 0;
+}
+
+/**
+ * Finish the record of the active transfer
+ */
+static void poll_finish(I2C_Status status) {
+  __xdata TPollRecord* rec;
+
+  rec = (__xdata TPollRecord*)(IN4BUF + poll_offset);
+  rec->Status = status;
+  if (poll_offset == 0)
+    poll_first = rec->Time;
+  poll_offset += sizeof(TPollRecord) + poll_table[poll_current].Len;
+  poll_state = psIdle;
+}
+
+/**
+ * Start reading the data bytes of the active entry directly into IN4BUF
+ */
+static void poll_read() {
+  poll_seg.ptr    = IN4BUF + poll_offset + sizeof(TPollRecord);
+  poll_seg.length = poll_table[poll_current].Len;
+  i2c_start_read(poll_table[poll_current].Addr,&poll_seg,1);
+  poll_state = psData;
+}
+
+/**
+ * Calculate the time of the next sample of a table entry, skip missed periods
+ */
+static void poll_schedule(uint8_t i, uint16_t now) {
+  poll_due[i] += poll_table[i].Period;
+  if ((int16_t)(now - poll_due[i]) >= 0)
+    poll_due[i] = now + poll_table[i].Period;
+}
+
+/**
+ * Start the read of a table entry
+ *
+ * The record header is placed in IN4BUF and the data bytes are received by
+ * the I2C ISR directly behind it.
+ */
+static void poll_start(uint8_t i, uint16_t now) {
+  __xdata TPollEntry*  entry;
+  __xdata TPollRecord* rec;
+
+  entry = &poll_table[i];
+  rec = (__xdata TPollRecord*)(IN4BUF + poll_offset);
+  rec->Id   = i;
+  rec->Time = now;
+  poll_current = i;
+
+  if (entry->Flags & POLL_NO_REG) {
+    poll_read();
+  } else {
+    poll_seg.ptr    = &entry->Reg;
+    poll_seg.length = 1;
+    i2c_start_write(entry->Addr,&poll_seg,1);
+    poll_state = psAddress;
+  }
+}
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Get the current timestamp in ms (USB frames)
+ *
+ * The SOF interrupt is disabled while reading the 16 bit counter to get a
+ * consistent value.
+ */
+uint16_t poll_now(void) {
+  uint16_t now;
+  EUSB = 0;
+  now = usb_sof_count;
+  EUSB = 1;
+  return now;
+}
+
+/**
+ * Initialize the polling engine with an empty table
+ */
+void poll_init(void) {
+  poll_count   = 0;
+  poll_running = false;
+  poll_state   = psIdle;
+  poll_offset  = 0;
+}
+
+/**
+ * Append an entry to the polling table
+ *
+ * @return false if the table is full, the entry is invalid or polling is
+ *   active
+ */
+bool poll_add(__xdata TPollEntry* entry) {
+  if (poll_running)
+    return false;
+  if (poll_count >= POLL_MAX_ENTRIES)
+    return false;
+  if ((entry->Len == 0) || (entry->Len > POLL_MAX_LENGTH) || (entry->Period == 0))
+    return false;
+  poll_table[poll_count++] = *entry;
+  return true;
+}
+
+/**
+ * Start, stop, clear or query the polling engine
+ */
+void poll_control(uint8_t ctrl) {
+  __xdata TPollStatus* status;
+  uint16_t now;
+  uint8_t i;
+
+  switch (ctrl) {
+    case POLL_CTRL_STOP:
+      poll_sync();
+      poll_running = false;
+      if (!(IN4CS & EPBSY))
+        poll_flush();
+      break;
+    case POLL_CTRL_START:
+      if (poll_count == 0)
+        break;
+      poll_sync();
+      now = poll_now();
+      for (i = 0; i < poll_count; i++)
+        poll_due[i] = now;
+      poll_offset   = 0;
+      poll_overruns = 0;
+      poll_running  = true;
+      break;
+    case POLL_CTRL_CLEAR:
+      poll_control(POLL_CTRL_STOP);
+      poll_count = 0;
+      break;
+    case POLL_CTRL_STATUS:
+      status = (__xdata TPollStatus*)IN2BUF;
+      status->Running  = poll_running;
+      status->Count    = poll_count;
+      status->Overruns = poll_overruns;
+      IN2BC = sizeof(TPollStatus);
+      break;
+  }
+}
+
+/**
+ * Advance the polling engine
+ *
+ * This function never waits. It is called from command_loop() whenever no
+ * command is pending.
+ */
+void poll_task(void) {
+  __xdata TPollEntry* entry;
+  I2C_Status status;
+  uint16_t now;
+  uint8_t i;
+
+  switch (poll_state) {
+    case psIdle:
+      if (!poll_running)
+        return;
+      now = poll_now();
+      // don't let a partly filled packet wait too long
+      if (poll_offset && ((uint16_t)(now - poll_first) >= POLL_FLUSH_MS))
+        poll_flush();
+      // find the next entry which is due
+      for (i = 0; i < poll_count; i++)
+        if ((int16_t)(now - poll_due[i]) >= 0)
+          break;
+      if (i == poll_count)
+        return;
+      entry = &poll_table[i];
+      // host didn't fetch the last packet yet -> drop sample
+      if (IN4CS & EPBSY) {
+        poll_schedule(i,now);
+        poll_overruns++;
+        return;
+      }
+      // record doesn't fit in this packet -> send it, retry in the next call
+      if (poll_offset + sizeof(TPollRecord) + entry->Len > 64) {
+        poll_flush();
+        return;
+      }
+      poll_schedule(i,now);
+      poll_start(i,now);
+      break;
+    case psAddress:
+      status = i2c_status();
+      if (status == I2C_BUSY)
+        return;
+      if (status != I2C_OK) {
+        poll_finish(status);
+        return;
+      }
+      poll_read();
+      break;
+    case psData:
+      status = i2c_status();
+      if (status == I2C_BUSY)
+        return;
+      poll_finish(status);
+      break;
+  }
+}
+
+/**
+ * Finish an active polling transfer
+ *
+ * This must be called before any other user of the I2C driver starts a
+ * transfer.
+ */
+void poll_sync(void) {
+  while (poll_state != psIdle)
+    poll_task();
+}
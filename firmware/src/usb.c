@@ -46,11 +46,15 @@ volatile bool Semaphore_Command = 0;
 volatile bool Semaphore_EP2_out = 0;
 volatile bool Semaphore_EP2_in  = 0;
 
+/* Free running millisecond counter, incremented with every USB Start Of Frame
+ * packet. This is used as timebase for periodic tasks (see poll.c). */
+volatile uint16_t usb_sof_count = 0;
+
 volatile __xdata __at 0x7FE8 struct setup_data setup_data;
 
 /* Define number of endpoints (except Control Endpoint 0) in a central place.
  * Be sure to include the neccessary endpoint descriptors! */
-#define NUM_ENDPOINTS  2
+#define NUM_ENDPOINTS  3
 
 /*
  * Normally, we would initialize the descriptor structures in C99 style:
@@ -129,6 +133,15 @@ __code struct usb_endpoint_descriptor Bulk_EP2_OUT_Endpoint_Descriptor = {
   /* .bInterval = */           0
 };
 
+__code struct usb_endpoint_descriptor Bulk_EP4_IN_Endpoint_Descriptor = {
+  /* .bLength = */             sizeof(struct usb_endpoint_descriptor),
+  /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_ENDPOINT,
+  /* .bEndpointAddress = */    4 | USB_DIR_IN,
+  /* .bmAttributes = */        USB_ENDPOINT_TYPE_BULK,
+  /* .wMaxPacketSize = */      64,
+  /* .bInterval = */           0
+};
+
 __code struct usb_language_descriptor language_descriptor = {
   /* .bLength =  */            4,
   /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_STRING,
@@ -167,7 +180,16 @@ void sudav_isr(void) __interrupt SUDAV_ISR {
   EP0CS |= HSNAK;
 }
 
-void sof_isr(void)      __interrupt SOF_ISR      { }
+/**
+ * SOF: called every 1ms with the USB Start Of Frame packet
+ */
+void sof_isr(void)      __interrupt SOF_ISR {
+  usb_sof_count++;
+
+  CLEAR_IRQ();
+  USBIRQ = SOFIR;
+}
+
 void sutok_isr(void)    __interrupt SUTOK_ISR    { }
 void suspend_isr(void)  __interrupt SUSPEND_ISR  { }
 void usbreset_isr(void) __interrupt USBRESET_ISR { }
@@ -448,9 +470,11 @@ static void usb_handle_set_interface(void) {
   /* Reset Data Toggle */
   usb_reset_data_toggle(USB_DIR_IN  | 2);
   usb_reset_data_toggle(USB_DIR_OUT | 2);
+  usb_reset_data_toggle(USB_DIR_IN  | 4);
 
   /* Unstall & clear busy flag of all valid IN endpoints */
   IN2CS = 0 | EPBSY;
+  IN4CS = 0 | EPBSY;
   
   /* Unstall all valid OUT endpoints, reset bytecounts */
   OUT2CS = 0;
@@ -524,8 +548,8 @@ static void usb_handle_setup_data(void) {
  * ReNumeration.
  */
 void usb_init(void) {
-  /* Mark endpoint 2 IN & OUT as valid */
-  IN07VAL  = IN2VAL;
+  /* Mark endpoint 2 IN & OUT and endpoint 4 IN as valid */
+  IN07VAL  = IN2VAL | IN4VAL;
   OUT07VAL = OUT2VAL;
 
   /* Make sure no isochronous endpoints are marked valid */
@@ -539,8 +563,8 @@ void usb_init(void) {
   /* Enable USB Autovectoring */
   USBBAV |= AVEN;
   
-  /* Enable SUDAV interrupt */
-  USBIEN |= SUDAVIE;
+  /* Enable SUDAV and SOF interrupts */
+  USBIEN |= SUDAVIE | SOFIE;
 
   /* Enable EP2 OUT & IN interrupts */
   OUT07IEN = OUT2IEN;
@@ -0,0 +1,171 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * EZ-USB "B2" boot EEPROM images
+ *
+ * After power-on the EZ-USB core checks for an I2C EEPROM with address 0x51
+ * (16 bit word address). If its first byte is 0xB2, it enumerates with the
+ * VID/PID/DID stored behind it and loads the following records into the
+ * internal RAM. The last record writes 0x00 to CPUCS to release the 8051 from
+ * reset. The layout is
+ *
+ *   0xB2 VIDL VIDH PIDL PIDH DIDL DIDH
+ *   { LenH LenL AddrH AddrL data[Len] }    Len = 1..1023
+ *   0x80 0x01 0x7F 0x92 0x00
+ *
+ * See EZ-USB Technical Reference Manual, chapter 4 "EZ-USB Enumeration".
+ *)
+Unit BootImage;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Utils;
+
+Const
+  B2_MAX_RECORD = 1023;     // maximum number of data bytes per record
+  B2_RAM_SIZE   = $1B40;    // internal code/data RAM of the AN2131
+
+Type
+  EBootImage = class(Exception);
+
+Procedure ParseIntelHex(HexFile:String;Const MemName:String;Var Mem:Array of Byte;Var Used:Array of Boolean);
+Function  BuildB2Image(HexFile:String;idVendor,idProduct,bcdDevice:Word) : AnsiString;
+
+Implementation
+
+Const
+  IHEX_MAX_RECORD = 5+255;  // count, address, type, checksum and data bytes
+
+(**
+ * Parse an Intel Hex file into a RAM image
+ *
+ * Only data records (type 00) and the end of file record (type 01) are
+ * accepted. Every byte must lie within Mem, MemName is used for the error
+ * message.
+ *)
+Procedure ParseIntelHex(HexFile:String;Const MemName:String;Var Mem:Array of Byte;Var Used:Array of Boolean);
+Var Lines : TStringList;
+    Line  : String;
+    LineNo: Integer;
+    Rec   : Array[0..IHEX_MAX_RECORD-1] of Byte;
+    Len   : Integer;
+    Addr  : Integer;
+    Sum   : Byte;
+    I     : Integer;
+    EOF   : Boolean;
+Begin
+  Lines := TStringList.Create;
+  try
+    Lines.LoadFromFile(HexFile);
+    EOF := false;
+    For LineNo := 0 to Lines.Count-1 do
+      Begin
+        Line := Trim(Lines[LineNo]);
+        if Line = '' then Continue;
+        if EOF then
+          raise EBootImage.CreateFmt('%s:%d: Data after end of file record',[HexFile,LineNo+1]);
+        if (Line[1] <> ':') or (Length(Line) < 11) or not Odd(Length(Line)) then
+          raise EBootImage.CreateFmt('%s:%d: Invalid record',[HexFile,LineNo+1]);
+        // check the length before decoding into Rec
+        Len := (Length(Line)-1) div 2;
+        if (Len > IHEX_MAX_RECORD) or (HexToInt(Copy(Line,2,2)) + 5 <> Len) then
+          raise EBootImage.CreateFmt('%s:%d: Invalid record length',[HexFile,LineNo+1]);
+        Sum := 0;
+        For I := 0 to Len-1 do
+          Begin
+            Rec[I] := HexToInt(Copy(Line,2+2*I,2));
+            Sum := Sum + Rec[I];
+          End;
+        if Sum <> 0 then
+          raise EBootImage.CreateFmt('%s:%d: Checksum error',[HexFile,LineNo+1]);
+        Addr := (Rec[1] shl 8) or Rec[2];
+        case Rec[3] of
+          $00 : Begin
+                  if Addr + Rec[0] > Length(Mem) then
+                    raise EBootImage.CreateFmt('%s:%d: Data at 0x%.4X is outside of the %s',[HexFile,LineNo+1,Addr,MemName]);
+                  For I := 0 to Rec[0]-1 do
+                    Begin
+                      Mem [Addr+I] := Rec[4+I];
+                      Used[Addr+I] := true;
+                    End;
+                End;
+          $01 : EOF := true;
+        else
+          raise EBootImage.CreateFmt('%s:%d: Unsupported record type %.2X',[HexFile,LineNo+1,Rec[3]]);
+        End;
+      End;
+  finally
+    Lines.Free;
+  End;
+End;
+
+(**
+ * Convert an Intel Hex firmware file to a B2 boot EEPROM image
+ *
+ * Contiguous ranges are merged to as few load records as possible.
+ *)
+Function BuildB2Image(HexFile:String;idVendor,idProduct,bcdDevice:Word) : AnsiString;
+Var Mem   : Array[0..B2_RAM_SIZE-1] of Byte;
+    Used  : Array[0..B2_RAM_SIZE-1] of Boolean;
+    Start : Integer;
+    Len   : Integer;
+    Img   : TStringStream;
+
+  Procedure Put(Const B:Array of Byte);
+  Begin
+    Img.WriteBuffer(B[0],Length(B));
+  End;
+
+Begin
+  FillChar(Mem, SizeOf(Mem), 0);
+  FillChar(Used,SizeOf(Used),0);
+  ParseIntelHex(HexFile,'internal RAM',Mem,Used);
+
+  Img := TStringStream.Create('');
+  try
+    Put([$B2,Lo(idVendor),Hi(idVendor),Lo(idProduct),Hi(idProduct),Lo(bcdDevice),Hi(bcdDevice)]);
+    Start := 0;
+    while Start < B2_RAM_SIZE do
+      Begin
+        if not Used[Start] then
+          Begin
+            Inc(Start);
+            Continue;
+          End;
+        Len := 0;
+        while (Start+Len < B2_RAM_SIZE) and Used[Start+Len] and (Len < B2_MAX_RECORD) do
+          Inc(Len);
+        Put([Hi(Len),Lo(Len),Hi(Start),Lo(Start)]);
+        Img.WriteBuffer(Mem[Start],Len);
+        Start := Start + Len;
+      End;
+    // release the 8051 from reset: write 0x00 to CPUCS (0x7F92)
+    Put([$80,$01,$7F,$92,$00]);
+    Result := Img.DataString;
+  finally
+    Img.Free;
+  End;
+End;
+
+End.
+
@@ -0,0 +1,258 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Bursts of control transfers for devices with control-endpoint-only
+ * protocols
+ *
+ * The requests are distributed to Depth worker threads, which take the next
+ * request from a shared index. Each of them issues synchronous control
+ * transfers, so up to Depth requests are in flight at the same time. The
+ * results are stored in the request records, i.e. in the original order.
+ *)
+Unit CtrlBurst;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math, LibUsb, UsbTrace, USBDeviceDebug, RealTime, Utils;
+
+Const
+  BURST_MAX_DEPTH = 32;
+
+Type
+  TControlRequest = record
+    Setup   : TUsbSetup;
+    Data    : AnsiString;  // OUT: bytes to send, IN: received bytes
+    Status  : LongInt;     // transferred length or libusb error code
+    Latency : LongWord;    // us
+  End;
+  TControlRequests = Array of TControlRequest;
+
+  // TUSBDeviceDebug.ControlMsg or an equivalent method of another device class
+  TControlMsgFunc = Function(bmRequestType,bRequest:Byte;wValue,wIndex:Word;Var Buf;Length:LongInt;Timeout:LongInt) : LongInt of object;
+
+  TBurstResult = record
+    Elapsed   : UInt64;                // us
+    Errors    : Integer;
+    Latencies : Array of LongWord;     // us, sorted
+  End;
+
+Function  ParseControlRequest(St:String) : TControlRequest;
+Function  LoadControlRequests(AFilename:String) : TControlRequests;
+Function  RunControlBurst(ADevice:TUSBDeviceDebug;Var Reqs:TControlRequests;ADepth:Integer;ATimeout:LongInt) : TBurstResult;
+Function  RunControlBurst(AControlMsg:TControlMsgFunc;Var Reqs:TControlRequests;ADepth:Integer;ATimeout:LongInt) : TBurstResult;
+Function  BurstPercentile(Const Res:TBurstResult;P:Integer) : LongWord;
+
+Implementation
+
+Type
+
+  { TControlWorker }
+
+  TControlWorker = class(TThread)
+  private
+    FControl : TControlMsgFunc;
+    FReqs    : TControlRequests;
+    FNext    : PLongInt;
+    FTimeout : LongInt;
+  protected
+    Procedure Execute; override;
+  public
+    Constructor Create(AControlMsg:TControlMsgFunc;AReqs:TControlRequests;ANext:PLongInt;ATimeout:LongInt);
+  End;
+
+Constructor TControlWorker.Create(AControlMsg:TControlMsgFunc;AReqs:TControlRequests;ANext:PLongInt;ATimeout:LongInt);
+Begin
+  FControl := AControlMsg;
+  FReqs    := AReqs;   // the same array as the caller's, not a copy
+  FNext    := ANext;
+  FTimeout := ATimeout;
+  inherited Create(false);
+End;
+
+Procedure TControlWorker.Execute;
+Var I  : LongInt;
+    T  : UInt64;
+    RT : TRealTimeSaved;
+Begin
+  RT := RealTimeEnter;
+  repeat
+    I := InterLockedIncrement(FNext^) - 1;
+    if I > High(FReqs) then
+      Break;
+    With FReqs[I] do
+      Begin
+        T := GetUSec;
+        Status  := FControl(Setup.bmRequestType,Setup.bRequest,Setup.wValue,Setup.wIndex,
+                            PChar(Data)^,Setup.wLength,FTimeout);
+        T := GetUSec - T;
+        if T > High(LongWord) then
+          T := High(LongWord);
+        Latency := T;
+      End;
+  until false;
+  RealTimeLeave(RT);
+End;
+
+(**
+ * Parse "bmRequestType bRequest wValue wIndex [length|b0 b1 ...]"
+ *
+ * The syntax is the same as for the command "controlmsg": IN requests take
+ * an optional length, OUT requests the data bytes.
+ *)
+Function ParseControlRequest(St:String) : TControlRequest;
+Var Fields : TStringList;
+    I      : Integer;
+Begin
+  Fields := TStringList.Create;
+  try
+    Fields.Delimiter     := ' ';   // also splits at tabs
+    Fields.DelimitedText := Trim(St);
+    For I := Fields.Count-1 downto 0 do
+      if Fields[I] = '' then
+        Fields.Delete(I);
+    if Fields.Count < 4 then
+      raise Exception.Create('Invalid control request "'+St+'"');
+    With Result.Setup do
+      Begin
+        bmRequestType := StrToInt(Fields[0]);
+        bRequest      := StrToInt(Fields[1]);
+        wValue        := StrToInt(Fields[2]);
+        wIndex        := StrToInt(Fields[3]);
+        if bmRequestType and LIBUSB_ENDPOINT_DIR_MASK <> 0 then
+          Begin
+            if Fields.Count > 5 then
+              raise Exception.Create('Invalid control request "'+St+'"');
+            wLength := 0;
+            if Fields.Count = 5 then
+              wLength := StrToInt(Fields[4]);
+            Result.Data := StringOfChar(#0,wLength);
+          End
+        else
+          Begin
+            wLength := Fields.Count-4;
+            SetLength(Result.Data,wLength);
+            For I := 4 to Fields.Count-1 do
+              Result.Data[I-3] := Chr(StrToInt(Fields[I]));
+          End;
+      End;
+    Result.Status  := 0;
+    Result.Latency := 0;
+  finally
+    Fields.Free;
+  End;
+End;
+
+(**
+ * Read one request per line, empty lines and lines starting with '#' are
+ * ignored
+ *)
+Function LoadControlRequests(AFilename:String) : TControlRequests;
+Var Lines : TStringList;
+    N     : Integer;
+    I     : Integer;
+Begin
+  Lines := TStringList.Create;
+  try
+    Lines.LoadFromFile(AFilename);
+    SetLength(Result,Lines.Count);
+    N := 0;
+    For I := 0 to Lines.Count-1 do
+      Begin
+        if (Trim(Lines[I]) = '') or (Trim(Lines[I])[1] = '#') then
+          Continue;
+        Result[N] := ParseControlRequest(Lines[I]);
+        Inc(N);
+      End;
+    SetLength(Result,N);
+  finally
+    Lines.Free;
+  End;
+End;
+
+(**
+ * Execute all requests with up to ADepth in flight
+ *
+ * The IN data of each request is truncated to the received length.
+ *)
+Function RunControlBurst(ADevice:TUSBDeviceDebug;Var Reqs:TControlRequests;ADepth:Integer;ATimeout:LongInt) : TBurstResult;
+Begin
+  Result := RunControlBurst(@ADevice.ControlMsg,Reqs,ADepth,ATimeout);
+End;
+
+Function RunControlBurst(AControlMsg:TControlMsgFunc;Var Reqs:TControlRequests;ADepth:Integer;ATimeout:LongInt) : TBurstResult;
+Var Workers : Array of TControlWorker;
+    Next    : LongInt;
+    Start   : UInt64;
+    Error   : String;
+    I       : Integer;
+Begin
+  if (ADepth < 1) or (ADepth > BURST_MAX_DEPTH) then
+    raise Exception.CreateFmt('Depth must be 1 to %d',[BURST_MAX_DEPTH]);
+  // the workers write into the strings, they must not be shared
+  For I := 0 to High(Reqs) do
+    UniqueString(Reqs[I].Data);
+  SetLength(Workers,Min(ADepth,Max(1,Length(Reqs))));
+  Next  := 0;
+  Start := GetUSec;
+  For I := 0 to High(Workers) do
+    Workers[I] := TControlWorker.Create(AControlMsg,Reqs,@Next,ATimeout);
+  Error := '';
+  For I := 0 to High(Workers) do
+    Begin
+      Workers[I].WaitFor;
+      if Assigned(Workers[I].FatalException) then
+        Error := Exception(Workers[I].FatalException).Message;
+      Workers[I].Free;
+    End;
+  Result.Elapsed := GetUSec - Start;
+  if Error > '' then
+    raise Exception.Create(Error);
+  Result.Errors := 0;
+  SetLength(Result.Latencies,Length(Reqs));
+  For I := 0 to High(Reqs) do
+    With Reqs[I] do
+      Begin
+        Result.Latencies[I] := Latency;
+        if Status < 0 then
+          Begin
+            Inc(Result.Errors);
+            if Setup.bmRequestType and LIBUSB_ENDPOINT_DIR_MASK <> 0 then
+              Data := '';
+          End
+        else if Setup.bmRequestType and LIBUSB_ENDPOINT_DIR_MASK <> 0 then
+          SetLength(Data,Status);
+      End;
+  if Length(Reqs) > 0 then
+    SortSamples(Result.Latencies,0,High(Reqs));
+End;
+
+Function BurstPercentile(Const Res:TBurstResult;P:Integer) : LongWord;
+Var N : Integer;
+Begin
+  N := Length(Res.Latencies);
+  if N = 0 then
+    Exit(0);
+  Result := Res.Latencies[Min(N-1,(N*P) div 100)];
+End;
+
+End.
@@ -0,0 +1,608 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Unix domain socket server and client for "eztool --daemon"
+ *
+ * The daemon keeps the Tcl interpreter and the USB devices open and executes
+ * the scripts sent by thin clients. Every connection is a session. A session
+ * can lock the daemon, then the requests of all other sessions are deferred
+ * until it unlocks or disconnects.
+ *
+ * Every client can execute any Tcl command, including "exec". Therefore the
+ * socket is created with umask 077 in a directory of the own user, and only
+ * connections of the own user (SO_PEERCRED) are accepted. A second daemon
+ * refuses to take over the socket of a running one.
+ *
+ * The daemon never waits for a single client: every session collects the bytes
+ * of its current frame with one recv per select, and executes it when it is
+ * complete. The response is queued and sent without blocking whenever select
+ * reports the socket writable, the next request of the session is executed
+ * after it was sent completely. So a slow or stalled client doesn't block the
+ * other sessions.
+ *
+ * All messages are frames of a 4 byte length (big endian), a 1 byte kind and
+ * the payload:
+ *   client -> daemon   'E' script      evaluate script
+ *   daemon -> client   'O' output      script was successful
+ *                      'X' output      script failed
+ *)
+Unit Daemon;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, BaseUnix, Sockets, Utils;
+
+Const
+  DAEMON_MAX_FRAME  = 16*1024*1024;
+  DAEMON_HEADER_LEN = 5;
+  DAEMON_FLUSH_TIME = 1000;   // ms to deliver the last responses at exit
+
+Type
+  (**
+   * Callback to evaluate a script, returns false on errors
+   *)
+  TDaemonEval = Function(Const Script:AnsiString;Out Output:AnsiString) : Boolean;
+
+  // struct ucred of SO_PEERCRED
+  TPeerCred = record
+    pid : cint;
+    uid : cuint32;
+    gid : cuint32;
+  End;
+
+  TDaemonSession = class
+    FSocket : cint;
+    FId     : Integer;
+    // the frame being received, FHave counts the header and the payload bytes
+    FHeader : Array[0..DAEMON_HEADER_LEN-1] of Byte;
+    FData   : AnsiString;
+    FHave   : SizeInt;
+    // queued response frames, FSent bytes of them are already sent
+    FOut    : AnsiString;
+    FSent   : SizeInt;
+    Function Complete : Boolean;
+    Function Receive : Boolean;
+    Function Pending : Boolean;
+    Procedure Queue(Kind:Char;Const Data:AnsiString);
+    Function Flush : Boolean;
+  End;
+
+  { TEZToolDaemon }
+
+  TEZToolDaemon = class
+  private
+    FPath       : String;
+    FListen     : cint;
+    FBound      : Boolean;   // FPath is our socket and removed at the end
+    FSessions   : TList;
+    FNextId     : Integer;
+    FCurrent    : TDaemonSession;
+    FLockOwner  : TDaemonSession;
+    FEval       : TDaemonEval;
+    FTerminated : Boolean;
+    Procedure Accept;
+    Procedure Drop(ASession:TDaemonSession);
+    Procedure FlushAll;
+    Function  Ready(ASession:TDaemonSession) : Boolean;
+    Function  Handle(ASession:TDaemonSession) : Boolean;
+    Function  GetSessionId : Integer;
+  public
+    Constructor Create(APath:String;AEval:TDaemonEval);
+    Destructor  Destroy; override;
+    Procedure Run;
+    Procedure Terminate;
+    Procedure Lock;
+    Procedure Unlock;
+    property SessionId : Integer read GetSessionId;
+  End;
+
+Function DaemonFallbackDir : String;
+Function DaemonDefaultPath : String;
+Function RunClient(APath:String;Scripts:TStrings) : Integer;
+
+Implementation
+
+(**
+ * Per-user directory for the socket if there is no $XDG_RUNTIME_DIR, the
+ * daemon creates it with mode 0700
+ *)
+Function DaemonFallbackDir : String;
+Begin
+  Result := '/tmp/eztool-'+IntToStr(fpGetUID);
+End;
+
+(**
+ * Default socket path, per user in $XDG_RUNTIME_DIR or in DaemonFallbackDir
+ *)
+Function DaemonDefaultPath : String;
+Begin
+  Result := fpGetEnv('XDG_RUNTIME_DIR');
+  if Result = '' then
+    Result := DaemonFallbackDir;
+  Result := IncludeTrailingPathDelimiter(Result)+'eztool.sock';
+End;
+
+(**
+ * Create a directory only the own user can access, or check an existing one,
+ * because another user could have created it in /tmp before
+ *)
+Procedure MakePrivateDir(Dir:String);
+Var St : TStat;
+Begin
+  if (fpMkdir(Dir,&700) <> 0) and (fpGetErrno <> ESysEEXIST) then
+    raise Exception.Create('Couldn''t create '+Dir+': '+SysErrorMessage(fpGetErrno));
+  if fpLstat(Dir,St) <> 0 then
+    raise Exception.Create('Couldn''t access '+Dir+': '+SysErrorMessage(fpGetErrno));
+  if not fpS_ISDIR(St.st_mode) or (St.st_uid <> fpGetUID) or (St.st_mode and &077 <> 0) then
+    raise Exception.Create(Dir+' must be a directory of the own user with mode 0700');
+End;
+
+(**
+ * Another daemon accepts connections at the socket
+ *)
+Function SocketAlive(Const Addr:TUnixSockAddr;Len:LongInt) : Boolean;
+Var Sock : cint;
+Begin
+  Sock := fpSocket(AF_UNIX,SOCK_STREAM,0);
+  if Sock < 0 then
+    Exit(false);
+  Result := fpConnect(Sock,@Addr,Len) = 0;
+  CloseSocket(Sock);
+End;
+
+Function SendAll(Sock:cint;Const Buf;Len:SizeInt) : Boolean;
+Var P : PByte;
+    R : SizeInt;
+Begin
+  P := @Buf;
+  while Len > 0 do
+    Begin
+      R := fpSend(Sock,P,Len,0);
+      if R <= 0 then
+        Exit(false);
+      P   += R;
+      Len -= R;
+    End;
+  Result := true;
+End;
+
+Function RecvAll(Sock:cint;Out Buf;Len:SizeInt) : Boolean;
+Var P : PByte;
+    R : SizeInt;
+Begin
+  P := @Buf;
+  while Len > 0 do
+    Begin
+      R := fpRecv(Sock,P,Len,0);
+      if R <= 0 then
+        Exit(false);
+      P   += R;
+      Len -= R;
+    End;
+  Result := true;
+End;
+
+Function SendFrame(Sock:cint;Kind:Char;Const Data:AnsiString) : Boolean;
+Var Len : LongWord;
+Begin
+  Len := NtoBE(LongWord(Length(Data)));
+  Result := SendAll(Sock,Len,SizeOf(Len)) and SendAll(Sock,Kind,1);
+  if Result and (Length(Data) > 0) then
+    Result := SendAll(Sock,Data[1],Length(Data));
+End;
+
+Function RecvFrame(Sock:cint;Out Kind:Char;Out Data:AnsiString) : Boolean;
+Var Len : LongWord;
+Begin
+  Data := '';
+  Kind := #0;
+  if not RecvAll(Sock,Len,SizeOf(Len)) then Exit(false);
+  Len := BEtoN(Len);
+  if Len > DAEMON_MAX_FRAME then Exit(false);
+  if not RecvAll(Sock,Kind,1) then Exit(false);
+  SetLength(Data,Len);
+  Result := (Len = 0) or RecvAll(Sock,Data[1],Len);
+End;
+
+{ TDaemonSession }
+
+Function TDaemonSession.Complete : Boolean;
+Begin
+  Result := (FHave >= DAEMON_HEADER_LEN) and (FHave = DAEMON_HEADER_LEN + Length(FData));
+End;
+
+(**
+ * Receive the next part of the current frame with a single recv, so it
+ * doesn't block after select reported the socket readable
+ *
+ * @return false if the client disconnected or sent an invalid frame
+ *)
+Function TDaemonSession.Receive : Boolean;
+Var Len : LongWord;
+    R   : SizeInt;
+Begin
+  if FHave < DAEMON_HEADER_LEN then
+    R := fpRecv(FSocket,@FHeader[FHave],DAEMON_HEADER_LEN-FHave,0)
+  else
+    R := fpRecv(FSocket,@FData[FHave-DAEMON_HEADER_LEN+1],DAEMON_HEADER_LEN+Length(FData)-FHave,0);
+  if R < 0 then
+    Exit(fpGetErrno = ESysEINTR);
+  if R = 0 then
+    Exit(false);
+  Result := true;
+  FHave += R;
+  if FHave = DAEMON_HEADER_LEN then
+    Begin
+      Move(FHeader[0],Len,SizeOf(Len));
+      Len := BEtoN(Len);
+      if Len > DAEMON_MAX_FRAME then
+        Exit(false);
+      SetLength(FData,Len);
+    End;
+End;
+
+Function TDaemonSession.Pending : Boolean;
+Begin
+  Result := FSent < Length(FOut);
+End;
+
+Procedure TDaemonSession.Queue(Kind:Char;Const Data:AnsiString);
+Var Len : LongWord;
+    N   : SizeInt;
+Begin
+  N := Length(FOut);
+  SetLength(FOut,N+DAEMON_HEADER_LEN+Length(Data));
+  Len := NtoBE(LongWord(Length(Data)));
+  Move(Len,FOut[N+1],SizeOf(Len));
+  FOut[N+DAEMON_HEADER_LEN] := Kind;
+  if Length(Data) > 0 then
+    Move(Data[1],FOut[N+DAEMON_HEADER_LEN+1],Length(Data));
+End;
+
+(**
+ * Send as much of the queued responses as the socket takes without blocking
+ *
+ * @return false if the client disconnected
+ *)
+Function TDaemonSession.Flush : Boolean;
+Var R : SizeInt;
+Begin
+  if not Pending then
+    Exit(true);
+  R := fpSend(FSocket,@FOut[FSent+1],Length(FOut)-FSent,MSG_DONTWAIT);
+  if R < 0 then
+    Exit((fpGetErrno = ESysEINTR) or (fpGetErrno = ESysEAGAIN));
+  Result := true;
+  FSent += R;
+  if FSent = Length(FOut) then
+    Begin
+      FOut  := '';
+      FSent := 0;
+    End;
+End;
+
+{ TEZToolDaemon }
+
+Constructor TEZToolDaemon.Create(APath:String;AEval:TDaemonEval);
+Var Addr : TUnixSockAddr;
+    Len  : LongInt;
+    St   : TStat;
+    Mask : TMode;
+    R    : cint;
+Begin
+  inherited Create;
+  FPath     := APath;
+  FEval     := AEval;
+  FListen   := -1;
+  FSessions := TList.Create;
+  if ExtractFileDir(FPath) = DaemonFallbackDir then
+    MakePrivateDir(DaemonFallbackDir);
+  Str2UnixSockAddr(FPath,Addr,Len);
+  if fpLstat(FPath,St) = 0 then
+    Begin
+      if not fpS_ISSOCK(St.st_mode) then
+        raise Exception.Create(FPath+' exists and is not a socket');
+      if SocketAlive(Addr,Len) then
+        raise Exception.Create('A daemon is already running on '+FPath);
+      // remove the stale socket of a previous daemon
+      fpUnlink(FPath);
+    End;
+  FListen := fpSocket(AF_UNIX,SOCK_STREAM,0);
+  if FListen < 0 then
+    raise Exception.Create('Couldn''t create socket: '+SysErrorMessage(fpGetErrno));
+  // the socket must never be accessible by other users, not even until the
+  // chmod below
+  Mask := fpUmask(&077);
+  R := fpBind(FListen,@Addr,Len);
+  fpUmask(Mask);
+  if R <> 0 then
+    raise Exception.Create('Couldn''t bind to '+FPath+': '+SysErrorMessage(fpGetErrno));
+  FBound := true;
+  if fpListen(FListen,8) <> 0 then
+    raise Exception.Create('Couldn''t listen on '+FPath+': '+SysErrorMessage(fpGetErrno));
+  fpChmod(FPath,&600);
+End;
+
+Destructor TEZToolDaemon.Destroy;
+Begin
+  if Assigned(FSessions) then
+    while FSessions.Count > 0 do
+      Drop(TDaemonSession(FSessions[0]));
+  FSessions.Free;
+  if FListen >= 0 then
+    CloseSocket(FListen);
+  // only remove our own socket, not the one of another daemon
+  if FBound then
+    fpUnlink(FPath);
+  inherited Destroy;
+End;
+
+Procedure TEZToolDaemon.Accept;
+Var Session : TDaemonSession;
+    Sock    : cint;
+    Cred    : TPeerCred;
+    Len     : TSockLen;
+Begin
+  Sock := fpAccept(FListen,Nil,Nil);
+  if Sock < 0 then
+    Exit;
+  // the permissions of the socket should already prevent this
+  Len := SizeOf(Cred);
+  if (fpGetSockOpt(Sock,SOL_SOCKET,SO_PEERCRED,@Cred,@Len) <> 0) or (Cred.uid <> fpGetUID) then
+    Begin
+      CloseSocket(Sock);
+      Exit;
+    End;
+  Session := TDaemonSession.Create;
+  Session.FSocket := Sock;
+  Inc(FNextId);
+  Session.FId := FNextId;
+  FSessions.Add(Session);
+End;
+
+Procedure TEZToolDaemon.Drop(ASession:TDaemonSession);
+Begin
+  if FLockOwner = ASession then
+    FLockOwner := Nil;
+  CloseSocket(ASession.FSocket);
+  FSessions.Remove(ASession);
+  ASession.Free;
+End;
+
+(**
+ * Deliver the queued responses (e.g. of "exit") before the daemon terminates,
+ * but don't wait longer than DAEMON_FLUSH_TIME for stalled clients
+ *)
+Procedure TEZToolDaemon.FlushAll;
+Var FDs      : TFDSet;
+    Max      : cint;
+    Timeout  : TTimeVal;
+    Deadline : QWord;
+    Left     : Int64;
+    I        : Integer;
+    Session  : TDaemonSession;
+Begin
+  Deadline := GetTickCount64 + DAEMON_FLUSH_TIME;
+  repeat
+    fpFD_ZERO(FDs);
+    Max := -1;
+    For I := 0 to FSessions.Count-1 do
+      Begin
+        Session := TDaemonSession(FSessions[I]);
+        if not Session.Pending then
+          Continue;
+        fpFD_SET(Session.FSocket,FDs);
+        if Session.FSocket > Max then
+          Max := Session.FSocket;
+      End;
+    Left := Int64(Deadline) - Int64(GetTickCount64);
+    if (Max < 0) or (Left <= 0) then
+      Break;
+    Timeout.tv_sec  := Left div 1000;
+    Timeout.tv_usec := (Left mod 1000) * 1000;
+    if fpSelect(Max+1,Nil,@FDs,Nil,@Timeout) < 0 then
+      if fpGetErrno = ESysEINTR then
+        Continue
+      else
+        Break;
+    I := 0;
+    while I < FSessions.Count do
+      Begin
+        Session := TDaemonSession(FSessions[I]);
+        if (fpFD_ISSET(Session.FSocket,FDs) = 1) and not Session.Flush then
+          Drop(Session)
+        else
+          Inc(I);
+      End;
+  until false;
+End;
+
+(**
+ * A complete request of the session may be executed now, i.e. its previous
+ * response was sent and no other session holds the lock
+ *)
+Function TEZToolDaemon.Ready(ASession:TDaemonSession) : Boolean;
+Begin
+  Result := ASession.Complete and not ASession.Pending and
+            (not Assigned(FLockOwner) or (FLockOwner = ASession));
+End;
+
+(**
+ * Execute the received request of a session and queue the response
+ *
+ * @return false if the session was closed
+ *)
+Function TEZToolDaemon.Handle(ASession:TDaemonSession) : Boolean;
+Var Script : AnsiString;
+    Output : AnsiString;
+    OK     : Boolean;
+Begin
+  if Chr(ASession.FHeader[DAEMON_HEADER_LEN-1]) <> 'E' then
+    Exit(false);
+  Script := ASession.FData;
+  ASession.FData := '';
+  ASession.FHave := 0;
+  FCurrent := ASession;
+  try
+    OK := FEval(Script,Output);
+  finally
+    FCurrent := Nil;
+  End;
+  ASession.Queue(Select(OK,'O','X')[1],Output);
+  // most responses fit into the socket buffer and are sent right away
+  Result := ASession.Flush;
+End;
+
+Function TEZToolDaemon.GetSessionId : Integer;
+Begin
+  if Assigned(FCurrent) then
+    Result := FCurrent.FId
+  else
+    Result := 0;
+End;
+
+(**
+ * Serve the clients until Terminate is called (e.g. by "exit")
+ *)
+Procedure TEZToolDaemon.Run;
+Var FDs     : TFDSet;
+    WFDs    : TFDSet;
+    Max     : cint;
+    Timeout : TTimeVal;
+    Wait    : PTimeVal;
+    I       : Integer;
+    Session : TDaemonSession;
+    OK      : Boolean;
+Begin
+  // don't die if a client disconnects while we send the response
+  fpSignal(SIGPIPE,SignalHandler(SIG_IGN));
+  while not FTerminated do
+    Begin
+      fpFD_ZERO(FDs);
+      fpFD_ZERO(WFDs);
+      fpFD_SET(FListen,FDs);
+      Max  := FListen;
+      Wait := Nil;
+      // while a session holds the lock, the others are not even read, a
+      // complete request waits until its session may execute it
+      For I := 0 to FSessions.Count-1 do
+        Begin
+          Session := TDaemonSession(FSessions[I]);
+          if Ready(Session) then
+            Wait := @Timeout;
+          if Session.Pending then
+            Begin
+              fpFD_SET(Session.FSocket,WFDs);
+              if Session.FSocket > Max then
+                Max := Session.FSocket;
+            End;
+          if (Assigned(FLockOwner) and (Session <> FLockOwner)) or Session.Complete then
+            Continue;
+          fpFD_SET(Session.FSocket,FDs);
+          if Session.FSocket > Max then
+            Max := Session.FSocket;
+        End;
+      // don't sleep if an unlock made a request ready
+      Timeout.tv_sec  := 0;
+      Timeout.tv_usec := 0;
+      if fpSelect(Max+1,@FDs,@WFDs,Nil,Wait) < 0 then
+        Begin
+          if fpGetErrno = ESysEINTR then
+            Continue;
+          raise Exception.Create('select: '+SysErrorMessage(fpGetErrno));
+        End;
+      if fpFD_ISSET(FListen,FDs) = 1 then
+        Accept;
+      I := 0;
+      while (I < FSessions.Count) and not FTerminated do
+        Begin
+          Session := TDaemonSession(FSessions[I]);
+          OK := true;
+          if fpFD_ISSET(Session.FSocket,WFDs) = 1 then
+            OK := Session.Flush;
+          if OK and not Session.Complete and (fpFD_ISSET(Session.FSocket,FDs) = 1) then
+            OK := Session.Receive;
+          if OK and Ready(Session) then
+            OK := Handle(Session);
+          if not OK then
+            Drop(Session)
+          else
+            Inc(I);
+        End;
+    End;
+  FlushAll;
+End;
+
+Procedure TEZToolDaemon.Terminate;
+Begin
+  FTerminated := true;
+End;
+
+Procedure TEZToolDaemon.Lock;
+Begin
+  if not Assigned(FCurrent) then
+    raise Exception.Create('Locking is only available for daemon clients');
+  FLockOwner := FCurrent;
+End;
+
+Procedure TEZToolDaemon.Unlock;
+Begin
+  if FLockOwner = FCurrent then
+    FLockOwner := Nil;
+End;
+
+(**
+ * Client: send all scripts to the daemon and print the outputs
+ *
+ * @return exit code, 0 if all scripts were successful
+ *)
+Function RunClient(APath:String;Scripts:TStrings) : Integer;
+Var Sock   : cint;
+    Addr   : TUnixSockAddr;
+    Len    : LongInt;
+    Script : String;
+    Kind   : Char;
+    Output : AnsiString;
+Begin
+  Sock := fpSocket(AF_UNIX,SOCK_STREAM,0);
+  if Sock < 0 then
+    raise Exception.Create('Couldn''t create socket: '+SysErrorMessage(fpGetErrno));
+  try
+    Str2UnixSockAddr(APath,Addr,Len);
+    if fpConnect(Sock,@Addr,Len) <> 0 then
+      raise Exception.Create('Couldn''t connect to daemon at '+APath+': '+SysErrorMessage(fpGetErrno));
+    Result := 0;
+    for Script in Scripts do
+      Begin
+        if not SendFrame(Sock,'E',Script) or not RecvFrame(Sock,Kind,Output) then
+          raise Exception.Create('Lost connection to daemon');
+        Write(Output);
+        if Kind <> 'O' then
+          Exit(1);
+      End;
+  finally
+    CloseSocket(Sock);
+  End;
+End;
+
+End.
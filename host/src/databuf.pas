@@ -0,0 +1,534 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Binary data buffers for the Tcl command "data"
+ *
+ * Tcl scripts refer to the buffers by handles ("data1", "data2", ...). The
+ * device commands read into and write from the buffers directly, so the data
+ * is never converted to Tcl strings unless requested.
+ *
+ * The bulk operations work on whole machine words where possible.
+ *)
+Unit DataBuf;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math;
+
+Type
+
+  { TDataBuffer }
+
+  TDataBuffer = class
+  private
+    FBytes : Array of Byte;
+    Function  GetLength : SizeInt;
+    Procedure SetLength(ALength:SizeInt);
+    Function  GetPtr : PByte;
+  public
+    Constructor Create(ALength:SizeInt);
+    Constructor Create(Const Buf;ALength:SizeInt);
+    Procedure CheckRange(AStart,ALength:SizeInt);
+    property Length : SizeInt read GetLength write SetLength;
+    property Ptr    : PByte   read GetPtr;
+  End;
+
+  { TDataStore }
+
+  TDataStore = class
+  private
+    FBuffers : TStringList;
+    FNextId  : Integer;
+  public
+    Constructor Create;
+    Destructor  Destroy; override;
+    Function  Add(ABuffer:TDataBuffer) : String;
+    Function  Get(AHandle:String) : TDataBuffer;
+    Procedure Remove(AHandle:String);
+    Function  Names : String;
+  End;
+
+Function DataCompare(A,B:PByte;Len:SizeInt) : SizeInt;
+Function DataBitErrors(A,B:PByte;Len:SizeInt) : Int64;
+Procedure DataPrbs31(P:PByte;Len:SizeInt;Var State:LongWord);
+Function DataPrbs31Errors(P:PByte;Len:SizeInt) : Int64;
+Function DataDiff(A:PByte;ALen:SizeInt;B:PByte;BLen:SizeInt;MaxCount:Integer) : String;
+Function DataSearch(Hay:PByte;HayLen:SizeInt;Needle:PByte;NeedleLen:SizeInt;Start:SizeInt) : SizeInt;
+Function DataBits(P:PByte;Len:SizeInt;BitOffset:SizeInt;Width:Integer) : QWord;
+Function DataCRC32(P:PByte;Len:SizeInt) : LongWord;
+Function DataCRC16(P:PByte;Len:SizeInt) : Word;
+Function DataSum8(P:PByte;Len:SizeInt) : Byte;
+Function DataXor8(P:PByte;Len:SizeInt) : Byte;
+Function DataToHex(P:PByte;Len:SizeInt) : AnsiString;
+Function DataFromHex(St:AnsiString) : TDataBuffer;
+
+Implementation
+
+{ TDataBuffer }
+
+Constructor TDataBuffer.Create(ALength:SizeInt);
+Begin
+  inherited Create;
+  System.SetLength(FBytes,ALength);   // zero-initialized
+End;
+
+Constructor TDataBuffer.Create(Const Buf;ALength:SizeInt);
+Begin
+  Create(ALength);
+  if ALength > 0 then
+    Move(Buf,FBytes[0],ALength);
+End;
+
+Function TDataBuffer.GetLength : SizeInt;
+Begin
+  Result := System.Length(FBytes);
+End;
+
+Procedure TDataBuffer.SetLength(ALength:SizeInt);
+Begin
+  System.SetLength(FBytes,ALength);
+End;
+
+Function TDataBuffer.GetPtr : PByte;
+Begin
+  if System.Length(FBytes) = 0 then
+    Result := Nil
+  else
+    Result := @FBytes[0];
+End;
+
+Procedure TDataBuffer.CheckRange(AStart,ALength:SizeInt);
+Begin
+  if (AStart < 0) or (ALength < 0) or (AStart + ALength > System.Length(FBytes)) then
+    raise Exception.CreateFmt('Range %d+%d exceeds the buffer length %d',[AStart,ALength,System.Length(FBytes)]);
+End;
+
+{ TDataStore }
+
+Constructor TDataStore.Create;
+Begin
+  inherited Create;
+  FBuffers := TStringList.Create;
+  FBuffers.OwnsObjects := true;
+  FBuffers.Sorted := true;
+End;
+
+Destructor TDataStore.Destroy;
+Begin
+  FBuffers.Free;
+  inherited Destroy;
+End;
+
+Function TDataStore.Add(ABuffer:TDataBuffer) : String;
+Begin
+  Inc(FNextId);
+  Result := 'data' + IntToStr(FNextId);
+  FBuffers.AddObject(Result,ABuffer);
+End;
+
+Function TDataStore.Get(AHandle:String) : TDataBuffer;
+Var I : Integer;
+Begin
+  if not FBuffers.Find(AHandle,I) then
+    raise Exception.Create('Unknown data buffer "'+AHandle+'"');
+  Result := TDataBuffer(FBuffers.Objects[I]);
+End;
+
+Procedure TDataStore.Remove(AHandle:String);
+Var I : Integer;
+Begin
+  if not FBuffers.Find(AHandle,I) then
+    raise Exception.Create('Unknown data buffer "'+AHandle+'"');
+  FBuffers.Delete(I);   // frees the object
+End;
+
+Function TDataStore.Names : String;
+Var I : Integer;
+Begin
+  Result := '';
+  For I := 0 to FBuffers.Count-1 do
+    Result += Copy(' ',1,Ord(I > 0)) + FBuffers[I];
+End;
+
+(*****************************************************************************)
+(***  Operations  ************************************************************)
+(*****************************************************************************)
+
+(**
+ * Return the offset of the first differing byte, -1 if all are equal
+ *)
+Function DataCompare(A,B:PByte;Len:SizeInt) : SizeInt;
+Var I : SizeInt;
+Begin
+  I := 0;
+  // skip equal words
+  while (I + SizeOf(PtrUInt) <= Len) and (PPtrUInt(A+I)^ = PPtrUInt(B+I)^) do
+    I += SizeOf(PtrUInt);
+  while I < Len do
+    Begin
+      if A[I] <> B[I] then
+        Exit(I);
+      Inc(I);
+    End;
+  Result := -1;
+End;
+
+(**
+ * Count the bits which differ between A and B
+ *)
+Function DataBitErrors(A,B:PByte;Len:SizeInt) : Int64;
+Var I : SizeInt;
+Begin
+  Result := 0;
+  I := 0;
+  while I + SizeOf(QWord) <= Len do
+    Begin
+      Result += PopCnt(PQWord(A+I)^ xor PQWord(B+I)^);
+      I += SizeOf(QWord);
+    End;
+  while I < Len do
+    Begin
+      Result += PopCnt(Byte(A[I] xor B[I]));
+      Inc(I);
+    End;
+End;
+
+(**
+ * Fill with the PRBS-31 sequence x^31 + x^28 + 1 (ITU-T O.150), MSB first
+ *
+ * @param State  shift register, must not be 0, is updated for the next call
+ *)
+Procedure DataPrbs31(P:PByte;Len:SizeInt;Var State:LongWord);
+Var I   : SizeInt;
+    B   : Integer;
+    Bit : LongWord;
+    V   : Byte;
+Begin
+  For I := 0 to Len-1 do
+    Begin
+      V := 0;
+      For B := 0 to 7 do
+        Begin
+          Bit   := ((State shr 30) xor (State shr 27)) and 1;
+          State := ((State shl 1) or Bit) and $7FFFFFFF;
+          V     := (V shl 1) or Bit;
+        End;
+      P[I] := V;
+    End;
+End;
+
+(**
+ * Count the bit errors of a PRBS-31 sequence
+ *
+ * The checker is self-synchronizing, i.e. every bit is checked against the
+ * 31 bits received before it. Therefore the data may start at any position
+ * of the sequence and transfers may arrive in any order. The first 31 bits
+ * are not checked, and a single flipped bit is counted three times (once
+ * itself, once for each tap it feeds).
+ *)
+Function DataPrbs31Errors(P:PByte;Len:SizeInt) : Int64;
+Var I     : SizeInt;
+    B     : Integer;
+    Bit   : LongWord;
+    State : LongWord;
+    N     : Integer;
+Begin
+  Result := 0;
+  State  := 0;
+  N      := 0;
+  For I := 0 to Len-1 do
+    For B := 7 downto 0 do
+      Begin
+        Bit := (P[I] shr B) and 1;
+        if N < 31 then
+          Inc(N)
+        else if Bit <> ((State shr 30) xor (State shr 27)) and 1 then
+          Inc(Result);
+        State := ((State shl 1) or Bit) and $7FFFFFFF;
+      End;
+End;
+
+(**
+ * List offset, byte of A and byte of B of up to MaxCount differing bytes as
+ * Tcl list, the bytes after the end of the shorter buffer differ too and
+ * have {} for the missing byte
+ *)
+Function DataDiff(A:PByte;ALen:SizeInt;B:PByte;BLen:SizeInt;MaxCount:Integer) : String;
+
+  Function Hex(P:PByte;PLen,I:SizeInt) : String;
+  Begin
+    if I < PLen then
+      Result := '0x' + IntToHex(P[I],2)
+    else
+      Result := '{}';
+  End;
+
+Var I     : SizeInt;
+    Len   : SizeInt;
+    Stop  : SizeInt;
+    Count : Integer;
+Begin
+  Result := '';
+  Count  := 0;
+  I      := 0;
+  Len    := Min(ALen,BLen);
+  while (I < Len) and (Count < MaxCount) do
+    Begin
+      if (I + SizeOf(PtrUInt) <= Len) and (PPtrUInt(A+I)^ = PPtrUInt(B+I)^) then
+        Begin
+          I += SizeOf(PtrUInt);
+          Continue;
+        End;
+      Stop := I + SizeOf(PtrUInt);
+      if Stop > Len then Stop := Len;
+      while (I < Stop) and (Count < MaxCount) do
+        Begin
+          if A[I] <> B[I] then
+            Begin
+              if Count > 0 then Result += ' ';
+              Result += IntToStr(I) + ' ' + Hex(A,ALen,I) + ' ' + Hex(B,BLen,I);
+              Inc(Count);
+            End;
+          Inc(I);
+        End;
+    End;
+  while (I < Max(ALen,BLen)) and (Count < MaxCount) do
+    Begin
+      if Count > 0 then Result += ' ';
+      Result += IntToStr(I) + ' ' + Hex(A,ALen,I) + ' ' + Hex(B,BLen,I);
+      Inc(Count);
+      Inc(I);
+    End;
+End;
+
+(**
+ * Return the offset of the first occurence of Needle at or after Start, -1 if
+ * not found
+ *)
+Function DataSearch(Hay:PByte;HayLen:SizeInt;Needle:PByte;NeedleLen:SizeInt;Start:SizeInt) : SizeInt;
+Var I : SizeInt;
+    J : SizeInt;
+Begin
+  if (NeedleLen = 0) or (Start < 0) then
+    Exit(-1);
+  I := Start;
+  while I + NeedleLen <= HayLen do
+    Begin
+      // IndexByte is the optimized memchr() of the RTL
+      J := IndexByte(Hay[I],HayLen-NeedleLen+1-I,Needle[0]);
+      if J < 0 then
+        Exit(-1);
+      I += J;
+      if CompareByte(Hay[I],Needle[0],NeedleLen) = 0 then
+        Exit(I);
+      Inc(I);
+    End;
+  Result := -1;
+End;
+
+(**
+ * Extract a bit field, bit 0 is the LSB of the first byte (little endian)
+ *)
+Function DataBits(P:PByte;Len:SizeInt;BitOffset:SizeInt;Width:Integer) : QWord;
+Var I : Integer;
+    B : SizeInt;
+Begin
+  if (Width < 1) or (Width > 64) or (BitOffset < 0) or (BitOffset + Width > Len * 8) then
+    raise Exception.Create('Bit field exceeds the buffer');
+  Result := 0;
+  For I := Width-1 downto 0 do
+    Begin
+      B := BitOffset + I;
+      Result := (Result shl 1) or ((P[B shr 3] shr (B and 7)) and 1);
+    End;
+End;
+
+Var
+  CRC32Table : Array[0..255] of LongWord;
+  CRC16Table : Array[0..255] of Word;
+
+Procedure InitTables;
+Var I,J : Integer;
+    C32 : LongWord;
+    C16 : Word;
+Begin
+  For I := 0 to 255 do
+    Begin
+      // CRC-32 (IEEE 802.3), reflected polynomial
+      C32 := I;
+      For J := 0 to 7 do
+        if (C32 and 1) <> 0 then
+          C32 := (C32 shr 1) xor $EDB88320
+        else
+          C32 := C32 shr 1;
+      CRC32Table[I] := C32;
+      // CRC-16/CCITT-FALSE, polynomial 0x1021
+      C16 := I shl 8;
+      For J := 0 to 7 do
+        if (C16 and $8000) <> 0 then
+          C16 := (C16 shl 1) xor $1021
+        else
+          C16 := C16 shl 1;
+      CRC16Table[I] := C16;
+    End;
+End;
+
+Function DataCRC32(P:PByte;Len:SizeInt) : LongWord;
+Var I : SizeInt;
+Begin
+  Result := $FFFFFFFF;
+  For I := 0 to Len-1 do
+    Result := CRC32Table[(Result xor P[I]) and $FF] xor (Result shr 8);
+  Result := not Result;
+End;
+
+Function DataCRC16(P:PByte;Len:SizeInt) : Word;
+Var I : SizeInt;
+Begin
+  Result := $FFFF;
+  For I := 0 to Len-1 do
+    Result := CRC16Table[(Result shr 8) xor P[I]] xor Word(Result shl 8);
+End;
+
+(**
+ * 8 bit sum, adds whole words and folds the byte lanes afterwards
+ *)
+Function DataSum8(P:PByte;Len:SizeInt) : Byte;
+Var I   : SizeInt;
+    W   : PtrUInt;
+    Acc : PtrUInt;
+    S   : PtrUInt;
+    N   : Integer;
+Const
+{$IFDEF CPU64}
+  Mask = PtrUInt($00FF00FF00FF00FF);
+{$ELSE}
+  Mask = PtrUInt($00FF00FF);
+{$ENDIF}
+Begin
+  S := 0;
+  I := 0;
+  while I + SizeOf(PtrUInt) <= Len do
+    Begin
+      // add the even and odd bytes in 16 bit lanes, 128 words don't overflow
+      Acc := 0;
+      N   := 0;
+      while (I + SizeOf(PtrUInt) <= Len) and (N < 128) do
+        Begin
+          W   := PPtrUInt(P+I)^;
+          Acc += (W and Mask) + ((W shr 8) and Mask);
+          I   += SizeOf(PtrUInt);
+          Inc(N);
+        End;
+      while Acc <> 0 do
+        Begin
+          S   += Acc and $FFFF;
+          Acc := Acc shr 16;
+        End;
+    End;
+  while I < Len do
+    Begin
+      S += P[I];
+      Inc(I);
+    End;
+  Result := S and $FF;
+End;
+
+Function DataXor8(P:PByte;Len:SizeInt) : Byte;
+Var I   : SizeInt;
+    Acc : PtrUInt;
+Begin
+  Acc := 0;
+  I   := 0;
+  while I + SizeOf(PtrUInt) <= Len do
+    Begin
+      Acc := Acc xor PPtrUInt(P+I)^;
+      I   += SizeOf(PtrUInt);
+    End;
+  // fold the byte lanes
+  Result := 0;
+  while Acc <> 0 do
+    Begin
+      Result := Result xor (Acc and $FF);
+      Acc    := Acc shr 8;
+    End;
+  while I < Len do
+    Begin
+      Result := Result xor P[I];
+      Inc(I);
+    End;
+End;
+
+Const
+  HexDigits : Array[0..15] of Char = '0123456789ABCDEF';
+
+Function DataToHex(P:PByte;Len:SizeInt) : AnsiString;
+Var I : SizeInt;
+    D : PChar;
+Begin
+  System.SetLength(Result,Len*2);
+  D := PChar(Result);
+  For I := 0 to Len-1 do
+    Begin
+      D[0] := HexDigits[P[I] shr 4];
+      D[1] := HexDigits[P[I] and $0F];
+      D += 2;
+    End;
+End;
+
+Function HexNibble(C:Char) : Byte;
+Begin
+  case C of
+    '0'..'9' : Result := Ord(C) - Ord('0');
+    'A'..'F' : Result := Ord(C) - Ord('A') + 10;
+    'a'..'f' : Result := Ord(C) - Ord('a') + 10;
+  else
+    raise Exception.Create('Invalid hex digit "'+C+'"');
+  End;
+End;
+
+(**
+ * Convert a hex string to a new buffer, white space is ignored
+ *)
+Function DataFromHex(St:AnsiString) : TDataBuffer;
+Var I,N : SizeInt;
+    P   : PByte;
+Begin
+  St := StringReplace(StringReplace(StringReplace(St,' ','',[rfReplaceAll]),#10,'',[rfReplaceAll]),#9,'',[rfReplaceAll]);
+  if Odd(System.Length(St)) then
+    raise Exception.Create('Hex string must have an even number of digits');
+  N := System.Length(St) div 2;
+  Result := TDataBuffer.Create(N);
+  P := Result.Ptr;
+  try
+    For I := 0 to N-1 do
+      P[I] := (HexNibble(St[2*I+1]) shl 4) or HexNibble(St[2*I+2]);
+  except
+    Result.Free;
+    raise;
+  End;
+End;
+
+Initialization
+  InitTables;
+End.
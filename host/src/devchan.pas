@@ -0,0 +1,335 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Device memories and streams as Tcl channels
+ *
+ * TDevChannel implements the I/O of one channel opened with a name like
+ * "eztool:xram". The Tcl side is a reflected channel ("chan create"), whose
+ * handler calls Read, Write and Seek, see TEZTool.ChanCmd. Tcl does the
+ * buffering, so every call transfers up to one channel buffer, which is
+ * split into chunks the firmware accepts.
+ *
+ *   eztool:xram       XRAM, 64 kB, seekable
+ *   eztool:eeprom     I2C EEPROM 0x50 (24C02), seekable
+ *   eztool:eeprom16   boot EEPROM 0x51 (24LC64), seekable
+ *   eztool:i2c/ADDR   I2C slave ADDR, every read or write is one transfer
+ *   eztool:ep/EP      bulk endpoint EP of a device in User mode
+ *)
+Unit DevChan;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math, LibUsb, LibUsbOop, Device, USBDeviceDebug, Utils;
+
+Const
+  CHAN_XRAM_CHUNK   = $1000;   // bytes per XRead/XWrite
+  CHAN_BULK_CHUNK   = $4000;   // bytes per bulk transfer
+  CHAN_BULK_TIMEOUT = 1000;    // ms
+
+Type
+  TDevChannelKind = (ckXRAM,ckEEPROM,ckEEPROM16,ckI2C,ckEndpoint);
+
+  { TDevChannel }
+
+  TDevChannel = class
+  private
+    FName     : String;
+    FKind     : TDevChannelKind;
+    FEZTool   : TEZToolDevice;
+    FUser     : TUSBDeviceDebug;
+    FAddr     : Byte;        // I2C address or endpoint
+    FSize     : LongInt;     // memories only
+    FPos      : LongInt;
+    FReadable : Boolean;
+    FWritable : Boolean;
+    Function  Chunk(Cmd:Byte;Default:Word) : Word;
+    Procedure CheckDevice;
+  public
+    ChanId    : String;      // name of the Tcl channel
+    Watch     : String;      // events requested by Tcl, "read" and/or "write"
+    Posting   : Boolean;     // a "post" is scheduled, see TEZTool.ChanCmd
+    Constructor Create(Const AName,AMode:String;AEZTool:TEZToolDevice;AUser:TUSBDeviceDebug);
+    Procedure Detach;
+    Function  Read(Count:LongInt) : AnsiString;
+    Function  Write(Const Data:AnsiString) : LongInt;
+    Function  Seek(Offset:Int64;Const Base:String) : LongInt;
+    Function  Methods : String;
+    Function  Seekable : Boolean;
+    property Name     : String  read FName;
+    property Readable : Boolean read FReadable;
+    property Writable : Boolean read FWritable;
+  End;
+
+Implementation
+
+(**
+ * Parse the channel name and check the access mode
+ *
+ * @param AMode  access as for "open": r, r+, w, w+, a, a+ or a list of
+ *               flags with RDONLY, WRONLY or RDWR; w doesn't truncate
+ *)
+Constructor TDevChannel.Create(Const AName,AMode:String;AEZTool:TEZToolDevice;AUser:TUSBDeviceDebug);
+Var Res : String;
+    Arg : String;
+    P   : Integer;
+Begin
+  inherited Create;
+  FName := AName;
+  if Pos('eztool:',AName) <> 1 then
+    raise Exception.Create('Invalid channel name "'+AName+'"');
+  Res := Copy(AName,8,MaxInt);
+  Arg := '';
+  P   := Pos('/',Res);
+  if P > 0 then
+    Begin
+      Arg := Copy(Res,P+1,MaxInt);
+      Res := Copy(Res,1,P-1);
+    End;
+  if      Res = 'xram'     then Begin FKind := ckXRAM;     FSize := XRAM_SIZE;     End
+  else if Res = 'eeprom'   then Begin FKind := ckEEPROM;   FSize := EEPROM_SIZE;   End
+  else if Res = 'eeprom16' then Begin FKind := ckEEPROM16; FSize := EEPROM16_SIZE; End
+  else if Res = 'i2c'      then FKind := ckI2C
+  else if Res = 'ep'       then FKind := ckEndpoint
+  else
+    raise Exception.Create('Invalid channel name "'+AName+'"');
+  if (FKind in [ckI2C,ckEndpoint]) <> (Arg <> '') then
+    raise Exception.Create('Invalid channel name "'+AName+'"');
+  if Arg <> '' then
+    FAddr := StrToInt(Arg);
+
+  if FKind = ckEndpoint then
+    Begin
+      if not Assigned(AUser) then
+        raise Exception.Create(AName+' is only available in User mode');
+      if not AUser.HaveInterface then
+        raise Exception.Create('You must first ''claim'' an interface.');
+      FUser := AUser;
+    End
+  else
+    Begin
+      if not Assigned(AEZTool) then
+        raise Exception.Create(AName+' is only available in EZTool mode');
+      FEZTool := AEZTool;
+    End;
+
+  if (AMode = '') or (AMode = 'r') or (AMode = 'rb') then
+    FReadable := true
+  else if (AMode = 'w') or (AMode = 'wb') or (AMode = 'a') or (AMode = 'ab') then
+    FWritable := true
+  else if (AMode = 'r+') or (AMode = 'w+') or (AMode = 'a+') then
+    Begin
+      FReadable := true;
+      FWritable := true;
+    End
+  else if Pos('RDWR',AMode) > 0 then
+    Begin
+      FReadable := true;
+      FWritable := true;
+    End
+  else if Pos('RDONLY',AMode) > 0 then
+    FReadable := true
+  else if Pos('WRONLY',AMode) > 0 then
+    FWritable := true
+  else
+    raise Exception.Create('Invalid access mode "'+AMode+'"');
+  if FKind = ckEndpoint then
+    if FAddr and LIBUSB_ENDPOINT_DIR_MASK <> 0 then
+      Begin
+        if FWritable then
+          raise Exception.CreateFmt('Endpoint 0x%.2x is an IN endpoint, it can only be read',[FAddr]);
+      End
+    else
+      Begin
+        if FReadable then
+          raise Exception.CreateFmt('Endpoint 0x%.2x is an OUT endpoint, it can only be written',[FAddr]);
+      End;
+  if (AMode <> '') and (AMode[1] = 'a') then
+    FPos := FSize;
+End;
+
+(**
+ * The device was disconnected, all further operations fail
+ *)
+Procedure TDevChannel.Detach;
+Begin
+  FEZTool := Nil;
+  FUser   := Nil;
+End;
+
+Procedure TDevChannel.CheckDevice;
+Begin
+  if not Assigned(FEZTool) and not Assigned(FUser) then
+    raise Exception.Create('The device of '+FName+' was disconnected');
+End;
+
+Function TDevChannel.Chunk(Cmd:Byte;Default:Word) : Word;
+Begin
+  Result := FEZTool.MaxLength(Cmd);
+  if Result = 0 then
+    Result := Default;
+End;
+
+(**
+ * Read up to Count bytes
+ *
+ * Memories return less at their end and '' at EOF. Streams return what
+ * one transfer delivered.
+ *)
+Function TDevChannel.Read(Count:LongInt) : AnsiString;
+Var Len  : LongInt;
+    Offs : LongInt;
+Begin
+  CheckDevice;
+  if FKind in [ckXRAM,ckEEPROM,ckEEPROM16] then
+    Count := Max(0,Min(Count,FSize-FPos));
+  SetLength(Result,Count);
+  if Count = 0 then
+    Exit;
+  Case FKind of
+    ckI2C      : Begin
+                   Count := Min(Count,Chunk(CMD_READ_I2C,64));
+                   FEZTool.I2CRead(FAddr,Result[1],Count);
+                 End;
+    ckEndpoint : Begin
+                   Count := FUser.BulkIn(FAddr,Result[1],Min(Count,CHAN_BULK_CHUNK),CHAN_BULK_TIMEOUT);
+                   if Count < 0 then
+                     raise ELibUsb.Create(Count,'BulkIn');
+                 End;
+  else
+    Offs := 0;
+    while Offs < Count do
+      Begin
+        Case FKind of
+          ckXRAM     : Begin
+                         Len := Min(Count-Offs,CHAN_XRAM_CHUNK);
+                         FEZTool.XRead(FPos,Result[Offs+1],Len);
+                       End;
+          ckEEPROM   : Begin
+                         Len := Min(Count-Offs,Chunk(CMD_READ_EEPROM,EEPROM_PAGE_SIZE));
+                         FEZTool.EERead(FPos,Result[Offs+1],Len);
+                       End;
+          ckEEPROM16 : Begin
+                         Len := Min(Count-Offs,Chunk(CMD_READ_EEPROM16,EEPROM16_PAGE_SIZE));
+                         FEZTool.EE16Read(FPos,Result[Offs+1],Len);
+                       End;
+        End;
+        Offs += Len;
+        FPos += Len;
+      End;
+  End;
+  SetLength(Result,Count);
+End;
+
+(**
+ * Write Data, memories are written page by page
+ *
+ * @return number of bytes written
+ *)
+Function TDevChannel.Write(Const Data:AnsiString) : LongInt;
+Var Count : LongInt;
+    Len   : LongInt;
+    Offs  : LongInt;
+    Page  : LongInt;
+Begin
+  CheckDevice;
+  Count := Length(Data);
+  if FKind in [ckXRAM,ckEEPROM,ckEEPROM16] then
+    Begin
+      Count := Min(Count,FSize-FPos);
+      if (Count <= 0) and (Length(Data) > 0) then
+        raise Exception.Create('Write beyond the end of '+FName);
+    End;
+  if Count = 0 then
+    Exit(0);
+  Case FKind of
+    ckI2C      : Begin
+                   Count := Min(Count,Chunk(CMD_WRITE_I2C,64));
+                   FEZTool.I2CWrite(FAddr,Data[1],Count);
+                 End;
+    ckEndpoint : Begin
+                   Count := FUser.BulkOut(FAddr,Data[1],Min(Count,CHAN_BULK_CHUNK),CHAN_BULK_TIMEOUT);
+                   if Count < 0 then
+                     raise ELibUsb.Create(Count,'BulkOut');
+                 End;
+    ckEEPROM16 : Begin
+                   // run-length encoded if possible, see EE16WriteBlock
+                   FEZTool.EE16WriteBlock(FPos,Data[1],Count);
+                   FPos += Count;
+                 End;
+  else
+    if FKind = ckEEPROM then
+      Page := Chunk(CMD_WRITE_EEPROM,EEPROM_PAGE_SIZE)
+    else
+      Page := CHAN_XRAM_CHUNK;
+    Offs := 0;
+    while Offs < Count do
+      Begin
+        // EEPROM page writes must not cross a page boundary
+        Len := Min(Count-Offs,Page - FPos mod Page);
+        if FKind = ckXRAM then
+          FEZTool.XWrite (FPos,Data[Offs+1],Len)
+        else
+          FEZTool.EEWrite(FPos,Data[Offs+1],Len);
+        Offs += Len;
+        FPos += Len;
+      End;
+  End;
+  Result := Count;
+End;
+
+Function TDevChannel.Seek(Offset:Int64;Const Base:String) : LongInt;
+Var P : Int64;
+Begin
+  if not Seekable then
+    raise Exception.Create(FName+' is not seekable');
+  if      Base = 'start'   then P := Offset
+  else if Base = 'current' then P := FPos + Offset
+  else if Base = 'end'     then P := FSize + Offset
+  else
+    raise Exception.Create('Invalid seek base "'+Base+'"');
+  if (P < 0) or (P > FSize) then
+    raise Exception.CreateFmt('Seek position %d is outside of %s (0 to %d)',[P,FName,FSize]);
+  FPos   := P;
+  Result := FPos;
+End;
+
+Function TDevChannel.Seekable : Boolean;
+Begin
+  Result := FKind in [ckXRAM,ckEEPROM,ckEEPROM16];
+End;
+
+(**
+ * The sub-commands for the "initialize" method of the reflected channel
+ *)
+Function TDevChannel.Methods : String;
+Begin
+  Result := 'initialize finalize watch';
+  if FReadable then
+    Result += ' read';
+  if FWritable then
+    Result += ' write';
+  if Seekable then
+    Result += ' seek';
+End;
+
+End.
@@ -24,7 +24,7 @@ Unit Device;
 Interface
 
 Uses
-  Classes,SysUtils,BaseUnix,Utils,LibUsb,LibUsbOop,LibUsbUtil,EZUSB;
+  Classes,SysUtils,Math,BaseUnix,Utils,LibUsb,LibUsbOop,LibUsbUtil,EZUSB,ShadowCache,UsbTrace;
 
 Const
   USBVendConf   = $0547;
@@ -34,20 +34,35 @@ Const
 Const
   EP_IN    =  2 or LIBUSB_ENDPOINT_IN;
   EP_OUT   =  2 or LIBUSB_ENDPOINT_OUT;
+  EP_POLL  =  4 or LIBUSB_ENDPOINT_IN;    // I2C polling records
+
+{ opcodes and constants shared with the firmware, generated from
+  protocol/commands.def }
+{$I protocol.inc}
 
 Const
-  CMD_GET_VERSION   = $80;
-  CMD_GET_STATUS    = $81;
-  CMD_SETUP_IOPORT  = $82;    // PORTxCFG and OEx
-  CMD_SET_IOPORT    = $83;    // write OUTx
-  CMD_GET_IOPORT    = $84;    // read INx
-  CMD_READ_EEPROM   = $85;    // read from EEPROM
-  CMD_WRITE_EEPROM  = $86;    // write to EEPROM
-  CMD_READ_XDATA    = $87;    // read from XDATA
-  CMD_WRITE_XDATA   = $88;    // write to XDATA
-  CMD_READ_I2C      = $89;    // generic read at I2C bus
-  CMD_WRITE_I2C     = $8A;    // generic write at I2C bus
+  EEPROM_SIZE        = 256;   // 24C02, at I2C address 0x50
+  EEPROM_PAGE_SIZE   = 16;
+  EEPROM16_SIZE      = $2000;
+  EEPROM16_PAGE_SIZE = 32;    // 24LC64, at I2C address 0x51
+  XRAM_SIZE          = $10000;
+  XRAM_PAGE_SIZE     = 64;    // one bulk packet
+  I2C_ADDR_EEPROM    = $50;
+  CPUCS_ADDR         = $7F92;
+  XRAM_REGS_START    = $7B40;   // endpoint buffers and registers up to 0x7FFF
+  XRAM_REGS_MIRROR   = $1B40;   // the same at 0x1B40 to 0x1FFF
+  XRAM_REGS_LENGTH   = $04C0;
 
+Const
+  // sub-commands for CMD_POLL_CONTROL
+  POLL_CTRL_STOP    = 0;
+  POLL_CTRL_START   = 1;
+  POLL_CTRL_CLEAR   = 2;
+  POLL_CTRL_STATUS  = 3;
+  // flags of TPollEntry
+  POLL_NO_REG       = $01;    // don't write a register address before reading
+  POLL_MAX_ENTRIES  = 8;
+  POLL_MAX_LENGTH   = 16;
 
 Const
   EZToolUSBConfiguration = 1;
@@ -57,7 +72,58 @@ Const
 Type
 
   TPort = (ptA,ptB,ptC);
-  TStatus = Byte;  // TODO: define type as you like
+  { same as TGetStatus in firmware/include/commands.h }
+  TStatus = packed record
+    I2CNacks     : Word;   // I2C transfers not acknowledged since reset (little endian)
+    I2CBusErrors : Word;   // I2C bus errors since reset (little endian)
+  End;
+
+  { same as in firmware/include/poll.h }
+  TPollEntry = packed record
+    Addr   : Byte;       // 7-bit I2C slave address
+    Reg    : Byte;       // register address, written before each read
+    Len    : Byte;       // number of bytes to read
+    Flags  : Byte;       // POLL_* flags
+    Period : Word;       // sampling period in ms (little endian)
+  End;
+  TPollRecord = packed record
+    Id     : Byte;       // index of the entry in the polling table
+    Status : Byte;       // I2C status, 0 = OK
+    Time   : Word;       // timestamp in ms (little endian)
+  End;
+  PPollRecord = ^TPollRecord;
+  TPollStatus = packed record
+    Running  : Byte;
+    Count    : Byte;
+    Overruns : Word;
+  End;
+  { same as in firmware/include/commands.h }
+  TLinkStatus = packed record
+    Bytes     : LongWord;   // bytes transferred so far
+    BitErrors : LongWord;   // sink: bits which differ from the pattern
+    Checksum  : Word;       // sink: sum of all received bytes
+    Frames    : Word;       // SOF frames from the start to the last packet
+    Pattern   : Byte;       // LINK_PATTERN_*
+    Done      : Byte;       // all packets were transferred
+  End;
+
+  { same as TGetCaps in firmware/include/commands.h }
+  TCaps = packed record
+    Size        : Byte;
+    Protocol    : Byte;     // PROTOCOL_VERSION, 0 for firmware without CMD_GET_CAPS
+    Firmware    : Word;     // $0002 = 0.2
+    FirstOpcode : Byte;
+    NumOpcodes  : Byte;
+    Opcodes     : Array[0..(CAPS_NUM_OPCODES+7) div 8-1] of Byte;
+    EPIn        : Byte;
+    EPOut       : Byte;
+    EPPoll      : Byte;
+    PacketSize  : Byte;
+    PollEntries : Byte;
+    PollLength  : Byte;
+    I2CSpeeds   : Byte;     // CAPS_I2C_*
+    MaxLength   : Array[0..CAPS_NUM_OPCODES-1] of Word;
+  End;
 
   { TEZToolDevice }
 
@@ -72,7 +138,22 @@ Type
     FInterface       : TLibUsbInterface;
     FEPIn            : TLibUsbBulkInEndpoint;
     FEPOut           : TLibUsbBulkOutEndpoint;
+    FEPPoll          : TLibUsbBulkInEndpoint;
+    { a command and its data phase must not be interleaved with other threads }
+    FLock            : TRTLCriticalSection;
+    { optional shadow caches }
+    FEECache         : TShadowCache;
+    FXCache          : TShadowCache;
+    { capabilities of the firmware, see ReadCaps }
+    FCaps            : TCaps;
+    FHaveCaps        : Boolean;
     Procedure Configure(ADev:Plibusb_device); override;
+    Procedure EEReadRaw (Addr:Word;Out   Buf;Len:Word);
+    Procedure EEWriteRaw(Addr:Word;Const Buf;Len:Word);
+  public
+    { bypass the shadow cache, see CacheInvalidate }
+    Procedure XReadRaw  (Addr:Word;Out   Buf;Len:Word);
+    Procedure XWriteRaw (Addr:Word;Const Buf;Len:Word);
   public
     { class methods }
     Constructor Create(AContext:TLibUsbContext;AMatchUnconfigured:TLibUsbDeviceMatchClass;AFirmwareFile:String;AMatchConfigured:TLibUsbDeviceMatchClass);
@@ -80,25 +161,136 @@ Type
     Class Function FindFirmware(AName, AProgram : String) : String;
   protected
     Function  SendCommand(Cmd:Byte;Value:Word;Index:Word) : Integer;
+    Function  BulkRecv(Out   Buf;Len:LongInt;Timeout:LongInt) : LongInt;
+    Function  BulkSend(Const Buf;Len:LongInt;Timeout:LongInt) : LongInt;
+    Procedure ReadCaps;
+    Procedure Require(Cmd:Byte;Const AName:String);
+    Function  RLEWrite(Cmd:Byte;Addr:Word;Const Buf;Len:Word;Timeout:LongInt) : Boolean;
   private
     Function  Port2Index(APort:TPort) : Word;
     Function  Index2Port(AIndex:Word) : TPort;
   public
     Function  GetVersion:String;
-    Function  GetStatus:TStatus;
+    Function  HasCommand(Cmd:Byte) : Boolean;
+    Function  MaxLength(Cmd:Byte) : Word;
     Procedure IOSetup(APort:TPort;AConfig,AOutEnable:Byte);
     Procedure IOSet  (APort:TPort;AValue:Byte);
     Function  IOGet  (APort:TPort) : Byte;
     Function  EERead (Addr:Word;Out   Buf;Len:Byte) : Integer;
     Function  EEWrite(Addr:Word;Const Buf;Len:Byte) : Integer;
+    Function  EE16Read (Addr:Word;Out   Buf;Len:Byte) : Integer;
+    Function  EE16Write(Addr:Word;Const Buf;Len:Byte) : Integer;
+    Procedure EE16WriteBlock(Addr:Word;Const Buf;Len:Word);
     Function  XRead  (Addr:Word;Out   Buf;Len:Word) : Integer;
     Function  XWrite (Addr:Word;Const Buf;Len:Word) : Integer;
     Function  I2CRead (Addr:Byte;Out   Buf;Len:Byte) : Integer;
     Function  I2CWrite(Addr:Byte;Const Buf;Len:Byte) : Integer;
+    Procedure PollAdd(Const Entry:TPollEntry);
+    Function  PollStatus : TPollStatus;
+    Function  PollRecv(Out Buf;Len:Integer;Timeout:Integer) : Integer;
+    Procedure CacheFlush;
+    Procedure CacheInvalidate;
+    { hold the lock of the commands while EECache or XCache are used directly }
+    Procedure Lock;
+    Procedure Unlock;
+    Function  RawCommand(Const Setup:TUsbSetup) : LongInt;
+    Function  RawBulk(EP:Byte;Var Buf;Len:LongInt) : LongInt;
+    Function  LinkSource(Pattern:Byte;Out   Buf;Packets:Word) : LongInt;
+    Function  LinkSink  (Pattern:Byte;Const Buf;Packets:Word) : LongInt;
+    Function  LinkEcho  (Const Src;Out Dst;Packets:Word) : LongInt;
+    {$I protodecl.inc}
+    property EECache : TShadowCache read FEECache;
+    property XCache  : TShadowCache read FXCache;
+    property Caps     : TCaps   read FCaps;
+    property HaveCaps : Boolean read FHaveCaps;   // false: firmware 0.1, Caps are assumed
   End;
 
+Procedure LinkPattern(Pattern:Byte;P:PByte;Len:SizeInt);
+Function  RLEEncode(Const Buf;Len:SizeInt) : AnsiString;
+
 Implementation
 
+(**
+ * Generate the data stream of the link test as done by the firmware
+ *)
+Procedure LinkPattern(Pattern:Byte;P:PByte;Len:SizeInt);
+Var I : SizeInt;
+    B : Byte;
+Begin
+  if Pattern = LINK_PATTERN_PRBS then
+    Begin
+      B := $01;
+      For I := 0 to Len-1 do
+        Begin
+          P[I] := B;
+          if B and 1 <> 0 then
+            B := (B shr 1) xor $B8
+          else
+            B := B shr 1;
+        End;
+    End
+  else
+    For I := 0 to Len-1 do
+      P[I] := I and $FF;
+End;
+
+(**
+ * Run-length encode data for CMD_RLE_XDATA and CMD_RLE_EEPROM16
+ *
+ * Runs of at least 3 equal bytes become fill runs (2 bytes), everything
+ * else literal runs of up to RLE_MAX_RUN bytes (1 byte overhead). See
+ * WriteRLE in firmware/src/commands.c.
+ *)
+Function RLEEncode(Const Buf;Len:SizeInt) : AnsiString;
+Var P   : PByte;
+    I,J : SizeInt;
+    Lit : SizeInt;   // start of the pending literal run
+    N   : SizeInt;   // length of the result
+
+  Procedure Put(B:Byte);
+  Begin
+    Inc(N);
+    Result[N] := Chr(B);
+  End;
+
+  Procedure PutLiteral(AEnd:SizeInt);
+  Var K : SizeInt;
+  Begin
+    while Lit < AEnd do
+      Begin
+        K := Min(RLE_MAX_RUN,AEnd-Lit);
+        Put(K-1);
+        Move(P[Lit],Result[N+1],K);
+        N   += K;
+        Lit += K;
+      End;
+  End;
+
+Begin
+  P := @Buf;
+  // every fill run saves at least as much as the literal run it splits costs
+  SetLength(Result,Len + Len div RLE_MAX_RUN + 1);
+  N   := 0;
+  Lit := 0;
+  I   := 0;
+  while I < Len do
+    Begin
+      J := I+1;
+      while (J < Len) and (J-I < RLE_MAX_RUN) and (P[J] = P[I]) do
+        Inc(J);
+      if J-I >= 3 then
+        Begin
+          PutLiteral(I);
+          Put(RLE_FILL or (J-I-1));
+          Put(P[I]);
+          Lit := J;
+        End;
+      I := J;
+    End;
+  PutLiteral(Len);
+  SetLength(Result,N);
+End;
+
 (**
  * Constructor
  *
@@ -109,6 +301,7 @@ Implementation
  *)
 Constructor TEZToolDevice.Create(AContext:TLibUsbContext;AMatchUnconfigured:TLibUsbDeviceMatchClass;AFirmwareFile:String;AMatchConfigured:TLibUsbDeviceMatchClass);
 Begin
+  InitCriticalSection(FLock);
   FFirmwareFile     := AFirmwareFile;
   { uses MatchUnconfigured to find an unconfigured device, then Configure to
     do the configuration and finally MatchConfigured to find the configured
@@ -120,6 +313,16 @@ Begin
   FInterface       := TLibUsbInterface.Create(Self,FindInterface(EZToolUSBInterface,EZToolUSBAltInterface));
   FEPIn            := TLibUsbBulkInEndpoint. Create(FInterface,FInterface.FindEndpoint(EP_IN));
   FEPOut           := TLibUsbBulkOutEndpoint.Create(FInterface,FInterface.FindEndpoint(EP_OUT));
+  // the firmware 0.1 has no EP4, PollStatus and PollRecv require CMD_POLL_SETUP
+  if Assigned(FInterface.FindEndpoint(EP_POLL)) then
+    FEPPoll        := TLibUsbBulkInEndpoint. Create(FInterface,FInterface.FindEndpoint(EP_POLL));
+
+  // the caches are disabled by default, the EEPROM is completely cacheable
+  FEECache := TShadowCache.Create(EEPROM_SIZE,EEPROM_PAGE_SIZE,@EEReadRaw,@EEWriteRaw);
+  FEECache.AddRegion(0,EEPROM_SIZE);
+  FXCache  := TShadowCache.Create(XRAM_SIZE,XRAM_PAGE_SIZE,@XReadRaw,@XWriteRaw);
+
+  ReadCaps;
 End;
 
 (**
@@ -131,7 +334,10 @@ Begin
     exception occured there), this destructor is automatically called. In this
     case we don't have the USB stuff setup (and nothing else), so we don't
     do the freeing and finalization stuff. }
+  FEECache.Free;
+  FXCache.Free;
   FInterface.Free;
+  DoneCriticalSection(FLock);
   inherited Destroy;
 End;
 
@@ -143,13 +349,159 @@ End;
  * This function does not use the data phase.
  *)
 Function TEZToolDevice.SendCommand(Cmd:Byte;Value:Word;Index:Word):Integer;
+Var T     : UInt64;
+    Setup : TUsbSetup;
 Begin
+  T := Trace.Submit;
   Result := FControl.ControlMsg(
     { bmRequestType } LIBUSB_ENDPOINT_OUT or LIBUSB_REQUEST_TYPE_VENDOR or LIBUSB_RECIPIENT_DEVICE,
     { bRequest      } Cmd,
     { wValue        } Value,
     { wIndex        } Index,
     { Timeout       } 100);
+  if T <> 0 then
+    Begin
+      Setup.bmRequestType := LIBUSB_ENDPOINT_OUT or LIBUSB_REQUEST_TYPE_VENDOR or LIBUSB_RECIPIENT_DEVICE;
+      Setup.bRequest      := Cmd;
+      Setup.wValue        := Value;
+      Setup.wIndex        := Index;
+      Setup.wLength       := 0;
+      Trace.AddControl(T,Device,Setup,Nil,Result);
+    End;
+End;
+
+(**
+ * Receive the data phase of a command from EP2 IN
+ *)
+Function TEZToolDevice.BulkRecv(Out Buf;Len:LongInt;Timeout:LongInt) : LongInt;
+Var T : UInt64;
+Begin
+  T := Trace.Submit;
+  Result := FEPIn.Recv(Buf,Len,Timeout);
+  Trace.AddBulk(T,Device,EP_IN,@Buf,Len,Result);
+End;
+
+(**
+ * Send the data phase of a command to EP2 OUT
+ *)
+Function TEZToolDevice.BulkSend(Const Buf;Len:LongInt;Timeout:LongInt) : LongInt;
+Var T : UInt64;
+Begin
+  T := Trace.Submit;
+  Result := FEPOut.Send(Buf,Len,Timeout);
+  Trace.AddBulk(T,Device,EP_OUT,@Buf,Len,Result);
+End;
+
+(**
+ * Send Len bytes run-length encoded with Cmd
+ *
+ * Nothing is sent if the firmware doesn't support Cmd or if the encoded data
+ * doesn't need fewer packets than the raw data.
+ *
+ * @return false if nothing was sent, the caller then sends the raw data
+ *)
+Function TEZToolDevice.RLEWrite(Cmd:Byte;Addr:Word;Const Buf;Len:Word;Timeout:LongInt) : Boolean;
+Var Enc : AnsiString;
+    PS  : Integer;
+    R   : LongInt;
+Begin
+  Result := false;
+  if (Len < 3) or not HasCommand(Cmd) then
+    Exit;
+  Enc := RLEEncode(Buf,Len);
+  PS  := Max(1,FCaps.PacketSize);
+  if (Length(Enc)+PS-1) div PS >= (Len+PS-1) div PS then
+    Exit;
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(Cmd,Len,Addr);
+    if R < 0 then
+      raise ELibUsb.Create(R,'RLEWrite SendCommand');
+    R := BulkSend(Enc[1],Length(Enc),Timeout);
+    if R <> Length(Enc) then
+      raise ELibUsb.Create(R,'RLEWrite EP Send');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+  Result := true;
+End;
+
+(**
+ * Negotiate the capabilities of the firmware
+ *
+ * Firmware 0.1 doesn't know CMD_GET_CAPS and stalls or doesn't deliver the
+ * data phase. In this case the capabilities of 0.1 are assumed, so that the
+ * callers never have to distinguish the versions.
+ *)
+Procedure TEZToolDevice.ReadCaps;
+Var Buf : Array[0..63] of Byte;
+    R   : LongInt;
+    I   : Integer;
+Begin
+  // firmware 0.1: 0x80 .. 0x8A (except GET_STATUS), see SINCE in commands.def
+  FillChar(FCaps,SizeOf(FCaps),0);
+  FCaps.Size        := SizeOf(FCaps);
+  FCaps.Firmware    := $0001;
+  FCaps.FirstOpcode := CAPS_FIRST_OPCODE;
+  FCaps.NumOpcodes  := CAPS_NUM_OPCODES;
+  For I := 0 to CAPS_NUM_OPCODES-1 do
+    if CmdSince[I] <= FCaps.Firmware then
+      FCaps.Opcodes[I shr 3] += 1 shl (I and 7);
+  FCaps.EPIn        := EP_IN;
+  FCaps.EPOut       := EP_OUT;
+  FCaps.EPPoll      := EP_POLL;
+  FCaps.PacketSize  := 64;
+  FCaps.PollEntries := POLL_MAX_ENTRIES;
+  FCaps.PollLength  := POLL_MAX_LENGTH;
+  FCaps.I2CSpeeds   := CAPS_I2C_100KHZ;
+  FCaps.MaxLength   := CmdMaxLength;
+  FHaveCaps := false;
+
+  EnterCriticalSection(FLock);
+  try
+    if SendCommand(CMD_GET_CAPS,0,0) < 0 then
+      Exit;
+    R := BulkRecv(Buf,SizeOf(Buf),50);
+    // the fixed part must be there, a newer firmware may send more
+    if (R < 6) or (Buf[4] <> CAPS_FIRST_OPCODE) then
+      Exit;
+    FillChar(FCaps,SizeOf(FCaps),0);
+    if R > SizeOf(FCaps) then
+      R := SizeOf(FCaps);
+    Move(Buf,FCaps,R);
+    FCaps.Firmware := LEtoN(FCaps.Firmware);
+    For I := 0 to CAPS_NUM_OPCODES-1 do
+      FCaps.MaxLength[I] := LEtoN(FCaps.MaxLength[I]);
+    FHaveCaps := true;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Function TEZToolDevice.HasCommand(Cmd:Byte) : Boolean;
+Var I : Integer;
+Begin
+  I := Cmd - FCaps.FirstOpcode;
+  Result := (I >= 0) and (I < FCaps.NumOpcodes) and (I < CAPS_NUM_OPCODES) and
+            (FCaps.Opcodes[I shr 3] and (1 shl (I and 7)) <> 0);
+End;
+
+(**
+ * Maximum wValue (length or packet count) of a command, 0 if it doesn't
+ * take a length or isn't supported
+ *)
+Function TEZToolDevice.MaxLength(Cmd:Byte) : Word;
+Begin
+  if not HasCommand(Cmd) then
+    Exit(0);
+  Result := FCaps.MaxLength[Cmd - FCaps.FirstOpcode];
+End;
+
+Procedure TEZToolDevice.Require(Cmd:Byte;Const AName:String);
+Begin
+  if not HasCommand(Cmd) then
+    raise Exception.CreateFmt('%s is not supported by the firmware %d.%d',
+      [AName,FCaps.Firmware shr 8,FCaps.Firmware and $FF]);
 End;
 
 Function TEZToolDevice.Port2Index(APort:TPort):Word;
@@ -178,119 +530,500 @@ Function TEZToolDevice.GetVersion : String;
 Var R   : LongInt;
     Buf : Array[0..63] of Char;
 Begin
-  R := SendCommand(CMD_GET_VERSION,0,0);
-  if R < 0 then
-    raise ELibUsb.Create(R,'GetVersion SendCommand');
-  R := FEPIn.Recv(Buf,SizeOf(Buf),100);
-  if R < 0 then
-    raise ELibUsb.Create(R,'GetVersion EP Recv');
-  SetLength(Result,R);
-  Move(Buf,Result[1],R);
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_GET_VERSION,0,0);
+    if R < 0 then
+      raise ELibUsb.Create(R,'GetVersion SendCommand');
+    R := BulkRecv(Buf,SizeOf(Buf),100);
+    if R < 0 then
+      raise ELibUsb.Create(R,'GetVersion EP Recv');
+    SetLength(Result,R);
+    Move(Buf,Result[1],R);
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
-Function TEZToolDevice.GetStatus : TStatus;
+Procedure TEZToolDevice.IOSetup(APort:TPort;AConfig,AOutEnable:Byte);
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_GET_STATUS,0,0);
-  if R < 0 then
-    raise ELibUsb.Create(R,'GetStatus SendCommand');
-  R := FEPIn.Recv(Result,Sizeof(Result),100);
-  if R <> Sizeof(Result) then
-    raise ELibUsb.Create(R,'GetStatus EP Recv');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_SETUP_IOPORT,AConfig or (AOutEnable shl 8),Port2Index(APort));
+    if R < 0 then
+      raise ELibUsb.Create(R,'IOSetup SendCommand');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
-Procedure TEZToolDevice.IOSetup(APort:TPort;AConfig,AOutEnable:Byte);
+Procedure TEZToolDevice.IOSet(APort:TPort;AValue:Byte);
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_SETUP_IOPORT,AConfig or (AOutEnable shl 8),Port2Index(APort));
-  if R < 0 then
-    raise ELibUsb.Create(R,'IOSetup SendCommand');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_SET_IOPORT,AValue,Port2Index(APort));
+    if R < 0 then
+      raise ELibUsb.Create(R,'IOSet SendCommand');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
-Procedure TEZToolDevice.IOSet(APort:TPort;AValue:Byte);
+Function TEZToolDevice.IOGet(APort:TPort):Byte;
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_SET_IOPORT,AValue,Port2Index(APort));
-  if R < 0 then
-    raise ELibUsb.Create(R,'IOSet SendCommand');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_GET_IOPORT,0,Port2Index(APort));
+    if R < 0 then
+      raise ELibUsb.Create(R,'IOGet SendCommand');
+    R := BulkRecv(Result,Sizeof(Result),100);
+    if R <> Sizeof(Result) then
+      raise ELibUsb.Create(R,'IOGet EP Recv');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
-Function TEZToolDevice.IOGet(APort:TPort):Byte;
+Procedure TEZToolDevice.EEReadRaw(Addr:Word;Out Buf;Len:Word);
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_GET_IOPORT,0,Port2Index(APort));
-  if R < 0 then
-    raise ELibUsb.Create(R,'IOGet SendCommand');
-  R := FEPIn.Recv(Result,Sizeof(Result),100);
-  if R <> Sizeof(Result) then
-    raise ELibUsb.Create(R,'IOGet EP Recv');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_READ_EEPROM,Len,Addr);
+    if R < 0 then
+      raise ELibUsb.Create(R,'EERead SendCommand');
+    R := BulkRecv(Buf,Len,1000);
+    if R <> Len then
+      raise ELibUsb.Create(R,'EERead EP Recv');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
-Function TEZToolDevice.EERead(Addr:Word;Out Buf;Len:Byte):Integer;
+Procedure TEZToolDevice.EEWriteRaw(Addr:Word;Const Buf;Len:Word);
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_READ_EEPROM,Len,Addr);
-  if R < 0 then
-    raise ELibUsb.Create(R,'EERead SendCommand');
-  R := FEPIn.Recv(Buf,Len,1000);
-  if R <> Len then
-    raise ELibUsb.Create(R,'EERead EP Recv');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_WRITE_EEPROM,Len,Addr);
+    if R < 0 then
+      raise ELibUsb.Create(R,'EEWrite SendCommand');
+    R := BulkSend(Buf,Len,1000);
+    if R <> Len then
+      raise ELibUsb.Create(R,'EEWrite EP Send');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * Read from the I2C EEPROM, through the shadow cache if it is enabled
+ *)
+Function TEZToolDevice.EERead(Addr:Word;Out Buf;Len:Byte):Integer;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    FEECache.Read(Addr,Buf,Len);
+    Result := Len;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
+(**
+ * Write to the I2C EEPROM, in write-back mode only the shadow is modified
+ *)
 Function TEZToolDevice.EEWrite(Addr:Word;Const Buf;Len:Byte):Integer;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    FEECache.Write(Addr,Buf,Len);
+    Result := Len;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Function TEZToolDevice.EE16Read(Addr:Word;Out Buf;Len:Byte):Integer;
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_WRITE_EEPROM,Len,Addr);
-  if R < 0 then
-    raise ELibUsb.Create(R,'EEWrite SendCommand');
-  R := FEPOut.Send(Buf,Len,1000);
-  if R <> Len then
-    raise ELibUsb.Create(R,'EEWrite EP Send');
+  Require(CMD_READ_EEPROM16,'EE16Read');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_READ_EEPROM16,Len,Addr);
+    if R < 0 then
+      raise ELibUsb.Create(R,'EE16Read SendCommand');
+    R := BulkRecv(Buf,Len,1000);
+    if R <> Len then
+      raise ELibUsb.Create(R,'EE16Read EP Recv');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
-Function TEZToolDevice.XRead(Addr:Word;Out Buf;Len:Word):Integer;
+(**
+ * Write up to one page to the 16 bit address EEPROM
+ *
+ * The firmware polls the EEPROM until its write cycle has finished, so the
+ * next page can be written immediately.
+ *)
+Function TEZToolDevice.EE16Write(Addr:Word;Const Buf;Len:Byte):Integer;
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_READ_XDATA,Len,Addr);
-  if R < 0 then
-    raise ELibUsb.Create(R,'XRead SendCommand');
-  R := FEPIn.Recv(Buf,Len,1000);
-  if R <> Len then
-    raise ELibUsb.Create(R,'XRead EP Recv');
+  Require(CMD_WRITE_EEPROM16,'EE16Write');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_WRITE_EEPROM16,Len,Addr);
+    if R < 0 then
+      raise ELibUsb.Create(R,'EE16Write SendCommand');
+    R := BulkSend(Buf,Len,1000);
+    if R <> Len then
+      raise ELibUsb.Create(R,'EE16Write EP Send');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
-Function TEZToolDevice.XWrite(Addr:Word;Const Buf;Len:Word):Integer;
+(**
+ * Write any number of bytes to the 16 bit address EEPROM
+ *
+ * The data is sent run-length encoded if the firmware supports it and this
+ * saves packets, otherwise it is written page by page with EE16Write.
+ *)
+Procedure TEZToolDevice.EE16WriteBlock(Addr:Word;Const Buf;Len:Word);
+Var P    : PByte;
+    Page : Integer;
+    Offs : Integer;
+    N    : Integer;
+Begin
+  // the firmware writes the pages while the bulk transfer is pending
+  if RLEWrite(CMD_RLE_EEPROM16,Addr,Buf,Len,1000 + 10 * (Len div EEPROM16_PAGE_SIZE + 1)) then
+    Exit;
+  P    := @Buf;
+  Page := MaxLength(CMD_WRITE_EEPROM16);
+  if Page = 0 then
+    Page := EEPROM16_PAGE_SIZE;
+  Offs := 0;
+  while Offs < Len do
+    Begin
+      // a page write must not cross a page boundary
+      N := Min(Page - (Addr + Offs) mod Page,Len-Offs);
+      EE16Write(Addr+Offs,P[Offs],N);
+      Offs += N;
+    End;
+End;
+
+Procedure TEZToolDevice.XReadRaw(Addr:Word;Out Buf;Len:Word);
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_WRITE_XDATA,Len,Addr);
-  if R < 0 then
-    raise ELibUsb.Create(R,'XWrite SendCommand');
-  R := FEPOut.Send(Buf,Len,1000);
-  if R <> Len then
-    raise ELibUsb.Create(R,'XWrite EP Send');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_READ_XDATA,Len,Addr);
+    if R < 0 then
+      raise ELibUsb.Create(R,'XRead SendCommand');
+    R := BulkRecv(Buf,Len,1000);
+    if R <> Len then
+      raise ELibUsb.Create(R,'XRead EP Recv');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Procedure TEZToolDevice.XWriteRaw(Addr:Word;Const Buf;Len:Word);
+Var R : LongInt;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    if RLEWrite(CMD_RLE_XDATA,Addr,Buf,Len,1000) then
+      Exit;
+    R := SendCommand(CMD_WRITE_XDATA,Len,Addr);
+    if R < 0 then
+      raise ELibUsb.Create(R,'XWrite SendCommand');
+    R := BulkSend(Buf,Len,1000);
+    if R <> Len then
+      raise ELibUsb.Create(R,'XWrite EP Send');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Function TEZToolDevice.XRead(Addr:Word;Out Buf;Len:Word):Integer;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    FXCache.Read(Addr,Buf,Len);
+    Result := Len;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Function TEZToolDevice.XWrite(Addr:Word;Const Buf;Len:Word):Integer;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    FXCache.Write(Addr,Buf,Len);
+    // the 8051 might modify its RAM when it is released from reset
+    if (Addr <= CPUCS_ADDR) and (Addr + Len > CPUCS_ADDR) then
+      Begin
+        FXCache.Flush;
+        FXCache.Invalidate;
+      End;
+    Result := Len;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
 Function TEZToolDevice.I2CRead(Addr : Byte; Out Buf; Len : Byte) : Integer;
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_READ_I2C,Len,Addr);
-  if R < 0 then
-    raise ELibUsb.Create(R,'I2CRead SendCommand');
-  R := FEPIn.Recv(Buf,Len,1000);
-  if R <> Len then
-    raise ELibUsb.Create(R,'I2CRead EP Recv');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_READ_I2C,Len,Addr);
+    if R < 0 then
+      raise ELibUsb.Create(R,'I2CRead SendCommand');
+    R := BulkRecv(Buf,Len,1000);
+    if R <> Len then
+      raise ELibUsb.Create(R,'I2CRead EP Recv');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
 Function TEZToolDevice.I2CWrite(Addr : Byte; Const Buf; Len : Byte) : Integer;
 Var R : LongInt;
 Begin
-  R := SendCommand(CMD_WRITE_I2C,Len,Addr);
-  if R < 0 then
-    raise ELibUsb.Create(R,'I2CWrite SendCommand');
-  R := FEPOut.Send(Buf,Len,1000);
-  if R <> Len then
-    raise ELibUsb.Create(R,'I2CWrite EP Send');
+  EnterCriticalSection(FLock);
+  try
+    // bypassing the EEPROM cache
+    if Addr = I2C_ADDR_EEPROM then
+      Begin
+        FEECache.Flush;
+        FEECache.Invalidate;
+      End;
+    R := SendCommand(CMD_WRITE_I2C,Len,Addr);
+    if R < 0 then
+      raise ELibUsb.Create(R,'I2CWrite SendCommand');
+    R := BulkSend(Buf,Len,1000);
+    if R <> Len then
+      raise ELibUsb.Create(R,'I2CWrite EP Send');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
 End;
 
+Procedure TEZToolDevice.PollAdd(Const Entry:TPollEntry);
+Var R : LongInt;
+Begin
+  Require(CMD_POLL_SETUP,'PollAdd');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_POLL_SETUP,SizeOf(Entry),0);
+    if R < 0 then
+      raise ELibUsb.Create(R,'PollAdd SendCommand');
+    R := BulkSend(Entry,SizeOf(Entry),1000);
+    if R <> SizeOf(Entry) then
+      raise ELibUsb.Create(R,'PollAdd EP Send');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Function TEZToolDevice.PollStatus : TPollStatus;
+Var R : LongInt;
+Begin
+  Require(CMD_POLL_SETUP,'PollStatus');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_POLL_CONTROL,POLL_CTRL_STATUS,0);
+    if R < 0 then
+      raise ELibUsb.Create(R,'PollStatus SendCommand');
+    R := BulkRecv(Result,SizeOf(Result),100);
+    if R <> SizeOf(Result) then
+      raise ELibUsb.Create(R,'PollStatus EP Recv');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * Receive a packet with polling records from EP4 IN
+ *
+ * @return number of bytes received, 0 if the timeout elapsed
+ *)
+Function TEZToolDevice.PollRecv(Out Buf;Len:Integer;Timeout:Integer) : Integer;
+Var T : UInt64;
+Begin
+  Require(CMD_POLL_SETUP,'PollRecv');
+  T := Trace.Submit;
+  Result := FEPPoll.Recv(Buf,Len,Timeout);
+  Trace.AddBulk(T,Device,EP_POLL,@Buf,Len,Result);
+  if Result = LIBUSB_ERROR_TIMEOUT then
+    Result := 0
+  else if Result < 0 then
+    raise ELibUsb.Create(Result,'PollRecv EP Recv');
+End;
+
+(**
+ * Write back all dirty pages of both caches
+ *)
+Procedure TEZToolDevice.CacheFlush;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    FEECache.Flush;
+    FXCache.Flush;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Procedure TEZToolDevice.Lock;
+Begin
+  EnterCriticalSection(FLock);
+End;
+
+Procedure TEZToolDevice.Unlock;
+Begin
+  LeaveCriticalSection(FLock);
+End;
+
+(**
+ * Write back and drop all pages of both caches, e.g. before the device is
+ * accessed with XReadRaw and XWriteRaw
+ *)
+Procedure TEZToolDevice.CacheInvalidate;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    FEECache.Flush;
+    FEECache.Invalidate;
+    FXCache.Flush;
+    FXCache.Invalidate;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * Send a recorded command, used by the session replay
+ *
+ * Only the request, value and index are used, EZ-Tools commands always are
+ * vendor requests without data phase.
+ *)
+Function TEZToolDevice.RawCommand(Const Setup:TUsbSetup) : LongInt;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    Result := SendCommand(Setup.bRequest,Setup.wValue,Setup.wIndex);
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * Transfer a recorded data phase, used by the session replay
+ *)
+Function TEZToolDevice.RawBulk(EP:Byte;Var Buf;Len:LongInt) : LongInt;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    Case EP of
+      EP_IN   : Result := BulkRecv(Buf,Len,1000);
+      EP_OUT  : Result := BulkSend(Buf,Len,1000);
+      EP_POLL : Result := PollRecv(Buf,Len,1000);
+    else
+      raise Exception.CreateFmt('Invalid endpoint 0x%.2x',[EP]);
+    End;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * Link test: receive Packets packets generated by the firmware
+ *
+ * All packets are fetched with a single bulk transfer.
+ *
+ * @return number of bytes received
+ *)
+Function TEZToolDevice.LinkSource(Pattern:Byte;Out Buf;Packets:Word) : LongInt;
+Var R : LongInt;
+Begin
+  Require(CMD_SOURCE,'LinkSource');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_SOURCE,Packets,Pattern);
+    if R < 0 then
+      raise ELibUsb.Create(R,'LinkSource SendCommand');
+    Result := BulkRecv(Buf,Packets*LINK_PACKET_SIZE,1000+Packets);
+    if Result < 0 then
+      raise ELibUsb.Create(Result,'LinkSource EP Recv');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * Link test: send Packets packets to the firmware which checks them against
+ * Pattern
+ *
+ * @return number of bytes sent
+ *)
+Function TEZToolDevice.LinkSink(Pattern:Byte;Const Buf;Packets:Word) : LongInt;
+Var R : LongInt;
+Begin
+  Require(CMD_SINK,'LinkSink');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_SINK,Packets,Pattern);
+    if R < 0 then
+      raise ELibUsb.Create(R,'LinkSink SendCommand');
+    Result := BulkSend(Buf,Packets*LINK_PACKET_SIZE,1000+Packets);
+    if Result < 0 then
+      raise ELibUsb.Create(Result,'LinkSink EP Send');
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * Link test: send Packets packets and receive them back one by one
+ *
+ * @return number of bytes received
+ *)
+Function TEZToolDevice.LinkEcho(Const Src;Out Dst;Packets:Word) : LongInt;
+Var R : LongInt;
+    I : Integer;
+Begin
+  Require(CMD_ECHO,'LinkEcho');
+  EnterCriticalSection(FLock);
+  try
+    R := SendCommand(CMD_ECHO,Packets,0);
+    if R < 0 then
+      raise ELibUsb.Create(R,'LinkEcho SendCommand');
+    Result := 0;
+    For I := 0 to Packets-1 do
+      Begin
+        R := BulkSend(PByte(@Src)[I*LINK_PACKET_SIZE],LINK_PACKET_SIZE,1000);
+        if R <> LINK_PACKET_SIZE then
+          raise ELibUsb.Create(R,'LinkEcho EP Send');
+        R := BulkRecv(PByte(@Dst)[I*LINK_PACKET_SIZE],LINK_PACKET_SIZE,1000);
+        if R < 0 then
+          raise ELibUsb.Create(R,'LinkEcho EP Recv');
+        Result += R;
+      End;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+{ simple commands, generated from protocol/commands.def }
+{$I protoimpl.inc}
+
 Procedure TEZToolDevice.Configure(ADev:Plibusb_device);
 Var EZUSB : TLibUsbDeviceEZUSB;
 Begin
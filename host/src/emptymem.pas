@@ -0,0 +1,252 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Memory access of empty EZ-USB devices of any length
+ *
+ * The boot ROM handles the vendor request 0xA0 with wValue as start address
+ * and an arbitrary wLength, it just continues to the next EP0 data packet.
+ * So a block is split into control transfers as large as the host allows,
+ * and several of them are kept in flight with the workers of CtrlBurst.
+ *
+ * Only the RAM is accessed this way, the requests complete in any order.
+ * The endpoint buffers and registers (e.g. USBCS) are accessed afterwards in
+ * address order with one request in flight. The byte at CPUCS_ADDR is always
+ * written last and on its own, because releasing the 8051 from reset must
+ * not overtake the remaining data.
+ *
+ * ReadBlock and WriteBlock hold the lock, so a background job and the
+ * foreground commands don't interleave their requests. Other accesses of the
+ * device (e.g. ResetCPU) take it with Lock and Unlock.
+ *)
+Unit EmptyMem;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math, LibUsb, LibUsbOop, EZUSB, UsbTrace, CtrlBurst, Device;
+
+Const
+  A0_REQUEST    = $A0;
+  A0_MAX_LENGTH = 4096;   // usbfs limit for the data stage of a control transfer
+  A0_DEPTH      = 4;      // requests in flight
+  A0_TIMEOUT    = 1000;
+
+Type
+
+  { TEZUSBDeviceEmpty }
+
+  TEZUSBDeviceEmpty = class(TLibUsbDeviceEZUSB)
+  private
+    Procedure AddRequests(Var Reqs:TControlRequests;ADir:Byte;Addr:Word;Buf:PChar;Len:LongInt);
+    Procedure AddRange(Var RAM,Regs:TControlRequests;ADir:Byte;Addr:Word;Buf:PChar;Len:LongInt);
+    Procedure RunRequests(Var Reqs:TControlRequests;ADepth:Integer);
+  public
+    Function  ControlMsg(bmRequestType,bRequest:Byte;wValue,wIndex:Word;Var Buf;Length:LongInt;Timeout:LongInt) : LongInt;
+    Procedure ReadBlock (Addr:Word;Out   Buf;Len:LongInt);
+    Procedure WriteBlock(Addr:Word;Const Buf;Len:LongInt);
+    Procedure Lock;
+    Procedure Unlock;
+  End;
+
+Implementation
+
+Var
+  // there is only one empty device at a time
+  EmptyLock : TRTLCriticalSection;
+
+Function IsRegister(Addr:Cardinal) : Boolean;
+Begin
+  Result := ((Addr >= XRAM_REGS_START)  and (Addr < XRAM_REGS_START  + XRAM_REGS_LENGTH)) or
+            ((Addr >= XRAM_REGS_MIRROR) and (Addr < XRAM_REGS_MIRROR + XRAM_REGS_LENGTH));
+End;
+
+{ TEZUSBDeviceEmpty }
+
+(**
+ * Control transfer on EP0 with tracing, like TUSBDeviceDebug.ControlMsg
+ *)
+Function TEZUSBDeviceEmpty.ControlMsg(bmRequestType,bRequest:Byte;wValue,wIndex:Word;Var Buf;Length:LongInt;Timeout:LongInt) : LongInt;
+Var T     : UInt64;
+    Setup : TUsbSetup;
+Begin
+  T := Trace.Submit;
+  Result := FControl.ControlMsg(bmRequestType,bRequest,wValue,wIndex,Buf,Length,Timeout);
+  if T <> 0 then
+    Begin
+      Setup.bmRequestType := bmRequestType;
+      Setup.bRequest      := bRequest;
+      Setup.wValue        := wValue;
+      Setup.wIndex        := wIndex;
+      Setup.wLength       := Length;
+      Trace.AddControl(T,Device,Setup,@Buf,Result);
+    End;
+End;
+
+(**
+ * Append A0 requests of at most A0_MAX_LENGTH bytes for the range, Buf is
+ * the OUT data or Nil for IN requests
+ *)
+Procedure TEZUSBDeviceEmpty.AddRequests(Var Reqs:TControlRequests;ADir:Byte;Addr:Word;Buf:PChar;Len:LongInt);
+Var Offs  : LongInt;
+    Chunk : LongInt;
+    N     : Integer;
+Begin
+  Offs := 0;
+  while Offs < Len do
+    Begin
+      Chunk := Min(A0_MAX_LENGTH,Len-Offs);
+      N := Length(Reqs);
+      SetLength(Reqs,N+1);
+      With Reqs[N] do
+        Begin
+          Setup.bmRequestType := ADir or LIBUSB_REQUEST_TYPE_VENDOR or LIBUSB_RECIPIENT_DEVICE;
+          Setup.bRequest      := A0_REQUEST;
+          Setup.wValue        := Addr + Offs;
+          Setup.wIndex        := 0;
+          Setup.wLength       := Chunk;
+          if Assigned(Buf) then
+            SetString(Data,Buf+Offs,Chunk)
+          else
+            Data := StringOfChar(#0,Chunk);
+          Status  := 0;
+          Latency := 0;
+        End;
+      Offs += Chunk;
+    End;
+End;
+
+(**
+ * Split the range into runs of RAM and of registers and append their
+ * requests to RAM or Regs
+ *)
+Procedure TEZUSBDeviceEmpty.AddRange(Var RAM,Regs:TControlRequests;ADir:Byte;Addr:Word;Buf:PChar;Len:LongInt);
+Var Offs : LongInt;
+    N    : LongInt;
+    Reg  : Boolean;
+    Src  : PChar;
+Begin
+  Offs := 0;
+  while Offs < Len do
+    Begin
+      Reg := IsRegister(Addr+Offs);
+      N   := 1;
+      while (Offs+N < Len) and (IsRegister(Addr+Offs+N) = Reg) do
+        Inc(N);
+      Src := Nil;
+      if Assigned(Buf) then
+        Src := Buf+Offs;
+      if Reg then
+        AddRequests(Regs,ADir,Addr+Offs,Src,N)
+      else
+        AddRequests(RAM, ADir,Addr+Offs,Src,N);
+      Offs += N;
+    End;
+End;
+
+Procedure TEZUSBDeviceEmpty.RunRequests(Var Reqs:TControlRequests;ADepth:Integer);
+Var I : Integer;
+Begin
+  RunControlBurst(@ControlMsg,Reqs,ADepth,A0_TIMEOUT);
+  For I := 0 to High(Reqs) do
+    With Reqs[I] do
+      if Status < 0 then
+        raise ELibUsb.Create(Status,Format('A0 request at 0x%.4X',[Setup.wValue]))
+      else if Status <> Setup.wLength then
+        raise Exception.CreateFmt('A0 request at 0x%.4X transferred %d of %d bytes',[Setup.wValue,Status,Setup.wLength]);
+End;
+
+Procedure TEZUSBDeviceEmpty.ReadBlock(Addr:Word;Out Buf;Len:LongInt);
+
+  Procedure Store(Const Reqs:TControlRequests);
+  Var I : Integer;
+  Begin
+    For I := 0 to High(Reqs) do
+      With Reqs[I] do
+        Move(Data[1],(PChar(@Buf)+Setup.wValue-Addr)^,Length(Data));
+  End;
+
+Var RAM  : TControlRequests;
+    Regs : TControlRequests;
+Begin
+  if Addr + Len > XRAM_SIZE then
+    raise Exception.Create('Range exceeds the 64kB address space');
+  SetLength(RAM, 0);
+  SetLength(Regs,0);
+  AddRange(RAM,Regs,LIBUSB_ENDPOINT_IN,Addr,Nil,Len);
+  Lock;
+  try
+    RunRequests(RAM,A0_DEPTH);
+    RunRequests(Regs,1);
+  finally
+    Unlock;
+  End;
+  Store(RAM);
+  Store(Regs);
+End;
+
+Procedure TEZUSBDeviceEmpty.WriteBlock(Addr:Word;Const Buf;Len:LongInt);
+Var RAM   : TControlRequests;
+    Regs  : TControlRequests;
+    CPUCS : TControlRequests;
+    P     : PChar;
+    Offs  : LongInt;
+Begin
+  if Addr + Len > XRAM_SIZE then
+    raise Exception.Create('Range exceeds the 64kB address space');
+  P := @Buf;
+  SetLength(RAM,  0);
+  SetLength(Regs, 0);
+  SetLength(CPUCS,0);
+  if (Addr <= CPUCS_ADDR) and (Addr + Len > CPUCS_ADDR) then
+    Begin
+      Offs := CPUCS_ADDR - Addr;
+      AddRange(RAM,Regs,LIBUSB_ENDPOINT_OUT,Addr,P,Offs);
+      AddRange(RAM,Regs,LIBUSB_ENDPOINT_OUT,CPUCS_ADDR+1,P+Offs+1,Len-Offs-1);
+      AddRequests(CPUCS,LIBUSB_ENDPOINT_OUT,CPUCS_ADDR,P+Offs,1);
+    End
+  else
+    AddRange(RAM,Regs,LIBUSB_ENDPOINT_OUT,Addr,P,Len);
+  Lock;
+  try
+    RunRequests(RAM,A0_DEPTH);
+    RunRequests(Regs,1);
+    RunRequests(CPUCS,1);
+  finally
+    Unlock;
+  End;
+End;
+
+Procedure TEZUSBDeviceEmpty.Lock;
+Begin
+  EnterCriticalSection(EmptyLock);
+End;
+
+Procedure TEZUSBDeviceEmpty.Unlock;
+Begin
+  LeaveCriticalSection(EmptyLock);
+End;
+
+Initialization
+  InitCriticalSection(EmptyLock);
+Finalization
+  DoneCriticalSection(EmptyLock);
+End.
@@ -79,6 +79,38 @@ To quit `eztool` use `exit`(1ez) or type [Ctrl]-[D].
   * `-n`:
     Do not execute the start scripts (/etc/eztool/... TODO )
 
+  * `--startup-time`:
+    Print the duration of the startup phases (creation of the Tcl interpreter,
+    startup scripts, `-f` and `-c` parameters) to stderr. `make bench` uses
+    this to check the startup time against a budget.
+
+  * `--realtime`:
+    Real-time mode for streaming, the same as `rtmode on` (see `rtmode`(1ez))
+    at program start. The memory is locked and the threads which do the USB
+    transfers of streams run with `SCHED_FIFO` priority. If this is not
+    permitted, a warning is printed and `eztool` continues normally.
+
+  * `--daemon`:
+    Daemon mode. After the startup scripts and the `-f` and `-c` parameters,
+    `eztool` does not prompt for input but waits for clients on a Unix domain
+    socket. The Tcl interpreter, the connected device and its firmware persist
+    between the clients, which saves the startup, the firmware download and the
+    re-enumeration for every invocation. `exit`(1ez) sent by a client
+    terminates the daemon.
+
+  * `--client`:
+    Client mode. The scripts and commands given with `-f` and `-c` are sent to
+    the daemon and executed there. Their output is printed and the exit code
+    is 1 if one of them fails. No USB devices are accessed. See also
+    `lock`(1ez).
+
+  * `--socket` <path>:
+    Unix domain socket of the daemon. The default is
+    _$XDG_RUNTIME_DIR/eztool.sock_ or _/tmp/eztool-_<uid>_/eztool.sock_, the
+    directory is created with mode 0700. Only clients of the same user are
+    accepted. The daemon refuses to start if another daemon is running on the
+    socket.
+
 ## STARTUP SCRIPTS
 
 `eztool` searches and executes startup scripts at program start, which are
@@ -104,9 +136,23 @@ Note that some commands are only available in certain modes.
      man [page]
      exit [exitcode]
      history
-     lsusb [-a|...]
+     lsusb [-a|-native|...]
      disconnect
-     devinfo
+     devinfo [-dict]
+     lock
+     unlock
+     jobwait id
+     jobstatus [id]
+     data create|hex|list|dump|free|slice|concat|compare|diff|search|bits|crc|load|save ...
+     trace start|stop|clear|dump|status ...
+     record start|stop|status ...
+     replay file [-fast] [-sim [-latency]] [-verbose]
+     profile on|off|reset|report
+     rtmode on|off|status|reset ...
+     stats [show|get|reset|textfile ...]
+     topology [show|get|on|off|reset|order dev ...]
+     gang eeprog|xload image -devices list [-jobs n]
+     open eztool:xram|eeprom|eeprom16|i2c/addr|ep/ep [access]
 
 **Disconnected Mode**
      connect [-empty|-eztool|-user] [idVendor:idProduct]
@@ -115,6 +161,8 @@ Note that some commands are only available in certain modes.
      reset [-toggle|-keep|-release]
      xread
      xwrite
+     xload
+     xsave
      download [firmware.hex idVendor:idProduct] [-norelease]
 
 **EZTool Mode**
@@ -123,16 +171,24 @@ Note that some commands are only available in certain modes.
      ioget A|B|C
      eeread addr len
      eewrite addr b0 b1 b2 ...
-     xread addr len
-     xwrite addr b0 b1 b2 ...
+     xread [-async [-command script]] addr len
+     xwrite [-async [-command script]] addr b0 b1 b2 ...
+     xload file [addr]
+     xsave addr len file
      i2cread addr len
      i2cwrite addr b0 b1 b2 ...
+     i2clog add|clear|list|status|run ...
+     eeboot build|program|verify|erase ...
+     cache [ee|xram] on|off|writeback|writethrough|add|clear|flush|invalidate|status ...
+     linktest source|sink|echo len [counter|prbs|none]
 
 **User Mode**
      claim intf alt
      controlmsg bmRequestType bRequest wValue wIndex [length|b0 b1 b2 ...]
-     bulkin  ep length
-     bulkout ep b0 b1 b2 ...
+     controlburst [-depth n] [-timeout ms] -file f|request ...
+     bulkin  [-async [-command script]] ep length
+     bulkout [-async [-command script]] ep b0 b1 b2 ...
+     usbbench [-in ep] [-out ep] [-sizes list] [-depths list] [-time ms] ...
 
 ## VARIABLES
 
@@ -162,7 +218,6 @@ Note that some commands are only available in certain modes.
 ## TODO
 
  - implement variable $timeout
- - object type "data"
  - `man`: auto-complete man-pages (simpler: all TCL commands, but the user might
    be fooled)
  - add a `man` parameter to print to stdout without a pager
@@ -204,41 +259,113 @@ Program EZTool;
 {$mode objfpc}{$H+}
 
 Uses
-  Classes, SysUtils, Math, LibUSB, LibUsbOop, LibUsbUtil, EZUSB, Device, Utils, ReadlineOOP, Tcl, TclOOP, BaseUnix, Unix, TclApp, USBDeviceDebug;
+  {$IFDEF UNIX}cthreads,{$ENDIF}
+  Classes, SysUtils, Math, LibUSB, LibUsbOop, LibUsbUtil, EZUSB, Device, BootImage, Utils, ReadlineOOP, Tcl, TclOOP, BaseUnix, Unix, TclApp, USBDeviceDebug, Daemon, StreamIO, Jobs, ShadowCache, DataBuf, UsbTrace, Session, Profiler, UsbBench, CtrlBurst, UsbEnum, RealTime, UsbMetrics, Topology, Gang, DevChan, EmptyMem;
+
+Const
+  JOB_POLL_MS    = 5;      // interval to check for finished jobs
+  JOB_CHUNK_SIZE = 256;    // granularity of the progress of XRAM jobs
 
 Type
 
   TMode = (mdDisconnected,mdEmpty,mdEZTool,mdUser);
   TModeSet = set of TMode;
 
+  TEZToolCmd = Procedure(ObjC:Integer;ObjV:PPTcl_Object) of object;
+
+  TCommandEntry = class;
+  TCommandDispatch = Procedure(AEntry:TCommandEntry;ObjC:Integer;ObjV:PPTcl_Object) of object;
+
+  { one per Tcl command, so it is still found after "rename" or "interp alias" }
+  TCommandEntry = class
+    Name     : String;
+    Proc     : TEZToolCmd;
+    Dispatch : TCommandDispatch;
+    Procedure Invoke(ObjC:Integer;ObjV:PPTcl_Object);
+  End;
+
   { TEZTool }
 
   TEZTool = class(TTclApp)
   private
     FMode         : TMode;
     FContext      : TLibUsbContext;
-    FEmptyDevice  : TLibUsbDeviceEZUSB;
+    FEmptyDevice  : TEZUSBDeviceEmpty;
     FEZToolDevice : TEZToolDevice;
     FUserDevice   : TUSBDeviceDebug;
+    FPollTable    : Array of TPollEntry;
+    FDaemon       : TEZToolDaemon;
+    FManPath      : String;
+    FJobs         : TJobList;
+    FJobPolling   : Boolean;
+    FData         : TDataStore;
+    FRecorder     : TSessionRecorder;
+    FCommands     : TStringList;     // Tcl commands, see Dispatch
+    FProfiler     : TProfiler;
+    FMetrics      : TUsbMetrics;
+    FTopology     : TUsbTopology;
+    FChannels     : TStringList;     // TDevChannel by handler key, see ChanOpen
+    FChannelCount : Integer;
+    Function  GetContext : TLibUsbContext;
     Procedure SetMode(AMode:TMode;DoEqual:Boolean=true);
     Procedure CheckMode(AModes:TModeSet);
     // internal functions
     Procedure DisconnectAll;
+    Function  TclList(Const St:String) : TStringList;
+    Procedure MemRead (Addr,Len:Cardinal;Out   Buf);
+    Procedure MemWrite(Addr,Len:Cardinal;Const Buf);
+    Procedure StopRecording;
+    Procedure AddCommand(AName:String;AProc:TEZToolCmd);
+    Procedure Dispatch(AEntry:TCommandEntry;ObjC:Integer;ObjV:PPTcl_Object);
     Procedure ConnectEmpty(AidVendor:Word;AidProduct:Word);
     Procedure ConnectEZTool(AidVendorEmpty,AidProductEmpty:Word;AidVendorEztool:Word;AidProductEztool:Word);
+    Function  ProbeEZTool(AidVendor:Word;AidProduct:Word) : Boolean;
     Procedure ConnectUser(AidVendor:Word;AidProduct:Word);
     Procedure NotifyConnected(AidVendor : Word; AidProduct : Word);
+    Procedure UpdateFirmwareStatus;
+    Function  ConnectedDevice : TLibUsbDevice;
+    // background jobs
+    Function  AsyncOption(ObjC:Integer;ObjV:PPTcl_Object;Out Arg:Integer;Out Callback:String) : Boolean;
+    Procedure StartJob(AJob:TJob);
+    Procedure XReadWork  (AJob:TJob);
+    Procedure XWriteWork (AJob:TJob);
+    Procedure BulkInWork (AJob:TJob);
+    Procedure BulkOutWork(AJob:TJob);
+    // data buffers
+    Function  DataOption(Var ObjC:Integer;ObjV:PPTcl_Object) : Boolean;
+    Function  DataArg(ObjC:Integer;ObjV:PPTcl_Object;Index:Integer) : TDataBuffer;
     // common commands
+    property  Context : TLibUsbContext read GetContext;
     Procedure Help      (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure Man       (ObjC:Integer;ObjV:PPTcl_Object);
     Procedure LsUsb     (ObjC:Integer;ObjV:PPTcl_Object);
     Procedure DevInfo   (ObjC:Integer;ObjV:PPTcl_Object);
     Procedure Disconnect(ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure Lock      (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure Unlock    (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure Stdout    (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure JobWait   (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure JobStatus (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure JobPoll   (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure ChanOpen  (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure ChanCmd   (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure DataCmd   (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure TraceCmd  (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure RecordCmd (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure Replay    (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure Profile   (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure RtMode    (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure StatsCmd  (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure TopologyCmd(ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure GangCmd   (ObjC:Integer;ObjV:PPTcl_Object);
     // Mode: Disconnected
     Procedure Connect   (ObjC:Integer;ObjV:PPTcl_Object);
     // Mode: Empty
     Procedure Reset     (ObjC:Integer;ObjV:PPTcl_Object);
            // XRead
            // XWrite
+           // XLoad
+           // XSave
     Procedure Download  (ObjC:Integer;ObjV:PPTcl_Object);
     // Mode: EZTool
     Procedure IOSetup   (ObjC:Integer;ObjV:PPTcl_Object);
@@ -248,13 +375,21 @@ Type
     Procedure EEWrite   (ObjC:Integer;ObjV:PPTcl_Object);
     Procedure XRead     (ObjC:Integer;ObjV:PPTcl_Object);
     Procedure XWrite    (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure XLoad     (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure XSave     (ObjC:Integer;ObjV:PPTcl_Object);
     Procedure I2CRead   (ObjC:Integer;ObjV:PPTcl_Object);
     Procedure I2CWrite  (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure I2CLog    (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure EEBoot    (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure Cache     (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure LinkTest  (ObjC:Integer;ObjV:PPTcl_Object);
     // Mode: User
     Procedure Claim     (ObjC:Integer;ObjV:PPTcl_Object);
     Procedure ControlMsg(ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure ControlBurst(ObjC:Integer;ObjV:PPTcl_Object);
     Procedure BulkIn    (ObjC:Integer;ObjV:PPTcl_Object);
     Procedure BulkOut   (ObjC:Integer;ObjV:PPTcl_Object);
+    Procedure UsbBenchCmd(ObjC:Integer;ObjV:PPTcl_Object);
   public
     Constructor Create;
     Destructor  Destroy; override;
@@ -265,38 +400,82 @@ Type
 Constructor TEZTool.Create;
 Begin
   inherited Create('.eztool_history','EZTool');
+  FCommands := TStringList.Create;
+  FCommands.OwnsObjects := true;
+  FCommands.Sorted := true;
+  FProfiler := TProfiler.Create;
+  FMetrics  := TUsbMetrics.Create;
+  Trace.Metrics := FMetrics;
+  FTopology := TUsbTopology.Create;   // installed in Trace by "topology on"
 
   // Register/override in the Tcl engine our new functions
   // common commands
   FCmdLine.CreateCommandExit   ('exit');
   FCmdLine.CreateCommandHistory('history');
-  FCmdLine.CreateCommandMan    ('man',FpGetCwd + '/man');
-  FTCL.CreateObjCommand('help',      @Self.Help,      nil);
-  FTCL.CreateObjCommand('lsusb',     @Self.LsUsb,     nil);
-  FTCL.CreateObjCommand('devinfo',   @Self.DevInfo,   nil);
-  FTCL.CreateObjCommand('disconnect',@Self.Disconnect,nil);
+  // the man page command is only built when it is used the first time
+  FManPath := FpGetCwd + '/man';
+  AddCommand('man',       @Self.Man);
+  AddCommand('help',      @Self.Help);
+  AddCommand('lsusb',     @Self.LsUsb);
+  AddCommand('devinfo',   @Self.DevInfo);
+  AddCommand('disconnect',@Self.Disconnect);
+  AddCommand('lock',      @Self.Lock);
+  AddCommand('unlock',    @Self.Unlock);
+  AddCommand('jobwait',   @Self.JobWait);
+  AddCommand('jobstatus', @Self.JobStatus);
+  AddCommand('data',      @Self.DataCmd);
+  AddCommand('trace',     @Self.TraceCmd);
+  AddCommand('record',    @Self.RecordCmd);
+  AddCommand('replay',    @Self.Replay);
+  AddCommand('profile',   @Self.Profile);
+  AddCommand('rtmode',    @Self.RtMode);
+  AddCommand('stats',     @Self.StatsCmd);
+  AddCommand('topology',  @Self.TopologyCmd);
+  AddCommand('gang',      @Self.GangCmd);
+  FTCL.Eval('namespace eval ::eztool {}');
+  AddCommand('::eztool::jobpoll',@Self.JobPoll);
+  AddCommand('::eztool::chanopen',@Self.ChanOpen);
+  AddCommand('::eztool::chan',@Self.ChanCmd);
+  // "open eztool:..." creates device channels, everything else goes to Tcl
+  FTCL.Eval('rename ::open ::eztool::tclopen');
+  FTCL.Eval('proc ::open {name args} {'+
+            '  if {[string match eztool:* $name]} { return [::eztool::chanopen $name {*}$args] };'+
+            '  return [uplevel 1 [list ::eztool::tclopen $name {*}$args]] }');
+  FChannels := TStringList.Create;
+  FChannels.OwnsObjects := true;
+  FChannels.Sorted := true;
   // Mode: Disconnected
-  FTCL.CreateObjCommand('connect',   @Self.Connect,   nil);
+  AddCommand('connect',   @Self.Connect);
   // Mode: Empty
-  FTCL.CreateObjCommand('reset',     @Self.Reset,     nil);
+  AddCommand('reset',     @Self.Reset);
          // XRead
          // XWrite
-  FTCL.CreateObjCommand('download',  @Self.Download,  nil);
+         // XLoad
+         // XSave
+  AddCommand('download',  @Self.Download);
   // Mode: EZTool
-  FTCL.CreateObjCommand('iosetup',   @Self.IOSetup,   nil);
-  FTCL.CreateObjCommand('ioset',     @Self.IOSet,     nil);
-  FTCL.CreateObjCommand('ioget',     @Self.IOGet,     nil);
-  FTCL.CreateObjCommand('eeread',    @Self.EERead,    nil);
-  FTCL.CreateObjCommand('eewrite',   @Self.EEWrite,   nil);
-  FTCL.CreateObjCommand('xread',     @Self.XRead,     nil);
-  FTCL.CreateObjCommand('xwrite',    @Self.XWrite,    nil);
-  FTCL.CreateObjCommand('i2cread',   @Self.I2CRead,   nil);
-  FTCL.CreateObjCommand('i2cwrite',  @Self.I2CWrite,  nil);
+  AddCommand('iosetup',   @Self.IOSetup);
+  AddCommand('ioset',     @Self.IOSet);
+  AddCommand('ioget',     @Self.IOGet);
+  AddCommand('eeread',    @Self.EERead);
+  AddCommand('eewrite',   @Self.EEWrite);
+  AddCommand('xread',     @Self.XRead);
+  AddCommand('xwrite',    @Self.XWrite);
+  AddCommand('xload',     @Self.XLoad);
+  AddCommand('xsave',     @Self.XSave);
+  AddCommand('i2cread',   @Self.I2CRead);
+  AddCommand('i2cwrite',  @Self.I2CWrite);
+  AddCommand('i2clog',    @Self.I2CLog);
+  AddCommand('eeboot',    @Self.EEBoot);
+  AddCommand('cache',     @Self.Cache);
+  AddCommand('linktest',  @Self.LinkTest);
   // Mode: User
-  FTCL.CreateObjCommand('claim',     @Self.Claim,     nil);
-  FTCL.CreateObjCommand('controlmsg',@Self.ControlMsg,nil);
-  FTCL.CreateObjCommand('bulkin',    @Self.BulkIn,    nil);
-  FTCL.CreateObjCommand('bulkout',   @Self.BulkOut,   nil);
+  AddCommand('claim',     @Self.Claim);
+  AddCommand('controlmsg',@Self.ControlMsg);
+  AddCommand('controlburst',@Self.ControlBurst);
+  AddCommand('bulkin',    @Self.BulkIn);
+  AddCommand('bulkout',   @Self.BulkOut);
+  AddCommand('usbbench',  @Self.UsbBenchCmd);
 
   FTCL.SetVar('usbid_empty','0547:2131');
   FTCL.SetVar('usbid_eztool',IntToHex(USBVendConf,4)+':'+IntToHex(USBProdConf,4));
@@ -326,18 +505,48 @@ Begin
 
   SetMode(mdDisconnected);
 
-  FContext := TLibUsbContext.Create;
+  // FContext is created on first use, see GetContext
+
+  FJobs := TJobList.Create;
+  FData := TDataStore.Create;
 End;
 
 Destructor TEZTool.Destroy;
 Begin
+  StopRecording;
+  // "finalize" of the channels removes them from FChannels
+  while FChannels.Count > 0 do
+    if FTCL.Eval('close '+TDevChannel(FChannels.Objects[0]).ChanId) <> TCL_OK then
+      FChannels.Delete(0);
+  FChannels.Free;
+  FJobs.Free;   // waits for all jobs
+  FData.Free;
   FEmptyDevice.Free;
   FEZToolDevice.Free;
   FUserDevice.Free;
   FContext.Free;
+  Trace.Metrics := Nil;
+  FMetrics.Free;
+  Trace.Topology := Nil;
+  FTopology.Free;
+  FProfiler.Free;
+  FCommands.Free;
   inherited Destroy;
 End;
 
+(**
+ * Create the libusb context on first use
+ *
+ * Scripts which don't access USB devices (e.g. "eztool -b -c 'eeboot build
+ * ...'") don't need to initialize libusb.
+ *)
+Function TEZTool.GetContext : TLibUsbContext;
+Begin
+  if not Assigned(FContext) then
+    FContext := TLibUsbContext.Create;
+  Result := FContext;
+End;
+
 Procedure TEZTool.SetMode(AMode : TMode;DoEqual:Boolean);
 Begin
   if (FMode = AMode) and not DoEqual then
@@ -366,17 +575,97 @@ Begin
 End;
 
 Procedure TEZTool.DisconnectAll;
+Var I : Integer;
 Begin
+  // jobs still use the devices
+  FJobs.WaitAll;
+  // write back the shadow caches
+  if Assigned(FEZToolDevice) then
+    try
+      FEZToolDevice.CacheFlush;
+    except
+      on E : Exception do
+        WriteLn('Warning: Couldn''t write back the cache: ',E.Message);
+    End;
+  // the I2C errors since the last "stats"
+  if Assigned(FEZToolDevice) then
+    UpdateFirmwareStatus;
+  // open channels must not use the freed devices
+  For I := 0 to FChannels.Count-1 do
+    TDevChannel(FChannels.Objects[I]).Detach;
   // free all devices
   FreeAndNil(FEmptyDevice);
   FreeAndNil(FEZToolDevice);
   FreeAndNil(FUserDevice);
+  SetLength(FPollTable,0);
+End;
+
+(**
+ * Split a Tcl list into its elements, e.g. the value of an option
+ *)
+Function TEZTool.TclList(Const St:String) : TStringList;
+Var I : Integer;
+Begin
+  FTCL.SetVar('::eztool::list',St);
+  if FTCL.Eval('join $::eztool::list "\n"') <> TCL_OK then
+    raise Exception.Create(FTCL.GetStringResult);
+  Result := TStringList.Create;
+  Result.Text := FTCL.GetStringResult;
+  FTCL.Eval('unset ::eztool::list');
+  For I := Result.Count-1 downto 0 do
+    if Result[I] = '' then
+      Result.Delete(I);
+End;
+
+(**
+ * Register a Tcl command
+ *
+ * All commands are registered with Dispatch, which looks up the method by the
+ * command name. This gives a single place to measure the commands, see
+ * "profile".
+ *)
+Procedure TCommandEntry.Invoke(ObjC:Integer;ObjV:PPTcl_Object);
+Begin
+  Dispatch(Self,ObjC,ObjV);
+End;
+
+Procedure TEZTool.AddCommand(AName:String;AProc:TEZToolCmd);
+Var Entry : TCommandEntry;
+Begin
+  if Copy(AName,1,2) = '::' then
+    Delete(AName,1,2);
+  Entry := TCommandEntry.Create;
+  Entry.Name     := AName;
+  Entry.Proc     := AProc;
+  Entry.Dispatch := @Self.Dispatch;
+  FCommands.AddObject(AName,Entry);
+  FTCL.CreateObjCommand('::'+AName,@Entry.Invoke,nil);
+End;
+
+Procedure TEZTool.Dispatch(AEntry:TCommandEntry;ObjC:Integer;ObjV:PPTcl_Object);
+Var Frame     : TProfileFrame;
+    Profiling : Boolean;
+Begin
+  // "profile on|off" changes Enabled within the command
+  Profiling := FProfiler.Enabled;
+  if Profiling then
+    Frame := FProfiler.Enter;
+  try
+    AEntry.Proc(ObjC,ObjV);
+  except
+    FMetrics.CommandError;
+    if Profiling then
+      FProfiler.Leave(AEntry.Name,Frame);
+    raise;
+  End;
+  if Profiling then
+    FProfiler.Leave(AEntry.Name,Frame);
 End;
 
 Procedure TEZTool.ConnectEmpty(AidVendor:Word;AidProduct:Word);
 Begin
   DisconnectAll;
-  FEmptyDevice := TLibUsbDeviceEZUSB.Create(FContext,AidVendor,AidProduct);
+  FEmptyDevice := TEZUSBDeviceEmpty.Create(Context,AidVendor,AidProduct);
 End;
 
 Procedure TEZTool.ConnectEZTool(AidVendorEmpty,AidProductEmpty:Word;AidVendorEztool:Word;AidProductEztool:Word);
@@ -386,15 +675,27 @@ Begin
   try
     if (AidVendorEmpty <> 0) or (AidProductEmpty <> 0) then
       // unconfigured (=empty) device given -> use a matcher
-      MatchEmpty := TLibUsbDeviceMatchVidPid.Create(FContext,AidVendorEmpty,AidProductEmpty)
+      MatchEmpty := TLibUsbDeviceMatchVidPid.Create(Context,AidVendorEmpty,AidProductEmpty)
     else
       // no unconfigured device given -> don't use a matcher, and don't even search for it
       MatchEmpty := Nil;
-    FEZToolDevice := TEZToolDevice.Create(
-      FContext,
-      MatchEmpty,
-      TEZToolDevice.FindFirmware(Device.FirmwareName,'eztool'),
-      TLibUsbDeviceMatchVidPid.Create(FContext,AidVendorEztool,AidProductEztool));
+    // a device which booted the EZTool firmware from its EEPROM (see
+    // eeboot(1ez)) or which was configured before doesn't need a download
+    if Assigned(MatchEmpty) and ProbeEZTool(AidVendorEztool,AidProductEztool) then
+      Begin
+        MatchEmpty.Free;
+        WriteLn('Found running EZTool firmware, skipping download.');
+      End
+    else
+      Begin
+        FEZToolDevice := TEZToolDevice.Create(
+          Context,
+          MatchEmpty,
+          TEZToolDevice.FindFirmware(Device.FirmwareName,'eztool'),
+          TLibUsbDeviceMatchVidPid.Create(Context,AidVendorEztool,AidProductEztool));
+        if Assigned(MatchEmpty) then
+          FMetrics.FirmwareDownload(IntToHex(AidVendorEmpty,4)+':'+IntToHex(AidProductEmpty,4));
+      End;
     // the two matcher classes are .Free()ed inside the constructor
     WriteLn('Successfully connected to USB device ',IntToHex(AidVendorEztool,4),':',IntToHex(AidProductEztool,4),': ',FEZToolDevice.GetVersion);
   except
@@ -406,10 +707,34 @@ Begin
   End;
 End;
 
+(**
+ * Try to connect to a device which already runs the EZTool firmware
+ *
+ * @return true if FEZToolDevice was created and the firmware reports its
+ *   version string
+ *)
+Function TEZTool.ProbeEZTool(AidVendor:Word;AidProduct:Word) : Boolean;
+Begin
+  Result := false;
+  try
+    // no matcher for unconfigured devices -> no firmware download
+    FEZToolDevice := TEZToolDevice.Create(
+      Context,
+      Nil,
+      '',
+      TLibUsbDeviceMatchVidPid.Create(Context,AidVendor,AidProduct));
+    Result := (Pos('EZ-Tools',FEZToolDevice.GetVersion) = 1);
+  except
+    Result := false;
+  End;
+  if not Result then
+    FreeAndNil(FEZToolDevice);
+End;
+
 Procedure TEZTool.ConnectUser(AidVendor:Word;AidProduct:Word);
 Begin
   DisconnectAll;
-  FUserDevice := TUSBDeviceDebug.Create(FContext,AidVendor,AidProduct);
+  FUserDevice := TUSBDeviceDebug.Create(Context,AidVendor,AidProduct);
 End;
 
 Procedure TEZTool.NotifyConnected(AidVendor:Word;AidProduct:Word);
@@ -418,6 +743,185 @@ Begin
   UsbID := IntToHex(AidVendor,4)+':'+IntToHex(AidProduct,4);
   FTCL.SetVar('usbid',UsbID);
   WriteLn('Connected to device ',UsbID);
+  // fetch the static descriptors once per connect
+  UsbDescCache.Refresh(Context);
+  UsbDescCache.Load(Context,ConnectedDevice);
+  FMetrics.Connected(UsbID,libusb_get_bus_number(ConnectedDevice.Device),libusb_get_device_address(ConnectedDevice.Device));
+  FTopology.Scan(Context);
+  FTCL.SetVar('usbpath',DevicePath(ConnectedDevice.Device));
+  if Assigned(FEZToolDevice) then
+    UpdateFirmwareStatus;
+End;
+
+(**
+ * Add the I2C error counters of the firmware to the metrics
+ *
+ * Firmware 0.1 doesn't have these counters. Errors (e.g. the device was
+ * unplugged) are ignored.
+ *)
+Procedure TEZTool.UpdateFirmwareStatus;
+Var Status : TStatus;
+Begin
+  if not FEZToolDevice.HasCommand(CMD_GET_STATUS) then
+    Exit;
+  try
+    Status := FEZToolDevice.GetStatus;
+    FMetrics.FirmwareStatus(LEtoN(Status.I2CNacks),LEtoN(Status.I2CBusErrors));
+  except
+    on E : ELibUsb do ;
+  End;
+End;
+
+Function TEZTool.ConnectedDevice : TLibUsbDevice;
+Begin
+  if Assigned(FEmptyDevice) then
+    Result := FEmptyDevice
+  else if Assigned(FEZToolDevice) then
+    Result := FEZToolDevice
+  else if Assigned(FUserDevice) then
+    Result := FUserDevice
+  else
+    raise Exception.Create('Not connected');
+End;
+
+(**
+ * Parse the options "-async [-command script]" of a data-moving command
+ *
+ * @param Arg  index of the first positional argument
+ * @return true if the command should be executed as background job
+ *)
+Function TEZTool.AsyncOption(ObjC:Integer;ObjV:PPTcl_Object;Out Arg:Integer;Out Callback:String) : Boolean;
+Begin
+  Arg      := 1;
+  Callback := '';
+  Result   := (ObjC > 1) and (ObjV^[1].AsString = '-async');
+  if not Result then
+    Exit;
+  Arg := 2;
+  if (ObjC > 3) and (ObjV^[2].AsString = '-command') then
+    Begin
+      Callback := ObjV^[3].AsString;
+      Arg := 4;
+    End;
+End;
+
+(**
+ * Start a background job and return its ID as Tcl result
+ *
+ * The completion is reported by ::eztool::jobpoll, which is scheduled with
+ * "after" as long as jobs are running.
+ *)
+Procedure TEZTool.StartJob(AJob:TJob);
+Var Id : Integer;
+Begin
+  Id := FJobs.Start(AJob);
+  FTCL.SetVar('::eztool::job('+IntToStr(Id)+')',JobStateNames[jsRunning]);
+  if not FJobPolling then
+    Begin
+      FTCL.Eval('after '+IntToStr(JOB_POLL_MS)+' ::eztool::jobpoll');
+      FJobPolling := true;
+    End;
+  FTCL.SetObjResult(Id);
+End;
+
+(**
+ * Work methods of the background jobs, these are executed in the job thread
+ *)
+Procedure TEZTool.XReadWork(AJob:TJob);
+Var Off : Cardinal;
+    Len : Cardinal;
+Begin
+  SetLength(AJob.Data,AJob.Len);
+  Prefault(PChar(AJob.Data),AJob.Len);
+  // in mode Empty as one block, so the requests are pipelined and the
+  // registers are read in order, like by xread
+  if FMode = mdEmpty then
+    Begin
+      if AJob.Len > 0 then
+        FEmptyDevice.ReadBlock(AJob.Addr,AJob.Data[1],AJob.Len);
+      AJob.Progress(AJob.Len);
+      Exit;
+    End;
+  Off := 0;
+  while Off < AJob.Len do
+    Begin
+      Len := Min(JOB_CHUNK_SIZE,AJob.Len-Off);
+      FEZToolDevice.XRead(AJob.Addr+Off,AJob.Data[Off+1],Len);
+      Off += Len;
+      AJob.Progress(Off);
+    End;
+End;
+
+Procedure TEZTool.XWriteWork(AJob:TJob);
+Var Off : Cardinal;
+    Len : Cardinal;
+Begin
+  // in mode Empty as one block, so CPUCS is written after all other bytes
+  if FMode = mdEmpty then
+    Begin
+      if AJob.Len > 0 then
+        FEmptyDevice.WriteBlock(AJob.Addr,AJob.Data[1],AJob.Len);
+      AJob.Progress(AJob.Len);
+      AJob.Data := '';
+      Exit;
+    End;
+  Off := 0;
+  while Off < AJob.Len do
+    Begin
+      Len := Min(JOB_CHUNK_SIZE,AJob.Len-Off);
+      FEZToolDevice.XWrite(AJob.Addr+Off,AJob.Data[Off+1],Len);
+      Off += Len;
+      AJob.Progress(Off);
+    End;
+  AJob.Data := '';
+End;
+
+Procedure TEZTool.BulkInWork(AJob:TJob);
+Var R : Integer;
+Begin
+  SetLength(AJob.Data,AJob.Len);
+  Prefault(PChar(AJob.Data),AJob.Len);
+  R := FUserDevice.BulkIn(AJob.EP or LIBUSB_ENDPOINT_IN,AJob.Data[1],AJob.Len,100);
+  if R < 0 then
+    raise Exception.CreateFmt('Error during bulk in transfer (%d): %s',[-R,SysErrorMessage(-R)]);
+  SetLength(AJob.Data,R);
+  AJob.Progress(R);
+End;
+
+Procedure TEZTool.BulkOutWork(AJob:TJob);
+Var R : Integer;
+Begin
+  R := FUserDevice.BulkOut(AJob.EP or LIBUSB_ENDPOINT_OUT,AJob.Data[1],AJob.Len,100);
+  if R < 0 then
+    raise Exception.CreateFmt('Error during bulk out transfer (%d): %s',[-R,SysErrorMessage(-R)]);
+  AJob.Data := '';
+  AJob.Progress(R);
+End;
+
+(**
+ * Check for the option "-data" as last parameter of a reading command
+ *
+ * The option is removed from ObjC. The command then returns the handle of a
+ * new data buffer instead of printing a hex dump.
+ *)
+Function TEZTool.DataOption(Var ObjC:Integer;ObjV:PPTcl_Object) : Boolean;
+Begin
+  Result := (ObjC > 1) and (ObjV^[ObjC-1].AsString = '-data');
+  if Result then
+    Dec(ObjC);
+End;
+
+(**
+ * Check for "-data handle" instead of the data bytes of a writing command
+ *
+ * @return the data buffer or Nil if the bytes are given as parameters
+ *)
+Function TEZTool.DataArg(ObjC:Integer;ObjV:PPTcl_Object;Index:Integer) : TDataBuffer;
+Begin
+  if (ObjC = Index+2) and (ObjV^[Index].AsString = '-data') then
+    Result := FData.Get(ObjV^[Index+1].AsString)
+  else
+    Result := Nil;
 End;
 
 (*****************************************************************************)
@@ -461,9 +965,23 @@ Begin
   WriteLn('  help [word]');
   WriteLn('  man [page]');
   WriteLn('  history');
-  WriteLn('  lsusb [-a|...]');
+  WriteLn('  lsusb [-a|-native|...]');
   WriteLn('  disconnect');
-  WriteLn('  devinfo');
+  WriteLn('  devinfo [-dict]');
+  WriteLn('  lock');
+  WriteLn('  unlock');
+  WriteLn('  jobwait id');
+  WriteLn('  jobstatus [id]');
+  WriteLn('  data create|hex|list|dump|free|slice|concat|compare|diff|search|bits|crc|load|save ...');
+  WriteLn('  trace start|stop|clear|dump|status ...');
+  WriteLn('  record start|stop|status ...');
+  WriteLn('  replay file [-fast] [-sim [-latency]] [-verbose]');
+  WriteLn('  profile on|off|reset|report');
+  WriteLn('  rtmode on|off|status|reset ...');
+  WriteLn('  stats [show|get|reset|textfile ...]');
+  WriteLn('  topology [show|get|on|off|reset|order dev ...]');
+  WriteLn('  gang eeprog|xload image -devices list [-jobs n]');
+  WriteLn('  open eztool:xram|eeprom|eeprom16|i2c/addr|ep/ep [access]');
   WriteLn('  exit [exitcode]');
   WriteLn('Mode: Disconnected ("Discon")');
   WriteLn('  connect [-empty|-eztool|-user] [idVendor:idProduct]');
@@ -471,6 +989,8 @@ Begin
   WriteLn('  reset [-toggle|-keep|-release]');
   WriteLn('  xread');
   WriteLn('  xwrite');
+  WriteLn('  xload');
+  WriteLn('  xsave');
   WriteLn('  download [firmware.hex idVendor:idProduct] [-norelease]  ');
   WriteLn('Mode: Connected to EU-USB device with EZTool firmware ("EZTool")');
   WriteLn('  iosetup A|B|C PORTxCFG OEx');
@@ -478,15 +998,23 @@ Begin
   WriteLn('  ioget A|B|C');
   WriteLn('  eeread addr len');
   WriteLn('  eewrite addr b0 b1 b2 ...');
-  WriteLn('  xread addr len');
-  WriteLn('  xwrite addr b0 b1 b2 ...');
+  WriteLn('  xread [-async [-command script]] addr len');
+  WriteLn('  xwrite [-async [-command script]] addr b0 b1 b2 ...');
+  WriteLn('  xload file [addr]');
+  WriteLn('  xsave addr len file');
   WriteLn('  i2cread addr len');
   WriteLn('  i2cwrite addr b0 b1 b2 ...');
+  WriteLn('  i2clog add|clear|list|status|run ...');
+  WriteLn('  eeboot build|program|verify|erase ...');
+  WriteLn('  cache [ee|xram] on|off|writeback|writethrough|add|clear|flush|invalidate|status ...');
+  WriteLn('  linktest source|sink|echo len [counter|prbs|none]');
   WriteLn('Mode: Connected to EU-USB device with user firmware ("User")');
   WriteLn('  claim intf alt');
   WriteLn('  controlmsg bmRequestType bRequest wValue wIndex [length|b0 b1 b2 ...]');
-  WriteLn('  bulkin  ep length');
-  WriteLn('  bulkout ep b0 b1 b2 ...');
+  WriteLn('  controlburst [-depth n] [-timeout ms] -file f|request ...');
+  WriteLn('  bulkin  [-async [-command script]] ep length');
+  WriteLn('  bulkout [-async [-command script]] ep b0 b1 b2 ...');
+  WriteLn('  usbbench [-in ep] [-out ep] [-sizes list] [-depths list] [-time ms] ...');
   WriteLn('Variables');
   WriteLn('  $timeout');
   WriteLn('  $usbid');
@@ -518,6 +1046,18 @@ all man pages and short descriptions is given, similar to `whatis`(1).
 help(1ez)
 
 *)
+Procedure TEZTool.Man(ObjC : Integer; ObjV: PPTcl_Object);
+Var Cmd : String;
+    I   : Integer;
+Begin
+  // replace this stub by the real command and execute it
+  FCmdLine.CreateCommandMan('man',FManPath);
+  Cmd := 'man';
+  For I := 1 to ObjC-1 do
+    Cmd += ' {' + ObjV^[I].AsString + '}';
+  if FTCL.Eval(Cmd) <> TCL_OK then
+    raise Exception.Create(FTCL.GetStringResult);
+End;
 
 (*ronn
 history(1ez) -- display the history list
@@ -565,11 +1105,20 @@ lsusb(1ez) -- list USB devices
 
 `lsusb` [-a|<options>]
 
+`lsusb` `-native`
+
 ## DESCRIPTION
 
 The command `lsusb` invokes the external program `lsusb` with the parameters as
 given at the prompt.
 
+With `-native`, the devices are enumerated with libusb within `eztool` and
+returned as Tcl list of dicts with the keys `bus`, `address`, `ports`, `speed`,
+`idVendor`, `idProduct`, `bcdDevice`, `bcdUSB`, `class`, `subclass`,
+`protocol`, `maxpacket0`, `configurations`, `manufacturer`, `product` and
+`serial`. No process is started and no device is accessed. The strings are
+only known for devices which were connected before, otherwise they are empty.
+
 In modes `Empty`, `EZTool` and `User`, a special behavior is provided. When
 called without parameteres, the external program is invoked with the parameters
 `-v -d` _idVendor_`:`_idProduct_. Use the option `-a` to execute `lsusb` without
@@ -605,6 +1154,12 @@ Var Args     : TDynArrString;
   End;
 
 Begin
+  if (ObjC = 2) and (ObjV^[1].AsString = '-native') then
+    Begin
+      UsbDescCache.Refresh(Context);
+      FTCL.SetObjResult(UsbDescCache.List);
+      Exit;
+    End;
   if FMode <> mdDisconnected then
     Begin
       if ObjC = 1 then    // connected, no parameters
@@ -629,13 +1184,31 @@ devinfo(1ez) -- print information on the connected device
 
 ## SYNOPSYS
 
-`devinfo`
+`devinfo` [`-dict`]
 
 ## DESCRIPTION
 
 The command `devinfo` shows the configurations, interfaces, alternate settings
 and end points of the currently connected device.
 
+With `-dict`, the information is returned as Tcl dict with the keys of
+`lsusb -native` and additionally `interfaces`, a list of dicts with the keys
+`number`, `alternate`, `class`, `subclass`, `protocol`, `name` and
+`endpoints`. The latter is a list of dicts with the keys `address`, `type`,
+`maxpacket` and `interval`.
+
+In mode `EZTool`, the capabilities of the firmware are shown too: its
+version, the protocol version, the supported command opcodes, the maximum
+length of each command and the limits of the I2C polling. These are read
+from the firmware with a binary capability descriptor when connecting.
+Firmware 0.1 doesn't provide it, then the capabilities of 0.1 are assumed.
+With `-dict`, they are added as key `firmware` with the keys `version`,
+`protocol`, `negotiated`, `commands`, `maxlength` (a dict from opcode to
+length), `packetsize`, `pollentries`, `polllength` and `i2cspeeds`.
+
+The descriptors and strings are read once when connecting to the device, so
+`devinfo` doesn't transfer anything.
+
 ## MODES
 
 `Empty`, `EZTool` and `User`
@@ -645,41 +1218,72 @@ and end points of the currently connected device.
 lsusb(1ez)
 *)
 Procedure TEZTool.DevInfo(ObjC : Integer; ObjV : PPTcl_Object);
-Var Dev : TLibUsbDevice;
-    Config : Plibusb_config_descriptor;
-    NumIf,IIf : Integer;
-    TheIf : Plibusb_interface_descriptor;
-    NumAlt,IAlt : Integer;
-    TheAlt : Plibusb_interface_descriptor;
-    NumEp,IEp : Integer;
-    TheEP : Plibusb_endpoint_descriptor;
-Begin
-  CheckMode([mdEmpty,mdEZTool,mdUser]);
-  case FMode of
-    mdEmpty  : Dev := FEmptyDevice;
-    mdEZTool : Dev := FEZToolDevice;
-    mdUser   : Dev := FUserDevice;
+Var Dev  : TLibUsbDevice;
+    Info : TUsbDeviceInfo;
+    I,J  : Integer;
+
+  { capabilities of the EZ-Tools firmware, as dict or as text }
+  Function FirmwareCaps(AsDict:Boolean) : AnsiString;
+  Var Cmds,Limits : AnsiString;
+      Cmd         : Integer;
+  Begin
+    Cmds   := '';
+    Limits := '';
+    With FEZToolDevice.Caps do
+      Begin
+        For Cmd := FirstOpcode to FirstOpcode+NumOpcodes-1 do
+          if FEZToolDevice.HasCommand(Cmd) then
+            Begin
+              if (Cmd < CAPS_FIRST_OPCODE+CAPS_NUM_OPCODES) and (CmdNames[Cmd-CAPS_FIRST_OPCODE] > '') and not AsDict then
+                Cmds += ' ' + CmdNames[Cmd-CAPS_FIRST_OPCODE]
+              else
+                Cmds += ' 0x' + IntToHex(Cmd,2);
+              if FEZToolDevice.MaxLength(Cmd) > 0 then
+                Limits += ' 0x' + IntToHex(Cmd,2) + ' ' + IntToStr(FEZToolDevice.MaxLength(Cmd));
+            End;
+        Delete(Cmds,1,1);
+        Delete(Limits,1,1);
+        if AsDict then
+          Result := Format('version %d.%d protocol %d negotiated %d commands {%s} maxlength {%s} packetsize %d pollentries %d polllength %d i2cspeeds %d',
+            [Firmware shr 8,Firmware and $FF,Protocol,Ord(FEZToolDevice.HaveCaps),Cmds,Limits,PacketSize,PollEntries,PollLength,I2CSpeeds])
+        else
+          Result := Format('Firmware %d.%d, protocol %d%s'^J'  Commands: %s'^J'  Max. lengths: %s'^J'  Packet size %d, %d polling entries of up to %d bytes, I2C%s%s',
+            [Firmware shr 8,Firmware and $FF,Protocol,Select(FEZToolDevice.HaveCaps,'',' (assumed, no capability descriptor)'),
+             Cmds,Limits,PacketSize,PollEntries,PollLength,
+             Select(I2CSpeeds and CAPS_I2C_100KHZ <> 0,' 100kHz',''),Select(I2CSpeeds and CAPS_I2C_400KHZ <> 0,' 400kHz','')]);
+      End;
   End;
 
-  Config := FContext.GetActiveConfigDescriptor(Dev.Device);
-  // iterate over all interfaces
-  For IIf := 0 to Config^.bNumInterfaces-1 do
-    With Config^._interface^[IIf] do
+Begin
+  CheckMode([mdEmpty,mdEZTool,mdUser]);
+  if (ObjC > 2) or ((ObjC = 2) and (ObjV^[1].AsString <> '-dict')) then
+    raise Exception.Create('Invalid parameters');
+  Dev := ConnectedDevice;
+  UsbDescCache.Load(Context,Dev);
+  Info := UsbDescCache.Lookup(Dev.Device);
+  if ObjC = 2 then
+    Begin
+      if FMode = mdEZTool then
+        FTCL.SetObjResult(Info.Dict(true) + ' firmware {' + FirmwareCaps(true) + '}')
+      else
+        FTCL.SetObjResult(Info.Dict(true));
+      Exit;
+    End;
+  if FMode = mdEZTool then
+    WriteLn(FirmwareCaps(false));
+  // iterate over all interfaces and alternate settings
+  For I := 0 to High(Info.Interfaces) do
+    With Info.Interfaces[I] do
       Begin
-        // iterate over all alternate settings
-        For IAlt := 0 to num_altsetting-1 do
-          With altsetting^[IAlt] do
+        WriteLn('Interface ',Number,
+                ' (Alternate ',Alternate,')',
+                ' "',Info.CachedString(iInterface),'":');
+        For J := 0 to High(Endpoints) do
+          With Endpoints[J] do
             Begin
-              WriteLn('Interface ',bInterfaceNumber,
-                      ' (Alternate ',bAlternateSetting,')',
-                      ' "',Dev.Control.GetString(iInterface),'":');
-              For IEp := 0 to bNumEndpoints-1 do
-                With endpoint^[IEp] do
-                  Begin
-                    WriteLn('  EP ',   bEndpointAddress and LIBUSB_ENDPOINT_ADDRESS_MASK:2,
-                            ' ',Select(bEndpointAddress and LIBUSB_ENDPOINT_DIR_MASK <> 0,'IN ','OUT'),
-                            ' ',Select(bmAttributes     and LIBUSB_TRANSFER_TYPE_MASK,['Control','Isochronous','Bulk','Interrupt']));
-                  End;
+              WriteLn('  EP ',   Address and LIBUSB_ENDPOINT_ADDRESS_MASK:2,
+                      ' ',Select(Address and LIBUSB_ENDPOINT_DIR_MASK <> 0,'IN ','OUT'),
+                      ' ',Select(Attributes and LIBUSB_TRANSFER_TYPE_MASK,['Control','Isochronous','Bulk','Interrupt']));
             End;
       End;
 End;
@@ -716,111 +1320,1620 @@ Begin
   SetMode(mdDisconnected);
 End;
 
-(*****************************************************************************)
-(***  TCL Functions: Mode: Disconnected  *************************************)
-(*****************************************************************************)
-
 (*ronn
-connect(1ez) -- connect to a USB device
-=======================================
+lock(1ez) -- get exclusive access to the eztool daemon
+======================================================
 
 ## SYNOPSYS
 
-`connect` [`-empty`|`-eztool`|`-user`] [<idVendor>`:`<idProduct>]
+`lock`
+
+`unlock`
 
 ## DESCRIPTION
 
-With `connect`, `eztool` connects to a USB device. The options `-empty`,
-`eztool` and `-user` specify the mode and therefore the functionality.
+When `eztool` runs as daemon (see `--daemon` in eztool(1)), every client
+connection is a session. `lock` reserves the daemon for the current session:
+the commands of all other sessions are deferred until the session calls
+`unlock` or disconnects. Use this to group several commands of a test step,
+which must not be interleaved with those of other clients.
 
-If no arguments are given, first a connection in mode `Empty` to the EZ-USB
-device is established. Then the eztool firmware is `download`(1ez)ed. After
-a view hundret milliseconds, a re-connect in `EZTool` mode is performed.
+The Tcl variable `$session` holds the number of the current session.
 
-With the optional second parameter [<idVendor>`:`<idProduct>] the USB device
-identification can be supplied. If this parameter is omitted, the values of the
-variables `$usbid_empty`, `$usbid_eztool` or `$usbid_user` are used,
-respectively.
+## MODES
 
-After successfully connecting to the USB device, the variable `$usbid` is set
-with the current USB IDs.
+This command is available in all modes, but only for daemon clients.
 
-## VARIABLES
+*)
+Procedure TEZTool.Lock(ObjC:Integer;ObjV:PPTcl_Object);
+Begin
+  if ObjC <> 1 then
+    raise Exception.Create('Invalid parameters');
+  if not Assigned(FDaemon) then
+    raise Exception.Create('Locking is only available in daemon mode');
+  FDaemon.Lock;
+End;
 
- - `$usbid_empty`
- - `$usbid_eztool`
- - `$usbid_user`
- - `$usbid`
+Procedure TEZTool.Unlock(ObjC:Integer;ObjV:PPTcl_Object);
+Begin
+  if ObjC <> 1 then
+    raise Exception.Create('Invalid parameters');
+  if not Assigned(FDaemon) then
+    raise Exception.Create('Locking is only available in daemon mode');
+  FDaemon.Unlock;
+End;
 
-## EXAMPLES
+(**
+ * Helper for the Tcl "puts" wrapper in daemon mode
+ *
+ * Tcl writes to the file descriptor directly, so its output would bypass the
+ * redirection to the client. The wrapper passes it to Pascal's Output instead.
+ *)
+Procedure TEZTool.Stdout(ObjC:Integer;ObjV:PPTcl_Object);
+Begin
+  if ObjC <> 2 then
+    raise Exception.Create('Invalid parameters');
+  Write(ObjV^[1].AsString);
+End;
 
-To connect to a EZ-USB device without firmware, but to work with its IO ports
-and the external I2c EEPROM, the `EZTool` mode is entered after connecting and
-downloading the EZTool firmware. This allows, e.g., to program the external
-I2C EEPROM with the USB IDs 1234:5678.
+(*ronn
+jobwait(1ez) -- wait for a background job
+=========================================
 
-    connect
-    eewrite 0x0000 0xB0 0x34 0x12 0x78 0x56 0x01 0x00
-    eeread 0x0000 16
-    disconnect
+## SYNOPSYS
 
-The following command connects to a EZ-USB device with already loaded firmware
-for the `EZTool` mode.
+`jobwait` <id>
 
-    connect -eztool
+`jobstatus` [<id>]
 
-Before a custom firmware is `download`(1ez)ed, a connection to the empty
-EZ-USB device is necessary. In this example, an external I2C EEPROM with
-custom USB IDs is assumed.
+## DESCRIPTION
 
-    connect -empty 1234:5678
-    download ../firmware.hex 1234:abcd
-    disconnect
+The commands `xread`, `xwrite`, `bulkin` and `bulkout` accept the option
+`-async`. Then they only start the transfer in a background thread and return
+a job <id>. Several jobs can run at the same time, e.g. for different devices
+or endpoints, while the script continues with other commands.
 
-Finally, with the custom firmware loaded, a connection in `User` mode allows
-to communicate with the device.
+`jobwait` waits until the job <id> has finished and removes it. It returns the
+data bytes received by `xread` and `bulkin` as list, or the number of bytes
+sent by `xwrite` and `bulkout`. If the transfer failed, `jobwait` raises the
+error.
 
-    connect -user 1234:abcd
-    controlmsg ...
-    bulkin ...
-    bulkout ...
+`jobstatus` without parameter returns the list of all job IDs. With <id> it
+returns a dictionary with the keys `name`, `state` (`running`, `done` or
+`error`), `done` (bytes transferred so far), `total` and `error`.
 
-## MODES
+When a job finishes, the array element `::eztool::job(`<id>`)` is set to its
+state and the script given with `-command` is executed with the <id>
+appended. Both happen in the Tcl event loop, i.e. while Tcl executes
+`vwait`, `update` or `after` <ms>.
 
-`Disconnected`
+## EXAMPLES
 
-Switches to modes `Empty`, `EZTool` or `User`, depending on the option.
+Read the XRAM in the background and use the time to toggle a port pin.
 
-## SEE ALSO
+    set id [xread -async 0x0000 1024]
+    ioset B 0x01
+    set data [jobwait $id]
 
-`disconnect`(1ez)
+Wait for the completion with `vwait` and a callback.
 
-*)
-Procedure TEZTool.Connect(ObjC : Integer; ObjV: PPTcl_Object);
-Var idVendor,      idProduct       : Word;
-    idVendorEmpty, idProductEmpty  : Word;
-    idVendorEztool,idProductEztool : Word;
+    proc done {id} { puts "job $id: [jobwait $id]" }
+    bulkin -async -command done 1 64
+    vwait ::eztool::job(1)
 
-  Procedure GetUSBIDs(VarName:String);
-  Begin
-    if ObjC = 3 then
-      Begin
-        if not SplitUsbID(ObjV^[2].AsPChar,idVendor,idProduct) then
-          raise Exception.Create('Invalid format of parameter idVendor:idProduct');
-        FTCL.SetVar(VarName,IntToHex(idVendor,4)+':'+IntToHex(idProduct,4));
-      End
-    else
-      Begin
-        if not SplitUsbID(FTCL.GetVar(VarName),idVendor,idProduct) then
-          raise Exception.Create('Invalid format of variable $'+VarName);
-      End;
-  End;
+## MODES
 
-Begin
-  CheckMode([mdDisconnected]);
+This command is available in all modes.
 
-  if (ObjC < 1) or (ObjC > 3) then
-    raise Exception.Create('Invalid paramaters');
+*)
+Procedure TEZTool.JobWait(ObjC:Integer;ObjV:PPTcl_Object);
+Var Job : TJob;
+    St  : String;
+    I   : Integer;
+Begin
+  if ObjC <> 2 then
+    raise Exception.Create('Invalid parameters');
+  Job := FJobs.Find(ObjV^[1].AsInteger(FTCL));
+  Job.WaitFor;
+  FTCL.SetVar('::eztool::job('+IntToStr(Job.Id)+')',JobStateNames[Job.State]);
+  if Job.State = jsError then
+    Begin
+      St := Job.Error;
+      FJobs.Remove(Job);
+      raise Exception.Create(St);
+    End;
+  if (Job.Name = 'xread') or (Job.Name = 'bulkin') then
+    Begin
+      St := '';
+      For I := 1 to Length(Job.Data) do
+        St += Select(I > 1,' ','') + '0x' + IntToHex(Ord(Job.Data[I]),2);
+      FTCL.SetObjResult(St);
+    End
+  else
+    FTCL.SetObjResult(Job.Done);
+  FJobs.Remove(Job);
+End;
+
+Procedure TEZTool.JobStatus(ObjC:Integer;ObjV:PPTcl_Object);
+Var Job : TJob;
+    St  : String;
+    I   : Integer;
+Begin
+  if ObjC = 1 then
+    Begin
+      St := '';
+      For I := 0 to FJobs.Count-1 do
+        St += Select(I > 0,' ','') + IntToStr(FJobs[I].Id);
+      FTCL.SetObjResult(St);
+    End
+  else if ObjC = 2 then
+    Begin
+      Job := FJobs.Find(ObjV^[1].AsInteger(FTCL));
+      FTCL.SetObjResult('name ' + Job.Name
+                     + ' state ' + JobStateNames[Job.State]
+                     + ' done ' + IntToStr(Job.Done)
+                     + ' total ' + IntToStr(Job.Len)
+                     + ' error {' + Job.Error + '}');
+    End
+  else
+    raise Exception.Create('Invalid parameters');
+End;
+
+(**
+ * Report finished jobs to Tcl, scheduled by StartJob with "after"
+ *)
+Procedure TEZTool.JobPoll(ObjC:Integer;ObjV:PPTcl_Object);
+Var Job : TJob;
+    I   : Integer;
+Begin
+  FJobPolling := false;
+  For I := 0 to FJobs.Count-1 do
+    Begin
+      Job := FJobs[I];
+      if Job.Reported or not Job.Finished then
+        Continue;
+      Job.Reported := true;
+      FTCL.SetVar('::eztool::job('+IntToStr(Job.Id)+')',JobStateNames[Job.State]);
+      if Job.Callback > '' then
+        Begin
+          if FTCL.Eval(Job.Callback + ' ' + IntToStr(Job.Id)) <> TCL_OK then
+            WriteLn('Error in callback of job ',Job.Id,': ',FTCL.GetStringResult);
+          Break;   // the callback might have removed jobs, continue in the next poll
+        End;
+    End;
+  For I := 0 to FJobs.Count-1 do
+    if not FJobs[I].Reported then
+      Begin
+        FTCL.Eval('after '+IntToStr(JOB_POLL_MS)+' ::eztool::jobpoll');
+        FJobPolling := true;
+        Break;
+      End;
+End;
+
+(*ronn
+open(1ez) -- device memories and streams as Tcl channels
+========================================================
+
+## SYNOPSYS
+
+`open` `eztool:xram`|`eztool:eeprom`|`eztool:eeprom16` [<access>]
+
+`open` `eztool:i2c/`<addr> [<access>]
+
+`open` `eztool:ep/`<ep> [<access>]
+
+## DESCRIPTION
+
+Tcl's `open` is extended to open the memories and streams of the connected
+device as Tcl channels. These are used with `read`, `puts -nonewline`,
+`seek`, `tell`, `fcopy`, `fileevent` and `close` like files. Large amounts of
+data are transferred in chunks with bounded memory and without handling
+single bytes in Tcl. All other file names are passed to the original `open`.
+
+`eztool:xram` (64 kB), `eztool:eeprom` (I2C EEPROM at 0x50, 256 bytes) and
+`eztool:eeprom16` (boot EEPROM at 0x51, 8 kB) are seekable and return EOF at
+their end. The EEPROMs are written page by page. `eztool:eeprom` uses the
+shadow cache, see `cache`(1ez).
+
+`eztool:i2c/`<addr> is a stream to the I2C slave <addr>. Every read or write
+of the channel buffer is one I2C transfer of at most 64 bytes, i.e. use
+`read $ch` <n> with small <n> or `-buffersize`.
+
+`eztool:ep/`<ep> is a stream to the bulk endpoint <ep> of the claimed
+interface in the `User` mode, e.g. `eztool:ep/0x82`. IN endpoints can only be
+read, OUT endpoints only written. A read times out after 1 s.
+
+<access> is `r` (default), `w`, `a`, `r+`, `w+`, `a+` or a list of flags
+with `RDONLY`, `WRONLY` or `RDWR`. `w` doesn't truncate the memory, `a`
+starts at its end. The channels are opened with `-translation binary`.
+
+When the device is disconnected, all further operations on the channel fail
+until it is closed.
+
+## EXAMPLES
+
+Save the XRAM to a file and write a file to the boot EEPROM.
+
+    set src [open eztool:xram]
+    set dst [open xram.bin w]
+    fconfigure $dst -translation binary
+    fcopy $src $dst
+    close $src ; close $dst
+
+    set src [open fixture.bin] ; fconfigure $src -translation binary
+    set dst [open eztool:eeprom16 w]
+    fcopy $src $dst
+    close $src ; close $dst
+
+## MODES
+
+`xram`, `eeprom`, `eeprom16` and `i2c` are available in `EZTool`, `ep` in
+`User`.
+
+## SEE ALSO
+
+`xread`(1ez), `eeread`(1ez), `i2cread`(1ez), `bulkin`(1ez), `data`(1ez)
+
+*)
+Procedure TEZTool.ChanOpen(ObjC:Integer;ObjV:PPTcl_Object);
+Var Chan : TDevChannel;
+    Key  : String;
+    Mode : String;
+Begin
+  // ::eztool::chanopen name [access [permissions]]
+  if (ObjC < 2) or (ObjC > 4) then
+    raise Exception.Create('Invalid parameters');
+  Mode := '';
+  if ObjC >= 3 then
+    Mode := ObjV^[2].AsString;
+  Chan := TDevChannel.Create(ObjV^[1].AsString,Mode,FEZToolDevice,FUserDevice);
+  Inc(FChannelCount);
+  Key := 'devchan' + IntToStr(FChannelCount);
+  FChannels.AddObject(Key,Chan);
+  if FTCL.Eval('chan create {'+Select(Chan.Readable,'read ','')+Select(Chan.Writable,'write','')+'} {::eztool::chan '+Key+'}') <> TCL_OK then
+    Begin
+      FChannels.Delete(FChannels.IndexOf(Key));
+      raise Exception.Create(FTCL.GetStringResult);
+    End;
+  Chan.ChanId := FTCL.GetStringResult;
+  FTCL.Eval('fconfigure '+Chan.ChanId+' -translation binary');
+  FTCL.SetObjResult(Chan.ChanId);
+End;
+
+(**
+ * Handler of the reflected channels created by ChanOpen
+ *
+ * Called by Tcl as "::eztool::chan key method channel args...". The method
+ * "post" is scheduled by "watch" to generate the events for "fileevent".
+ *)
+Procedure TEZTool.ChanCmd(ObjC:Integer;ObjV:PPTcl_Object);
+Var Chan   : TDevChannel;
+    Method : String;
+    Data   : AnsiString;
+    I      : Integer;
+Begin
+  if ObjC < 4 then
+    raise Exception.Create('Invalid parameters');
+  Method := ObjV^[2].AsString;
+  if not FChannels.Find(ObjV^[1].AsString,I) then
+    Begin
+      // the channel was closed before the scheduled "post"
+      if Method = 'post' then
+        Exit;
+      raise Exception.Create('Unknown channel "'+ObjV^[1].AsString+'"');
+    End;
+  Chan := TDevChannel(FChannels.Objects[I]);
+  if Method = 'initialize' then
+    FTCL.SetObjResult(Chan.Methods)
+  else if Method = 'finalize' then
+    FChannels.Delete(I)
+  else if Method = 'watch' then
+    Begin
+      Chan.Watch := Trim(ObjV^[4].AsString);
+      // streams and memories are always ready, so post events until the
+      // fileevent is removed
+      if (Chan.Watch <> '') and not Chan.Posting then
+        Begin
+          Chan.Posting := true;
+          FTCL.Eval('after idle {::eztool::chan '+ObjV^[1].AsString+' post '+Chan.ChanId+'}');
+        End;
+    End
+  else if Method = 'post' then
+    Begin
+      Chan.Posting := false;
+      if Chan.Watch = '' then
+        Exit;
+      Chan.Posting := true;
+      FTCL.Eval('chan postevent '+Chan.ChanId+' {'+Chan.Watch+'}');
+      FTCL.Eval('after '+IntToStr(JOB_POLL_MS)+' {::eztool::chan '+ObjV^[1].AsString+' post '+Chan.ChanId+'}');
+    End
+  else if Method = 'read' then
+    Begin
+      Data := Chan.Read(ObjV^[4].AsInteger(FTCL));
+      FTCL.SetObjResult(BinToTcl(PChar(Data)^,Length(Data)));
+    End
+  else if Method = 'write' then
+    FTCL.SetObjResult(Chan.Write(TclToBin(ObjV^[4].AsString)))
+  else if Method = 'seek' then
+    FTCL.SetObjResult(Chan.Seek(ObjV^[4].AsInteger(FTCL),ObjV^[5].AsString))
+  else
+    raise Exception.Create('Unsupported channel method "'+Method+'"');
+End;
+
+(*ronn
+data(1ez) -- binary data buffers
+================================
+
+## SYNOPSYS
+
+`data create` <len> [<fill>]
+
+`data fromhex` <hexstring>
+
+`data fromlist` <byte> ...
+
+`data load` <filename>
+
+`data save` <handle> <filename>
+
+`data free` <handle> ...
+
+`data names`
+
+`data length` <handle>
+
+`data hex` <handle> [<start> <len>]
+
+`data list` <handle> [<start> <len>]
+
+`data dump` <handle> [<addr>] [`-file` <filename> | `-channel` <channel>]
+
+`data slice` <handle> <start> <len>
+
+`data concat` <handle> ...
+
+`data compare` <handle1> <handle2>
+
+`data diff` <handle1> <handle2> [<max>]
+
+`data search` <handle> <hexpattern> [<start>]
+
+`data bits` <handle> <bitoffset> <width>
+
+`data crc` <handle> `crc32`|`crc16`|`sum8`|`xor8`
+
+## DESCRIPTION
+
+Large amounts of binary data are slow to handle as Tcl lists of bytes. The
+`data` command manages binary buffers on the host, which are referred to by
+handles like `data1`. The commands `eeread`, `xread`, `i2cread` and `bulkin`
+store their result in a new buffer and return its handle when `-data` is
+appended. The commands `eewrite`, `xwrite`, `i2cwrite` and `bulkout` accept
+`-data` <handle> instead of the data bytes.
+
+Buffers exist until they are released with `data free`.
+
+`create`, `fromhex`, `fromlist`, `load`, `slice` and `concat` create a new
+buffer and return its handle. `fromlist` takes the bytes as separate
+parameters, use `{*}`$list to expand a Tcl list. `hex` returns the contents as
+hex string, `list` as Tcl list of bytes.
+
+`dump` prints a hex dump with ASCII column like `xread`. The addresses start
+at <addr> (default 0). With `-file` the dump is written to a file, with
+`-channel` to an open Tcl channel, e.g. a log file opened with `open`.
+
+`compare` returns -1 if both buffers are equal, otherwise the offset of the
+first difference (or of the end of the shorter buffer). `diff` returns a list
+of offset, byte1 and byte2 triples for up to <max> (default 100) differing
+bytes. If the buffers have different lengths, the bytes after the end of the
+shorter one are listed too, with {} for the missing byte.
+
+`search` returns the offset of the first occurrence of the byte pattern given
+as hex string at or after <start>, or -1.
+
+`bits` extracts an unsigned bit field of up to 64 bits, counted from bit 0 of
+the first byte (LSB first).
+
+`crc` calculates the CRC-32 (as used by Ethernet and zlib), the CRC-16/CCITT
+(initial value 0xFFFF), the 8 bit sum or the 8 bit XOR of the buffer.
+
+## EXAMPLES
+
+Read the XRAM, compare it with a file and print the differences.
+
+    set a [xread 0x0000 0x2000 -data]
+    set b [data load firmware.bin]
+    if {[data compare $a $b] >= 0} { puts [data diff $a $b 10] }
+    data free $a $b
+
+## MODES
+
+This command is available in all modes, the device commands with `-data` only
+in their respective modes.
+
+*)
+Procedure TEZTool.DataCmd(ObjC:Integer;ObjV:PPTcl_Object);
+Var Cmd    : String;
+    Data   : TDataBuffer;
+    Data2  : TDataBuffer;
+    Start  : SizeInt;
+    Len    : SizeInt;
+    Pos    : SizeInt;
+    I      : Integer;
+    Count  : Integer;
+    St     : AnsiString;
+    Needle : TDataBuffer;
+    Stream : TFileStream;
+
+  (**
+   * Optional range "start len" at ObjV[3..4], default is the whole buffer
+   *)
+  Procedure GetRange;
+  Begin
+    if ObjC = 5 then
+      Begin
+        Start := ObjV^[3].AsInteger(FTCL);
+        Len   := ObjV^[4].AsInteger(FTCL);
+      End
+    else if ObjC = 3 then
+      Begin
+        Start := 0;
+        Len   := Data.Length;
+      End
+    else
+      raise Exception.Create('Invalid parameters');
+    Data.CheckRange(Start,Len);
+  End;
+
+Begin
+  if ObjC < 2 then
+    raise Exception.Create('Invalid parameters');
+  Cmd := ObjV^[1].AsString;
+  if Cmd = 'create' then
+    Begin
+      if (ObjC < 3) or (ObjC > 4) then
+        raise Exception.Create('Invalid parameters');
+      Data := TDataBuffer.Create(ObjV^[2].AsInteger(FTCL));
+      try
+        if ObjC = 4 then
+          FillChar(Data.Ptr^,Data.Length,ObjV^[3].AsInteger(FTCL) and $FF);
+      except
+        Data.Free;   // invalid fill byte
+        raise;
+      End;
+      FTCL.SetObjResult(FData.Add(Data));
+    End
+  else if Cmd = 'fromhex' then
+    Begin
+      if ObjC <> 3 then
+        raise Exception.Create('Invalid parameters');
+      FTCL.SetObjResult(FData.Add(DataFromHex(ObjV^[2].AsString)));
+    End
+  else if Cmd = 'fromlist' then
+    Begin
+      Data := TDataBuffer.Create(ObjC-2);
+      try
+        For I := 2 to ObjC-1 do
+          Data.Ptr[I-2] := ObjV^[I].AsInteger(FTCL) and $FF;
+      except
+        Data.Free;   // invalid byte
+        raise;
+      End;
+      FTCL.SetObjResult(FData.Add(Data));
+    End
+  else if Cmd = 'load' then
+    Begin
+      if ObjC <> 3 then
+        raise Exception.Create('Invalid parameters');
+      St := LoadFile(ObjV^[2].AsString);
+      FTCL.SetObjResult(FData.Add(TDataBuffer.Create(PChar(St)^,Length(St))));
+    End
+  else if Cmd = 'save' then
+    Begin
+      if ObjC <> 4 then
+        raise Exception.Create('Invalid parameters');
+      Data := FData.Get(ObjV^[2].AsString);
+      With TFileStream.Create(ObjV^[3].AsString,fmCreate) do
+        try
+          if Data.Length > 0 then
+            WriteBuffer(Data.Ptr^,Data.Length);
+        finally
+          Free;
+        End;
+    End
+  else if Cmd = 'free' then
+    Begin
+      For I := 2 to ObjC-1 do
+        FData.Remove(ObjV^[I].AsString);
+    End
+  else if Cmd = 'names' then
+    Begin
+      if ObjC <> 2 then
+        raise Exception.Create('Invalid parameters');
+      FTCL.SetObjResult(FData.Names);
+    End
+  else if Cmd = 'length' then
+    Begin
+      if ObjC <> 3 then
+        raise Exception.Create('Invalid parameters');
+      FTCL.SetObjResult(FData.Get(ObjV^[2].AsString).Length);
+    End
+  else if Cmd = 'hex' then
+    Begin
+      if ObjC < 3 then
+        raise Exception.Create('Invalid parameters');
+      Data := FData.Get(ObjV^[2].AsString);
+      GetRange;
+      FTCL.SetObjResult(DataToHex(Data.Ptr+Start,Len));
+    End
+  else if Cmd = 'list' then
+    Begin
+      if ObjC < 3 then
+        raise Exception.Create('Invalid parameters');
+      Data := FData.Get(ObjV^[2].AsString);
+      GetRange;
+      St := '';
+      For Pos := Start to Start+Len-1 do
+        St += Select(Pos > Start,' ','') + '0x' + IntToHex(Data.Ptr[Pos],2);
+      FTCL.SetObjResult(St);
+    End
+  else if Cmd = 'dump' then
+    Begin
+      if (ObjC < 3) or (ObjC > 6) then
+        raise Exception.Create('Invalid parameters');
+      Data := FData.Get(ObjV^[2].AsString);
+      Start := 0;
+      I := 3;
+      if (ObjC = 4) or (ObjC = 6) then
+        Begin
+          Start := ObjV^[3].AsInteger(FTCL);
+          I := 4;
+        End;
+      if ObjC = I then
+        HexDump(Start,Data.Ptr^,Data.Length)
+      else if (ObjC = I+2) and (ObjV^[I].AsString = '-file') then
+        Begin
+          Stream := TFileStream.Create(ObjV^[I+1].AsString,fmCreate);
+          try
+            HexDump(Start,Data.Ptr^,Data.Length,Stream);
+          finally
+            Stream.Free;
+          End;
+        End
+      else if (ObjC = I+2) and (ObjV^[I].AsString = '-channel') then
+        Begin
+          // one "puts" per block of 4kB
+          St := ObjV^[I+1].AsString;
+          Pos := 0;
+          while Pos < Data.Length do
+            Begin
+              Len := Min(4096,Data.Length-Pos);
+              FTCL.SetVar('::eztool::dumpblock',HexDumpStr(Start+Pos,Data.Ptr[Pos],Len));
+              if FTCL.Eval('puts -nonewline ' + St + ' $::eztool::dumpblock') <> TCL_OK then
+                raise Exception.Create(FTCL.GetStringResult);
+              Pos += Len;
+            End;
+          FTCL.Eval('unset ::eztool::dumpblock');
+        End
+      else
+        raise Exception.Create('Invalid parameters');
+    End
+  else if Cmd = 'slice' then
+    Begin
+      if ObjC <> 5 then
+        raise Exception.Create('Invalid parameters');
+      Data := FData.Get(ObjV^[2].AsString);
+      GetRange;
+      FTCL.SetObjResult(FData.Add(TDataBuffer.Create(Data.Ptr[Start],Len)));
+    End
+  else if Cmd = 'concat' then
+    Begin
+      Len := 0;
+      For I := 2 to ObjC-1 do
+        Len += FData.Get(ObjV^[I].AsString).Length;
+      Data := TDataBuffer.Create(Len);
+      Pos := 0;
+      For I := 2 to ObjC-1 do
+        Begin
+          Data2 := FData.Get(ObjV^[I].AsString);
+          if Data2.Length > 0 then
+            Move(Data2.Ptr^,Data.Ptr[Pos],Data2.Length);
+          Pos += Data2.Length;
+        End;
+      FTCL.SetObjResult(FData.Add(Data));
+    End
+  else if Cmd = 'compare' then
+    Begin
+      if ObjC <> 4 then
+        raise Exception.Create('Invalid parameters');
+      Data  := FData.Get(ObjV^[2].AsString);
+      Data2 := FData.Get(ObjV^[3].AsString);
+      Pos := DataCompare(Data.Ptr,Data2.Ptr,Min(Data.Length,Data2.Length));
+      if (Pos < 0) and (Data.Length <> Data2.Length) then
+        Pos := Min(Data.Length,Data2.Length);
+      FTCL.SetObjResult(Pos);
+    End
+  else if Cmd = 'diff' then
+    Begin
+      if (ObjC < 4) or (ObjC > 5) then
+        raise Exception.Create('Invalid parameters');
+      Data  := FData.Get(ObjV^[2].AsString);
+      Data2 := FData.Get(ObjV^[3].AsString);
+      Count := 100;
+      if ObjC = 5 then
+        Count := ObjV^[4].AsInteger(FTCL);
+      FTCL.SetObjResult(DataDiff(Data.Ptr,Data.Length,Data2.Ptr,Data2.Length,Count));
+    End
+  else if Cmd = 'search' then
+    Begin
+      if (ObjC < 4) or (ObjC > 5) then
+        raise Exception.Create('Invalid parameters');
+      Data := FData.Get(ObjV^[2].AsString);
+      Start := 0;
+      if ObjC = 5 then
+        Start := ObjV^[4].AsInteger(FTCL);
+      Needle := DataFromHex(ObjV^[3].AsString);
+      try
+        FTCL.SetObjResult(DataSearch(Data.Ptr,Data.Length,Needle.Ptr,Needle.Length,Start));
+      finally
+        Needle.Free;
+      End;
+    End
+  else if Cmd = 'bits' then
+    Begin
+      if ObjC <> 5 then
+        raise Exception.Create('Invalid parameters');
+      Data := FData.Get(ObjV^[2].AsString);
+      FTCL.SetObjResult(IntToStr(DataBits(Data.Ptr,Data.Length,ObjV^[3].AsInteger(FTCL),ObjV^[4].AsInteger(FTCL))));
+    End
+  else if Cmd = 'crc' then
+    Begin
+      if ObjC <> 4 then
+        raise Exception.Create('Invalid parameters');
+      Data := FData.Get(ObjV^[2].AsString);
+      St := ObjV^[3].AsString;
+      if      St = 'crc32' then FTCL.SetObjResult('0x' + IntToHex(DataCRC32(Data.Ptr,Data.Length),8))
+      else if St = 'crc16' then FTCL.SetObjResult('0x' + IntToHex(DataCRC16(Data.Ptr,Data.Length),4))
+      else if St = 'sum8'  then FTCL.SetObjResult('0x' + IntToHex(DataSum8 (Data.Ptr,Data.Length),2))
+      else if St = 'xor8'  then FTCL.SetObjResult('0x' + IntToHex(DataXor8 (Data.Ptr,Data.Length),2))
+      else
+        raise Exception.Create('Unknown checksum "'+St+'"');
+    End
+  else
+    raise Exception.Create('Unknown subcommand "'+Cmd+'"');
+End;
+
+(*ronn
+trace(1ez) -- trace the USB transfers
+=====================================
+
+## SYNOPSYS
+
+`trace start` [<slots> [<snaplen>]]
+
+`trace stop`
+
+`trace clear`
+
+`trace dump` [<filename>]
+
+`trace status`
+
+## DESCRIPTION
+
+`trace` records every control and bulk transfer of eztool with its
+direction, endpoint, setup packet, length, status and the time of submission
+and completion. The first <snaplen> (default 64) bytes of the payload are
+recorded too. The records are stored in a ring buffer with <slots> (default
+4096) entries, i.e. the oldest records are overwritten.
+
+`start` starts recording, the records of a previous run are kept unless
+the buffer size changes or `clear` is used. `stop` stops recording.
+
+`dump` without <filename> prints the records as table with the submission
+time relative to the start and the latency of each transfer. With <filename>
+it writes a pcap file with usbmon headers (link type LINKTYPE_USB_LINUX),
+which can be opened with Wireshark.
+
+`status` returns a dictionary with the keys `enabled`, `count` and `dropped`
+(overwritten records).
+
+The transfers of the firmware download (mode "Empty") are done by the libusb
+bindings and are not recorded.
+
+## EXAMPLES
+
+    trace start
+    xread 0x0000 256
+    trace stop
+    trace dump xread.pcap
+
+## MODES
+
+This command is available in all modes.
+
+*)
+Procedure TEZTool.TraceCmd(ObjC:Integer;ObjV:PPTcl_Object);
+Var Cmd : String;
+Begin
+  if ObjC < 2 then
+    raise Exception.Create('Invalid parameters');
+  Cmd := ObjV^[1].AsString;
+  if Cmd = 'start' then
+    Begin
+      if ObjC > 4 then
+        raise Exception.Create('Invalid parameters');
+      if ObjC = 2 then
+        Trace.Start(TRACE_DEFAULT_SLOTS,TRACE_DEFAULT_SNAPLEN)
+      else if ObjC = 3 then
+        Trace.Start(ObjV^[2].AsInteger(FTCL),TRACE_DEFAULT_SNAPLEN)
+      else
+        Trace.Start(ObjV^[2].AsInteger(FTCL),ObjV^[3].AsInteger(FTCL));
+    End
+  else if Cmd = 'stop' then
+    Trace.Stop
+  else if Cmd = 'clear' then
+    Trace.Clear
+  else if Cmd = 'dump' then
+    Begin
+      if ObjC = 2 then
+        Trace.Dump
+      else if ObjC = 3 then
+        Trace.SavePcap(ObjV^[2].AsString)
+      else
+        raise Exception.Create('Invalid parameters');
+    End
+  else if Cmd = 'status' then
+    FTCL.SetObjResult('enabled ' + Select(Trace.Enabled,'1','0')
+                   + ' count ' + IntToStr(Trace.Count)
+                   + ' dropped ' + IntToStr(Trace.Dropped))
+  else
+    raise Exception.Create('Unknown subcommand "'+Cmd+'"');
+End;
+
+(*ronn
+record(1ez) -- record and replay USB sessions
+=============================================
+
+## SYNOPSYS
+
+`record start` <filename>
+
+`record stop`
+
+`record status`
+
+`replay` <filename> [`-fast`] [`-sim` [`-latency`]] [`-verbose`]
+
+## DESCRIPTION
+
+`record start` records all control and bulk transfers to the EZ-Tools device
+or the user device with their payload and timing until `record stop` writes
+them to the session file <filename>. `record status` returns a dictionary with
+the keys `enabled`, `file` and `count`.
+
+`replay` re-issues the transfers of a session file to the connected device
+(mode "EZTool" or "User"). By default the original gaps between the
+transfers are kept, with `-fast` the transfers are issued back to back.
+
+With `-sim` the transfers are not sent to a device but answered by a
+simulation with the recorded status and data. Without `-latency` every
+transfer completes immediately, i.e. only the host side is measured, with
+`-latency` it takes as long as recorded.
+
+`replay` returns a dictionary with the keys `ops` (number of transfers),
+`recorded` and `replayed` (total time in us) and `mismatches` (number of
+transfers with a different status or different received data). With
+`-verbose` it prints the recorded and replayed time of every transfer.
+
+## EXAMPLES
+
+Record a production sequence and compare its timing with a new firmware.
+
+    record start prod.ezs
+    source production.tcl
+    record stop
+    ...
+    replay prod.ezs -fast -verbose
+
+## MODES
+
+`record` is available in all modes. `replay` requires the mode "EZTool" or
+"User" unless `-sim` is given.
+
+*)
+Procedure TEZTool.RecordCmd(ObjC:Integer;ObjV:PPTcl_Object);
+Var Cmd : String;
+Begin
+  if ObjC < 2 then
+    raise Exception.Create('Invalid parameters');
+  Cmd := ObjV^[1].AsString;
+  if Cmd = 'start' then
+    Begin
+      if ObjC <> 3 then
+        raise Exception.Create('Invalid parameters');
+      if Assigned(FRecorder) then
+        raise Exception.Create('Already recording to '+FRecorder.Filename);
+      FRecorder := TSessionRecorder.Create(ObjV^[2].AsString);
+      Trace.Recorder := FRecorder;
+    End
+  else if Cmd = 'stop' then
+    Begin
+      if not Assigned(FRecorder) then
+        raise Exception.Create('Not recording');
+      StopRecording;
+    End
+  else if Cmd = 'status' then
+    Begin
+      if Assigned(FRecorder) then
+        FTCL.SetObjResult('enabled 1 file {' + FRecorder.Filename + '} count ' + IntToStr(FRecorder.Count))
+      else
+        FTCL.SetObjResult('enabled 0 file {} count 0');
+    End
+  else
+    raise Exception.Create('Unknown subcommand "'+Cmd+'"');
+End;
+
+(**
+ * Detach the recorder and write the session file
+ *)
+Procedure TEZTool.StopRecording;
+Begin
+  if not Assigned(FRecorder) then
+    Exit;
+  FJobs.WaitAll;
+  Trace.Recorder := Nil;
+  try
+    FRecorder.Save;
+    WriteLn('Recorded ',FRecorder.Count,' transfers to ',FRecorder.Filename);
+  finally
+    FreeAndNil(FRecorder);
+  End;
+End;
+
+Procedure TEZTool.Replay(ObjC:Integer;ObjV:PPTcl_Object);
+Var Ops      : TSessionOps;
+    Target   : TReplayTarget;
+    Res      : TReplayResult;
+    Realtime : Boolean;
+    Sim      : Boolean;
+    Latency  : Boolean;
+    Verbose  : Boolean;
+    I        : Integer;
+    St       : String;
+Begin
+  if ObjC < 2 then
+    raise Exception.Create('Invalid parameters');
+  Realtime := true;
+  Sim      := false;
+  Latency  := false;
+  Verbose  := false;
+  For I := 2 to ObjC-1 do
+    Begin
+      St := ObjV^[I].AsString;
+      if      St = '-fast'    then Realtime := false
+      else if St = '-sim'     then Sim      := true
+      else if St = '-latency' then Latency  := true
+      else if St = '-verbose' then Verbose  := true
+      else
+        raise Exception.Create('Invalid parameters');
+    End;
+  if Latency and not Sim then
+    raise Exception.Create('-latency requires -sim');
+  if Assigned(FRecorder) then
+    raise Exception.Create('Can''t replay while recording');
+
+  Ops := LoadSession(ObjV^[1].AsString);
+  if Sim then
+    Target := TReplaySim.Create(Latency)
+  else if FMode = mdEZTool then
+    Target := TReplayEZTool.Create(FEZToolDevice)
+  else if FMode = mdUser then
+    Target := TReplayUser.Create(FUserDevice)
+  else
+    raise Exception.Create('This command is not available in this mode.');
+  try
+    Res := ReplaySession(Ops,Target,Realtime);
+  finally
+    Target.Free;
+  End;
+
+  if Verbose then
+    Begin
+      WriteLn('    #  Type  Dir  EP    Len  Recorded [us]  Replayed [us]  Delta [us]');
+      For I := 0 to High(Ops) do
+        With Ops[I].Hdr do
+          WriteLn(Format('%5d  %-4s  %-3s  %2d  %5d  %13d  %13d  %10d%s',
+            [I,Select(XferType = TRACE_XFER_CONTROL,'ctrl','bulk'),
+             Select(EP and LIBUSB_ENDPOINT_IN <> 0,'IN','OUT'),
+             EP and LIBUSB_ENDPOINT_ADDRESS_MASK,Length,Duration,Res.Durations[I],
+             Int64(Res.Durations[I]) - Int64(Duration),
+             Select(Res.Mismatch[I],'  mismatch','')]));
+    End;
+  FTCL.SetObjResult('ops ' + IntToStr(Length(Ops))
+                 + ' recorded ' + IntToStr(Res.Recorded)
+                 + ' replayed ' + IntToStr(Res.Replayed)
+                 + ' mismatches ' + IntToStr(Res.Mismatches));
+End;
+
+(*ronn
+profile(1ez) -- measure the time spent in the commands
+======================================================
+
+## SYNOPSYS
+
+`profile on`
+
+`profile off`
+
+`profile reset`
+
+`profile report`
+
+## DESCRIPTION
+
+While the profiler is on, every call of an eztool command is measured. The
+time of each call is split up into
+
+  * _Args_:
+    from the start of the command to its first USB transfer, i.e. mostly
+    the conversion of the arguments
+  * _USB_:
+    time spent in USB transfers
+  * _Output_:
+    time spent formatting and printing hex dumps and writing other output
+    (e.g. tables and messages) to the terminal or the daemon client
+  * _Other_:
+    the rest, e.g. the conversion of the result
+
+`profile report` prints for every command the number of calls, the total and
+mean time, the minimum, the 50th, 90th and 99th percentile and the maximum of
+the time per call and the shares of the parts above. The percentiles are
+taken from a sample of the calls, the minimum and maximum are exact.
+`profile reset` clears the statistics.
+
+Tcl's own commands (e.g. `set`, `for`) are not measured. The time spent in
+them is the difference between the total run time of a script and the sum of
+the times in the report.
+
+## EXAMPLES
+
+    profile on
+    for {set i 0} {$i < 1000} {incr i} { xread 0x1000 64 }
+    profile report
+
+## MODES
+
+This command is available in all modes.
+
+*)
+Procedure TEZTool.Profile(ObjC:Integer;ObjV:PPTcl_Object);
+Var Cmd : String;
+Begin
+  if ObjC <> 2 then
+    raise Exception.Create('Invalid parameters');
+  Cmd := ObjV^[1].AsString;
+  if      Cmd = 'on'     then FProfiler.Enabled := true
+  else if Cmd = 'off'    then FProfiler.Enabled := false
+  else if Cmd = 'reset'  then FProfiler.Reset
+  else if Cmd = 'report' then FProfiler.Report
+  else
+    raise Exception.Create('Unknown subcommand "'+Cmd+'"');
+End;
+
+(*ronn
+rtmode(1ez) -- real-time mode for streaming
+==========================================
+
+## SYNOPSYS
+
+`rtmode on` [`-priority` <prio>] [`-cpu` <cpu>] [`-nolock`]
+
+`rtmode off`
+
+`rtmode status`
+
+`rtmode reset`
+
+## DESCRIPTION
+
+On a loaded host, scheduling jitter can cause overruns of streams long before
+the USB bandwidth is exhausted. In the real-time mode the threads which do
+the USB transfers of streams, i.e. the background jobs (`-async`), the
+workers of `usbbench`(1ez) and `controlburst`(1ez) and the receive loop of
+`i2clog run`, switch to the `SCHED_FIFO` scheduling policy with priority
+<prio> (1 to 99, default 50) while they are running. With `-cpu`, they are
+additionally pinned to the CPU <cpu>. The memory of the process is locked
+(`mlockall`), unless `-nolock` is given. The buffers of the streams are
+allocated and touched before the transfers start.
+
+`SCHED_FIFO` and `mlockall` need the according privileges, e.g.
+`CAP_SYS_NICE` and `CAP_IPC_LOCK` or appropriate `RLIMIT_RTPRIO` and
+`RLIMIT_MEMLOCK` limits. Otherwise a warning is printed and the transfers
+run with the normal scheduling.
+
+`rtmode off` restores the normal scheduling and unlocks the memory.
+
+`rtmode status` prints the settings and for every stream the number of
+packets and bytes, the overruns, the timeouts and the largest gap between two
+packets. For `i2clog` the overruns are the samples dropped by the firmware,
+`usbbench` counts the timed out transfers. `rtmode reset` clears these
+counters.
+
+The option `--realtime` is the same as `rtmode on` at program start.
+
+## EXAMPLES
+
+Compare the overruns of an I2C log without and with the real-time mode.
+
+    i2clog run normal.csv 60000
+    rtmode on -priority 80 -cpu 3
+    i2clog run realtime.csv 60000
+    rtmode status
+
+## MODES
+
+This command is available in all modes.
+
+## SEE ALSO
+
+`i2clog`(1ez), `usbbench`(1ez)
+
+*)
+Procedure TEZTool.RtMode(ObjC:Integer;ObjV:PPTcl_Object);
+Var Cmd    : String;
+    Opt    : String;
+    Config : TRealTimeConfig;
+    St     : String;
+    I      : Integer;
+Begin
+  if ObjC < 2 then
+    raise Exception.Create('Invalid parameters');
+  Cmd := ObjV^[1].AsString;
+  if Cmd = 'on' then
+    Begin
+      Config := RealTimeConfig;
+      Config.LockMemory := true;
+      I := 2;
+      While I < ObjC do
+        Begin
+          Opt := ObjV^[I].AsString;
+          if (Opt = '-priority') and (I+1 < ObjC) then
+            Begin
+              Inc(I);
+              Config.Priority := ObjV^[I].AsInteger(FTCL);
+              if (Config.Priority < 1) or (Config.Priority > 99) then
+                raise Exception.Create('Priority must be 1 to 99');
+            End
+          else if (Opt = '-cpu') and (I+1 < ObjC) then
+            Begin
+              Inc(I);
+              Config.CPU := ObjV^[I].AsInteger(FTCL);
+            End
+          else if Opt = '-nolock' then
+            Config.LockMemory := false
+          else
+            raise Exception.Create('Invalid parameters');
+          Inc(I);
+        End;
+      RealTimeConfig := Config;
+      St := RealTimeEnable(true);
+      if St > '' then
+        WriteLn('Warning: ',St);
+    End
+  else if ObjC <> 2 then
+    raise Exception.Create('Invalid parameters')
+  else if Cmd = 'off' then
+    RealTimeEnable(false)
+  else if Cmd = 'reset' then
+    StreamReset
+  else if Cmd = 'status' then
+    Begin
+      With RealTimeConfig do
+        WriteLn('Real-time mode ',Select(Enabled,'on','off'),', priority ',Priority,
+                ', CPU ',Select(CPU >= 0,IntToStr(CPU),'any'),
+                ', memory ',Select(RealTimeLocked,'locked','not locked'));
+      StreamReport;
+    End
+  else
+    raise Exception.Create('Unknown subcommand "'+Cmd+'"');
+End;
+
+(*ronn
+stats(1ez) -- counters of the USB communication
+===============================================
+
+## SYNOPSYS
+
+`stats` [`show`]
+
+`stats get`
+
+`stats reset`
+
+`stats textfile` [<filename> [`-interval` <ms>]|`off`]
+
+## DESCRIPTION
+
+`eztool` counts for every device (identified by <idVendor>`:`<idProduct>)
+since the program start
+
+  * the control and bulk transfers and their bytes per direction,
+  * the transfers which failed with a timeout, a stall or other errors,
+  * the duration of the transfers as histogram,
+  * the I2C transfers which were not acknowledged (NACK) and the I2C bus
+    errors, as reported by the EZTool firmware,
+  * the connects, the re-enumerations (connects after a firmware download or
+    with a new bus address) and the firmware downloads.
+
+Transfers are counted for the device they address, e.g. also for the devices
+programmed by `gang`(1ez), not only for the connected one.
+
+Additionally, the commands which failed are counted.
+
+`stats show` prints a summary, `stats get` returns all counters as Tcl dict
+with the device as key. `stats reset` clears the counters. The I2C error
+counters of the firmware are fetched after connecting, on every `stats` call
+and before disconnecting.
+
+`stats textfile` <filename> periodically writes the counters to <filename>
+in the Prometheus text exposition format, e.g. for the textfile collector of
+the node exporter. The file is written every <ms> milliseconds (default 15000)
+by a background thread, therefore also while long running commands execute.
+It is replaced atomically. `stats textfile off` stops writing, `stats textfile`
+without arguments returns the current file name.
+
+In daemon mode (see `eztool`(1)), `eztool --client -c stats` queries the
+counters of the daemon.
+
+## EXAMPLES
+
+    stats textfile /var/lib/node_exporter/textfile/eztool.prom -interval 10000
+
+## MODES
+
+This command is available in all modes.
+
+## SEE ALSO
+
+`profile`(1ez), `rtmode`(1ez), `trace`(1ez)
+
+*)
+Procedure TEZTool.StatsCmd(ObjC:Integer;ObjV:PPTcl_Object);
+Var Cmd      : String;
+    Interval : Integer;
+Begin
+  Cmd := 'show';
+  if ObjC > 1 then
+    Cmd := ObjV^[1].AsString;
+  if (Cmd <> 'textfile') and (ObjC > 2) then
+    raise Exception.Create('Invalid parameters');
+  if (Cmd = 'show') or (Cmd = 'get') then
+    if Assigned(FEZToolDevice) then
+      UpdateFirmwareStatus;
+  if Cmd = 'show' then
+    FMetrics.Report
+  else if Cmd = 'get' then
+    FTCL.SetObjResult(FMetrics.AsDict)
+  else if Cmd = 'reset' then
+    FMetrics.Reset
+  else if Cmd = 'textfile' then
+    Begin
+      if ObjC = 2 then
+        FTCL.SetObjResult(FMetrics.TextFile)
+      else if (ObjC = 3) and (ObjV^[2].AsString = 'off') then
+        FMetrics.StopTextFile
+      else
+        Begin
+          Interval := 15000;
+          if ObjC = 5 then
+            Begin
+              if ObjV^[3].AsString <> '-interval' then
+                raise Exception.Create('Invalid parameters');
+              Interval := ObjV^[4].AsInteger(FTCL);
+              if Interval < 100 then
+                raise Exception.Create('The interval must be at least 100 ms');
+            End
+          else if ObjC <> 3 then
+            raise Exception.Create('Invalid parameters');
+          FMetrics.StartTextFile(ObjV^[2].AsString,Interval);
+        End;
+    End
+  else
+    raise Exception.Create('Unknown subcommand "'+Cmd+'"');
+End;
+
+(*ronn
+topology(1ez) -- USB host controllers, transaction translators and bandwidth
+============================================================================
+
+## SYNOPSYS
+
+`topology` [`show`]
+
+`topology get`
+
+`topology on`|`off`|`reset`
+
+`topology order` <device> ...
+
+## DESCRIPTION
+
+Devices which are connected to the same host controller share its bandwidth.
+Full- and low-speed devices (like the EZ-USB) behind a high-speed hub
+additionally share the transaction translator (TT) of the hub, i.e. 12
+Mbit/s, or the TT of their port if it is a multi-TT hub. `topology` shows
+which devices share a controller or a TT, as read from the operating system
+without talking to the devices. The topology is read again on every call and
+when connecting.
+
+A device is identified by its path <bus>`-`<port>`.`<port>..., as in
+`/sys/bus/usb/devices`, which stays the same as long as the cabling isn't
+changed. The path of the connected device is stored in `$usbpath`.
+
+For every controller, TT and device, the transfers and bytes are counted.
+The busy time is the time in which at least one of their transfers was
+pending, bytes / busy time is the bandwidth they achieved, also if several
+devices transferred concurrently. This shows which slots of a rack are slow
+because they share a TT or a controller.
+
+Counting costs time in every transfer, therefore it is off after the start.
+`topology on` starts it, `topology off` stops it. `topology show` and
+`topology get` start it too, so their counters include all transfers from
+the first call on.
+
+`topology show` prints the tree of controllers, TTs and devices with their
+counters, `topology get` returns it as Tcl dict with the keys `groups` and
+`devices`. `topology reset` clears the counters.
+
+`topology order` sorts the given devices (paths or <bus>`:`<address>) for
+concurrent work: they are distributed round-robin over their TTs (or
+controllers if they are not behind a TT), and consecutive TTs are on
+different controllers where possible. Starting the devices in this order
+with a limited number of workers spreads the load evenly.
+
+## EXAMPLES
+
+    topology order 3-1.1 3-1.2 3-1.3 4-2 4-3
+    => 3-1.1 4-2 3-1.2 4-3 3-1.3
+
+## MODES
+
+This command is available in all modes.
+
+## SEE ALSO
+
+`lsusb`(1ez), `stats`(1ez)
+
+*)
+Procedure TEZTool.TopologyCmd(ObjC:Integer;ObjV:PPTcl_Object);
+Var Cmd   : String;
+    Devs  : Array of Integer;
+    Order : TScheduleOrder;
+    St    : AnsiString;
+    I     : Integer;
+Begin
+  Cmd := 'show';
+  if ObjC > 1 then
+    Cmd := ObjV^[1].AsString;
+  if (Cmd <> 'order') and (ObjC > 2) then
+    raise Exception.Create('Invalid parameters');
+  if Cmd = 'reset' then
+    Begin
+      FTopology.Reset;
+      Exit;
+    End
+  else if Cmd = 'off' then
+    Begin
+      Trace.Topology := Nil;
+      Exit;
+    End;
+  FTopology.Scan(Context);
+  // counting starts with the first "on", "show" or "get"
+  if (Cmd = 'on') or (Cmd = 'show') or (Cmd = 'get') then
+    Trace.Topology := FTopology;
+  if Cmd = 'on' then
+    Exit
+  else if Cmd = 'show' then
+    FTopology.Report
+  else if Cmd = 'get' then
+    FTCL.SetObjResult(FTopology.AsDict)
+  else if Cmd = 'order' then
+    Begin
+      SetLength(Devs,ObjC-2);
+      For I := 2 to ObjC-1 do
+        Begin
+          Devs[I-2] := FTopology.Find(ObjV^[I].AsString);
+          if Devs[I-2] < 0 then
+            raise Exception.Create('Unknown device "'+ObjV^[I].AsString+'"');
+        End;
+      Order := FTopology.Schedule(Devs);
+      St := '';
+      For I := 0 to High(Order) do
+        St += Select(I > 0,' ','') + FTopology.Path(Devs[Order[I]]);
+      FTCL.SetObjResult(St);
+    End
+  else
+    raise Exception.Create('Unknown subcommand "'+Cmd+'"');
+End;
+
+(*ronn
+gang(1ez) -- program many EZTool devices at the same time
+=========================================================
+
+## SYNOPSYS
+
+`gang` `eeprog` <image.bin>|<firmware.ihx> `-devices` <list> [`-jobs` <n>]
+
+`gang` `xload` <image.ihx> `-devices` <list> [`-jobs` <n>]
+
+## DESCRIPTION
+
+`gang` writes the same image to all devices in <list> concurrently and reads
+it back from every device for verification. This is used to provision a
+tray of boards in about the time of a single one.
+
+`gang eeprog` writes a B2 boot EEPROM image to the I2C EEPROM at address
+0x51, like `eeboot program`(1ez). An Intel Hex file is converted with the USB
+IDs `$usbid_eztool`. `gang xload` writes the data of an Intel Hex file to the
+XRAM, like `xwrite`(1ez), but past the shadow cache, see `cache`(1ez). The
+caches of every device are written back and invalidated first, so the
+verification always reads the device.
+
+The devices are given as paths or <bus>`:`<address> as shown by
+`topology`(1ez). Every device must either run the EZTool firmware
+(`$usbid_eztool`) or be an empty EZ-USB (`$usbid_empty`), which gets the
+EZTool firmware downloaded first. The device which is connected in the
+`EZTool` mode is used as it is, a device which is connected in the `Empty`
+or `User` mode must be disconnected first.
+
+The image file is parsed only once. Each device is handled by a worker
+thread, up to <n> (default: all) at the same time. The devices are started in
+the order of `topology order`(1ez), i.e. spread over the transaction
+translators and host controllers.
+
+The result of each device is printed with the time to connect (including the
+firmware download) and the total time. An error of one device doesn't stop
+the others. The command returns a Tcl dict with the paths as keys and dicts
+with the keys `result` (`pass` or `fail`), `connect_ms`, `total_ms` and
+`error` as values.
+
+## EXAMPLES
+
+    gang eeprog fixture.bin -devices {3-1.1 3-1.2 3-1.3 3-1.4}
+    gang xload selftest.ihx -devices {3:7 3:8} -jobs 1
+
+## MODES
+
+This command is available in all modes.
+
+## SEE ALSO
+
+`eeboot`(1ez), `xwrite`(1ez), `topology`(1ez)
+
+*)
+Procedure TEZTool.GangCmd(ObjC:Integer;ObjV:PPTcl_Object);
+Var Cmd       : String;
+    Filename  : String;
+    List      : TStringList;
+    Jobs      : Integer;
+    Params    : TGangParams;
+    Image     : TGangImage;
+    Idx       : Array of Integer;
+    Order     : TScheduleOrder;
+    Devs      : TGangDevices;
+    Topo      : TTopoDevice;
+    Total     : UInt64;
+    Passed    : Integer;
+    St        : AnsiString;
+    I,J       : Integer;
+Begin
+  // gang eeprog|xload image -devices list [-jobs n]
+  if ObjC < 5 then
+    raise Exception.Create('Invalid parameters');
+  Cmd      := ObjV^[1].AsString;
+  Filename := ObjV^[2].AsString;
+  if (Cmd <> 'eeprog') and (Cmd <> 'xload') then
+    raise Exception.Create('Invalid parameters');
+  List := Nil;
+  try
+    Jobs := GANG_MAX_JOBS;
+    I := 3;
+    while I < ObjC do
+      Begin
+        if I+1 >= ObjC then
+          raise Exception.Create('Invalid parameters');
+        St := ObjV^[I].AsString;
+        Inc(I);
+        if St = '-devices' then
+          Begin
+            FreeAndNil(List);
+            List := TclList(ObjV^[I].AsString);
+          End
+        else if St = '-jobs' then
+          Jobs := ObjV^[I].AsInteger(FTCL)
+        else
+          raise Exception.Create('Invalid parameters');
+        Inc(I);
+      End;
+    if not Assigned(List) or (List.Count = 0) then
+      raise Exception.Create('Specify the devices with -devices');
+
+    With Params do
+      Begin
+        Context := Self.Context;
+        if not SplitUsbID(FTCL.GetVar('usbid_empty'),idVendorEmpty,idProductEmpty) then
+          raise Exception.Create('Invalid format of variable $usbid_empty');
+        if not SplitUsbID(FTCL.GetVar('usbid_eztool'),idVendorEZTool,idProductEZTool) then
+          raise Exception.Create('Invalid format of variable $usbid_eztool');
+        Firmware := TEZToolDevice.FindFirmware(Device.FirmwareName,'eztool');
+      End;
+
+    // resolve the devices and sort them by their bottlenecks
+    FTopology.Scan(Context);
+    SetLength(Idx,List.Count);
+    For I := 0 to List.Count-1 do
+      Begin
+        Idx[I] := FTopology.Find(List[I]);
+        if Idx[I] < 0 then
+          raise Exception.Create('Unknown device "'+List[I]+'"');
+        For J := 0 to I-1 do
+          if Idx[J] = Idx[I] then
+            raise Exception.Create('Device "'+List[I]+'" is given twice');
+      End;
+    Order := FTopology.Schedule(Idx);
+    SetLength(Devs,Length(Order));
+    For I := 0 to High(Order) do
+      With Devs[I] do
+        Begin
+          Topo   := FTopology.Device(Idx[Order[I]]);
+          Path   := Topo.Path;
+          EZTool := Nil;
+          if (Topo.idVendor = Params.idVendorEZTool) and (Topo.idProduct = Params.idProductEZTool) then
+            Empty := false
+          else if (Topo.idVendor = Params.idVendorEmpty) and (Topo.idProduct = Params.idProductEmpty) then
+            Empty := true
+          else
+            raise Exception.Create('"'+Path+'" is neither an empty EZ-USB nor an EZTool device');
+          if (FMode <> mdDisconnected) and (DevicePath(ConnectedDevice.Device) = Path) then
+            Begin
+              if FMode <> mdEZTool then
+                raise Exception.Create('"'+Path+'" is connected, use "disconnect" first');
+              // jobs still use the device
+              FJobs.WaitAll;
+              EZTool := FEZToolDevice;
+            End;
+        End;
+  finally
+    List.Free;
+  End;
+
+  if Cmd = 'eeprog' then
+    Image := LoadGangImage(gtEEPROM,Filename,Params.idVendorEZTool,Params.idProductEZTool)
+  else
+    Image := LoadGangImage(gtXRAM,Filename,0,0);
+  Total := RunGang(Image,Params,Devs,Jobs);
+
+  Passed := 0;
+  St     := '';
+  For I := 0 to High(Devs) do
+    With Devs[I] do
+      Begin
+        WriteLn(Path:12,'  ',Select(Error = '','pass','FAIL'),ConnectTime div 1000:8,' ms connect',Elapsed div 1000:8,' ms total  ',Error);
+        if Error = '' then
+          Inc(Passed);
+        St += Format(' %s {result %s connect_ms %d total_ms %d error %s}',
+          [TclQuote(Path),Select(Error = '','pass','fail'),ConnectTime div 1000,Elapsed div 1000,TclQuote(Error)]);
+      End;
+  WriteLn(Passed,' of ',Length(Devs),' devices passed, ',Image.Size,' bytes each in ',Total div 1000,' ms');
+  FTCL.SetObjResult(Copy(St,2,MaxInt));
+End;
+
+(*****************************************************************************)
+(***  TCL Functions: Mode: Disconnected  *************************************)
+(*****************************************************************************)
+
+(*ronn
+connect(1ez) -- connect to a USB device
+=======================================
+
+## SYNOPSYS
+
+`connect` [`-empty`|`-eztool`|`-user`] [<idVendor>`:`<idProduct>]
+
+## DESCRIPTION
+
+With `connect`, `eztool` connects to a USB device. The options `-empty`,
+`eztool` and `-user` specify the mode and therefore the functionality.
+
+If no arguments are given, first a connection in mode `Empty` to the EZ-USB
+device is established. Then the eztool firmware is `download`(1ez)ed. After
+a view hundret milliseconds, a re-connect in `EZTool` mode is performed.
+
+With the optional second parameter [<idVendor>`:`<idProduct>] the USB device
+identification can be supplied. If this parameter is omitted, the values of the
+variables `$usbid_empty`, `$usbid_eztool` or `$usbid_user` are used,
+respectively.
+
+After successfully connecting to the USB device, the variable `$usbid` is set
+with the current USB IDs.
+
+## VARIABLES
+
+ - `$usbid_empty`
+ - `$usbid_eztool`
+ - `$usbid_user`
+ - `$usbid`
+
+## EXAMPLES
+
+To connect to a EZ-USB device without firmware, but to work with its IO ports
+and the external I2c EEPROM, the `EZTool` mode is entered after connecting and
+downloading the EZTool firmware. This allows, e.g., to program the external
+I2C EEPROM with the USB IDs 1234:5678.
+
+    connect
+    eewrite 0x0000 0xB0 0x34 0x12 0x78 0x56 0x01 0x00
+    eeread 0x0000 16
+    disconnect
+
+The following command connects to a EZ-USB device with already loaded firmware
+for the `EZTool` mode.
+
+    connect -eztool
+
+Before a custom firmware is `download`(1ez)ed, a connection to the empty
+EZ-USB device is necessary. In this example, an external I2C EEPROM with
+custom USB IDs is assumed.
+
+    connect -empty 1234:5678
+    download ../firmware.hex 1234:abcd
+    disconnect
+
+Finally, with the custom firmware loaded, a connection in `User` mode allows
+to communicate with the device.
+
+    connect -user 1234:abcd
+    controlmsg ...
+    bulkin ...
+    bulkout ...
+
+## MODES
+
+`Disconnected`
+
+Switches to modes `Empty`, `EZTool` or `User`, depending on the option.
+
+## SEE ALSO
+
+`disconnect`(1ez)
+
+*)
+Procedure TEZTool.Connect(ObjC : Integer; ObjV: PPTcl_Object);
+Var idVendor,      idProduct       : Word;
+    idVendorEmpty, idProductEmpty  : Word;
+    idVendorEztool,idProductEztool : Word;
+
+  Procedure GetUSBIDs(VarName:String);
+  Begin
+    if ObjC = 3 then
+      Begin
+        if not SplitUsbID(ObjV^[2].AsPChar,idVendor,idProduct) then
+          raise Exception.Create('Invalid format of parameter idVendor:idProduct');
+        FTCL.SetVar(VarName,IntToHex(idVendor,4)+':'+IntToHex(idProduct,4));
+      End
+    else
+      Begin
+        if not SplitUsbID(FTCL.GetVar(VarName),idVendor,idProduct) then
+          raise Exception.Create('Invalid format of variable $'+VarName);
+      End;
+  End;
+
+Begin
+  CheckMode([mdDisconnected]);
+
+  if (ObjC < 1) or (ObjC > 3) then
+    raise Exception.Create('Invalid paramaters');
 
   if ObjC = 1 then
     Begin
@@ -838,377 +2951,941 @@ Begin
     End
   else if MatchOption(ObjV^[1].AsString,'-empty',3) then
     Begin
-      // connect -empty  [idVendor:idProduct]
-      GetUSBIDs('usbid_empty');
-      ConnectEmpty(idVendor,idProduct);
+      // connect -empty  [idVendor:idProduct]
+      GetUSBIDs('usbid_empty');
+      ConnectEmpty(idVendor,idProduct);
+      NotifyConnected(idVendor,idProduct);
+      SetMode(mdEmpty);
+    End
+  else if MatchOption(ObjV^[1].AsString,'-eztool',3) then
+    Begin
+      // connect -eztool [idVendor:idProduct]
+      GetUSBIDs('usbid_eztool');
+      ConnectEZTool($0000,$0000,idVendor,idProduct);
+      NotifyConnected(idVendor,idProduct);
+      SetMode(mdEZTool);
+    End
+  else if MatchOption(ObjV^[1].AsString,'-user',2) then
+    Begin
+      // connect -user   [idVendor:idProduct]
+      GetUSBIDs('usbid_user');
+      ConnectUser(idVendor,idProduct);
+      NotifyConnected(idVendor,idProduct);
+      SetMode(mdUser);
+    End
+  else
+    raise Exception.Create('Invalid paramaters');
+End;
+
+(*****************************************************************************)
+(***  TCL Functions: Mode: Empty  ********************************************)
+(*****************************************************************************)
+
+(*ronn
+reset(1ez) -- reset the 8051 CPU in the EZ-USB
+==============================================
+
+## SYNOPSYS
+
+`reset` [-toggle|-keep|-release]
+
+## DESCRIPTION
+
+The command `reset` asserts the Reset bit for the 8051 CPU in the EZ-USB
+microcontroller.
+
+With `-toggle`, the reset is asserted and deasserted again. If no option is
+supplied, this is the default behavior.
+
+`-keep` asserts the reset and keeps that state.
+
+The reset can be deasserted with the `-release` option.
+
+## MODES
+
+`Empty`
+
+## SEE ALSO
+
+`xread`(1ez), `xwrite`(1ez)
+
+*)
+Procedure TEZTool.Reset(ObjC : Integer; ObjV : PPTcl_Object);
+Var DoReset,DoRelease : Boolean;
+Begin
+  CheckMode([mdEmpty]);
+  // reset [-toggle|-keep|-release]
+  // default
+  DoReset   := true;
+  DoRelease := true;
+  // parse parameters
+  if ObjC = 2 then
+    Begin
+      if      MatchOption(ObjV^[1].AsString,'-toggle',2) then
+        // do nothing, default is already set
+      else if MatchOption(ObjV^[1].AsString,'-keep',2) then
+        DoRelease := False
+      else if MatchOption(ObjV^[1].AsString,'-release',2) then
+        DoReset   := False;
+    End
+  else
+    if ObjC <> 1 then
+      raise Exception.Create('Invalid paramaters');
+
+  // not in the middle of an xwrite -async
+  FEmptyDevice.Lock;
+  try
+    if DoReset then
+      if FEmptyDevice.ResetCPU(CPUCS_8051RESET) <> 1 then
+        raise Exception.Create('Error resetting EZ-USB');
+    if DoRelease then
+      if FEmptyDevice.ResetCPU(0) <> 1 then
+        raise Exception.Create('Error releasing EZ-USB from reset');
+  finally
+    FEmptyDevice.Unlock;
+  End;
+End;
+
+(*ronn
+download(1ez) -- download firmware
+==================================
+
+## SYNOPSYS
+
+`download` [<firmware>.<hex> <idVendor>`:`<idProduct>] [`-norelease`]
+
+## DESCRIPTION
+
+With `download`, firmware is downloaded to the SRAM of the EZ-USB device. As
+first step the 8051 CPU is held in reset. Then the Intel Hex file is read and
+downloaded to the SRAM. Finally the CPU is released from reset and starts to
+execute the firmware.
+
+EZ-Tools disconnects from the device and waits for 1 sec. Meanwhile the EZ-USB
+device should have booted and (re-)enumerated on the USB bus. Then a connection
+is made to the device with running firmware.
+
+If `-norelease` is used, the reset state is kept after the download and the
+connection is not closed.
+
+The parameter <firmware>.<hex> specifies the firmware file to read. The USB IDs
+to connect to the booted device are given with <idVendor>`:`<idProduct>.
+
+If no firmware file and no USB IDs are given, the EZ-Tools firmware is used.
+
+## MODES
+
+`Empty`
+
+Switches the mode to `EZTool` or `User`.
+
+## SEE ALSO
+
+`xwrite`(1ez), `reset`(1ez)
+
+*)
+Procedure TEZTool.Download(ObjC : Integer; ObjV : PPTcl_Object);
+Var Firmware           : String;
+    StartImmediately   : Boolean;
+    UserMode           : Boolean;
+    idVendor,idProduct : Word;
+Begin
+  CheckMode([mdEmpty]);
+  // Usage:
+  //   download [-norelease]                                  # use default EZTool firmware
+  //   download firmware.hex idVendor:idProduct [-norelease]
+  // implies reset, disconnect and connect -eztool/-user; -norelease keeps the device in reset
+
+  if (ObjC < 1) or (ObjC > 4) then
+    raise Exception.Create('Invalid paramaters');
+
+  // set defaults
+  Firmware := TEZToolDevice.FindFirmware(Device.FirmwareName,'eztool');
+  StartImmediately := true;
+  UserMode         := false;
+  if not SplitUsbID(FTCL.GetVar('usbid_eztool'),idVendor,idProduct) then
+    raise Exception.Create('Invalid format of variable $usbid_eztool');
+
+  // check for '-norelease'
+  if (ObjC = 2) or (ObjC = 4) then
+    Begin
+      // download (...) -norelease
+      if not MatchOption(ObjV^[ObjC-1].AsString,'-norelease',2) then
+        raise Exception.Create('Invalid parameters');
+      StartImmediately := false;
+    End;
+  // get filename and USB IDs
+  if (ObjC = 3) or (ObjC = 4) then
+    Begin
+      // download firmware.hex idVendor:idProduct [-norelease]
+      Firmware := ObjV^[1].AsString;
+      if not SplitUsbID(ObjV^[2].AsPChar,idVendor,idProduct) then
+        raise Exception.Create('Invalid format of parameter idVendor:idProduct');
+      UserMode := true;
+    End;
+
+  // download new firmware
+  WriteLn('Downloading firmware ',Firmware);
+  FMetrics.FirmwareDownload(FTCL.GetVar('usbid'));
+  FEmptyDevice.Lock;
+  try
+    FEmptyDevice.DownloadFirmware(Firmware,StartImmediately);
+  finally
+    FEmptyDevice.Unlock;
+  End;
+  if not StartImmediately then
+    Exit;   // device is held in Reset
+  // disconnect from device
+  FreeAndNil(FEmptyDevice);
+  SetMode(mdDisconnected);   // set the mode, in case something goes wrong below
+  Sleep(1000);    // wait for device to boot up, TODO: use USBFindDevices
+  // connect to new device
+  if UserMode then
+    Begin
+      ConnectUser(idVendor,idProduct);
       NotifyConnected(idVendor,idProduct);
-      SetMode(mdEmpty);
+      SetMode(mdUser);
     End
-  else if MatchOption(ObjV^[1].AsString,'-eztool',3) then
+  else
     Begin
-      // connect -eztool [idVendor:idProduct]
-      GetUSBIDs('usbid_eztool');
       ConnectEZTool($0000,$0000,idVendor,idProduct);
       NotifyConnected(idVendor,idProduct);
       SetMode(mdEZTool);
-    End
-  else if MatchOption(ObjV^[1].AsString,'-user',2) then
-    Begin
-      // connect -user   [idVendor:idProduct]
-      GetUSBIDs('usbid_user');
-      ConnectUser(idVendor,idProduct);
-      NotifyConnected(idVendor,idProduct);
-      SetMode(mdUser);
-    End
-  else
-    raise Exception.Create('Invalid paramaters');
+    End;
 End;
 
 (*****************************************************************************)
-(***  TCL Functions: Mode: Empty  ********************************************)
+(***  TCL Functions: Mode: EZTool ********************************************)
 (*****************************************************************************)
 
+Function ConvPort(Port:String):TPort;
+Begin
+  if Length(Port) <> 1 then
+    raise Exception.Create('Invalid port qualifier');
+  Case Port[1] of
+    'A','a' : Result := ptA;
+    'B','b' : Result := ptB;
+    'C','c' : Result := ptC;
+  else
+    raise Exception.Create('Invalid port qualifier');
+  End;
+End;
+
 (*ronn
-reset(1ez) -- reset the 8051 CPU in the EZ-USB
-==============================================
+iosetup(1ez) -- setup IO port special function and output enable
+================================================================
 
 ## SYNOPSYS
 
-`reset` [-toggle|-keep|-release]
+`iosetup` `A`|`B`|`C` <PORTxCFG> <OEx>
 
 ## DESCRIPTION
 
-The command `reset` asserts the Reset bit for the 8051 CPU in the EZ-USB
-microcontroller.
+The command `iosetup` sets the IO port configuration and output enable
+registers `PORTxCFG` and `OEx` of the EZ-USB device for the Ports `A`, `B` and
+`C`.
 
-With `-toggle`, the reset is asserted and deasserted again. If no option is
-supplied, this is the default behavior.
+The bitmask given by <PORTxCFG> is written to the `PORTxCFG` register, where
+_x_ is `A`, `B` or `C`. A `1` configures the corresponding pin (e.g. `B`, bit 3
+correspond to pin PB3) as a special function pin (PB3 is TXD1). Writing `0` to
+a configuration bit sets this pin as a general purpose input/output.
 
-`-keep` asserts the reset and keeps that state.
+<OEx> specifies the bitmask for the register `OEx`. Writing `1` to a bit sets
+the corresponding pin as an output by enabling the push-pull CMOS drivers. The
+value `0` disables these drivers and therefore configures the pin as an input.
+
+## EXAMPLES
+
+To configure all eight pins of port A as general purpose outputs, the command
+
+    iosetup A 0x00 0xFF
+
+is used.
+
+## MODES
+
+`EZTool`
+
+## REFERENCES
+
+<EZ-USB Technical Reference Manual> p. 4-5.
+
+## SEE ALSO
+
+`ioset`(1ez), `ioget`(1ez)
+
+*)
+Procedure TEZTool.IOSetup(ObjC : Integer; ObjV: PPTcl_Object);
+Begin
+  CheckMode([mdEZTool]);
+  // iosetup A|B|C PORTxCFG OEx
+  if ObjC <> 4 then
+    raise Exception.Create('Invalid parameters');
+  FEZToolDevice.IOSetup(ConvPort(ObjV^[1].AsPChar),ObjV^[2].AsInteger(FTCL),ObjV^[3].AsInteger(FTCL));
+End;
+
+(*ronn
+ioset(1ez) -- set IO port output
+================================
+
+## SYNOPSYS
+
+`ioset` `A`|`B`|`C` <OUTx>
+
+## DESCRIPTION
+
+Pins, which are configured as general purpose outputs can be set with `ioset`.
+The bitmask given by <OUTx> is written to the register `OUTx`, where _x_ is
+`A`, `B` or `C`. Writing `1` sets the pin to high (i.e., 3.3V, VCC) and writing
+`0` sets the pin to low (i.e., 0V, GND).
+
+Note that the pins must be configured as general purpose IOs and as outputs
+using `iosetup`(1ez).
+
+## EXAMPLES
+
+To set pin PA5 to high, all other PAx to low, use the command
+
+    ioset A 0x20
+
+## MODES
+
+`EZTool`
+
+## SEE ALSO
+
+`iosetup`(1ez), `ioget`(1ez)
+
+*)
+Procedure TEZTool.IOSet(ObjC : Integer; ObjV: PPTcl_Object);
+Begin
+  CheckMode([mdEZTool]);
+  // ioset A|B|C OUTx
+  if ObjC <> 3 then
+    raise Exception.Create('Invalid parameters');
+  FEZToolDevice.IOSet(ConvPort(ObjV^[1].AsPChar),ObjV^[2].AsInteger(FTCL));
+End;
+
+(*ronn
+ioget(1ez) -- query IO pin signal
+=================================
+
+## SYNOPSYS
+
+`ioget` `A`|`B`|`C`
+
+## DESCRIPTION
+
+To read the current input signal on the port pins, the command `ioget` returns
+the value of the `PINSx` register of the EZ-USB, where _x_ is `A`, `B` or `C`.
+
+The pin state can be read of any pin at any time, regardless of its
+configuration.
+
+## EXAMPLES
+
+To query the state of the pins of port A, use the command
+
+    ioget A
+
+To set pin PA5 to high and keeping the other pins of port A as is, the state
+of port A can be read, modified and written again.
+
+    ioset A [expr [ioget A] | 0x20]
+
+## MODES
+
+`EZTool`
+
+## SEE ALSO
+
+`iosetup`(1ez), `ioget`(1ez)
+
+*)
+Procedure TEZTool.IOGet(ObjC : Integer; ObjV: PPTcl_Object);
+Var B : Byte;
+Begin
+  CheckMode([mdEZTool]);
+  // ioget A|B|C
+  if ObjC <> 2 then
+    raise Exception.Create('Invalid parameters');
+  B := FEZToolDevice.IOGet(ConvPort(ObjV^[1].AsPChar));
+  WriteLn('Port ',ObjV^[1].AsPChar,' = $',IntToHex(B,2),' = ',IntToBin(B,8));
+  FTCL.SetObjResult(B);
+End;
+
+(*ronn
+eeread(1ez) -- get data from I2C EEPROM
+=======================================
+
+## SYNOPSYS
+
+`eeread` <addr> <len>
+
+`eeread` <addr> <len> `-data`
+
+## DESCRIPTION
+
+`eeread` reads data from the I2C EEPROM with I2C address 0x50 connected to the
+EZ-USB microcontroller. A total of <len> bytes are read starting at address
+<addr>. The maximum value of <len> is 64. <addr> is limited to 255 (i.e. an
+8 bit value).
+
+## EXAMPLES
+
+Reading the first 16 bytes of the EEPROM is performed using
+
+    eeread 0x0000 16
+
+## MODES
+
+`EZTool`
+
+## SEE ALSO
+
+`eewrite`(1ez)
+
+*)
+Procedure TEZTool.EERead(ObjC : Integer; ObjV: PPTcl_Object);
+Var Buf  : Array[0..63] of Byte;
+    Addr : Cardinal;
+    Len  : Cardinal;
+    Data : TDataBuffer;
+    AsData : Boolean;
+Begin
+  CheckMode([mdEZTool]);
+  // eeread addr len [-data]
+  AsData := DataOption(ObjC,ObjV);
+  if ObjC <> 3 then
+    raise Exception.Create('Invalid parameters');
+  Addr := ObjV^[1].AsInteger(FTCL);
+  Len  := ObjV^[2].AsInteger(FTCL);
+  if Addr >= $0100 then
+    raise Exception.Create('Maximum start address is 0x00FF');
+  if Len > 64 then
+    raise Exception.Create('Maximum length is 64 bytes');
+  if AsData then
+    Begin
+      Data := TDataBuffer.Create(Len);
+      FEZToolDevice.EERead(Addr,Data.Ptr^,Len);
+      FTCL.SetObjResult(FData.Add(Data));
+      Exit;
+    End;
+  FEZToolDevice.EERead(Addr,Buf,Len);
+  HexDump(Addr,Buf,Len);
+End;
+
+(*ronn
+eewrite(1ez) -- write data to I2C EEPROM
+========================================
+
+## SYNOPSYS
+
+`eewrite` <addr> <b0> <b1> <b2> ...
+
+`eewrite` <addr> `-data` <handle>
+
+## DESCRIPTION
+
+Use `eewrite` to write to the I2C EEPROM with I2C address 0x50. <addr>
+specifies the start address. It must be between 0x00 and 0xFF. The following
+arguments <b0>, <b1>, ... are one or more data bytes which are written to the
+EEPROM.
+
+**Important:** The EEPROM does not allow to write across page boundares. Each
+page is 16 bytes, therefore the maximum amount of data is 16 bytes. If the
+start address is not is not divisible by 16, the maximum amount of data is
+reduced by _addr mod 16_.
+
+## EXAMPLES
+
+To write the USB IDs to the EEPROM, with which the EZ-USB microcontroller
+enumerates itself (e.g. 1234:5678), use the command:
 
-The reset can be deasserted with the `-release` option.
+    eewrite 0x0000 0xB0 0x34 0x12 0x78 0x56 0x01 0x00
+    eeread 0x0000 16
 
 ## MODES
 
-`Empty`
+`EZTool`
 
 ## SEE ALSO
 
-`xread`(1ez), `xwrite`(1ez)
+`eeread`(1ez)
 
 *)
-Procedure TEZTool.Reset(ObjC : Integer; ObjV : PPTcl_Object);
-Var DoReset,DoRelease : Boolean;
+Procedure TEZTool.EEWrite(ObjC : Integer; ObjV: PPTcl_Object);
+Var Buf  : Array[0..63] of Byte;
+    Addr : Cardinal;
+    I    : Integer;
+    Data : TDataBuffer;
 Begin
-  CheckMode([mdEmpty]);
-  // reset [-toggle|-keep|-release]
-  // default
-  DoReset   := true;
-  DoRelease := true;
-  // parse parameters
-  if ObjC = 2 then
+  CheckMode([mdEZTool]);
+  // eewrite addr b0 b1 b2 ...|-data handle
+  if ObjC < 3 then
+    raise Exception.Create('Invalid parameters');
+  Addr := ObjV^[1].AsInteger(FTCL);
+  if Addr >= $0100 then
+    raise Exception.Create('Maximum start address is 0x00FF');
+  Data := DataArg(ObjC,ObjV,2);
+  if Assigned(Data) then
     Begin
-      if      MatchOption(ObjV^[1].AsString,'-toggle',2) then
-        // do nothing, default is already set
-      else if MatchOption(ObjV^[1].AsString,'-keep',2) then
-        DoRelease := False
-      else if MatchOption(ObjV^[1].AsString,'-release',2) then
-        DoReset   := False;
-    End
-  else
-    if ObjC <> 1 then
-      raise Exception.Create('Invalid paramaters');
+      if (Data.Length = 0) or ((Addr and $000F) + Data.Length > 16) then
+        raise Exception.Create('You can not cross a 16-byte-page boundary');
+      FEZToolDevice.EEWrite(Addr,Data.Ptr^,Data.Length);
+      Exit;
+    End;
+  if (Addr and $000F) + (ObjC-2) > 16 then
+    raise Exception.Create('You can not cross a 16-byte-page boundary');
+  For I := 0 to Min(ObjC-3,High(Buf)) do
+    Buf[I] := ObjV^[I+2].AsInteger(FTCL);
+  HexDump(Addr,Buf,ObjC-2);
+  FEZToolDevice.EEWrite(Addr,Buf,ObjC-2);
+End;
+
+(**
+ * Read or write XRAM of any length in mode Empty or EZTool
+ *
+ * In mode Empty the block is split into maximal A0 requests with several in
+ * flight, see TEZUSBDeviceEmpty.
+ *)
+Procedure TEZTool.MemRead(Addr,Len:Cardinal;Out Buf);
+Var Off   : Cardinal;
+    Chunk : Cardinal;
+Begin
+  if Addr + Len > XRAM_SIZE then
+    raise Exception.Create('Range exceeds the 64kB address space');
+  if FMode = mdEmpty then
+    Begin
+      FEmptyDevice.ReadBlock(Addr,Buf,Len);
+      Exit;
+    End;
+  Off := 0;
+  while Off < Len do
+    Begin
+      Chunk := Min(1024,Len-Off);
+      FEZToolDevice.XRead(Addr+Off,(PChar(@Buf)+Off)^,Chunk);
+      Off += Chunk;
+    End;
+End;
 
-  if DoReset then
-    if FEmptyDevice.ResetCPU(CPUCS_8051RESET) <> 1 then
-      raise Exception.Create('Error resetting EZ-USB');
-  if DoRelease then
-    if FEmptyDevice.ResetCPU(0) <> 1 then
-      raise Exception.Create('Error releasing EZ-USB from reset');
+Procedure TEZTool.MemWrite(Addr,Len:Cardinal;Const Buf);
+Var Off   : Cardinal;
+    Chunk : Cardinal;
+Begin
+  if Addr + Len > XRAM_SIZE then
+    raise Exception.Create('Range exceeds the 64kB address space');
+  if FMode = mdEmpty then
+    Begin
+      FEmptyDevice.WriteBlock(Addr,Buf,Len);
+      Exit;
+    End;
+  Off := 0;
+  while Off < Len do
+    Begin
+      Chunk := Min(1024,Len-Off);
+      FEZToolDevice.XWrite(Addr+Off,(PChar(@Buf)+Off)^,Chunk);
+      Off += Chunk;
+    End;
 End;
 
 (*ronn
-download(1ez) -- download firmware
-==================================
+xread(1ez) -- read from the 8051 XRAM space
+===========================================
 
 ## SYNOPSYS
 
-`download` [<firmware>.<hex> <idVendor>`:`<idProduct>] [`-norelease`]
+`xread` [`-async` [`-command` <script>]] <addr> <len>
+
+`xread` <addr> <len> `-data`
 
 ## DESCRIPTION
 
-With `download`, firmware is downloaded to the SRAM of the EZ-USB device. As
-first step the 8051 CPU is held in reset. Then the Intel Hex file is read and
-downloaded to the SRAM. Finally the CPU is released from reset and starts to
-execute the firmware.
+Use `xread` to read data from the 8051 XRAM of the EZ-USB microcontroller. The
+start address is specified by <addr> and the number of bytes to read is given
+with <len>. The address and the length can range from 0x0000 to 0xFFFF
+(i.e. 16 bit).
 
-EZ-Tools disconnects from the device and waits for 1 sec. Meanwhile the EZ-USB
-device should have booted and (re-)enumerated on the USB bus. Then a connection
-is made to the device with running firmware.
+With `-async`, the command returns a job ID immediately and the transfer is
+executed in the background, see `jobwait`(1ez).
 
-If `-norelease` is used, the reset state is kept after the download and the
-connection is not closed.
+With `-data`, the bytes are stored in a new data buffer and its handle is
+returned, see `data`(1ez). To store them in a file, see `xsave`(1ez).
 
-The parameter <firmware>.<hex> specifies the firmware file to read. The USB IDs
-to connect to the booted device are given with <idVendor>`:`<idProduct>.
+Without `-async`, <len> is not limited, with `-async` the maximum length is
+1024 bytes. In mode `Empty`, the range is read with the vendor request 0xA0 of
+the boot ROM, split into requests of up to 4096 bytes. For the RAM, several of
+them are in flight, the endpoint buffers and registers are read in address
+order with one request at a time. A background job does the same and waits
+for the accesses of other commands.
 
-If no firmware file and no USB IDs are given, the EZ-Tools firmware is used.
+## ADDRESS MAP
+
+The EZ-USB AN2131 has 8kB SRAM from 0x0000 to 0x1FFF. The range from 0x0000 to
+0x1B3F is used as combined code and data RAM. The range from 0x1B40 to
+0x1FFF holds the EZ-USB register and the USB bulk endpoint buffers. The latter
+range from 0x1B40 to 0x1F3F (16 buffer with 64 bytes each, 1024 bytes). The
+EZ-USB registers are placed from 0x1F40 to 0x1FFF (192 bytes). The range from
+0x1B40 to 0x1FFF is mirrored at 0x7B40 to 0x7FFF.
+
+An additional 2kB SRAM are available from 0x2000 to 0x27FF if the isochronous
+endpoints are disabled.
+
+In mode `EZTool` the whole memory range can be accessed. In mode `Empty`, the
+range is limited to 0x0000 to 0x1B3F (i.e., the code and data memory of the
+8051 CPU) and the endpoint buffers and registers from 0x7B40 to 0x7FFF. Of
+the CPUCS register at 0x7F92 only bit 0, the 8051 Reset signal, is writable.
+A write in mode `Empty` first writes the RAM, then the endpoint buffers and
+registers in address order, and the byte at 0x7F92 last.
+
+## EXAMPLES
+
+To read the interrupt vector table, use
+
+    xread 0x0003 112
+
+To dump the code and data RAM of an empty device to a data buffer, use
+
+    set ram [xread 0x0000 0x1B40 -data]
 
 ## MODES
 
-`Empty`
+`Empty`, `EZTool`
 
-Switches the mode to `EZTool` or `User`.
+## REFERENCES
+
+<EZ-USB Technical Reference Manual> p. 3-1ff.
 
 ## SEE ALSO
 
-`xwrite`(1ez), `reset`(1ez)
+`xwrite`(1ez), `xsave`(1ez), `data`(1ez)
 
 *)
-Procedure TEZTool.Download(ObjC : Integer; ObjV : PPTcl_Object);
-Var Firmware           : String;
-    StartImmediately   : Boolean;
-    UserMode           : Boolean;
-    idVendor,idProduct : Word;
+Procedure TEZTool.XRead(ObjC : Integer; ObjV: PPTcl_Object);
+Var Buf      : Pointer;
+    Addr     : Cardinal;
+    Len      : Cardinal;
+    Data     : TDataBuffer;
+    AsData   : Boolean;
+    A        : Integer;
+    Async    : Boolean;
+    Callback : String;
+    Job      : TJob;
 Begin
-  CheckMode([mdEmpty]);
-  // Usage:
-  //   download [-norelease]                                  # use default EZTool firmware
-  //   download firmware.hex idVendor:idProduct [-norelease]
-  // implies reset, disconnect and connect -eztool/-user; -norelease keeps the device in reset
-
-  if (ObjC < 1) or (ObjC > 4) then
-    raise Exception.Create('Invalid paramaters');
-
-  // set defaults
-  Firmware := TEZToolDevice.FindFirmware(Device.FirmwareName,'eztool');
-  StartImmediately := true;
-  UserMode         := false;
-  if not SplitUsbID(FTCL.GetVar('usbid_eztool'),idVendor,idProduct) then
-    raise Exception.Create('Invalid format of variable $usbid_eztool');
-
-  // check for '-norelease'
-  if (ObjC = 2) or (ObjC = 4) then
-    Begin
-      // download (...) -norelease
-      if not MatchOption(ObjV^[ObjC-1].AsString,'-norelease',2) then
-        raise Exception.Create('Invalid parameters');
-      StartImmediately := false;
-    End;
-  // get filename and USB IDs
-  if (ObjC = 3) or (ObjC = 4) then
+  CheckMode([mdEmpty,mdEZTool]);
+  // xread [-async [-command script]] addr len [-data]
+  AsData := DataOption(ObjC,ObjV);
+  Async := AsyncOption(ObjC,ObjV,A,Callback);
+  if ObjC <> A+2 then
+    raise Exception.Create('Invalid parameters');
+  Addr := ObjV^[A  ].AsInteger(FTCL);
+  Len  := ObjV^[A+1].AsInteger(FTCL);
+  if AsData and not Async then
     Begin
-      // download firmware.hex idVendor:idProduct [-norelease]
-      Firmware := ObjV^[1].AsString;
-      if not SplitUsbID(ObjV^[2].AsPChar,idVendor,idProduct) then
-        raise Exception.Create('Invalid format of parameter idVendor:idProduct');
-      UserMode := true;
+      // read the whole address space directly into the buffer
+      if Addr + Len > XRAM_SIZE then
+        raise Exception.Create('Range exceeds the 64kB address space');
+      Data := TDataBuffer.Create(Len);
+      MemRead(Addr,Len,Data.Ptr^);
+      FTCL.SetObjResult(FData.Add(Data));
+      Exit;
     End;
-
-  // download new firmware
-  WriteLn('Downloading firmware ',Firmware);
-  FEmptyDevice.DownloadFirmware(Firmware,StartImmediately);
-  if not StartImmediately then
-    Exit;   // device is held in Reset
-  // disconnect from device
-  FreeAndNil(FEmptyDevice);
-  SetMode(mdDisconnected);   // set the mode, in case something goes wrong below
-  Sleep(1000);    // wait for device to boot up, TODO: use USBFindDevices
-  // connect to new device
-  if UserMode then
-    Begin
-      ConnectUser(idVendor,idProduct);
-      NotifyConnected(idVendor,idProduct);
-      SetMode(mdUser);
-    End
-  else
+  if Async then
     Begin
-      ConnectEZTool($0000,$0000,idVendor,idProduct);
-      NotifyConnected(idVendor,idProduct);
-      SetMode(mdEZTool);
+      if AsData then
+        raise Exception.Create('-data can not be combined with -async');
+      if Len > 1024 then
+        raise Exception.Create('Maximum length is 1024');
+      Job := TJob.Create('xread',@XReadWork);
+      Job.Addr     := Addr;
+      Job.Len      := Len;
+      Job.Callback := Callback;
+      StartJob(Job);
+      Exit;
     End;
-End;
-
-(*****************************************************************************)
-(***  TCL Functions: Mode: EZTool ********************************************)
-(*****************************************************************************)
-
-Function ConvPort(Port:String):TPort;
-Begin
-  if Length(Port) <> 1 then
-    raise Exception.Create('Invalid port qualifier');
-  Case Port[1] of
-    'A','a' : Result := ptA;
-    'B','b' : Result := ptB;
-    'C','c' : Result := ptC;
-  else
-    raise Exception.Create('Invalid port qualifier');
+  GetMem(Buf,Len);
+  try
+    MemRead(Addr,Len,Buf^);
+    HexDump(Addr,Buf^,Len);
+  finally
+    FreeMem(Buf);
   End;
 End;
 
 (*ronn
-iosetup(1ez) -- setup IO port special function and output enable
-================================================================
+xwrite(1ez) -- write to the 8051 XRAM space
+===========================================
 
 ## SYNOPSYS
 
-`iosetup` `A`|`B`|`C` <PORTxCFG> <OEx>
+`xwrite` [`-async` [`-command` <script>]] <addr> <b0> <b1> <b2> ...
+
+`xwrite` <addr> `-data` <handle>
 
 ## DESCRIPTION
 
-The command `iosetup` sets the IO port configuration and output enable
-registers `PORTxCFG` and `OEx` of the EZ-USB device for the Ports `A`, `B` and
-`C`.
+Use `xwrite` to write to the 8051 XRAM space. <addr> specifies the start
+address in a range from 0x0000 0xFFFF. The following arguments <b0>, <b1>, ...
+are one or more data bytes which are written to the XRAM.
 
-The bitmask given by <PORTxCFG> is written to the `PORTxCFG` register, where
-_x_ is `A`, `B` or `C`. A `1` configures the corresponding pin (e.g. `B`, bit 3
-correspond to pin PB3) as a special function pin (PB3 is TXD1). Writing `0` to
-a configuration bit sets this pin as a general purpose input/output.
+For a description of the address map and limitations in mode `Empty`, see
+`xread`(1ez). In mode `Empty`, the bytes (also with `-data` and `-async`)
+are written with the same large A0 requests as `xread`(1ez) reads: the RAM
+with several requests in flight, then the endpoint buffers and registers in
+address order, and CPUCS last.
 
-<OEx> specifies the bitmask for the register `OEx`. Writing `1` to a bit sets
-the corresponding pin as an output by enabling the push-pull CMOS drivers. The
-value `0` disables these drivers and therefore configures the pin as an input.
+In mode `EZTool`, data with runs of equal bytes (e.g. 0x00 or 0xFF padding)
+is sent run-length encoded if the firmware supports it and this saves USB
+packets.
 
-## EXAMPLES
+With `-async`, the command returns a job ID immediately and the transfer is
+executed in the background, see `jobwait`(1ez).
 
-To configure all eight pins of port A as general purpose outputs, the command
+## EXAMPLES
 
-    iosetup A 0x00 0xFF
+To change the value of an XDATA variable, which is placed at 0x09A3 by the
+linker, use
 
-is used.
+    xwrite 0x09A3 0xC3
 
 ## MODES
 
-`EZTool`
+`Empty`, `EZTool`
 
 ## REFERENCES
 
-<EZ-USB Technical Reference Manual> p. 4-5.
+<EZ-USB Technical Reference Manual> p. 3-1ff.
 
 ## SEE ALSO
 
-`ioset`(1ez), `ioget`(1ez)
+`xread`(1ez), `xload`(1ez)
 
 *)
-Procedure TEZTool.IOSetup(ObjC : Integer; ObjV: PPTcl_Object);
+Procedure TEZTool.XWrite(ObjC : Integer; ObjV: PPTcl_Object);
+Var Buf      : PByteArray;
+    Addr     : Cardinal;
+    I        : Cardinal;
+    Data     : TDataBuffer;
+    A        : Integer;
+    Async    : Boolean;
+    Callback : String;
+    Job      : TJob;
 Begin
-  CheckMode([mdEZTool]);
-  // iosetup A|B|C PORTxCFG OEx
-  if ObjC <> 4 then
+  CheckMode([mdEmpty,mdEZTool]);
+  // xwrite [-async [-command script]] addr b0 b1 b2 ...|-data handle
+  Async := AsyncOption(ObjC,ObjV,A,Callback);
+  if ObjC < A+2 then
     raise Exception.Create('Invalid parameters');
-  FEZToolDevice.IOSetup(ConvPort(ObjV^[1].AsPChar),ObjV^[2].AsInteger(FTCL),ObjV^[3].AsInteger(FTCL));
+  Addr := ObjV^[A].AsInteger(FTCL);
+  Data := DataArg(ObjC,ObjV,A+1);
+  if Assigned(Data) and not Async then
+    Begin
+      MemWrite(Addr,Data.Length,Data.Ptr^);
+      Exit;
+    End;
+  if Async then
+    Begin
+      if Assigned(Data) then
+        raise Exception.Create('-data can not be combined with -async');
+      Job := TJob.Create('xwrite',@XWriteWork);
+      Job.Addr := Addr;
+      Job.Len  := ObjC-A-1;
+      SetLength(Job.Data,Job.Len);
+      For I := 0 to Job.Len-1 do
+        Job.Data[I+1] := Chr(ObjV^[A+1+I].AsInteger(FTCL));
+      Job.Callback := Callback;
+      StartJob(Job);
+      Exit;
+    End;
+  GetMem(Buf,ObjC-2);
+  For I := 0 to ObjC-3 do
+    Buf^[I] := ObjV^[I+2].AsInteger(FTCL);
+  HexDump(Addr,Buf^,ObjC-2);
+  MemWrite(Addr,ObjC-2,Buf^);
+  FreeMem(Buf);
 End;
 
 (*ronn
-ioset(1ez) -- set IO port output
-================================
+xload(1ez) -- write a file to the 8051 XRAM space
+=================================================
 
 ## SYNOPSYS
 
-`ioset` `A`|`B`|`C` <OUTx>
+`xload` <file>`.ihx`|<file>`.hex`
+
+`xload` <file> <addr>
 
 ## DESCRIPTION
 
-Pins, which are configured as general purpose outputs can be set with `ioset`.
-The bitmask given by <OUTx> is written to the register `OUTx`, where _x_ is
-`A`, `B` or `C`. Writing `1` sets the pin to high (i.e., 3.3V, VCC) and writing
-`0` sets the pin to low (i.e., 0V, GND).
+`xload` writes the contents of a file to the XRAM. An Intel Hex file (with
+the extension _.ihx_ or _.hex_) is written to the addresses of its records.
+Any other file is written as binary data starting at <addr>.
+
+Unlike `download`(1ez), the 8051 is neither reset nor released and the
+connection stays in the same mode. Only a record for the CPUCS register at
+0x7F92 changes the reset state. This byte is written after all others.
+
+In mode `Empty`, the data is written with the vendor request 0xA0 of the boot
+ROM, split into requests of up to 4096 bytes. The RAM is written with several
+of them in flight, the endpoint buffers and registers in address order with
+one at a time. For a description of the address map and limitations in mode `Empty`, see
+`xread`(1ez).
 
-Note that the pins must be configured as general purpose IOs and as outputs
-using `iosetup`(1ez).
+The number of bytes written is returned.
 
 ## EXAMPLES
 
-To set pin PA5 to high, all other PAx to low, use the command
+To restore a RAM dump taken with `xsave`(1ez), use
 
-    ioset A 0x20
+    xload ram.bin 0x0000
 
 ## MODES
 
-`EZTool`
+`Empty`, `EZTool`
 
 ## SEE ALSO
 
-`iosetup`(1ez), `ioget`(1ez)
+`xsave`(1ez), `xwrite`(1ez), `download`(1ez)
 
 *)
-Procedure TEZTool.IOSet(ObjC : Integer; ObjV: PPTcl_Object);
+Procedure TEZTool.XLoad(ObjC : Integer; ObjV: PPTcl_Object);
+Var Filename : String;
+    Ext      : String;
+    St       : AnsiString;
+    Mem      : Array of Byte;
+    Used     : Array of Boolean;
+    CPUCS    : Boolean;
+    Start    : Cardinal;
+    I        : Cardinal;
+    Total    : Integer;
 Begin
-  CheckMode([mdEZTool]);
-  // ioset A|B|C OUTx
-  if ObjC <> 3 then
+  CheckMode([mdEmpty,mdEZTool]);
+  // xload file.ihx|file addr
+  if (ObjC < 2) or (ObjC > 3) then
     raise Exception.Create('Invalid parameters');
-  FEZToolDevice.IOSet(ConvPort(ObjV^[1].AsPChar),ObjV^[2].AsInteger(FTCL));
+  Filename := ObjV^[1].AsString;
+  Ext := LowerCase(ExtractFileExt(Filename));
+  if (Ext <> '.ihx') and (Ext <> '.hex') then
+    Begin
+      if ObjC <> 3 then
+        raise Exception.Create('Invalid parameters');
+      St := LoadFile(Filename);
+      if St > '' then
+        MemWrite(ObjV^[2].AsInteger(FTCL),Length(St),St[1]);
+      FTCL.SetObjResult(Length(St));
+      Exit;
+    End;
+  if ObjC <> 2 then
+    raise Exception.Create('Invalid parameters');
+  SetLength(Mem, XRAM_SIZE);
+  SetLength(Used,XRAM_SIZE);
+  ParseIntelHex(Filename,'XRAM',Mem,Used);
+  // release the 8051 from reset only after all other bytes are written
+  CPUCS := Used[CPUCS_ADDR];
+  Used[CPUCS_ADDR] := false;
+  Total := 0;
+  I := 0;
+  while I < XRAM_SIZE do
+    Begin
+      if not Used[I] then
+        Begin
+          Inc(I);
+          Continue;
+        End;
+      Start := I;
+      while (I < XRAM_SIZE) and Used[I] do
+        Inc(I);
+      MemWrite(Start,I-Start,Mem[Start]);
+      Total += I-Start;
+    End;
+  if CPUCS then
+    Begin
+      MemWrite(CPUCS_ADDR,1,Mem[CPUCS_ADDR]);
+      Inc(Total);
+    End;
+  FTCL.SetObjResult(Total);
 End;
 
 (*ronn
-ioget(1ez) -- query IO pin signal
-=================================
+xsave(1ez) -- save the 8051 XRAM space to a file
+================================================
 
 ## SYNOPSYS
 
-`ioget` `A`|`B`|`C`
+`xsave` <addr> <len> <file>
 
 ## DESCRIPTION
 
-To read the current input signal on the port pins, the command `ioget` returns
-the value of the `PINSx` register of the EZ-USB, where _x_ is `A`, `B` or `C`.
+`xsave` reads <len> bytes from the XRAM starting at <addr> and writes them
+as binary data to <file>. An existing file is overwritten.
 
-The pin state can be read of any pin at any time, regardless of its
-configuration.
+In mode `Empty`, the data is read with the vendor request 0xA0 of the boot
+ROM, split into requests of up to 4096 bytes. The RAM is read with several of
+them in flight, the endpoint buffers and registers in address order with one
+at a time. For a description of the address map and limitations in mode `Empty`, see
+`xread`(1ez).
 
 ## EXAMPLES
 
-To query the state of the pins of port A, use the command
-
-    ioget A
-
-To set pin PA5 to high and keeping the other pins of port A as is, the state
-of port A can be read, modified and written again.
+To save the code and data RAM and the registers of an empty device, use
 
-    ioset A [expr [ioget A] | 0x20]
+    xsave 0x0000 0x1B40 ram.bin
+    xsave 0x7B40 0x04C0 regs.bin
 
 ## MODES
 
-`EZTool`
+`Empty`, `EZTool`
 
 ## SEE ALSO
 
-`iosetup`(1ez), `ioget`(1ez)
+`xload`(1ez), `xread`(1ez)
 
 *)
-Procedure TEZTool.IOGet(ObjC : Integer; ObjV: PPTcl_Object);
-Var B : Byte;
+Procedure TEZTool.XSave(ObjC : Integer; ObjV: PPTcl_Object);
+Var Addr : Cardinal;
+    Len  : Cardinal;
+    St   : AnsiString;
 Begin
-  CheckMode([mdEZTool]);
-  // ioget A|B|C
-  if ObjC <> 2 then
+  CheckMode([mdEmpty,mdEZTool]);
+  // xsave addr len file
+  if ObjC <> 4 then
     raise Exception.Create('Invalid parameters');
-  B := FEZToolDevice.IOGet(ConvPort(ObjV^[1].AsPChar));
-  WriteLn('Port ',ObjV^[1].AsPChar,' = $',IntToHex(B,2),' = ',IntToBin(B,8));
-  FTCL.SetObjResult(B);
+  Addr := ObjV^[1].AsInteger(FTCL);
+  Len  := ObjV^[2].AsInteger(FTCL);
+  if Addr + Len > XRAM_SIZE then
+    raise Exception.Create('Range exceeds the 64kB address space');
+  SetLength(St,Len);
+  if Len > 0 then
+    MemRead(Addr,Len,St[1]);
+  With TFileStream.Create(ObjV^[3].AsString,fmCreate) do
+    try
+      if Len > 0 then
+        WriteBuffer(St[1],Len);
+    finally
+      Free;
+    End;
 End;
 
 (*ronn
-eeread(1ez) -- get data from I2C EEPROM
+i2cread(1ez) -- get data from I2C EEPROM
 =======================================
 
 ## SYNOPSYS
 
-`eeread` <addr> <len>
+`i2cread` <addr> <len>
+
+`i2cread` <addr> <len> `-data`
 
 ## DESCRIPTION
 
-`eeread` reads data from the I2C EEPROM with I2C address 0x50 connected to the
-EZ-USB microcontroller. A total of <len> bytes are read starting at address
-<addr>. The maximum value of <len> is 64. <addr> is limited to 255 (i.e. an
-8 bit value).
+`i2cread` issues a read transfer at the I2C bus. The 7-bit address of the I2C
+slave is specifyed with <addr>. This value will be left-shifted by 1 and the
+LSB is set to 1, denoting an I2C read transfer. A total of <len> bytes are
+read. The maximum value of <len> is 64. <addr> is limited to 0x7F.
 
 ## EXAMPLES
 
-Reading the first 16 bytes of the EEPROM is performed using
-
-    eeread 0x0000 16
+For an example see `i2cwrite`(1ez).
 
 ## MODES
 
@@ -1216,55 +3893,71 @@ Reading the first 16 bytes of the EEPROM is performed using
 
 ## SEE ALSO
 
-`eewrite`(1ez)
+`i2cwrite`(1ez)
 
 *)
-Procedure TEZTool.EERead(ObjC : Integer; ObjV: PPTcl_Object);
+Procedure TEZTool.I2CRead(ObjC : Integer; ObjV: PPTcl_Object);
 Var Buf  : Array[0..63] of Byte;
     Addr : Cardinal;
     Len  : Cardinal;
+    Data : TDataBuffer;
+    AsData : Boolean;
 Begin
   CheckMode([mdEZTool]);
-  // eeread addr len
+  // i2cread addr len [-data]
+  AsData := DataOption(ObjC,ObjV);
   if ObjC <> 3 then
     raise Exception.Create('Invalid parameters');
   Addr := ObjV^[1].AsInteger(FTCL);
   Len  := ObjV^[2].AsInteger(FTCL);
-  if Addr >= $0100 then
-    raise Exception.Create('Maximum start address is 0x00FF');
+  if Addr >= $007F then
+    raise Exception.Create('Maximum I2C address is 0x7F');
   if Len > 64 then
     raise Exception.Create('Maximum length is 64 bytes');
-  FEZToolDevice.EERead(Addr,Buf,Len);
-  HexDump(Addr,Buf,Len);
+  if AsData then
+    Begin
+      Data := TDataBuffer.Create(Len);
+      FEZToolDevice.I2CRead(Addr,Data.Ptr^,Len);
+      FTCL.SetObjResult(FData.Add(Data));
+      Exit;
+    End;
+  FEZToolDevice.I2CRead(Addr,Buf,Len);
+  HexDump($0000,Buf,Len);
 End;
 
 (*ronn
-eewrite(1ez) -- write data to I2C EEPROM
+i2cwrite(1ez) -- write data to I2C EEPROM
 ========================================
 
 ## SYNOPSYS
 
-`eewrite` <addr> <b0> <b1> <b2> ...
+`i2cwrite` <addr> <b0> <b1> <b2> ...
 
-## DESCRIPTION
+`i2cwrite` <addr> `-data` <handle>
 
-Use `eewrite` to write to the I2C EEPROM with I2C address 0x50. <addr>
-specifies the start address. It must be between 0x00 and 0xFF. The following
-arguments <b0>, <b1>, ... are one or more data bytes which are written to the
-EEPROM.
+## DESCRIPTION
 
-**Important:** The EEPROM does not allow to write across page boundares. Each
-page is 16 bytes, therefore the maximum amount of data is 16 bytes. If the
-start address is not is not divisible by 16, the maximum amount of data is
-reduced by _addr mod 16_.
+Use `i2cwrite` to perform a generic write transfer at the I2C bus. <addr>
+specifies the 7-bit slave address. It must be between 0x00 and 0x7F. This value
+will be left-shifted by 1 and the LSB is set to 0, denoting an I2C write
+transfer. The following arguments <b0>, <b1>, ... are one or more data bytes
+which are written on the I2C bus
 
 ## EXAMPLES
 
-To write the USB IDs to the EEPROM, with which the EZ-USB microcontroller
-enumerates itself (e.g. 1234:5678), use the command:
+To configure an HMC5883L (Three-Axis Digital Compass IC, 7-bit address 0x1E,
+8-bit read address 0x3D, 8-bit write address 0x3C) for continuous measurement
+mode (mode register at internal address 0x02 set to 0x00), use the command:
 
-    eewrite 0x0000 0xB0 0x34 0x12 0x78 0x56 0x01 0x00
-    eeread 0x0000 16
+    i2cwrite 0x1E 0x02 0x00
+
+To read the current measurement (data registers at internal addresses 0x03 to
+0x08), use the commands
+
+    # set address pointer
+    i2cwrite 0x1E 0x03
+    # read 6 bytes
+    i2cread  0x1E 6
 
 ## MODES
 
@@ -1272,178 +3965,486 @@ enumerates itself (e.g. 1234:5678), use the command:
 
 ## SEE ALSO
 
-`eeread`(1ez)
+`i2cread`(1ez)
 
 *)
-Procedure TEZTool.EEWrite(ObjC : Integer; ObjV: PPTcl_Object);
+Procedure TEZTool.I2CWrite(ObjC : Integer; ObjV: PPTcl_Object);
 Var Buf  : Array[0..63] of Byte;
     Addr : Cardinal;
     I    : Integer;
+    Data : TDataBuffer;
 Begin
   CheckMode([mdEZTool]);
-  // eewrite addr b0 b1 b2 ...
+  // i2cwrite addr b0 b1 b2 ...|-data handle
   if ObjC < 3 then
     raise Exception.Create('Invalid parameters');
   Addr := ObjV^[1].AsInteger(FTCL);
-  if Addr >= $0100 then
-    raise Exception.Create('Maximum start address is 0x00FF');
-  if (Addr and $000F) + (ObjC-2) > 16 then
-    raise Exception.Create('You can not cross a 16-byte-page boundary');
+  if Addr >= $007F then
+    raise Exception.Create('Maximum I2C address is 0x7F');
+  Data := DataArg(ObjC,ObjV,2);
+  if Assigned(Data) then
+    Begin
+      if (Data.Length = 0) or (Data.Length > 64) then
+        raise Exception.Create('Maximum length is 64 bytes');
+      FEZToolDevice.I2CWrite(Addr,Data.Ptr^,Data.Length);
+      Exit;
+    End;
+  if ObjC-2 > 64 then
+    raise Exception.Create('Maximum length is 64 bytes');
   For I := 0 to Min(ObjC-3,High(Buf)) do
     Buf[I] := ObjV^[I+2].AsInteger(FTCL);
-  HexDump(Addr,Buf,ObjC-2);
-  FEZToolDevice.EEWrite(Addr,Buf,ObjC-2);
+  HexDump($0000,Buf,ObjC-2);
+  FEZToolDevice.I2CWrite(Addr,Buf,ObjC-2);
 End;
 
 (*ronn
-xread(1ez) -- read from the 8051 XRAM space
-===========================================
+i2clog(1ez) -- periodically read I2C registers and log the values
+=================================================================
 
 ## SYNOPSYS
 
-`xread` <addr> <len>
+`i2clog` `add` <addr> <reg>|`-noreg` <len> <period>
+
+`i2clog` `clear`|`list`|`status`
+
+`i2clog` `run` <filename> <duration> [`-csv`|`-bin`]
 
 ## DESCRIPTION
 
-Use `xread` to read data from the 8051 XRAM of the EZ-USB microcontroller. The
-start address is specified by <addr> and the number of bytes to read is given
-with <len>. The address and the length can range from 0x0000 to 0xFFFF
-(i.e. 16 bit).
+`i2clog` sets up the firmware to autonomously read I2C registers with a fixed
+period. The firmware executes the reads without any involvement of the host
+and streams the timestamped values to the host via the bulk endpoint 4 IN.
+This allows much higher sampling rates than `i2cread`(1ez) in a Tcl loop.
 
-## ADDRESS MAP
+`i2clog add` appends an entry to the polling table. <addr> is the 7-bit I2C
+slave address. Before each read, the register address <reg> is written to the
+slave. Use `-noreg` for slaves without register address. Then <len> bytes (at
+most 16) are read. The read is repeated every <period> milliseconds. Up to 8
+entries are supported.
 
-The EZ-USB AN2131 has 8kB SRAM from 0x0000 to 0x1FFF. The range from 0x0000 to
-0x1B3F is used as combined code and data RAM. The range from 0x1B40 to
-0x1FFF holds the EZ-USB register and the USB bulk endpoint buffers. The latter
-range from 0x1B40 to 0x1F3F (16 buffer with 64 bytes each, 1024 bytes). The
-EZ-USB registers are placed from 0x1F40 to 0x1FFF (192 bytes). The range from
-0x1B40 to 0x1FFF is mirrored at 0x7B40 to 0x7FFF.
+`i2clog clear` stops polling and empties the polling table. `i2clog list`
+prints the polling table. `i2clog status` prints whether polling is active and
+how many samples were dropped because the host didn't fetch the data in time.
 
-An additional 2kB SRAM are available from 0x2000 to 0x27FF if the isochronous
-endpoints are disabled.
+`i2clog run` starts polling and writes all records received within <duration>
+milliseconds to the file <filename>. With `-csv` (the default), every sample
+is written as a line with the timestamp in milliseconds, the entry index, the
+I2C address, the register address, the I2C status (0 = OK) and the data bytes
+in hex. With `-bin`, the USB packets are written as received, i.e. as a
+sequence of 4 byte headers (index, status, 16 bit timestamp, little endian)
+followed by the data bytes.
 
-In mode `EZTool` the whole memory range can be accessed. In mode `Empty`, the
-range is limited to 0x0000 to 0x1B40 (i.e., the code and data memory of the
-8051 CPU) and 0x7F92 (i.e., the CPUCS register, but only bit 0, the 8051 Reset
-signal, is writable).
+The timestamps are based on the USB Start Of Frame packets, i.e. they have a
+resolution of 1 ms.
 
 ## EXAMPLES
 
-To read the interrupt vector table, use
+Log the measurement registers of an HMC5883L (see `i2cwrite`(1ez)) every
+10 ms and the register 0x00 of a temperature sensor every 250 ms for one
+minute.
 
-    xread 0x0003 112
+    i2clog clear
+    i2clog add 0x1E 0x03 6 10
+    i2clog add 0x48 0x00 2 250
+    i2clog run sensors.csv 60000
 
 ## MODES
 
-`Empty`, `EZTool`
-
-## REFERENCES
-
-<EZ-USB Technical Reference Manual> p. 3-1ff.
+`EZTool`
 
 ## SEE ALSO
 
-`xwrite`(1ez)
+`i2cread`(1ez), `i2cwrite`(1ez)
 
 *)
-Procedure TEZTool.XRead(ObjC : Integer; ObjV: PPTcl_Object);
-Var Buf  : Pointer;
-    Addr : Cardinal;
-    Len  : Cardinal;
+Procedure TEZTool.I2CLog(ObjC : Integer; ObjV: PPTcl_Object);
+Var Cmd      : String;
+    Entry    : TPollEntry;
+    Status   : TPollStatus;
+    I        : Integer;
+
+  Procedure Run(AFilename:String;ADuration:Cardinal;ABinary:Boolean);
+  Var Buf      : Array[0..63] of Byte;
+      R,Off    : Integer;
+      Rec      : PPollRecord;
+      Len      : Integer;
+      CSV      : Text;
+      Bin      : TFileStream;
+      Stop     : UInt64;
+      Stopped  : Boolean;
+      Last     : Word;
+      Base     : Cardinal;
+      First    : Boolean;
+      Samples  : Cardinal;
+      Errors   : Cardinal;
+      J        : Integer;
+      Line     : String;
+      Timeout  : Integer;
+      CSVBuf   : Array of Char;
+      Stream   : PStreamCounters;
+      RT       : TRealTimeSaved;
+  Begin
+    if Length(FPollTable) = 0 then
+      raise Exception.Create('The polling table is empty, use ''i2clog add'' first');
+    Bin := Nil;
+    if ABinary then
+      Bin := TFileStream.Create(AFilename,fmCreate)
+    else
+      Begin
+        Assign(CSV,AFilename);
+        // allocated before the stream starts, also saves write() calls
+        SetLength(CSVBuf,65536);
+        Prefault(@CSVBuf[0],Length(CSVBuf));
+        SetTextBuf(CSV,CSVBuf[0],Length(CSVBuf));
+        Rewrite(CSV);
+        WriteLn(CSV,'time_ms,id,addr,reg,status,data');
+      End;
+    Samples := 0;
+    Errors  := 0;
+    First   := true;
+    Base    := 0;
+    Last    := 0;
+    Stopped := true;
+    Stream  := StreamCounters('i2clog');
+    RT      := RealTimeEnter;
+    try
+      FEZToolDevice.PollControl(POLL_CTRL_START);
+      StreamStart(Stream);
+      Stopped := false;
+      Stop    := GetUSec + UInt64(ADuration) * 1000;
+      Timeout := 100;
+      repeat
+        if not Stopped and (GetUSec >= Stop) then
+          Begin
+            FEZToolDevice.PollControl(POLL_CTRL_STOP);
+            Stopped := true;
+            // fetch the remaining packets until the EP is empty
+            Timeout := 20;
+          End;
+        R := FEZToolDevice.PollRecv(Buf,SizeOf(Buf),Timeout);
+        if R = 0 then
+          Begin
+            if Stopped then break;
+            continue;
+          End;
+        StreamPacket(Stream,R);
+        if ABinary then
+          Bin.WriteBuffer(Buf,R);
+        Off := 0;
+        While Off + SizeOf(TPollRecord) <= R do
+          Begin
+            Rec := PPollRecord(@Buf[Off]);
+            if Rec^.Id >= Length(FPollTable) then
+              break;   // garbage, skip the rest of this packet
+            Len := FPollTable[Rec^.Id].Len;
+            // extend the 16 bit timestamp
+            if First then
+              First := false
+            else if LEtoN(Rec^.Time) < Last then
+              Base += $10000;
+            Last := LEtoN(Rec^.Time);
+            Inc(Samples);
+            if Rec^.Status <> 0 then
+              Inc(Errors);
+            if not ABinary then
+              Begin
+                Line := IntToStr(Base + Last) + ',' + IntToStr(Rec^.Id) + ','
+                      + '0x' + IntToHex(FPollTable[Rec^.Id].Addr,2) + ','
+                      + Select(FPollTable[Rec^.Id].Flags and POLL_NO_REG <> 0,'','0x' + IntToHex(FPollTable[Rec^.Id].Reg,2)) + ','
+                      + IntToStr(Rec^.Status) + ',';
+                For J := 0 to Len-1 do
+                  Line += IntToHex(Buf[Off+SizeOf(TPollRecord)+J],2);
+                WriteLn(CSV,Line);
+              End;
+            Off += SizeOf(TPollRecord) + Len;
+          End;
+      until false;
+      Status := FEZToolDevice.PollStatus;
+      StreamOverrun(Stream,LEtoN(Status.Overruns));
+      WriteLn('Logged ',Samples,' samples (',Errors,' I2C errors, ',LEtoN(Status.Overruns),' dropped) to ',AFilename);
+    finally
+      RealTimeLeave(RT);
+      if not Stopped then
+        FEZToolDevice.PollControl(POLL_CTRL_STOP);
+      if ABinary then
+        Bin.Free
+      else
+        Close(CSV);
+    End;
+  End;
+
 Begin
-  CheckMode([mdEmpty,mdEZTool]);
-  // xread addr len
-  if ObjC <> 3 then
+  CheckMode([mdEZTool]);
+  // i2clog add addr reg|-noreg len period
+  // i2clog clear|list|status
+  // i2clog run filename duration [-csv|-bin]
+  if ObjC < 2 then
     raise Exception.Create('Invalid parameters');
-  Addr := ObjV^[1].AsInteger(FTCL);
-  Len  := ObjV^[2].AsInteger(FTCL);
-  if Len > 1024 then
-    raise Exception.Create('Maximum length is 1024');
-  GetMem(Buf,Len);
-  if FMode = mdEmpty then
-    FEmptyDevice.ReadMem(Addr,Buf^,Len)
+  Cmd := ObjV^[1].AsString;
+  if Cmd = 'add' then
+    Begin
+      if ObjC <> 6 then
+        raise Exception.Create('Invalid parameters');
+      if Length(FPollTable) >= FEZToolDevice.Caps.PollEntries then
+        raise Exception.CreateFmt('Maximum number of entries is %d',[FEZToolDevice.Caps.PollEntries]);
+      FillChar(Entry,SizeOf(Entry),0);
+      Entry.Addr := ObjV^[2].AsInteger(FTCL);
+      if Entry.Addr > $7F then
+        raise Exception.Create('Maximum I2C address is 0x7F');
+      if ObjV^[3].AsString = '-noreg' then
+        Entry.Flags := POLL_NO_REG
+      else
+        Entry.Reg := ObjV^[3].AsInteger(FTCL);
+      I := ObjV^[4].AsInteger(FTCL);
+      if (I < 1) or (I > FEZToolDevice.Caps.PollLength) then
+        raise Exception.CreateFmt('Length must be between 1 and %d bytes',[FEZToolDevice.Caps.PollLength]);
+      Entry.Len := I;
+      I := ObjV^[5].AsInteger(FTCL);
+      if (I < 1) or (I > $7FFF) then
+        raise Exception.Create('Period must be between 1 and 32767 ms');
+      Entry.Period := NtoLE(Word(I));
+      FEZToolDevice.PollAdd(Entry);
+      // the firmware silently ignores invalid entries, so check the result
+      Status := FEZToolDevice.PollStatus;
+      if Status.Count <> Length(FPollTable)+1 then
+        raise Exception.Create('The firmware rejected the entry');
+      SetLength(FPollTable,Length(FPollTable)+1);
+      FPollTable[High(FPollTable)] := Entry;
+      FTCL.SetObjResult(High(FPollTable));
+    End
+  else if Cmd = 'clear' then
+    Begin
+      FEZToolDevice.PollControl(POLL_CTRL_CLEAR);
+      SetLength(FPollTable,0);
+    End
+  else if Cmd = 'list' then
+    Begin
+      For I := 0 to High(FPollTable) do
+        With FPollTable[I] do
+          WriteLn(I:2,': addr 0x',IntToHex(Addr,2),
+                  ' reg ',Select(Flags and POLL_NO_REG <> 0,'-   ','0x'+IntToHex(Reg,2)),
+                  ' len ',Len:2,' period ',LEtoN(Period),' ms');
+    End
+  else if Cmd = 'status' then
+    Begin
+      Status := FEZToolDevice.PollStatus;
+      WriteLn('Polling ',Select(Status.Running <> 0,'active','stopped'),', ',
+              Status.Count,' entries, ',LEtoN(Status.Overruns),' samples dropped');
+    End
+  else if Cmd = 'run' then
+    Begin
+      if (ObjC < 4) or (ObjC > 5) then
+        raise Exception.Create('Invalid parameters');
+      if (ObjC = 5) and (ObjV^[4].AsString <> '-csv') and (ObjV^[4].AsString <> '-bin') then
+        raise Exception.Create('Invalid parameters');
+      Run(ObjV^[2].AsString,ObjV^[3].AsInteger(FTCL),(ObjC = 5) and (ObjV^[4].AsString = '-bin'));
+    End
   else
-    FEZToolDevice.XRead(Addr,Buf^,Len);
-  HexDump(Addr,Buf^,Len);
-  FreeMem(Buf);
+    raise Exception.Create('Invalid parameters');
 End;
 
 (*ronn
-xwrite(1ez) -- write to the 8051 XRAM space
-===========================================
+eeboot(1ez) -- boot the EZTool firmware from the I2C EEPROM
+===========================================================
 
 ## SYNOPSYS
 
-`xwrite` <addr> <b0> <b1> <b2> ...
+`eeboot` `build` <firmware.ihx> <image.bin> [<idVendor>:<idProduct> [<bcdDevice>]]
 
-## DESCRIPTION
+`eeboot` `program`|`verify` [<image.bin>|<firmware.ihx>]
 
-Use `xwrite` to write to the 8051 XRAM space. <addr> specifies the start
-address in a range from 0x0000 0xFFFF. The following arguments <b0>, <b1>, ...
-are one or more data bytes which are written to the XRAM.
+`eeboot` `erase`
 
-For a description of the address map and limitations in mode `Empty`, see
-`xread`(1ez).
+## DESCRIPTION
 
-## EXAMPLES
+The EZ-USB microcontroller can load its firmware from an I2C EEPROM with
+16 bit word addresses (e.g. 24LC64) at the I2C address 0x51 directly after
+power-on ("B2 load"). It then enumerates with the USB IDs stored in the EEPROM
+and starts the firmware without any host involvement. `connect`(1ez) detects
+the running EZTool firmware and skips the firmware download.
 
-To change the value of an XDATA variable, which is placed at 0x09A3 by the
-linker, use
+`eeboot build` converts the Intel Hex file <firmware.ihx> to a B2 boot EEPROM
+image and writes it to <image.bin>. The image contains the USB IDs
+<idVendor>:<idProduct> (default: `$usbid_eztool`) and the device release
+number <bcdDevice> (default: 0x0000).
 
-    xwrite 0x09A3 0xC3
+`eeboot program` writes the image to the EEPROM and reads it back for
+verification. The padding of the image is sent run-length encoded if the
+firmware supports it. `eeboot verify` only compares the EEPROM contents with the
+image. Both accept a B2 image or an Intel Hex file, which is converted with
+the default USB IDs. Without parameter, the EZTool firmware file is used.
 
-## MODES
+`eeboot erase` overwrites the first byte of the EEPROM, so that the EZ-USB
+enumerates as unconfigured device again.
 
-`Empty`, `EZTool`
+## EXAMPLES
 
-## REFERENCES
+    eeboot build firmware.ihx fixture.bin 0547:CFAA 0x0001
+    eeboot program fixture.bin
 
-<EZ-USB Technical Reference Manual> p. 3-1ff.
+## MODES
+
+`build` is available in all modes, all other sub-commands in `EZTool`.
 
 ## SEE ALSO
 
-`xread`(1ez)
+`connect`(1ez), `eeread`(1ez)
 
 *)
-Procedure TEZTool.XWrite(ObjC : Integer; ObjV: PPTcl_Object);
-Var Buf  : PByteArray;
-    Addr : Cardinal;
-    I    : Cardinal;
+Procedure TEZTool.EEBoot(ObjC : Integer; ObjV: PPTcl_Object);
+Var Cmd       : String;
+    Image     : AnsiString;
+    idVendor  : Word;
+    idProduct : Word;
+    bcdDevice : Word;
+    Buf       : Array[0..63] of Byte;
+    Addr      : Integer;
+    Len       : Integer;
+    Start     : UInt64;
+
+  Function GetImage(Filename:String) : AnsiString;
+  Var Ext : String;
+  Begin
+    if Filename = '' then
+      Filename := TEZToolDevice.FindFirmware(Device.FirmwareName,'eztool');
+    Ext := LowerCase(ExtractFileExt(Filename));
+    if (Ext = '.ihx') or (Ext = '.hex') then
+      Begin
+        if not SplitUsbID(FTCL.GetVar('usbid_eztool'),idVendor,idProduct) then
+          raise Exception.Create('Invalid format of variable $usbid_eztool');
+        Result := BuildB2Image(Filename,idVendor,idProduct,$0000);
+      End
+    else
+      Result := LoadFile(Filename);
+    if (Length(Result) < 7) or (Result[1] <> #$B2) then
+      raise Exception.Create('"'+Filename+'" is not a B2 boot EEPROM image');
+  End;
+
+  Procedure Verify;
+  Var I : Integer;
+  Begin
+    Addr := 0;
+    while Addr < Length(Image) do
+      Begin
+        Len := Min(SizeOf(Buf),Length(Image)-Addr);
+        FEZToolDevice.EE16Read(Addr,Buf,Len);
+        For I := 0 to Len-1 do
+          if Buf[I] <> Byte(Image[Addr+I+1]) then
+            raise Exception.CreateFmt('Verify error at EEPROM address 0x%.4X: read 0x%.2X, expected 0x%.2X',[Addr+I,Buf[I],Byte(Image[Addr+I+1])]);
+        Addr += Len;
+      End;
+  End;
+
 Begin
-  CheckMode([mdEmpty,mdEZTool]);
-  // xwrite addr b0 b1 b2 ...
-  if ObjC < 3 then
+  // eeboot build firmware.ihx image.bin [idVendor:idProduct [bcdDevice]]
+  // eeboot program|verify [image.bin|firmware.ihx]
+  // eeboot erase
+  if ObjC < 2 then
     raise Exception.Create('Invalid parameters');
-  Addr := ObjV^[1].AsInteger(FTCL);
-  GetMem(Buf,ObjC-2);
-  For I := 0 to ObjC-3 do
-    Buf^[I] := ObjV^[I+2].AsInteger(FTCL);
-  HexDump(Addr,Buf^,ObjC-2);
-  if FMode = mdEmpty then
-    FEmptyDevice.WriteMem(Addr,Buf^,ObjC-2)
+  Cmd := ObjV^[1].AsString;
+  if Cmd = 'build' then
+    Begin
+      if (ObjC < 4) or (ObjC > 6) then
+        raise Exception.Create('Invalid parameters');
+      if ObjC >= 5 then
+        Begin
+          if not SplitUsbID(ObjV^[4].AsPChar,idVendor,idProduct) then
+            raise Exception.Create('Invalid format of parameter idVendor:idProduct');
+        End
+      else if not SplitUsbID(FTCL.GetVar('usbid_eztool'),idVendor,idProduct) then
+        raise Exception.Create('Invalid format of variable $usbid_eztool');
+      bcdDevice := 0;
+      if ObjC = 6 then
+        bcdDevice := ObjV^[5].AsInteger(FTCL);
+      Image := BuildB2Image(ObjV^[2].AsString,idVendor,idProduct,bcdDevice);
+      With TFileStream.Create(ObjV^[3].AsString,fmCreate) do
+        try
+          WriteBuffer(Image[1],Length(Image));
+        finally
+          Free;
+        End;
+      WriteLn('Wrote ',Length(Image),' bytes B2 image for ',IntToHex(idVendor,4),':',IntToHex(idProduct,4),' to ',ObjV^[3].AsString);
+      Exit;
+    End;
+
+  CheckMode([mdEZTool]);
+  if Cmd = 'program' then
+    Begin
+      if ObjC > 3 then
+        raise Exception.Create('Invalid parameters');
+      Image := GetImage(Select(ObjC = 3,ObjV^[ObjC-1].AsString,''));
+      Start := GetUSec;
+      FEZToolDevice.EE16WriteBlock(0,Image[1],Length(Image));
+      Verify;
+      WriteLn('Programmed and verified ',Length(Image),' bytes in ',(GetUSec-Start) div 1000,' ms');
+    End
+  else if Cmd = 'verify' then
+    Begin
+      if ObjC > 3 then
+        raise Exception.Create('Invalid parameters');
+      Image := GetImage(Select(ObjC = 3,ObjV^[ObjC-1].AsString,''));
+      Verify;
+      WriteLn('Verified ',Length(Image),' bytes');
+    End
+  else if Cmd = 'erase' then
+    Begin
+      if ObjC <> 2 then
+        raise Exception.Create('Invalid parameters');
+      Buf[0] := $FF;
+      FEZToolDevice.EE16Write(0,Buf,1);
+    End
   else
-    FEZToolDevice.XWrite(Addr,Buf^,ObjC-2);
-  FreeMem(Buf);
+    raise Exception.Create('Invalid parameters');
 End;
 
 (*ronn
-i2cread(1ez) -- get data from I2C EEPROM
-=======================================
+cache(1ez) -- host-side shadow of the EEPROM and XRAM
+=====================================================
 
 ## SYNOPSYS
 
-`i2cread` <addr> <len>
+`cache` `ee`|`xram` `on`|`off`|`writeback`|`writethrough`
+
+`cache` `xram` `add` <addr> <len>
+
+`cache` `xram` `clear`
+
+`cache` [`ee`|`xram`] `flush`|`invalidate`|`status`
 
 ## DESCRIPTION
 
-`i2cread` issues a read transfer at the I2C bus. The 7-bit address of the I2C
-slave is specifyed with <addr>. This value will be left-shifted by 1 and the
-LSB is set to 1, denoting an I2C read transfer. A total of <len> bytes are
-read. The maximum value of <len> is 64. <addr> is limited to 0x7F.
+`cache` controls the host-side shadows of the I2C EEPROM (used by `eeread` and
+`eewrite`) and of the 8051 XRAM (used by `xread` and `xwrite`). Both are off
+by default. The shadow works on pages of 16 bytes (EEPROM) and 64 bytes
+(XRAM). A page is read from the device once, then all reads of it are served
+from the shadow.
+
+In the default `writeback` mode, writes only modify the shadow and the
+modified ("dirty") pages are written with one transfer per page by `flush`,
+when the cache is switched `off` and on `disconnect`. This coalesces many
+small EEPROM writes to full page writes. In `writethrough` mode, every write
+goes to the device immediately.
+
+The whole EEPROM is cacheable. For the XRAM, only the regions given with
+`cache xram add` are cached, because the 8051 firmware and the USB core modify
+most of the memory. The endpoint buffers and registers from 0x1B40 to 0x1FFF
+and from 0x7B40 to 0x7FFF can't be added. `cache xram clear` removes all
+regions.
+
+`invalidate` discards the shadow including dirty pages. This is done
+automatically when the CPUCS register is written (i.e. the 8051 is reset or
+released) and, for the EEPROM, when `i2cwrite` accesses the EEPROM address
+0x50. After a reconnect, the caches are empty.
+
+`status` prints the mode, the hit and miss counters, the number of page
+writes and dirty pages, and the cached regions.
 
 ## EXAMPLES
 
-For an example see `i2cwrite`(1ez).
+    cache ee on
+    eewrite 0x10 0x01
+    eewrite 0x12 0x02 0x03
+    cache flush           ;# one page write instead of two
 
 ## MODES
 
@@ -1451,59 +4452,135 @@ For an example see `i2cwrite`(1ez).
 
 ## SEE ALSO
 
-`i2cwrite`(1ez)
+`eeread`(1ez), `eewrite`(1ez), `xread`(1ez), `xwrite`(1ez)
 
 *)
-Procedure TEZTool.I2CRead(ObjC : Integer; ObjV: PPTcl_Object);
-Var Buf  : Array[0..63] of Byte;
-    Addr : Cardinal;
-    Len  : Cardinal;
+Procedure TEZTool.Cache(ObjC : Integer; ObjV: PPTcl_Object);
+Const Names : Array[0..1] of String = ('ee','xram');
+Var Caches : Array[0..1] of TShadowCache;
+    First  : Integer;
+    Last   : Integer;
+    Cmd    : String;
+    I      : Integer;
+
+  Function Overlaps(Addr,Len,Start:Cardinal) : Boolean;
+  Begin
+    Result := (Addr < Start + XRAM_REGS_LENGTH) and (Addr + Len > Start);
+  End;
+
 Begin
   CheckMode([mdEZTool]);
-  // i2cread addr len
-  if ObjC <> 3 then
+  // cache [ee|xram] cmd ...
+  if ObjC < 2 then
     raise Exception.Create('Invalid parameters');
-  Addr := ObjV^[1].AsInteger(FTCL);
-  Len  := ObjV^[2].AsInteger(FTCL);
-  if Addr >= $007F then
-    raise Exception.Create('Maximum I2C address is 0x7F');
-  if Len > 64 then
-    raise Exception.Create('Maximum length is 64 bytes');
-  FEZToolDevice.I2CRead(Addr,Buf,Len);
-  HexDump($0000,Buf,Len);
+  Caches[0] := FEZToolDevice.EECache;
+  Caches[1] := FEZToolDevice.XCache;
+  First := 0;
+  Last  := 1;
+  I     := 1;
+  if ObjV^[1].AsString = 'ee' then
+    Last := 0
+  else if ObjV^[1].AsString = 'xram' then
+    First := 1;
+  if First = Last then
+    Inc(I);
+  if ObjC <= I then
+    raise Exception.Create('Invalid parameters');
+  Cmd := ObjV^[I].AsString;
+  // -async jobs of xread and xwrite use the caches from their threads
+  FEZToolDevice.Lock;
+  try
+    if (Cmd = 'flush') or (Cmd = 'invalidate') or (Cmd = 'status') then
+      Begin
+        if ObjC <> I+1 then
+          raise Exception.Create('Invalid parameters');
+        For I := First to Last do
+          With Caches[I] do
+            if Cmd = 'flush' then
+              Flush
+            else if Cmd = 'invalidate' then
+              Invalidate
+            else
+              WriteLn(Names[I]:4,': ',Select(Enabled,Select(WriteThrough,'write-through','write-back'),'off'),
+                      ', ',Hits,' hits, ',Misses,' misses, ',PageWrites,' page writes, ',DirtyPages,' dirty pages',
+                      ', regions: ',Regions);
+        Exit;
+      End;
+    // all other sub-commands need exactly one cache
+    if First <> Last then
+      raise Exception.Create('Invalid parameters');
+    if (Cmd = 'add') and (ObjC = I+3) then
+      Begin
+        if First <> 1 then
+          raise Exception.Create('The EEPROM is always completely cacheable');
+        // a flush of whole pages would write stale values to the registers
+        if Overlaps(ObjV^[I+1].AsInteger(FTCL),ObjV^[I+2].AsInteger(FTCL),XRAM_REGS_START) or
+           Overlaps(ObjV^[I+1].AsInteger(FTCL),ObjV^[I+2].AsInteger(FTCL),XRAM_REGS_MIRROR) then
+          raise Exception.Create('The endpoint buffers and registers (0x1B40 to 0x1FFF and 0x7B40 to 0x7FFF) can not be cached');
+        Caches[First].AddRegion(ObjV^[I+1].AsInteger(FTCL),ObjV^[I+2].AsInteger(FTCL));
+      End
+    else if ObjC <> I+1 then
+      raise Exception.Create('Invalid parameters')
+    else if Cmd = 'on' then
+      Caches[First].Enabled := true
+    else if Cmd = 'off' then
+      Caches[First].Enabled := false
+    else if Cmd = 'writeback' then
+      Caches[First].WriteThrough := false
+    else if Cmd = 'writethrough' then
+      Begin
+        Caches[First].Flush;
+        Caches[First].WriteThrough := true;
+      End
+    else if (Cmd = 'clear') and (First = 1) then
+      Caches[First].ClearRegions
+    else
+      raise Exception.Create('Invalid parameters');
+  finally
+    FEZToolDevice.Unlock;
+  End;
 End;
 
 (*ronn
-i2cwrite(1ez) -- write data to I2C EEPROM
-========================================
+linktest(1ez) -- measure the raw USB bulk transport
+===================================================
 
 ## SYNOPSYS
 
-`i2cwrite` <addr> <b0> <b1> <b2> ...
+`linktest` `source`|`sink`|`echo` <len> [`counter`|`prbs`|`none`]
 
 ## DESCRIPTION
 
-Use `i2cwrite` to perform a generic write transfer at the I2C bus. <addr>
-specifies the 7-bit slave address. It must be between 0x00 and 0x7F. This value
-will be left-shifted by 1 and the LSB is set to 0, denoting an I2C write
-transfer. The following arguments <b0>, <b1>, ... are one or more data bytes
-which are written on the I2C bus
+`linktest` transfers <len> bytes (rounded up to 64 byte packets, at most
+4 MiB) through EP2 without any other work in the firmware. This gives the
+upper bound for the throughput of all other commands, e.g. `xread` is limited
+by the transport and by its handler, `linktest` only by the transport.
 
-## EXAMPLES
+  * `source`:
+    The firmware sends the pattern on EP2 IN as fast as possible. The host
+    receives all packets with a single bulk transfer and counts the bits which
+    differ from the pattern.
 
-To configure an HMC5883L (Three-Axis Digital Compass IC, 7-bit address 0x1E,
-8-bit read address 0x3D, 8-bit write address 0x3C) for continuous measurement
-mode (mode register at internal address 0x02 set to 0x00), use the command:
+  * `sink`:
+    The host sends the pattern on EP2 OUT, the firmware sums up all bytes and
+    counts the bits which differ from the pattern.
 
-    i2cwrite 0x1E 0x02 0x00
+  * `echo`:
+    Every packet sent to EP2 OUT is returned on EP2 IN. This measures the round
+    trip of one packet.
 
-To read the current measurement (data registers at internal addresses 0x03 to
-0x08), use the commands
+The pattern is either a byte `counter` or the `prbs` (default) of an 8 bit
+LFSR. With `none`, the firmware doesn't generate or check any data, which
+gives the pure transport for `source` and `sink`.
 
-    # set address pointer
-    i2cwrite 0x1E 0x03
-    # read 6 bytes
-    i2cread  0x1E 6
+The result lists the throughput in MB/s (10^6 bytes per second), the number of
+packets per USB frame (counted by the firmware with the SOF interrupt) and the
+bit errors.
+
+## EXAMPLES
+
+    EZTool> linktest source 1048576 none
+    source: 1048576 bytes in 16384 packets, 876.543 ms, 1.196 MB/s, 18.7 packets/frame, 0 bit errors
 
 ## MODES
 
@@ -1511,27 +4588,88 @@ To read the current measurement (data registers at internal addresses 0x03 to
 
 ## SEE ALSO
 
-`i2cread`(1ez)
+`xread`(1ez), `profile`(1ez), `trace`(1ez)
 
 *)
-Procedure TEZTool.I2CWrite(ObjC : Integer; ObjV: PPTcl_Object);
-Var Buf  : Array[0..63] of Byte;
-    Addr : Cardinal;
-    I    : Integer;
+Procedure TEZTool.LinkTest(ObjC : Integer; ObjV: PPTcl_Object);
+Var Mode    : String;
+    Pattern : Byte;
+    Packets : Integer;
+    Len     : LongInt;
+    Src     : AnsiString;
+    Dst     : AnsiString;
+    T       : UInt64;
+    R       : LongInt;
+    Status  : TLinkStatus;
+    Errors  : Int64;
+    Sum     : Word;
+    I       : Integer;
 Begin
   CheckMode([mdEZTool]);
-  // i2cwrite addr b0 b1 b2 ...
-  if ObjC < 3 then
+  // linktest source|sink|echo len [counter|prbs|none]
+  if (ObjC < 3) or (ObjC > 4) then
     raise Exception.Create('Invalid parameters');
-  Addr := ObjV^[1].AsInteger(FTCL);
-  if Addr >= $007F then
-    raise Exception.Create('Maximum I2C address is 0x7F');
-  if ObjC-2 > 64 then
-    raise Exception.Create('Maximum length is 64 bytes');
-  For I := 0 to Min(ObjC-3,High(Buf)) do
-    Buf[I] := ObjV^[I+2].AsInteger(FTCL);
-  HexDump($0000,Buf,ObjC-2);
-  FEZToolDevice.I2CWrite(Addr,Buf,ObjC-2);
+  Mode    := ObjV^[1].AsString;
+  Packets := (ObjV^[2].AsInteger(FTCL) + LINK_PACKET_SIZE - 1) div LINK_PACKET_SIZE;
+  if (Packets < 1) or (Packets > FEZToolDevice.MaxLength(CMD_SOURCE)) then
+    raise Exception.Create('Invalid length');
+  Pattern := LINK_PATTERN_PRBS;
+  if ObjC = 4 then
+    if ObjV^[3].AsString = 'counter' then
+      Pattern := LINK_PATTERN_COUNTER
+    else if ObjV^[3].AsString = 'prbs' then
+      Pattern := LINK_PATTERN_PRBS
+    else if ObjV^[3].AsString = 'none' then
+      Pattern := LINK_PATTERN_NONE
+    else
+      raise Exception.Create('Invalid parameters');
+  Len := Packets * LINK_PACKET_SIZE;
+  SetLength(Src,Len);
+  SetLength(Dst,Len);
+  if Pattern <> LINK_PATTERN_NONE then
+    LinkPattern(Pattern,PByte(Src),Len)
+  else
+    FillChar(Src[1],Len,0);
+  Errors := 0;
+  if Mode = 'source' then
+    Begin
+      T := GetUSec;
+      R := FEZToolDevice.LinkSource(Pattern,Dst[1],Packets);
+      T := GetUSec - T;
+      if Pattern <> LINK_PATTERN_NONE then
+        Errors := DataBitErrors(PByte(Src),PByte(Dst),R);
+    End
+  else if Mode = 'sink' then
+    Begin
+      T := GetUSec;
+      R := FEZToolDevice.LinkSink(Pattern,Src[1],Packets);
+      T := GetUSec - T;
+    End
+  else if Mode = 'echo' then
+    Begin
+      T := GetUSec;
+      R := FEZToolDevice.LinkEcho(Src[1],Dst[1],Packets);
+      T := GetUSec - T;
+      Errors := DataBitErrors(PByte(Src),PByte(Dst),R);
+    End
+  else
+    raise Exception.Create('Invalid parameters');
+  Status := FEZToolDevice.LinkStatus;
+  if Mode = 'sink' then
+    Begin
+      Errors := Status.BitErrors;
+      Sum := 0;
+      For I := 1 to R do
+        Sum += Ord(Src[I]);
+      if Sum <> Status.Checksum then
+        WriteLn(Format('Warning: checksum 0x%.4x, expected 0x%.4x',[Status.Checksum,Sum]));
+    End;
+  if R <> Len then
+    WriteLn(Format('Warning: only %d of %d bytes were transferred',[R,Len]));
+  if T = 0 then
+    T := 1;
+  WriteLn(Format('%s: %d bytes in %d packets, %.3f ms, %.3f MB/s, %.1f packets/frame, %d bit errors',
+    [Mode,R,Packets,T/1000.0,R/T,Status.Bytes/LINK_PACKET_SIZE/Max(Status.Frames,1),Errors]));
 End;
 
 (*****************************************************************************)
@@ -1708,7 +4846,7 @@ Begin
   //        ', Length = ',Length);
 
   // Control Message
-  Result := FUserDevice.Control.ControlMsg(RequestType,Request,Value,Index,Buf^,Length,100);
+  Result := FUserDevice.ControlMsg(RequestType,Request,Value,Index,Buf^,Length,100);
 
   if Result < 0  then
     Begin
@@ -1730,13 +4868,144 @@ Begin
     End;
 End;
 
+(*ronn
+controlburst(1ez) -- issue many control transfers concurrently
+==============================================================
+
+## SYNOPSYS
+
+`controlburst` [`-depth` <n>] [`-timeout` <ms>] `-file` <filename>
+
+`controlburst` [`-depth` <n>] [`-timeout` <ms>] <request> ...
+
+## DESCRIPTION
+
+`controlburst` executes a list of control transfers with up to <n> (default 8,
+at most 32) of them in flight at the same time. This is much faster than many
+`controlmsg`(1ez) commands for devices which offer register access only via
+vendor requests.
+
+Every <request> is a string with the same parameters as for `controlmsg`, i.e.
+"<bmRequestType> <bRequest> <wValue> <wIndex> [<length>|<b0> <b1> ...]". With
+`-file`, the requests are read from <filename>, one per line. Empty lines and
+lines starting with `#` are ignored.
+
+The received bytes of all IN requests are concatenated in the order of the
+requests and stored in a new data buffer (see `data`(1ez)), whose handle is
+returned. The command prints the number of requests and errors, the elapsed
+time and the median, 99th percentile and maximum latency. The first failed
+requests are listed. The default timeout is 1000 ms per request.
+
+## EXAMPLES
+
+Read 1024 registers of 4 bytes each with vendor request 0x01.
+
+    set reqs {}
+    for {set i 0} {$i < 1024} {incr i} {
+      lappend reqs "0xC0 0x01 0 [expr $i * 4] 4"
+    }
+    set regs [controlburst -depth 16 {*}$reqs]
+    data dump $regs
+
+## MODES
+
+`User`
+
+## SEE ALSO
+
+`controlmsg`(1ez), `data`(1ez)
+
+*)
+Procedure TEZTool.ControlBurst(ObjC : Integer; ObjV : PPTcl_Object);
+Const MaxErrors = 10;
+Var Reqs    : TControlRequests;
+    Res     : TBurstResult;
+    Depth   : Integer;
+    Timeout : Integer;
+    St      : String;
+    Data    : TDataBuffer;
+    Len     : SizeInt;
+    T       : Double;
+    N       : Integer;
+    I       : Integer;
+Begin
+  CheckMode([mdUser]);
+  // controlburst [-depth n] [-timeout ms] -file f|request ...
+  Depth   := 8;
+  Timeout := 1000;
+  SetLength(Reqs,0);
+  I := 1;
+  while I < ObjC do
+    Begin
+      St := ObjV^[I].AsString;
+      if (St = '-depth') and (I+1 < ObjC) then
+        Begin
+          Depth := ObjV^[I+1].AsInteger(FTCL);
+          Inc(I,2);
+        End
+      else if (St = '-timeout') and (I+1 < ObjC) then
+        Begin
+          Timeout := ObjV^[I+1].AsInteger(FTCL);
+          Inc(I,2);
+        End
+      else if (St = '-file') and (I+2 = ObjC) then
+        Begin
+          Reqs := LoadControlRequests(ObjV^[I+1].AsString);
+          Inc(I,2);
+        End
+      else
+        Break;
+    End;
+  if (Length(Reqs) = 0) and (I >= ObjC) then
+    raise Exception.Create('Invalid parameters');
+  if Length(Reqs) = 0 then
+    Begin
+      SetLength(Reqs,ObjC-I);
+      For N := 0 to High(Reqs) do
+        Reqs[N] := ParseControlRequest(ObjV^[I+N].AsString);
+    End;
+
+  Res := RunControlBurst(FUserDevice,Reqs,Depth,Timeout);
+
+  // concatenate the received data
+  Len := 0;
+  For I := 0 to High(Reqs) do
+    if Reqs[I].Setup.bmRequestType and LIBUSB_ENDPOINT_DIR_MASK <> 0 then
+      Len += Length(Reqs[I].Data);
+  Data := TDataBuffer.Create(Len);
+  Len := 0;
+  For I := 0 to High(Reqs) do
+    if (Reqs[I].Setup.bmRequestType and LIBUSB_ENDPOINT_DIR_MASK <> 0) and (Reqs[I].Data > '') then
+      Begin
+        Move(Reqs[I].Data[1],Data.Ptr[Len],Length(Reqs[I].Data));
+        Len += Length(Reqs[I].Data);
+      End;
+
+  N := 0;
+  For I := 0 to High(Reqs) do
+    if (Reqs[I].Status < 0) and (N < MaxErrors) then
+      Begin
+        WriteLn(Format('Request %d failed (%d): %s',[I,-Reqs[I].Status,SysErrorMessage(-Reqs[I].Status)]));
+        Inc(N);
+      End;
+  T := Res.Elapsed;
+  if T = 0 then
+    T := 1;
+  WriteLn(Format('%d requests, %d errors, %.3f ms, %.0f requests/s, latency p50 %d us, p99 %d us, max %d us',
+    [Length(Reqs),Res.Errors,T/1000.0,Length(Reqs)*1000000.0/T,
+     BurstPercentile(Res,50),BurstPercentile(Res,99),BurstPercentile(Res,100)]));
+  FTCL.SetObjResult(FData.Add(Data));
+End;
+
 (*ronn
 bulkin(1ez) -- issue a bulk in transfer
 =======================================
 
 ## SYNOPSYS
 
-`bulkin` <ep> <length>
+`bulkin` [`-async` [`-command` <script>]] <ep> <length>
+
+`bulkin` <ep> <length> `-data`
 
 ## DESCRIPTION
 
@@ -1745,6 +5014,9 @@ Perform a USB bulk IN transfer from endpoint <ep> with up to <length> bytes.
 You have to `claim`(1ez) an interface before bulk transfers. Only the endpoints
 specified by the interface are available.
 
+With `-async`, the command returns a job ID immediately and the transfer is
+executed in the background, see `jobwait`(1ez).
+
 ## EXAMPLES
 
 For an example see `claim`(1ez).
@@ -1759,26 +5031,59 @@ For an example see `claim`(1ez).
 
 *)
 Procedure TEZTool.BulkIn(ObjC : Integer; ObjV : PPTcl_Object);
-Var EP     : Integer;
-    Length : Integer;
-    Buf    : PByteArray;
-    Result : Integer;
+Var EP       : Integer;
+    Length   : Integer;
+    Buf      : PByteArray;
+    Result   : Integer;
+    Data     : TDataBuffer;
+    AsData   : Boolean;
+    A        : Integer;
+    Async    : Boolean;
+    Callback : String;
+    Job      : TJob;
 Begin
   CheckMode([mdUser]);
   if not FUserDevice.HaveInterface then
     raise Exception.Create('You must first ''claim'' an interface.');
 
-  // bulkin  ep length                 # "connect" automatically creates TUSBBulk*Endpoints according to device descriptor
-  if ObjC <> 3 then
+  // bulkin  [-async [-command script]] ep length [-data]    # "connect" automatically creates TUSBBulk*Endpoints according to device descriptor
+  AsData := DataOption(ObjC,ObjV);
+  Async := AsyncOption(ObjC,ObjV,A,Callback);
+  if ObjC <> A+2 then
     raise Exception.Create('Invalid parameters');
 
-  EP     := ObjV^[1].AsInteger(FTCL);
-  Length := ObjV^[2].AsInteger(FTCL);
+  EP     := ObjV^[A  ].AsInteger(FTCL);
+  Length := ObjV^[A+1].AsInteger(FTCL);
   if Length > $FFFF then
     raise Exception.Create('maximum length is 0xFFFF');
+  if Async then
+    Begin
+      if AsData then
+        raise Exception.Create('-data can not be combined with -async');
+      Job := TJob.Create('bulkin',@BulkInWork);
+      Job.EP       := EP;
+      Job.Len      := Length;
+      Job.Callback := Callback;
+      StartJob(Job);
+      Exit;
+    End;
   GetMem(Buf,Length);
 
   //WriteLn('EP = ',EP,' IN, Length = ',Length,', Buf = ',IntToHex(PtrUInt(Buf),SizeOf(PtrUInt)*2));
+  if AsData then
+    Begin
+      FreeMem(Buf);
+      Data := TDataBuffer.Create(Length);
+      Result := FUserDevice.BulkIn(EP or LIBUSB_ENDPOINT_IN,Data.Ptr^,Length,100);
+      if Result < 0 then
+        Begin
+          Data.Free;
+          raise Exception.CreateFmt('Error during bulk in transfer (%d): %s',[-Result,SysErrorMessage(-Result)]);
+        End;
+      Data.Length := Result;
+      FTCL.SetObjResult(FData.Add(Data));
+      Exit;
+    End;
   Result := FUserDevice.BulkIn(EP or LIBUSB_ENDPOINT_IN,Buf^,Length,100);
 
   if Result < 0  then
@@ -1800,7 +5105,9 @@ bulkout(1ez) -- issue a bulk out transfer
 
 ## SYNOPSYS
 
-`bulkout` <ep> <b0> <b1> <b2> ...
+`bulkout` [`-async` [`-command` <script>]] <ep> <b0> <b1> <b2> ...
+
+`bulkout` <ep> `-data` <handle>
 
 ## DESCRIPTION
 
@@ -1810,6 +5117,9 @@ Perform a USB bulk OUT transfer to endpoint <ep> with the data byte <b0>,
 You have to `claim`(1ez) an interface before bulk transfers. Only the endpoints
 specified by the interface are available.
 
+With `-async`, the command returns a job ID immediately and the transfer is
+executed in the background, see `jobwait`(1ez).
+
 ## EXAMPLES
 
 Send data to a bulk OUT endpoint.
@@ -1826,24 +5136,53 @@ Send data to a bulk OUT endpoint.
 
 *)
 Procedure TEZTool.BulkOut(ObjC : Integer; ObjV : PPTcl_Object);
-Var EP     : Integer;
-    Length : Integer;
-    I      : Integer;
-    Buf    : PByteArray;
-    Result : Integer;
+Var EP       : Integer;
+    Length   : Integer;
+    I        : Integer;
+    Buf      : PByteArray;
+    Result   : Integer;
+    Data     : TDataBuffer;
+    A        : Integer;
+    Async    : Boolean;
+    Callback : String;
+    Job      : TJob;
 Begin
   CheckMode([mdUser]);
   if not FUserDevice.HaveInterface then
     raise Exception.Create('You must first ''claim'' an interface.');
 
-  // bulkout ep data|b0 b1 b2 ...
-  if ObjC < 3 then
+  // bulkout [-async [-command script]] ep b0 b1 b2 ...|-data handle
+  Async := AsyncOption(ObjC,ObjV,A,Callback);
+  if ObjC < A+2 then
     raise Exception.Create('Invalid parameters');
 
-  EP     := ObjV^[1].AsInteger(FTCL);
-  Length := ObjC - 2;
+  EP     := ObjV^[A].AsInteger(FTCL);
+  Data   := DataArg(ObjC,ObjV,A+1);
+  if Assigned(Data) and not Async then
+    Begin
+      Result := FUserDevice.BulkOut(EP or LIBUSB_ENDPOINT_OUT,Data.Ptr^,Data.Length,100);
+      if Result < 0  then
+        raise Exception.CreateFmt('Error during bulk out transfer (%d): %s',[-Result,SysErrorMessage(-Result)]);
+      FTCL.SetObjResult(Result);
+      Exit;
+    End;
+  Length := ObjC - A - 1;
   if Length > $FFFF then
     raise Exception.Create('maximum length is 0xFFFF');
+  if Async then
+    Begin
+      if Assigned(Data) then
+        raise Exception.Create('-data can not be combined with -async');
+      Job := TJob.Create('bulkout',@BulkOutWork);
+      Job.EP  := EP;
+      Job.Len := Length;
+      SetLength(Job.Data,Length);
+      For I := 0 to Length-1 do
+        Job.Data[I+1] := Chr(ObjV^[A+1+I].AsInteger(FTCL));
+      Job.Callback := Callback;
+      StartJob(Job);
+      Exit;
+    End;
   GetMem(Buf,Length);
 
   For I := 0 to Length-1 do
@@ -1865,6 +5204,152 @@ Begin
   FreeMem(Buf);
 End;
 
+(*ronn
+usbbench(1ez) -- bulk throughput and latency benchmark
+======================================================
+
+## SYNOPSYS
+
+`usbbench` [`-in` <ep>] [`-out` <ep>] [`-sizes` <list>] [`-depths` <list>] [`-time` <ms>] [`-timeout` <ms>] [`-check`] [`-histogram`]
+
+## DESCRIPTION
+
+`usbbench` measures the sustained bulk throughput and the per-transfer latency
+of any device in mode `User`. For every combination of the transfer sizes
+<list> (default 64 512 4096 65536) and queue depths <list> (default 1 4),
+transfers are issued on the IN and the OUT endpoint at the same time for
+`-time` milliseconds (default 1000). Every step prints one line per endpoint.
+
+The queue depth is the number of transfers per endpoint which are pending at
+the same time. Each of them is issued back to back by an own thread.
+
+OUT transfers send the PRBS-31 sequence (x^31 + x^28 + 1). With `-check`, the
+IN data is checked for PRBS-31 bit errors, e.g. for a device which returns the
+data of the OUT endpoint. The checker synchronizes itself at every transfer,
+therefore the order of the transfers doesn't matter. A single flipped bit is
+counted three times.
+
+Every step prints the throughput in MB/s (10^6 bytes per second), the number of
+transfers, the median, 99th percentile and maximum latency, the number of
+short transfers (less bytes than requested), timeouts (`-timeout`, default
+1000 ms), other errors and the bit errors. `-histogram` additionally prints the
+latency histogram with logarithmic buckets.
+
+You have to `claim`(1ez) an interface first.
+
+## EXAMPLES
+
+    claim 0 0
+    usbbench -in 0x82 -out 0x02 -sizes {512 16384} -depths {1 2 8} -check
+
+## MODES
+
+`User`
+
+## SEE ALSO
+
+`claim`(1ez), `bulkin`(1ez), `bulkout`(1ez), `linktest`(1ez)
+
+*)
+Procedure TEZTool.UsbBenchCmd(ObjC : Integer; ObjV : PPTcl_Object);
+
+  Function IntList(St:String) : TStringList;
+  Var I : Integer;
+  Begin
+    Result := TclList(St);
+    For I := 0 to Result.Count-1 do
+      StrToInt(Result[I]);   // raises an exception for invalid numbers
+  End;
+
+Var EPs       : Array of Byte;
+    Sizes     : TStringList;
+    Depths    : TStringList;
+    Time      : Integer;
+    Timeout   : Integer;
+    Check     : Boolean;
+    Histogram : Boolean;
+    St        : String;
+    Stats     : TBenchResults;
+    I,J,K     : Integer;
+Begin
+  CheckMode([mdUser]);
+  if not FUserDevice.HaveInterface then
+    raise Exception.Create('You must first ''claim'' an interface.');
+
+  // usbbench [-in ep] [-out ep] [-sizes list] [-depths list] [-time ms] [-timeout ms] [-check] [-histogram]
+  SetLength(EPs,0);
+  Time      := 1000;
+  Timeout   := 1000;
+  Check     := false;
+  Histogram := false;
+  Sizes     := Nil;
+  Depths    := Nil;
+  try
+    I := 1;
+    while I < ObjC do
+      Begin
+        St := ObjV^[I].AsString;
+        if      St = '-check'     then Check     := true
+        else if St = '-histogram' then Histogram := true
+        else if I+1 >= ObjC then
+          raise Exception.Create('Invalid parameters')
+        else
+          Begin
+            Inc(I);
+            if St = '-in' then
+              Begin
+                SetLength(EPs,Length(EPs)+1);
+                EPs[High(EPs)] := ObjV^[I].AsInteger(FTCL) or LIBUSB_ENDPOINT_IN;
+              End
+            else if St = '-out' then
+              Begin
+                SetLength(EPs,Length(EPs)+1);
+                EPs[High(EPs)] := ObjV^[I].AsInteger(FTCL) and not LIBUSB_ENDPOINT_IN;
+              End
+            else if St = '-sizes' then
+              Begin
+                FreeAndNil(Sizes);
+                Sizes := IntList(ObjV^[I].AsString);
+              End
+            else if St = '-depths' then
+              Begin
+                FreeAndNil(Depths);
+                Depths := IntList(ObjV^[I].AsString);
+              End
+            else if St = '-time' then
+              Time := ObjV^[I].AsInteger(FTCL)
+            else if St = '-timeout' then
+              Timeout := ObjV^[I].AsInteger(FTCL)
+            else
+              raise Exception.Create('Invalid parameters');
+          End;
+        Inc(I);
+      End;
+    if Length(EPs) = 0 then
+      raise Exception.Create('Specify at least one endpoint with -in or -out');
+    if not Assigned(Sizes) then
+      Sizes := IntList('64 512 4096 65536');
+    if not Assigned(Depths) then
+      Depths := IntList('1 4');
+
+    BenchHeader;
+    For I := 0 to Sizes.Count-1 do
+      For J := 0 to Depths.Count-1 do
+        Begin
+          Stats := RunBench(FUserDevice,EPs,StrToInt(Sizes[I]),StrToInt(Depths[J]),Time,Timeout,Check);
+          For K := 0 to High(Stats) do
+            Begin
+              BenchLine(Stats[K]);
+              if Histogram then
+                BenchHistogram(Stats[K]);
+            End;
+        End;
+  finally
+    Sizes.Free;
+    Depths.Free;
+  End;
+End;
+
 (*****************************************************************************)
 (***  Main Program  **********************************************************)
 (*****************************************************************************)
@@ -1873,12 +5358,37 @@ Var Dev        : TEZTool;
     RunScripts : Boolean;
     BatchMode  : Boolean;
     ExitStatus : Integer;
+    DaemonMode : Boolean;
+    ClientMode : Boolean;
+    DaemonPath : String;
+    Scripts    : TStringList;
+    StartupTime: Boolean;
+    RealTimeOpt: Boolean;
+    Warning    : String;
+    TimeStart  : UInt64;
+    TimeLast   : UInt64;
+
+Const
+  // Tcl writes "puts" output directly to the file descriptor, see TEZTool.Stdout
+  PutsWrapper =
+    'rename ::puts ::eztool::puts'#10+
+    'proc ::puts {args} {'#10+
+    '  set a $args'#10+
+    '  set nl "\n"'#10+
+    '  if {[lindex $a 0] eq "-nonewline"} { set nl "" ; set a [lrange $a 1 end] }'#10+
+    '  if {[llength $a] == 1 || ([llength $a] == 2 && [lindex $a 0] eq "stdout")} {'#10+
+    '    ::eztool::stdout "[lindex $a end]$nl"'#10+
+    '  } else {'#10+
+    '    ::eztool::puts {*}$args'#10+
+    '  }'#10+
+    '}';
 
 Procedure Usage(ExitCode:Byte);
 Begin
   WriteLn('EZTool');
   WriteLn;
   WriteLn('Usage: eztool [-h|--help] [-b] [-f filename] [-c string] [-n]');
+  WriteLn('              [--daemon|--client] [--socket path] [--realtime]');
   WriteLn;
   WriteLn('  -h, --help   Print a usage information and exit.');
   WriteLn;
@@ -1893,6 +5403,19 @@ Begin
   WriteLn;
   WriteLn('  -n           Do not execute the start scripts (/etc/eztool/... TODO )');
   WriteLn;
+  WriteLn('  --daemon     Keep running after the scripts and commands and execute the');
+  WriteLn('               commands sent by clients via a Unix domain socket.');
+  WriteLn;
+  WriteLn('  --client     Send the scripts and commands given with -f and -c to the');
+  WriteLn('               daemon instead of executing them.');
+  WriteLn;
+  WriteLn('  --socket path  Socket of the daemon (default: ',DaemonDefaultPath,').');
+  WriteLn;
+  WriteLn('  --startup-time  Print the duration of the startup phases to stderr.');
+  WriteLn;
+  WriteLn('  --realtime   Lock the memory and run the USB transfers of streams with');
+  WriteLn('               SCHED_FIFO priority (see "rtmode").');
+  WriteLn;
   Halt(ExitCode);
 End;
 
@@ -1922,6 +5445,50 @@ Begin
     raise Exception.Create(St);
 End;
 
+(**
+ * Execute a script sent by a daemon client
+ *
+ * Everything written to Output is captured and returned to the client. If
+ * 'exit' was used, the daemon is terminated.
+ *)
+Function DaemonEval(Const Script:AnsiString;Out AOutput:AnsiString) : Boolean;
+Var Code   : Integer;
+    St     : String;
+    Stream : TStringStream;
+    OldOut : Text;
+Begin
+  Dev.FTCL.SetVar('session',IntToStr(Dev.FDaemon.SessionId));
+  Stream := TStringStream.Create('');
+  try
+    Flush(Output);
+    OldOut := Output;
+    AssignStream(Output,Stream);
+    Rewrite(Output);
+    try
+      Code := Dev.FTCL.Eval(Script);
+      if (Code <> TCL_OK) then
+        Write('Error: ');
+      St := Dev.FTCL.GetStringResult;
+      if St > '' then
+        WriteLn(St);
+    finally
+      Close(Output);
+      Output := OldOut;
+    End;
+    AOutput := Stream.DataString;
+  finally
+    Stream.Free;
+  End;
+  Result := (Code = TCL_OK);
+
+  // handle if 'exit' was called
+  if Dev.FCmdLine.ExitStatus >= 0 then
+    Begin
+      ExitStatus := Dev.FCmdLine.ExitStatus;
+      Dev.FDaemon.Terminate;
+    End;
+End;
+
 Procedure EvalFile(St:String);
 Var Code : Integer;
 Begin
@@ -1947,6 +5514,8 @@ End;
  * The parameters are parsed in two phases. Phase 0 only sets internal variables
  * which influence the behavior of the program (-b, -n). In phase 1 the scripts
  * and commands specified with parameters -f and -c, respectively, are exeucuted.
+ * In phase 2 (client mode) they are collected in Scripts to be sent to the
+ * daemon.
  *
  * @param Phase
  *)
@@ -1967,18 +5536,35 @@ Begin
           // execute script file
           Inc(I);
           if Phase = 1 then
-            EvalFile(ParamStr(I));
+            EvalFile(ParamStr(I))
+          else if Phase = 2 then
+            Scripts.Add(LoadFile(ParamStr(I)));
         End
       else if ParamStr(I) = '-c' then
         Begin
           // execute command
           Inc(I);
           if Phase = 1 then
-            Eval(ParamStr(I));
+            Eval(ParamStr(I))
+          else if Phase = 2 then
+            Scripts.Add(ParamStr(I));
         End
       else if ParamStr(I) = '-n' then
         // don't run startup scripts
         RunScripts := false
+      else if ParamStr(I) = '--startup-time' then
+        StartupTime := true
+      else if ParamStr(I) = '--realtime' then
+        RealTimeOpt := true
+      else if ParamStr(I) = '--daemon' then
+        DaemonMode := true
+      else if ParamStr(I) = '--client' then
+        ClientMode := true
+      else if ParamStr(I) = '--socket' then
+        Begin
+          Inc(I);
+          DaemonPath := ParamStr(I);
+        End
       else
         // error
         Usage(1);
@@ -1986,6 +5572,18 @@ Begin
     End;
 End;
 
+(**
+ * Print the time since the last call for option --startup-time
+ *)
+Procedure StartupPhase(Name:String);
+Var Now : UInt64;
+Begin
+  if not StartupTime then Exit;
+  Now := GetUSec;
+  WriteLn(ErrOutput,'startup ',Name,' ',Now-TimeLast,' us');
+  TimeLast := Now;
+End;
+
 Procedure ExecuteStartupScripts;
   Procedure EvalFileIfExists(Filename:String);
   Begin
@@ -2015,21 +5613,69 @@ Begin
 End;
 
 Begin
-  Dev := TEZTool.Create;
+  TimeStart  := GetUSec;
+  TimeLast   := TimeStart;
   // initialize default values
+  StartupTime:= false;
+  RealTimeOpt:= false;
   ExitStatus := 0;
   RunScripts := true;
   BatchMode  := false;
+  DaemonMode := false;
+  ClientMode := false;
+  DaemonPath := DaemonDefaultPath;
   // parse parameters to set variables
   ParseParams(0);
+  if ClientMode then
+    Begin
+      // thin client: no Tcl interpreter and no USB, just forward -f and -c
+      Scripts := TStringList.Create;
+      try
+        ParseParams(2);
+        ExitStatus := RunClient(DaemonPath,Scripts);
+      except
+        on E : Exception do
+          Begin
+            WriteLn('Error: ',E.Message);
+            ExitStatus := 1;
+          End;
+      End;
+      Scripts.Free;
+      Halt(ExitStatus);
+    End;
+  if RealTimeOpt then
+    Begin
+      Warning := RealTimeEnable(true);
+      if Warning > '' then
+        WriteLn(ErrOutput,'Warning: ',Warning);
+    End;
+  Dev := TEZTool.Create;
+  StartupPhase('create');
   try
     // execute startup scripts
     if RunScripts then
       ExecuteStartupScripts;
+    StartupPhase('scripts');
     // parse parameters to execute scripts and commands given as parameters
     ParseParams(1);
+    StartupPhase('params');
+    if StartupTime then
+      WriteLn(ErrOutput,'startup total ',GetUSec-TimeStart,' us');
+    if DaemonMode then
+      Begin
+        Dev.FDaemon := TEZToolDaemon.Create(DaemonPath,@DaemonEval);
+        Eval('namespace eval ::eztool {}');
+        Dev.FTCL.CreateObjCommand('::eztool::stdout',@Dev.Stdout,nil);
+        Eval(PutsWrapper);
+        WriteLn('Waiting for clients on ',DaemonPath);
+        try
+          Dev.FDaemon.Run;
+        finally
+          FreeAndNil(Dev.FDaemon);
+        End;
+      End
     // show help and run command prompt
-    if not BatchMode then
+    else if not BatchMode then
       Begin
         Dev.Help(0,Nil);
         ExitStatus := Dev.Run;
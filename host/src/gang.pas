@@ -0,0 +1,337 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Gang programming: one image to many EZTool devices at the same time
+ *
+ * The image is parsed once and shared read-only by the workers. Each worker
+ * thread takes the next device from a shared index, connects to it
+ * (including the firmware download if it is still empty), writes the image,
+ * reads it back and stores the result in the device record. XRAM is written
+ * and verified past the shadow cache, so the verification reads the device. The devices are
+ * started in the order of the array, see TUsbTopology.Schedule.
+ *
+ * The devices are identified by their port path (e.g. "3-1.4"), which stays
+ * the same when the device re-enumerates after the firmware download.
+ *)
+Unit Gang;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math, LibUsb, LibUsbOop, Device, BootImage, Topology, Utils;
+
+Const
+  GANG_MAX_JOBS   = 32;
+  GANG_XRAM_CHUNK = $4000;   // bytes per XWrite/XRead
+
+Type
+  TGangTarget = (gtEEPROM,gtXRAM);
+
+  TGangSegment = record
+    Addr : Word;
+    Data : AnsiString;
+  End;
+
+  TGangImage = record
+    Target   : TGangTarget;
+    Segments : Array of TGangSegment;
+    Size     : LongInt;     // sum of all segments
+  End;
+
+  TGangParams = record
+    Context          : TLibUsbContext;
+    idVendorEmpty    : Word;
+    idProductEmpty   : Word;
+    idVendorEZTool   : Word;
+    idProductEZTool  : Word;
+    Firmware         : String;   // for empty devices
+  End;
+
+  TGangDevice = record
+    Path        : String;
+    Empty       : Boolean;         // needs the firmware download
+    EZTool      : TEZToolDevice;   // already connected device, otherwise Nil
+    Error       : String;          // '' = programmed and verified
+    ConnectTime : UInt64;          // us, including the firmware download
+    Elapsed     : UInt64;          // us from the start of the worker to the verified image
+  End;
+  TGangDevices = Array of TGangDevice;
+
+  { TLibUsbDeviceMatchPath }
+
+  TLibUsbDeviceMatchPath = class(TLibUsbDeviceMatchVidPid)
+  private
+    FPath : String;
+  public
+    Constructor Create(AContext:TLibUsbContext;AidVendor,AidProduct:Word;Const APath:String);
+    Function Match(ADev:Plibusb_device) : Boolean; override;
+  End;
+
+Function  LoadGangImage(ATarget:TGangTarget;Const AFilename:String;idVendor,idProduct:Word) : TGangImage;
+Function  RunGang(Const Image:TGangImage;Const Params:TGangParams;Var Devs:TGangDevices;AJobs:Integer) : UInt64;
+
+Implementation
+
+{ TLibUsbDeviceMatchPath }
+
+Constructor TLibUsbDeviceMatchPath.Create(AContext:TLibUsbContext;AidVendor,AidProduct:Word;Const APath:String);
+Begin
+  inherited Create(AContext,AidVendor,AidProduct);
+  FPath := APath;
+End;
+
+Function TLibUsbDeviceMatchPath.Match(ADev:Plibusb_device) : Boolean;
+Begin
+  Result := inherited Match(ADev) and (DevicePath(ADev) = FPath);
+End;
+
+Type
+
+  { TGangWorker }
+
+  TGangWorker = class(TThread)
+  private
+    FImage  : TGangImage;
+    FParams : TGangParams;
+    FDevs   : TGangDevices;
+    FNext   : PLongInt;
+    Function  Open(Const APath:String;AEmpty:Boolean) : TEZToolDevice;
+    Procedure Write (ADev:TEZToolDevice);
+    Procedure Verify(ADev:TEZToolDevice);
+  protected
+    Procedure Execute; override;
+  public
+    Constructor Create(Const AImage:TGangImage;Const AParams:TGangParams;ADevs:TGangDevices;ANext:PLongInt);
+  End;
+
+Constructor TGangWorker.Create(Const AImage:TGangImage;Const AParams:TGangParams;ADevs:TGangDevices;ANext:PLongInt);
+Begin
+  FImage  := AImage;
+  FParams := AParams;
+  FDevs   := ADevs;   // the same array as the caller's, not a copy
+  FNext   := ANext;
+  inherited Create(false);
+End;
+
+Function TGangWorker.Open(Const APath:String;AEmpty:Boolean) : TEZToolDevice;
+Begin
+  // the two matcher classes are .Free()ed inside the constructor
+  With FParams do
+    if AEmpty then
+      Result := TEZToolDevice.Create(Context,
+        TLibUsbDeviceMatchPath.Create(Context,idVendorEmpty,idProductEmpty,APath),
+        Firmware,
+        TLibUsbDeviceMatchPath.Create(Context,idVendorEZTool,idProductEZTool,APath))
+    else
+      Result := TEZToolDevice.Create(Context,
+        Nil,
+        '',
+        TLibUsbDeviceMatchPath.Create(Context,idVendorEZTool,idProductEZTool,APath));
+End;
+
+Procedure TGangWorker.Write(ADev:TEZToolDevice);
+Var Offs : Integer;
+    Len  : Integer;
+    I    : Integer;
+Begin
+  For I := 0 to High(FImage.Segments) do
+    With FImage.Segments[I] do
+      if FImage.Target = gtEEPROM then
+        ADev.EE16WriteBlock(Addr,Data[1],Length(Data))
+      else
+        Begin
+          Offs := 0;
+          while Offs < Length(Data) do
+            Begin
+              Len := Min(GANG_XRAM_CHUNK,Length(Data)-Offs);
+              ADev.XWriteRaw(Addr+Offs,Data[Offs+1],Len);
+              Offs += Len;
+            End;
+        End;
+End;
+
+Procedure TGangWorker.Verify(ADev:TEZToolDevice);
+Var Buf   : AnsiString;
+    Chunk : Integer;
+    Offs  : Integer;
+    Len   : Integer;
+    I,J   : Integer;
+Begin
+  if FImage.Target = gtEEPROM then
+    Chunk := Max(1,ADev.MaxLength(CMD_READ_EEPROM16))
+  else
+    Chunk := GANG_XRAM_CHUNK;
+  SetLength(Buf,Chunk);
+  For I := 0 to High(FImage.Segments) do
+    With FImage.Segments[I] do
+      Begin
+        Offs := 0;
+        while Offs < Length(Data) do
+          Begin
+            Len := Min(Chunk,Length(Data)-Offs);
+            if FImage.Target = gtEEPROM then
+              ADev.EE16Read(Addr+Offs,Buf[1],Len)
+            else
+              ADev.XReadRaw(Addr+Offs,Buf[1],Len);
+            For J := 1 to Len do
+              if Buf[J] <> Data[Offs+J] then
+                raise Exception.CreateFmt('Verify error at %s address 0x%.4X: read 0x%.2X, expected 0x%.2X',
+                  [Select(FImage.Target = gtEEPROM,'EEPROM','XRAM'),Addr+Offs+J-1,Byte(Buf[J]),Byte(Data[Offs+J])]);
+            Offs += Len;
+          End;
+      End;
+End;
+
+Procedure TGangWorker.Execute;
+Var I     : LongInt;
+    Start : UInt64;
+    Own   : Boolean;
+Begin
+  repeat
+    I := InterLockedIncrement(FNext^) - 1;
+    if I > High(FDevs) then
+      Break;
+    With FDevs[I] do
+      Begin
+        Start := GetUSec;
+        Own   := not Assigned(EZTool);
+        try
+          if Own then
+            EZTool := Open(Path,Empty);
+          ConnectTime := GetUSec - Start;
+          // e.g. the connected device of eztool with "cache xram on"
+          EZTool.CacheInvalidate;
+          Write(EZTool);
+          Verify(EZTool);
+        except
+          on E : Exception do
+            Error := E.Message;
+        End;
+        Elapsed := GetUSec - Start;
+        if Own then
+          FreeAndNil(EZTool);
+      End;
+  until false;
+End;
+
+(**
+ * Load the image for gtEEPROM or gtXRAM
+ *
+ * gtEEPROM accepts a B2 boot EEPROM image or an Intel Hex file, which is
+ * converted to a B2 image with idVendor:idProduct, see eeboot(1ez). gtXRAM
+ * accepts an Intel Hex file, every contiguous range becomes one segment.
+ *)
+Function LoadGangImage(ATarget:TGangTarget;Const AFilename:String;idVendor,idProduct:Word) : TGangImage;
+Var Ext   : String;
+    Seg   : AnsiString;
+    Mem   : Array of Byte;
+    Used  : Array of Boolean;
+    Start : Integer;
+    I     : Integer;
+
+  Procedure Add(AAddr:Word;Const AData:AnsiString);
+  Begin
+    SetLength(Result.Segments,Length(Result.Segments)+1);
+    Result.Segments[High(Result.Segments)].Addr := AAddr;
+    Result.Segments[High(Result.Segments)].Data := AData;
+    Result.Size += Length(AData);
+  End;
+
+Begin
+  Result.Target := ATarget;
+  Result.Size   := 0;
+  SetLength(Result.Segments,0);
+  Ext := LowerCase(ExtractFileExt(AFilename));
+  if ATarget = gtEEPROM then
+    Begin
+      if (Ext = '.ihx') or (Ext = '.hex') then
+        Add(0,BuildB2Image(AFilename,idVendor,idProduct,$0000))
+      else
+        Add(0,LoadFile(AFilename));
+      if (Result.Size < 7) or (Result.Segments[0].Data[1] <> #$B2) then
+        raise Exception.Create('"'+AFilename+'" is not a B2 boot EEPROM image');
+      Exit;
+    End;
+  if (Ext <> '.ihx') and (Ext <> '.hex') then
+    raise Exception.Create('"'+AFilename+'" is not an Intel Hex file');
+  SetLength(Mem, XRAM_SIZE);
+  SetLength(Used,XRAM_SIZE);
+  ParseIntelHex(AFilename,'XRAM',Mem,Used);
+  I := 0;
+  while I < XRAM_SIZE do
+    Begin
+      if not Used[I] then
+        Begin
+          Inc(I);
+          Continue;
+        End;
+      Start := I;
+      while (I < XRAM_SIZE) and Used[I] do
+        Inc(I);
+      SetString(Seg,PChar(@Mem[Start]),I-Start);
+      Add(Start,Seg);
+    End;
+  if Result.Size = 0 then
+    raise Exception.Create('"'+AFilename+'" doesn''t contain any data');
+End;
+
+(**
+ * Program and verify all devices with up to AJobs at the same time
+ *
+ * Errors of a device are stored in its record and don't stop the others.
+ *
+ * @return  us from the start of the first to the end of the last worker
+ *)
+Function RunGang(Const Image:TGangImage;Const Params:TGangParams;Var Devs:TGangDevices;AJobs:Integer) : UInt64;
+Var Workers : Array of TGangWorker;
+    Next    : LongInt;
+    Start   : UInt64;
+    Error   : String;
+    I       : Integer;
+Begin
+  if (AJobs < 1) or (AJobs > GANG_MAX_JOBS) then
+    raise Exception.CreateFmt('Jobs must be 1 to %d',[GANG_MAX_JOBS]);
+  For I := 0 to High(Devs) do
+    Begin
+      Devs[I].Error       := '';
+      Devs[I].ConnectTime := 0;
+      Devs[I].Elapsed     := 0;
+    End;
+  SetLength(Workers,Min(AJobs,Max(1,Length(Devs))));
+  Next  := 0;
+  Start := GetUSec;
+  For I := 0 to High(Workers) do
+    Workers[I] := TGangWorker.Create(Image,Params,Devs,@Next);
+  Error := '';
+  For I := 0 to High(Workers) do
+    Begin
+      Workers[I].WaitFor;
+      if Assigned(Workers[I].FatalException) then
+        Error := Exception(Workers[I].FatalException).Message;
+      Workers[I].Free;
+    End;
+  Result := GetUSec - Start;
+  if Error > '' then
+    raise Exception.Create(Error);
+End;
+
+End.
@@ -0,0 +1,208 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Background jobs for the "-async" variants of the Tcl commands
+ *
+ * Every job runs its work method in an own thread. The work method must not
+ * touch the Tcl interpreter, it only transfers data between the USB device
+ * and the job's Data buffer. The completion is reported to Tcl by the main
+ * thread (see TEZTool.JobPoll).
+ *)
+Unit Jobs;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, RealTime;
+
+Type
+  TJobState = (jsRunning,jsDone,jsError);
+
+  TJob = class;
+  TJobWork = Procedure(AJob:TJob) of object;
+
+  { TJob }
+
+  TJob = class(TThread)
+  private
+    FId       : Integer;
+    FName     : String;
+    FWork     : TJobWork;
+    FState    : TJobState;
+    FError    : String;
+    FDone     : LongInt;
+    FReported : Boolean;
+  protected
+    Procedure Execute; override;
+  public
+    { parameters and result of the work method }
+    Addr     : Cardinal;
+    Len      : Cardinal;
+    EP       : Byte;
+    Data     : AnsiString;
+    Callback : String;     // Tcl script evaluated on completion
+    Constructor Create(AName:String;AWork:TJobWork);
+    Procedure Progress(ADone:LongInt);
+    property Id       : Integer   read FId;
+    property Name     : String    read FName;
+    property State    : TJobState read FState;
+    property Error    : String    read FError;
+    property Done     : LongInt   read FDone;
+    property Reported : Boolean   read FReported write FReported;
+  End;
+
+  { TJobList }
+
+  TJobList = class
+  private
+    FJobs   : TList;
+    FNextId : Integer;
+    Function GetCount : Integer;
+    Function GetJob(Index:Integer) : TJob;
+  public
+    Constructor Create;
+    Destructor  Destroy; override;
+    Function  Start(AJob:TJob) : Integer;
+    Function  Find(AId:Integer) : TJob;
+    Procedure Remove(AJob:TJob);
+    Procedure WaitAll;
+    Function  Running : Integer;
+    property Count : Integer read GetCount;
+    property Jobs[Index:Integer] : TJob read GetJob; default;
+  End;
+
+Const
+  JobStateNames : Array[TJobState] of String = ('running','done','error');
+
+Implementation
+
+{ TJob }
+
+Constructor TJob.Create(AName:String;AWork:TJobWork);
+Begin
+  inherited Create(true);   // started by TJobList.Start
+  FreeOnTerminate := false;
+  FName  := AName;
+  FWork  := AWork;
+  FState := jsRunning;
+End;
+
+Procedure TJob.Execute;
+Var RT : TRealTimeSaved;
+Begin
+  RT := RealTimeEnter;
+  try
+    FWork(Self);
+    FState := jsDone;
+  except
+    on E : Exception do
+      Begin
+        FError := E.Message;
+        FState := jsError;
+      End;
+  End;
+  RealTimeLeave(RT);
+End;
+
+(**
+ * Update the number of transferred bytes, called by the work method
+ *)
+Procedure TJob.Progress(ADone:LongInt);
+Begin
+  InterLockedExchange(FDone,ADone);
+End;
+
+{ TJobList }
+
+Constructor TJobList.Create;
+Begin
+  inherited Create;
+  FJobs := TList.Create;
+End;
+
+Destructor TJobList.Destroy;
+Begin
+  WaitAll;
+  while FJobs.Count > 0 do
+    Remove(TJob(FJobs[0]));
+  FJobs.Free;
+  inherited Destroy;
+End;
+
+Function TJobList.GetCount : Integer;
+Begin
+  Result := FJobs.Count;
+End;
+
+Function TJobList.GetJob(Index:Integer) : TJob;
+Begin
+  Result := TJob(FJobs[Index]);
+End;
+
+(**
+ * Assign an ID to the job and start its thread
+ *)
+Function TJobList.Start(AJob:TJob) : Integer;
+Begin
+  Inc(FNextId);
+  AJob.FId := FNextId;
+  FJobs.Add(AJob);
+  AJob.Start;
+  Result := AJob.FId;
+End;
+
+Function TJobList.Find(AId:Integer) : TJob;
+Var I : Integer;
+Begin
+  For I := 0 to FJobs.Count-1 do
+    if TJob(FJobs[I]).FId = AId then
+      Exit(TJob(FJobs[I]));
+  raise Exception.CreateFmt('Unknown job %d',[AId]);
+End;
+
+Procedure TJobList.Remove(AJob:TJob);
+Begin
+  AJob.WaitFor;
+  FJobs.Remove(AJob);
+  AJob.Free;
+End;
+
+(**
+ * Wait until all jobs have finished, e.g. before a device is closed
+ *)
+Procedure TJobList.WaitAll;
+Var I : Integer;
+Begin
+  For I := 0 to FJobs.Count-1 do
+    TJob(FJobs[I]).WaitFor;
+End;
+
+Function TJobList.Running : Integer;
+Var I : Integer;
+Begin
+  Result := 0;
+  For I := 0 to FJobs.Count-1 do
+    if not TJob(FJobs[I]).Finished then
+      Inc(Result);
+End;
+
+End.
@@ -0,0 +1,307 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Per-command latency profiler for the Tcl commands
+ *
+ * Every call of a Tcl command implemented by eztool is measured and split up
+ * into
+ *   args    from the start of the command to its first USB transfer, i.e.
+ *           mostly argument conversion and preparation
+ *   usb     time spent in USB transfers (measured by the trace hooks)
+ *   output  time spent in HexDump and in writing to Output (WriteLn etc.)
+ *   other   the rest, e.g. result conversion
+ *
+ * Commands called from within a command (e.g. the callbacks of jobs) are
+ * measured separately, their times are also included in the caller.
+ *
+ * Writes to Output are measured by replacing its InOutFunc and FlushFunc for
+ * the duration of the outermost command. The formatting of WriteLn into the
+ * text buffer isn't included, only the writes of the buffer.
+ *)
+Unit Profiler;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math, Utils, UsbTrace;
+
+Const
+  PROFILE_MAX_SAMPLES = 100000;   // per command, then reservoir sampling
+
+Type
+  TProfileFrame = record
+    Start  : UInt64;
+    Usb    : UInt64;
+    First  : UInt64;
+    Output : UInt64;
+    Hooked : Boolean;   // this frame installed the Output hook
+  End;
+
+  { TCmdProfile }
+
+  TCmdProfile = class
+    Count   : Int64;
+    Total   : UInt64;
+    Args    : UInt64;
+    Usb     : UInt64;
+    Output  : UInt64;
+    MinTime : LongWord;            // us, exact, unlike the sampled percentiles
+    MaxTime : LongWord;            // us
+    Samples : Array of LongWord;   // durations in us
+    NumSamples : Integer;
+    Procedure Add(ATotal,AArgs,AUsb,AOutput:UInt64);
+    Function  Percentile(P:Integer) : LongWord;
+  End;
+
+  { TProfiler }
+
+  TProfiler = class
+  private
+    FCommands : TStringList;
+    FEnabled  : Boolean;
+    Procedure SetEnabled(AEnabled:Boolean);
+  public
+    Constructor Create;
+    Destructor  Destroy; override;
+    Function  Enter : TProfileFrame;
+    Procedure Leave(Const AName:String;Const Saved:TProfileFrame);
+    Procedure Reset;
+    Procedure Report;
+    property Enabled : Boolean read FEnabled write SetEnabled;
+  End;
+
+Implementation
+
+Type
+  TTextIOFunc = Procedure(Var T:TextRec);
+
+Var
+  OrigInOut : TTextIOFunc;
+  OrigFlush : TTextIOFunc;
+
+Procedure ProfileInOut(Var T:TextRec);
+Var S : UInt64;
+Begin
+  S := GetUSec;
+  OrigInOut(T);
+  if not InHexDump then
+    HexDumpTime += GetUSec - S;
+End;
+
+Procedure ProfileFlush(Var T:TextRec);
+Var S : UInt64;
+Begin
+  S := GetUSec;
+  OrigFlush(T);
+  if not InHexDump then
+    HexDumpTime += GetUSec - S;
+End;
+
+(**
+ * Install the hooks on Output, @return false if they are already installed
+ *)
+Function HookOutput : Boolean;
+Begin
+  With TextRec(Output) do
+    Begin
+      if InOutFunc = CodePointer(@ProfileInOut) then
+        Exit(false);
+      OrigInOut := TTextIOFunc(InOutFunc);
+      OrigFlush := TTextIOFunc(FlushFunc);
+      InOutFunc := CodePointer(@ProfileInOut);
+      if Assigned(FlushFunc) then
+        FlushFunc := CodePointer(@ProfileFlush);
+    End;
+  Result := true;
+End;
+
+Procedure UnhookOutput;
+Begin
+  With TextRec(Output) do
+    Begin
+      if InOutFunc = CodePointer(@ProfileInOut) then
+        InOutFunc := CodePointer(OrigInOut);
+      if FlushFunc = CodePointer(@ProfileFlush) then
+        FlushFunc := CodePointer(OrigFlush);
+    End;
+End;
+
+{ TCmdProfile }
+
+Procedure TCmdProfile.Add(ATotal,AArgs,AUsb,AOutput:UInt64);
+Var I : Int64;
+    D : LongWord;
+Begin
+  if ATotal > High(LongWord) then
+    D := High(LongWord)
+  else
+    D := ATotal;
+  if (Count = 0) or (D < MinTime) then
+    MinTime := D;
+  if D > MaxTime then
+    MaxTime := D;
+  Inc(Count);
+  Total  += ATotal;
+  Args   += AArgs;
+  Usb    += AUsb;
+  Output += AOutput;
+  if NumSamples < PROFILE_MAX_SAMPLES then
+    Begin
+      if NumSamples = Length(Samples) then
+        SetLength(Samples,Max(64,2*NumSamples));
+      Samples[NumSamples] := D;
+      Inc(NumSamples);
+    End
+  else
+    Begin
+      // keep a uniform sample of all calls
+      I := Random(Count);
+      if I < PROFILE_MAX_SAMPLES then
+        Samples[I] := D;
+    End;
+End;
+
+(**
+ * P-th percentile of the durations, the samples must be sorted
+ *)
+Function TCmdProfile.Percentile(P:Integer) : LongWord;
+Begin
+  if NumSamples = 0 then
+    Exit(0);
+  Result := Samples[Min(NumSamples-1,(NumSamples*P) div 100)];
+End;
+
+{ TProfiler }
+
+Constructor TProfiler.Create;
+Begin
+  inherited Create;
+  FCommands := TStringList.Create;
+  FCommands.OwnsObjects := true;
+  FCommands.Sorted := true;
+End;
+
+Destructor TProfiler.Destroy;
+Begin
+  SetEnabled(false);
+  FCommands.Free;
+  inherited Destroy;
+End;
+
+Procedure TProfiler.SetEnabled(AEnabled:Boolean);
+Begin
+  FEnabled := AEnabled;
+  Trace.Profiling  := AEnabled;
+  HexDumpProfiling := AEnabled;
+End;
+
+(**
+ * Start measuring a command
+ *
+ * @return counters of the calling command, to be passed to Leave
+ *)
+Function TProfiler.Enter : TProfileFrame;
+Begin
+  Result.Usb    := ProfileUsbTime;
+  Result.First  := ProfileFirstSubmit;
+  Result.Output := HexDumpTime;
+  ProfileUsbTime     := 0;
+  ProfileFirstSubmit := 0;
+  HexDumpTime        := 0;
+  Result.Hooked := HookOutput;
+  Result.Start := GetUSec;
+End;
+
+Procedure TProfiler.Leave(Const AName:String;Const Saved:TProfileFrame);
+Var Total : UInt64;
+    Args  : UInt64;
+    I     : Integer;
+Begin
+  Total := GetUSec - Saved.Start;
+  if Saved.Hooked then
+    UnhookOutput;
+  if ProfileFirstSubmit > Saved.Start then
+    Args := ProfileFirstSubmit - Saved.Start
+  else
+    Args := 0;
+  if not FCommands.Find(AName,I) then
+    I := FCommands.AddObject(AName,TCmdProfile.Create);
+  TCmdProfile(FCommands.Objects[I]).Add(Total,Args,ProfileUsbTime,HexDumpTime);
+  // the caller's times include this command
+  ProfileUsbTime += Saved.Usb;
+  HexDumpTime    += Saved.Output;
+  if Saved.First <> 0 then
+    ProfileFirstSubmit := Saved.First;
+End;
+
+Procedure TProfiler.Reset;
+Begin
+  FCommands.Clear;
+End;
+
+(**
+ * Print the statistics of all commands, sorted by their total time
+ *)
+Procedure TProfiler.Report;
+Var Order : TList;
+    I,J   : Integer;
+    P     : TCmdProfile;
+    Other : Int64;
+
+  Function Percent(Part:UInt64) : Double;
+  Begin
+    if P.Total = 0 then
+      Result := 0
+    else
+      Result := 100.0 * Part / P.Total;
+  End;
+
+Begin
+  Order := TList.Create;
+  try
+    For I := 0 to FCommands.Count-1 do
+      Order.Add(Pointer(PtrInt(I)));
+    // few commands, simple selection sort by total time
+    For I := 0 to Order.Count-2 do
+      For J := I+1 to Order.Count-1 do
+        if TCmdProfile(FCommands.Objects[PtrInt(Order[J])]).Total >
+           TCmdProfile(FCommands.Objects[PtrInt(Order[I])]).Total then
+          Order.Exchange(I,J);
+    WriteLn('Command         Count   Total [ms]  Mean [us]   Min [us]   p50 [us]   p90 [us]   p99 [us]   Max [us]   Args%   USB%  Output%  Other%');
+    For I := 0 to Order.Count-1 do
+      Begin
+        P := TCmdProfile(FCommands.Objects[PtrInt(Order[I])]);
+        if P.NumSamples > 0 then
+          SortSamples(P.Samples,0,P.NumSamples-1);
+        Other := Int64(P.Total) - Int64(P.Args) - Int64(P.Usb) - Int64(P.Output);
+        if Other < 0 then Other := 0;
+        WriteLn(Format('%-12s %8d %12.3f %10d %10d %10d %10d %10d %10d %7.1f %6.1f %8.1f %7.1f',
+          [FCommands[PtrInt(Order[I])],P.Count,P.Total/1000.0,P.Total div Max(1,P.Count),
+           P.MinTime,P.Percentile(50),P.Percentile(90),P.Percentile(99),P.MaxTime,
+           Percent(P.Args),Percent(P.Usb),Percent(P.Output),Percent(Other)]));
+      End;
+  finally
+    Order.Free;
+  End;
+End;
+
+End.
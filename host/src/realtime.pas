@@ -0,0 +1,326 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Real-time mode for the threads which do the USB transfers of streams
+ *
+ * While the real-time mode is enabled, the memory of the process is locked
+ * (mlockall) and every transfer thread (the jobs, the workers of usbbench and
+ * controlburst and the receive loop of "i2clog run") switches itself to
+ * SCHED_FIFO and optionally to a single CPU with RealTimeEnter. RealTimeLeave
+ * restores the previous scheduling of the thread.
+ *
+ * All transfers are synchronous, therefore the "transfer thread" is the
+ * thread which calls libusb, there is no separate event thread.
+ *
+ * Every stream counts its packets, the overruns (data lost because the host
+ * didn't fetch or deliver it in time) and the largest gap between two
+ * packets, to show whether the real-time mode helps.
+ *)
+Unit RealTime;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math, BaseUnix, InitC, Utils;
+
+Const
+  RT_MAX_STREAMS = 16;
+
+Type
+  TRealTimeConfig = record
+    Enabled    : Boolean;
+    Priority   : Integer;   // SCHED_FIFO priority, 1 to 99
+    CPU        : Integer;   // pin the transfer threads to this CPU, -1: don't pin
+    LockMemory : Boolean;   // mlockall while enabled
+  End;
+
+  TCpuSet = Array[0..127] of Byte;   // cpu_set_t, 1024 CPUs
+
+  TRealTimeSaved = record
+    Active   : Boolean;
+    Policy   : cint;
+    Priority : cint;
+    Pinned   : Boolean;
+    Mask     : TCpuSet;
+  End;
+
+  TStreamCounters = record
+    Name     : String;
+    Packets  : Int64;
+    Bytes    : Int64;
+    Overruns : Int64;
+    Timeouts : Int64;
+    MaxGap   : LongWord;   // us between two packets
+    Last     : UInt64;
+  End;
+  PStreamCounters = ^TStreamCounters;
+
+Var
+  RealTimeConfig : TRealTimeConfig = (Enabled:false; Priority:50; CPU:-1; LockMemory:true);
+  RealTimeLocked : Boolean = false;
+
+Function  RealTimeEnable(AEnable:Boolean) : String;
+Function  RealTimeEnter : TRealTimeSaved;
+Procedure RealTimeLeave(Const Saved:TRealTimeSaved);
+Procedure Prefault(P:Pointer;Len:PtrUInt);
+
+Function  StreamCounters(Const AName:String) : PStreamCounters;
+Procedure StreamStart(S:PStreamCounters);
+Procedure StreamPacket(S:PStreamCounters;ABytes:Int64);
+Procedure StreamOverrun(S:PStreamCounters;ACount:Int64);
+Procedure StreamAdd(S:PStreamCounters;APackets,ABytes,AOverruns,ATimeouts:Int64;AMaxGap:LongWord);
+Procedure StreamReset;
+Procedure StreamReport;
+
+Implementation
+
+Const
+  SCHED_OTHER = 0;
+  SCHED_FIFO  = 1;
+  MCL_CURRENT = 1;
+  MCL_FUTURE  = 2;
+
+Type
+  TSchedParam = record
+    sched_priority : cint;
+  End;
+
+{ pid 0 is the calling thread for these on Linux }
+Function sched_setscheduler(Pid:pid_t;Policy:cint;Param:Pointer) : cint; cdecl; external 'c';
+Function sched_getscheduler(Pid:pid_t) : cint; cdecl; external 'c';
+Function sched_getparam(Pid:pid_t;Param:Pointer) : cint; cdecl; external 'c';
+Function sched_setaffinity(Pid:pid_t;Size:size_t;Mask:Pointer) : cint; cdecl; external 'c';
+Function sched_getaffinity(Pid:pid_t;Size:size_t;Mask:Pointer) : cint; cdecl; external 'c';
+Function mlockall(Flags:cint) : cint; cdecl; external 'c';
+Function munlockall : cint; cdecl; external 'c';
+
+Var
+  Streams     : Array[0..RT_MAX_STREAMS-1] of TStreamCounters;
+  NumStreams  : Integer;
+  StreamsLock : TRTLCriticalSection;
+  WarnedSched : Boolean;
+
+(**
+ * Switch the real-time mode on or off
+ *
+ * @return  a warning if the memory could not be locked (e.g. missing
+ *          CAP_IPC_LOCK or RLIMIT_MEMLOCK too small), otherwise ''
+ *)
+Function RealTimeEnable(AEnable:Boolean) : String;
+Begin
+  Result := '';
+  RealTimeConfig.Enabled := AEnable;
+  WarnedSched := false;
+  if AEnable and RealTimeConfig.LockMemory and not RealTimeLocked then
+    Begin
+      if mlockall(MCL_CURRENT or MCL_FUTURE) = 0 then
+        RealTimeLocked := true
+      else
+        Result := 'Couldn''t lock memory: ' + SysErrorMessage(fpgetCerrno);
+    End
+  else if not (AEnable and RealTimeConfig.LockMemory) and RealTimeLocked then
+    Begin
+      munlockall;
+      RealTimeLocked := false;
+    End;
+End;
+
+(**
+ * Switch the calling thread to SCHED_FIFO and pin it to the configured CPU
+ *
+ * Nothing is done if the real-time mode is off. If the thread isn't allowed
+ * to (EPERM, see RLIMIT_RTPRIO), a warning is printed once and the thread
+ * continues with its normal scheduling.
+ *)
+Function RealTimeEnter : TRealTimeSaved;
+Var Param : TSchedParam;
+    Mask  : TCpuSet;
+Begin
+  Result.Active := false;
+  Result.Pinned := false;
+  if not RealTimeConfig.Enabled then
+    Exit;
+  Result.Policy := sched_getscheduler(0);
+  Param.sched_priority := 0;
+  sched_getparam(0,@Param);
+  Result.Priority := Param.sched_priority;
+  Param.sched_priority := EnsureRange(RealTimeConfig.Priority,1,99);
+  if sched_setscheduler(0,SCHED_FIFO,@Param) = 0 then
+    Result.Active := true
+  else if not WarnedSched then
+    Begin
+      WarnedSched := true;
+      WriteLn(ErrOutput,'Warning: Couldn''t set SCHED_FIFO: ',SysErrorMessage(fpgetCerrno));
+    End;
+  if (RealTimeConfig.CPU >= 0) and (RealTimeConfig.CPU < 8*SizeOf(Mask)) and
+     (sched_getaffinity(0,SizeOf(Result.Mask),@Result.Mask) = 0) then
+    Begin
+      FillChar(Mask,SizeOf(Mask),0);
+      Mask[RealTimeConfig.CPU shr 3] := 1 shl (RealTimeConfig.CPU and 7);
+      Result.Pinned := (sched_setaffinity(0,SizeOf(Mask),@Mask) = 0);
+    End;
+End;
+
+Procedure RealTimeLeave(Const Saved:TRealTimeSaved);
+Var Param : TSchedParam;
+Begin
+  if Saved.Pinned then
+    sched_setaffinity(0,SizeOf(Saved.Mask),@Saved.Mask);
+  if Saved.Active then
+    Begin
+      Param.sched_priority := Saved.Priority;
+      if sched_setscheduler(0,Saved.Policy,@Param) <> 0 then
+        Begin
+          Param.sched_priority := 0;
+          sched_setscheduler(0,SCHED_OTHER,@Param);
+        End;
+    End;
+End;
+
+(**
+ * Touch every page of a buffer, so that no page faults happen while
+ * streaming
+ *
+ * The content is not changed.
+ *)
+Procedure Prefault(P:Pointer;Len:PtrUInt);
+Var I : PtrUInt;
+    B : PByte;
+Begin
+  if Len = 0 then
+    Exit;
+  B := P;
+  I := 0;
+  while I < Len do
+    Begin
+      B[I] := B[I];
+      I += 4096;
+    End;
+  B[Len-1] := B[Len-1];
+End;
+
+(**
+ * Find or create the counters of a stream
+ *)
+Function StreamCounters(Const AName:String) : PStreamCounters;
+Var I : Integer;
+Begin
+  EnterCriticalSection(StreamsLock);
+  try
+    For I := 0 to NumStreams-1 do
+      if Streams[I].Name = AName then
+        Exit(@Streams[I]);
+    if NumStreams = RT_MAX_STREAMS then
+      raise Exception.Create('Too many streams');
+    Result := @Streams[NumStreams];
+    Inc(NumStreams);
+    Result^ := Default(TStreamCounters);
+    Result^.Name := AName;
+  finally
+    LeaveCriticalSection(StreamsLock);
+  End;
+End;
+
+(**
+ * Start a new run of a stream, the gap to the previous run is not counted
+ *
+ * All updates take StreamsLock like StreamReset, it is uncontended except
+ * during a reset or report, so the transfer loops don't block on it.
+ *)
+Procedure StreamStart(S:PStreamCounters);
+Begin
+  EnterCriticalSection(StreamsLock);
+  S^.Last := GetUSec;
+  LeaveCriticalSection(StreamsLock);
+End;
+
+Procedure StreamPacket(S:PStreamCounters;ABytes:Int64);
+Var Now : UInt64;
+Begin
+  Now := GetUSec;
+  EnterCriticalSection(StreamsLock);
+  if Now - S^.Last > S^.MaxGap then
+    S^.MaxGap := Min(Now - S^.Last,UInt64(High(LongWord)));
+  S^.Last := Now;
+  Inc(S^.Packets);
+  S^.Bytes += ABytes;
+  LeaveCriticalSection(StreamsLock);
+End;
+
+Procedure StreamOverrun(S:PStreamCounters;ACount:Int64);
+Begin
+  EnterCriticalSection(StreamsLock);
+  S^.Overruns += ACount;
+  LeaveCriticalSection(StreamsLock);
+End;
+
+(**
+ * Add the totals of a run, for streams with several transfer threads
+ *)
+Procedure StreamAdd(S:PStreamCounters;APackets,ABytes,AOverruns,ATimeouts:Int64;AMaxGap:LongWord);
+Begin
+  EnterCriticalSection(StreamsLock);
+  S^.Packets  += APackets;
+  S^.Bytes    += ABytes;
+  S^.Overruns += AOverruns;
+  S^.Timeouts += ATimeouts;
+  if AMaxGap > S^.MaxGap then
+    S^.MaxGap := AMaxGap;
+  LeaveCriticalSection(StreamsLock);
+End;
+
+Procedure StreamReset;
+Var I : Integer;
+Begin
+  EnterCriticalSection(StreamsLock);
+  For I := 0 to NumStreams-1 do
+    Begin
+      Streams[I].Packets  := 0;
+      Streams[I].Bytes    := 0;
+      Streams[I].Overruns := 0;
+      Streams[I].Timeouts := 0;
+      Streams[I].MaxGap   := 0;
+    End;
+  LeaveCriticalSection(StreamsLock);
+End;
+
+Procedure StreamReport;
+Var I    : Integer;
+    Snap : Array of TStreamCounters;
+Begin
+  // don't print while holding the lock of the transfer loops
+  EnterCriticalSection(StreamsLock);
+  SetLength(Snap,NumStreams);
+  For I := 0 to NumStreams-1 do
+    Snap[I] := Streams[I];
+  LeaveCriticalSection(StreamsLock);
+  WriteLn('Stream          Packets        Bytes   Overruns   Timeouts  Max gap [us]');
+  For I := 0 to High(Snap) do
+    With Snap[I] do
+      WriteLn(Format('%-12s %10d %12d %10d %10d %13d',[Name,Packets,Bytes,Overruns,Timeouts,MaxGap]));
+End;
+
+Initialization
+  InitCriticalSection(StreamsLock);
+Finalization
+  DoneCriticalSection(StreamsLock);
+End.
@@ -0,0 +1,338 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Recording and replay of USB sessions
+ *
+ * The recorder is attached to the global Trace object and gets every control
+ * and bulk transfer of TEZToolDevice and TUSBDeviceDebug with its complete
+ * payload. A session file starts with the 8 byte magic "EZSESS01", followed
+ * by one TSessionOpHeader and its data bytes per transfer (host byte order).
+ *
+ * The replay re-issues the transfers to a TReplayTarget, either the real
+ * device or a simulation which answers with the recorded data.
+ *)
+Unit Session;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, LibUsb, UsbTrace, Device, USBDeviceDebug, Utils;
+
+Const
+  SESSION_MAGIC = 'EZSESS01';
+
+Type
+  TSessionOpHeader = packed record
+    Offset   : QWord;     // submission relative to the start of the recording in us
+    Duration : LongWord;  // from submission to completion in us
+    XferType : Byte;      // TRACE_XFER_*
+    EP       : Byte;      // including direction bit, 0x00 or 0x80 for control
+    Setup    : TUsbSetup; // only for control transfers
+    Length   : LongInt;   // requested length
+    Status   : LongInt;   // transferred length or libusb error code
+    DataLen  : LongInt;   // number of data bytes following
+  End;
+
+  TSessionOp = record
+    Hdr  : TSessionOpHeader;
+    Data : AnsiString;    // OUT: sent bytes, IN: received bytes
+  End;
+  TSessionOps = Array of TSessionOp;
+
+  { TSessionRecorder }
+
+  TSessionRecorder = class(TTraceRecorder)
+  private
+    FLock     : TRTLCriticalSection;
+    FStream   : TMemoryStream;
+    FFilename : String;
+    FStart    : UInt64;
+    FCount    : Integer;
+  public
+    Constructor Create(AFilename:String);
+    Destructor  Destroy; override;
+    Procedure Transfer(ADev:Plibusb_device;ASubmit,AComplete:UInt64;AXferType,AEP:Byte;Const Setup:TUsbSetup;Buf:Pointer;ALength,AStatus:LongInt); override;
+    Procedure Save;
+    property Filename : String  read FFilename;
+    property Count    : Integer read FCount;
+  End;
+
+  { TReplayTarget }
+
+  TReplayTarget = class
+    (**
+     * Execute a transfer, Buf holds the data to send or receives the data
+     *
+     * @return number of bytes transferred or a libusb error code
+     *)
+    Function Transfer(Const Op:TSessionOp;Var Buf:AnsiString) : LongInt; virtual; abstract;
+  End;
+
+  TReplayEZTool = class(TReplayTarget)
+  private
+    FDevice : TEZToolDevice;
+  public
+    Constructor Create(ADevice:TEZToolDevice);
+    Function Transfer(Const Op:TSessionOp;Var Buf:AnsiString) : LongInt; override;
+  End;
+
+  TReplayUser = class(TReplayTarget)
+  private
+    FDevice : TUSBDeviceDebug;
+  public
+    Constructor Create(ADevice:TUSBDeviceDebug);
+    Function Transfer(Const Op:TSessionOp;Var Buf:AnsiString) : LongInt; override;
+  End;
+
+  (**
+   * Simulated device, answers with the recorded status and data
+   *
+   * With ALatency every transfer takes as long as recorded, otherwise the
+   * replay measures only the host side.
+   *)
+  TReplaySim = class(TReplayTarget)
+  private
+    FLatency : Boolean;
+  public
+    Constructor Create(ALatency:Boolean);
+    Function Transfer(Const Op:TSessionOp;Var Buf:AnsiString) : LongInt; override;
+  End;
+
+  TReplayResult = record
+    Recorded   : UInt64;              // duration of the recording in us
+    Replayed   : UInt64;              // duration of the replay in us
+    Mismatches : Integer;             // status or IN data differs
+    Durations  : Array of LongWord;   // replay duration of every transfer
+    Mismatch   : Array of Boolean;
+  End;
+
+Function LoadSession(AFilename:String) : TSessionOps;
+Function ReplaySession(Const Ops:TSessionOps;Target:TReplayTarget;Realtime:Boolean) : TReplayResult;
+
+Implementation
+
+{ TSessionRecorder }
+
+Constructor TSessionRecorder.Create(AFilename:String);
+Begin
+  inherited Create;
+  InitCriticalSection(FLock);
+  FFilename := AFilename;
+  FStream   := TMemoryStream.Create;
+  FStream.WriteBuffer(SESSION_MAGIC[1],Length(SESSION_MAGIC));
+  FStart    := GetUSec;
+End;
+
+Destructor TSessionRecorder.Destroy;
+Begin
+  FStream.Free;
+  DoneCriticalSection(FLock);
+  inherited Destroy;
+End;
+
+(**
+ * Called by TUsbTrace from the thread which did the transfer
+ *)
+Procedure TSessionRecorder.Transfer(ADev:Plibusb_device;ASubmit,AComplete:UInt64;AXferType,AEP:Byte;Const Setup:TUsbSetup;Buf:Pointer;ALength,AStatus:LongInt);
+Var Hdr : TSessionOpHeader;
+Begin
+  if ASubmit > FStart then
+    Hdr.Offset := ASubmit - FStart
+  else
+    Hdr.Offset := 0;
+  Hdr.Duration := AComplete - ASubmit;
+  Hdr.XferType := AXferType;
+  Hdr.EP       := AEP;
+  Hdr.Setup    := Setup;
+  Hdr.Length   := ALength;
+  Hdr.Status   := AStatus;
+  // IN: the received bytes, OUT: the sent bytes
+  if AEP and LIBUSB_ENDPOINT_IN <> 0 then
+    Hdr.DataLen := AStatus
+  else
+    Hdr.DataLen := ALength;
+  if (Hdr.DataLen < 0) or (Buf = Nil) then
+    Hdr.DataLen := 0;
+  EnterCriticalSection(FLock);
+  try
+    FStream.WriteBuffer(Hdr,SizeOf(Hdr));
+    if Hdr.DataLen > 0 then
+      FStream.WriteBuffer(Buf^,Hdr.DataLen);
+    Inc(FCount);
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Procedure TSessionRecorder.Save;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    FStream.SaveToFile(FFilename);
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Function LoadSession(AFilename:String) : TSessionOps;
+Var St  : AnsiString;
+    Pos : SizeInt;
+    Len : SizeInt;
+    N   : Integer;
+Begin
+  St := LoadFile(AFilename);
+  if Copy(St,1,Length(SESSION_MAGIC)) <> SESSION_MAGIC then
+    raise Exception.Create(AFilename+' is not a session file');
+  Pos := Length(SESSION_MAGIC)+1;
+  N := 0;
+  SetLength(Result,1024);
+  while Pos <= Length(St) do
+    Begin
+      if Pos + SizeOf(TSessionOpHeader) - 1 > Length(St) then
+        raise Exception.Create(AFilename+' is truncated');
+      if N = Length(Result) then
+        SetLength(Result,2*N);
+      Move(St[Pos],Result[N].Hdr,SizeOf(TSessionOpHeader));
+      Inc(Pos,SizeOf(TSessionOpHeader));
+      Len := Result[N].Hdr.DataLen;
+      if (Len < 0) or (Pos + Len - 1 > Length(St)) then
+        raise Exception.Create(AFilename+' is truncated');
+      Result[N].Data := Copy(St,Pos,Len);
+      Inc(Pos,Len);
+      Inc(N);
+    End;
+  SetLength(Result,N);
+End;
+
+{ TReplayEZTool }
+
+Constructor TReplayEZTool.Create(ADevice:TEZToolDevice);
+Begin
+  inherited Create;
+  FDevice := ADevice;
+End;
+
+Function TReplayEZTool.Transfer(Const Op:TSessionOp;Var Buf:AnsiString) : LongInt;
+Begin
+  if Op.Hdr.XferType = TRACE_XFER_CONTROL then
+    Result := FDevice.RawCommand(Op.Hdr.Setup)
+  else
+    Result := FDevice.RawBulk(Op.Hdr.EP,PChar(Buf)^,Op.Hdr.Length);
+End;
+
+{ TReplayUser }
+
+Constructor TReplayUser.Create(ADevice:TUSBDeviceDebug);
+Begin
+  inherited Create;
+  FDevice := ADevice;
+End;
+
+Function TReplayUser.Transfer(Const Op:TSessionOp;Var Buf:AnsiString) : LongInt;
+Begin
+  With Op.Hdr do
+    if XferType = TRACE_XFER_CONTROL then
+      Result := FDevice.ControlMsg(Setup.bmRequestType,Setup.bRequest,Setup.wValue,Setup.wIndex,PChar(Buf)^,Length,1000)
+    else if EP and LIBUSB_ENDPOINT_IN <> 0 then
+      Result := FDevice.BulkIn(EP,PChar(Buf)^,Length,1000)
+    else
+      Result := FDevice.BulkOut(EP,PChar(Buf)^,Length,1000);
+End;
+
+{ TReplaySim }
+
+Constructor TReplaySim.Create(ALatency:Boolean);
+Begin
+  inherited Create;
+  FLatency := ALatency;
+End;
+
+Function TReplaySim.Transfer(Const Op:TSessionOp;Var Buf:AnsiString) : LongInt;
+Var T : UInt64;
+Begin
+  T := GetUSec;
+  if Op.Hdr.EP and LIBUSB_ENDPOINT_IN <> 0 then
+    Buf := Op.Data;
+  Result := Op.Hdr.Status;
+  if FLatency then
+    while GetUSec - T < Op.Hdr.Duration do ;
+End;
+
+(**
+ * Wait until the given time, sleep for the most part and spin for the rest
+ *)
+Procedure WaitUntil(T:UInt64);
+Var Now : UInt64;
+Begin
+  repeat
+    Now := GetUSec;
+    if Now >= T then
+      Exit;
+    if T - Now > 2000 then
+      Sleep((T - Now) div 1000 - 1);
+  until false;
+End;
+
+(**
+ * Re-issue the transfers of a session
+ *
+ * @param Realtime  keep the original gaps between the transfers, otherwise
+ *                  as fast as possible
+ *)
+Function ReplaySession(Const Ops:TSessionOps;Target:TReplayTarget;Realtime:Boolean) : TReplayResult;
+Var Start : UInt64;
+    T     : UInt64;
+    I     : Integer;
+    R     : LongInt;
+    Buf   : AnsiString;
+Begin
+  SetLength(Result.Durations,Length(Ops));
+  SetLength(Result.Mismatch, Length(Ops));
+  Result.Mismatches := 0;
+  Result.Recorded   := 0;
+  if Length(Ops) > 0 then
+    Result.Recorded := Ops[High(Ops)].Hdr.Offset + Ops[High(Ops)].Hdr.Duration;
+  Start := GetUSec;
+  For I := 0 to High(Ops) do
+    Begin
+      if Realtime then
+        WaitUntil(Start + Ops[I].Hdr.Offset);
+      // buffer for the received bytes or copy of the bytes to send
+      if Ops[I].Hdr.EP and LIBUSB_ENDPOINT_IN <> 0 then
+        Buf := StringOfChar(#0,Ops[I].Hdr.Length)
+      else
+        Buf := Ops[I].Data;
+      UniqueString(Buf);
+      T := GetUSec;
+      R := Target.Transfer(Ops[I],Buf);
+      Result.Durations[I] := GetUSec - T;
+      if (Ops[I].Hdr.EP and LIBUSB_ENDPOINT_IN <> 0) and (R >= 0) then
+        SetLength(Buf,R);
+      Result.Mismatch[I] := (R <> Ops[I].Hdr.Status) or
+        ((Ops[I].Hdr.EP and LIBUSB_ENDPOINT_IN <> 0) and (Buf <> Ops[I].Data));
+      if Result.Mismatch[I] then
+        Inc(Result.Mismatches);
+    End;
+  Result.Replayed := GetUSec - Start;
+End;
+
+End.
@@ -0,0 +1,288 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Page granular host-side shadow of a device memory
+ *
+ * Only pages which were added with AddRegion are cached, all other accesses
+ * go directly to the device. Every page has a valid and a dirty bit. In
+ * write-back mode, writes only modify the shadow and Flush writes the dirty
+ * pages as a whole, i.e. scattered small writes are coalesced to one write
+ * per page. In write-through mode every write goes to the device immediately.
+ *)
+Unit ShadowCache;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math;
+
+Type
+  TCacheReadFunc  = Procedure(Addr:Word;Out   Buf;Len:Word) of object;
+  TCacheWriteFunc = Procedure(Addr:Word;Const Buf;Len:Word) of object;
+
+  { TShadowCache }
+
+  TShadowCache = class
+  private
+    FPageSize     : Word;
+    FData         : Array of Byte;
+    FCacheable    : Array of Boolean;
+    FValid        : Array of Boolean;
+    FDirty        : Array of Boolean;
+    FEnabled      : Boolean;
+    FWriteThrough : Boolean;
+    FReadFunc     : TCacheReadFunc;
+    FWriteFunc    : TCacheWriteFunc;
+    FHits         : Cardinal;
+    FMisses       : Cardinal;
+    FPageWrites   : Cardinal;
+    Function  Cacheable(Addr,Len:Cardinal) : Boolean;
+    Procedure Fill(Page:Cardinal);
+    Procedure FlushPage(Page:Cardinal);
+    Procedure SetEnabled(AEnabled:Boolean);
+    Function  GetDirtyPages : Cardinal;
+  public
+    Constructor Create(ASize:Cardinal;APageSize:Word;ARead:TCacheReadFunc;AWrite:TCacheWriteFunc);
+    Procedure AddRegion(AStart,ALength:Cardinal);
+    Procedure ClearRegions;
+    Procedure Read (Addr:Word;Out   Buf;Len:Word);
+    Procedure Write(Addr:Word;Const Buf;Len:Word);
+    Procedure Flush;
+    Procedure Invalidate;
+    Procedure Invalidate(Addr,Len:Cardinal);
+    Function  Regions : String;
+    property Enabled      : Boolean  read FEnabled      write SetEnabled;
+    property WriteThrough : Boolean  read FWriteThrough write FWriteThrough;
+    property PageSize     : Word     read FPageSize;
+    property Hits         : Cardinal read FHits;
+    property Misses       : Cardinal read FMisses;
+    property PageWrites   : Cardinal read FPageWrites;
+    property DirtyPages   : Cardinal read GetDirtyPages;
+  End;
+
+Implementation
+
+{ TShadowCache }
+
+(**
+ * Constructor
+ *
+ * @param ASize      size of the address space in bytes
+ * @param APageSize  page size in bytes, ASize must be a multiple of it
+ * @param ARead      reads from the device, never across a page boundary
+ * @param AWrite     writes to the device, never across a page boundary
+ *)
+Constructor TShadowCache.Create(ASize:Cardinal;APageSize:Word;ARead:TCacheReadFunc;AWrite:TCacheWriteFunc);
+Begin
+  inherited Create;
+  FPageSize  := APageSize;
+  FReadFunc  := ARead;
+  FWriteFunc := AWrite;
+  SetLength(FData,     ASize);
+  SetLength(FCacheable,ASize div APageSize);
+  SetLength(FValid,    ASize div APageSize);
+  SetLength(FDirty,    ASize div APageSize);
+End;
+
+(**
+ * Mark all pages which overlap the given range as cacheable
+ *)
+Procedure TShadowCache.AddRegion(AStart,ALength:Cardinal);
+Var Page : Cardinal;
+Begin
+  if (ALength = 0) or (AStart + ALength > Length(FData)) then
+    raise Exception.Create('Region exceeds the address space');
+  For Page := AStart div FPageSize to (AStart+ALength-1) div FPageSize do
+    FCacheable[Page] := true;
+End;
+
+Procedure TShadowCache.ClearRegions;
+Var Page : Cardinal;
+Begin
+  Flush;
+  Invalidate;
+  For Page := 0 to High(FCacheable) do
+    FCacheable[Page] := false;
+End;
+
+Function TShadowCache.Cacheable(Addr,Len:Cardinal) : Boolean;
+Var Page : Cardinal;
+Begin
+  if not FEnabled or (Len = 0) or (Addr + Len > Length(FData)) then
+    Exit(false);
+  For Page := Addr div FPageSize to (Addr+Len-1) div FPageSize do
+    if not FCacheable[Page] then
+      Exit(false);
+  Result := true;
+End;
+
+Procedure TShadowCache.Fill(Page:Cardinal);
+Begin
+  FReadFunc(Page*FPageSize,FData[Page*FPageSize],FPageSize);
+  FValid[Page] := true;
+  Inc(FMisses);
+End;
+
+Procedure TShadowCache.FlushPage(Page:Cardinal);
+Begin
+  if not FDirty[Page] then
+    Exit;
+  FWriteFunc(Page*FPageSize,FData[Page*FPageSize],FPageSize);
+  FDirty[Page] := false;
+  Inc(FPageWrites);
+End;
+
+Procedure TShadowCache.Read(Addr:Word;Out Buf;Len:Word);
+Var Page : Cardinal;
+Begin
+  if not Cacheable(Addr,Len) then
+    Begin
+      // the device must see the pending writes first
+      For Page := Addr div FPageSize to (Addr+Max(Len,1)-1) div FPageSize do
+        if Page <= High(FDirty) then
+          FlushPage(Page);
+      FReadFunc(Addr,Buf,Len);
+      Exit;
+    End;
+  For Page := Addr div FPageSize to (Addr+Len-1) div FPageSize do
+    if FValid[Page] then
+      Inc(FHits)
+    else
+      Fill(Page);
+  Move(FData[Addr],Buf,Len);
+End;
+
+Procedure TShadowCache.Write(Addr:Word;Const Buf;Len:Word);
+Var Page  : Cardinal;
+    Start : Cardinal;
+    Stop  : Cardinal;
+    Src   : PByte;
+Begin
+  if not Cacheable(Addr,Len) then
+    Begin
+      For Page := Addr div FPageSize to (Addr+Max(Len,1)-1) div FPageSize do
+        if Page <= High(FDirty) then
+          Begin
+            FlushPage(Page);
+            FValid[Page] := false;
+          End;
+      FWriteFunc(Addr,Buf,Len);
+      Exit;
+    End;
+  Src := @Buf;
+  For Page := Addr div FPageSize to (Addr+Len-1) div FPageSize do
+    Begin
+      // part of the range within this page
+      Start := Max(Addr,Page*FPageSize);
+      Stop  := Min(Addr+Len,(Page+1)*FPageSize);
+      if FWriteThrough then
+        FWriteFunc(Start,Src[Start-Addr],Stop-Start)
+      else if not FValid[Page] and (Stop-Start < FPageSize) then
+        Fill(Page);   // read-modify-write of a partial page
+      if FValid[Page] or not FWriteThrough then
+        Begin
+          Move(Src[Start-Addr],FData[Start],Stop-Start);
+          FValid[Page] := true;
+          FDirty[Page] := not FWriteThrough;
+        End;
+    End;
+End;
+
+(**
+ * Write all dirty pages to the device
+ *)
+Procedure TShadowCache.Flush;
+Var Page : Cardinal;
+Begin
+  For Page := 0 to High(FDirty) do
+    FlushPage(Page);
+End;
+
+(**
+ * Discard the shadow, dirty pages are lost
+ *)
+Procedure TShadowCache.Invalidate;
+Var Page : Cardinal;
+Begin
+  For Page := 0 to High(FValid) do
+    Begin
+      FValid[Page] := false;
+      FDirty[Page] := false;
+    End;
+End;
+
+Procedure TShadowCache.Invalidate(Addr,Len:Cardinal);
+Var Page : Cardinal;
+Begin
+  if (Len = 0) or (Addr >= Length(FData)) then
+    Exit;
+  For Page := Addr div FPageSize to Min(Addr+Len-1,Length(FData)-1) div FPageSize do
+    Begin
+      FValid[Page] := false;
+      FDirty[Page] := false;
+    End;
+End;
+
+Procedure TShadowCache.SetEnabled(AEnabled:Boolean);
+Begin
+  if not AEnabled then
+    Begin
+      Flush;
+      Invalidate;
+    End;
+  FEnabled := AEnabled;
+End;
+
+Function TShadowCache.GetDirtyPages : Cardinal;
+Var Page : Cardinal;
+Begin
+  Result := 0;
+  For Page := 0 to High(FDirty) do
+    if FDirty[Page] then
+      Inc(Result);
+End;
+
+(**
+ * Cacheable ranges as Tcl list of start address and length pairs
+ *)
+Function TShadowCache.Regions : String;
+Var Page  : Integer;
+    Start : Integer;
+Begin
+  Result := '';
+  Page := 0;
+  while Page <= High(FCacheable) do
+    Begin
+      if not FCacheable[Page] then
+        Begin
+          Inc(Page);
+          Continue;
+        End;
+      Start := Page;
+      while (Page <= High(FCacheable)) and FCacheable[Page] do
+        Inc(Page);
+      if Result > '' then Result += ' ';
+      Result += '0x' + IntToHex(Start*FPageSize,4) + ' ' + IntToStr((Page-Start)*FPageSize);
+    End;
+End;
+
+End.
@@ -0,0 +1,591 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * USB topology: which devices share a host controller or a transaction
+ * translator
+ *
+ * Every bus (libusb bus number) is one host controller. Full- and low-speed
+ * devices behind a high-speed hub share the transaction translator (TT) of
+ * that hub, i.e. its 12 Mbit/s, or the TT of their downstream port if it is
+ * a multi-TT hub. These groups are the bottlenecks for concurrent transfers.
+ *
+ * The topology is read from the libusb device list without talking to the
+ * devices. A device is identified by its path "bus-port.port...", which is
+ * stable as long as the cabling isn't changed.
+ *
+ * As trace recorder, every transfer is counted for its device and groups.
+ * The busy time of a group is the time in which at least one of its
+ * transfers was pending, so bytes / busy time is the bandwidth the group
+ * achieved, regardless of how many devices transferred concurrently. The
+ * recorder is only installed while somebody is interested in the counters,
+ * see "topology on".
+ *)
+Unit Topology;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math, LibUsb, LibUsbOop, UsbTrace, UsbEnum, Utils;
+
+Const
+  TOPO_WINDOW = 16;       // pending intervals which are still merged
+
+Type
+  TTopoInterval = record
+    Start : UInt64;
+    Stop  : UInt64;
+  End;
+
+  TTopoCounters = record
+    Transfers : Int64;
+    Bytes     : Int64;
+    Busy      : UInt64;   // us with at least one pending transfer, without Open
+    Closed    : UInt64;   // end of the latest interval which was added to Busy
+    NumOpen   : Integer;
+    Open      : Array[0..TOPO_WINDOW-1] of TTopoInterval;   // disjoint, sorted
+  End;
+
+  TTopoGroup = record
+    Name     : String;    // "bus 3", "tt 3-1" or "tt 3-1 port 4"
+    Bus      : Byte;
+    Speed    : Integer;   // of the root hub resp. of the hub with the TT
+    IsTT     : Boolean;
+    Devices  : Integer;
+    Counters : TTopoCounters;
+  End;
+
+  TTopoDevice = record
+    Path       : String;  // "3-1.4", "3-0" for the root hub
+    Bus        : Byte;
+    Address    : Byte;
+    Speed      : Integer;
+    idVendor   : Word;
+    idProduct  : Word;
+    IsHub      : Boolean;
+    Controller : Integer; // index of the group of the bus
+    TT         : Integer; // index of the group of the TT, -1 if none
+    Counters   : TTopoCounters;
+  End;
+
+  TScheduleOrder = Array of Integer;
+
+  { TUsbTopology }
+
+  TUsbTopology = class(TTraceRecorder)
+  private
+    FDevices : Array of TTopoDevice;
+    FGroups  : Array of TTopoGroup;
+    FIndex   : Array of Array of Integer;   // [bus][address] -> device, -1 if unknown
+    FLock    : TRTLCriticalSection;
+    Function  FindDevice(Bus:Byte;Const Ports:String) : Integer;
+    Function  AddGroup(Const AName:String;ABus:Byte;ASpeed:Integer;AIsTT:Boolean) : Integer;
+    Function  Bottleneck(Dev:Integer) : Integer;
+    Function  Stats(Const C:TTopoCounters) : String;
+  public
+    Constructor Create;
+    Destructor  Destroy; override;
+    Procedure Scan(Context:TLibUsbContext);
+    Procedure Transfer(ADev:Plibusb_device;ASubmit,AComplete:UInt64;AXferType,AEP:Byte;Const Setup:TUsbSetup;Buf:Pointer;ALength,AStatus:LongInt); override;
+    Procedure Reset;
+    Function  Find(Const AName:String) : Integer;
+    Function  Schedule(Const Devs:Array of Integer) : TScheduleOrder;
+    Function  Path(Dev:Integer) : String;
+    Function  Device(Dev:Integer) : TTopoDevice;
+    Procedure Report;
+    Function  AsDict : AnsiString;
+  End;
+
+Function DevicePath(Dev:Plibusb_device) : String;
+Function BusyTime(Const C:TTopoCounters) : UInt64;
+
+Implementation
+
+Const
+  USB_CLASS_HUB     = 9;
+  HUB_PROTOCOL_MTT  = 2;    // bDeviceProtocol of a multi-TT high-speed hub
+
+Function DevicePath(Dev:Plibusb_device) : String;
+Var Ports : String;
+Begin
+  Ports := PortPath(Dev);
+  if Ports = '' then
+    Ports := '0';
+  Result := IntToStr(libusb_get_bus_number(Dev)) + '-' + Ports;
+End;
+
+{ TUsbTopology }
+
+Constructor TUsbTopology.Create;
+Begin
+  inherited Create;
+  InitCriticalSection(FLock);
+End;
+
+Destructor TUsbTopology.Destroy;
+Begin
+  DoneCriticalSection(FLock);
+  inherited Destroy;
+End;
+
+Function TUsbTopology.FindDevice(Bus:Byte;Const Ports:String) : Integer;
+Var P : String;
+    I : Integer;
+Begin
+  if Ports = '' then
+    P := IntToStr(Bus) + '-0'
+  else
+    P := IntToStr(Bus) + '-' + Ports;
+  For I := 0 to High(FDevices) do
+    if FDevices[I].Path = P then
+      Exit(I);
+  Result := -1;
+End;
+
+Function TUsbTopology.AddGroup(Const AName:String;ABus:Byte;ASpeed:Integer;AIsTT:Boolean) : Integer;
+Var I : Integer;
+Begin
+  For I := 0 to High(FGroups) do
+    if FGroups[I].Name = AName then
+      Exit(I);
+  Result := Length(FGroups);
+  SetLength(FGroups,Result+1);
+  FGroups[Result] := Default(TTopoGroup);
+  FGroups[Result].Name  := AName;
+  FGroups[Result].Bus   := ABus;
+  FGroups[Result].Speed := ASpeed;
+  FGroups[Result].IsTT  := AIsTT;
+End;
+
+(**
+ * Re-read the topology
+ *
+ * The counters of devices and groups which are still there are kept.
+ *)
+Procedure TUsbTopology.Scan(Context:TLibUsbContext);
+Var List       : PPlibusb_device;
+    N,I,J,H    : Integer;
+    Desc       : libusb_device_descriptor;
+    OldDevices : Array of TTopoDevice;
+    OldGroups  : Array of TTopoGroup;
+    Ports      : Array of String;
+    HubProto   : Array of Byte;
+    Parent     : String;
+    Child      : String;
+Begin
+  N := libusb_get_device_list(Context.Context,@List);
+  if N < 0 then
+    raise ELibUsb.Create(N,'libusb_get_device_list');
+  EnterCriticalSection(FLock);
+  try
+    OldDevices := FDevices;
+    OldGroups  := FGroups;
+    SetLength(FDevices,N);
+    SetLength(FGroups,0);
+    SetLength(Ports,N);
+    SetLength(HubProto,N);
+    For I := 0 to N-1 do
+      With FDevices[I] do
+        Begin
+          libusb_get_device_descriptor(List[I],@Desc);
+          Path      := DevicePath(List[I]);
+          Ports[I]  := PortPath(List[I]);
+          Bus       := libusb_get_bus_number(List[I]);
+          Address   := libusb_get_device_address(List[I]);
+          Speed     := libusb_get_device_speed(List[I]);
+          idVendor  := Desc.idVendor;
+          idProduct := Desc.idProduct;
+          IsHub     := (Desc.bDeviceClass = USB_CLASS_HUB);
+          HubProto[I] := Desc.bDeviceProtocol;
+          Counters  := Default(TTopoCounters);
+          TT        := -1;
+        End;
+    // the root hubs define the controllers
+    For I := 0 to N-1 do
+      With FDevices[I] do
+        if Ports[I] = '' then
+          Controller := AddGroup('bus '+IntToStr(Bus),Bus,Speed,false);
+    For I := 0 to N-1 do
+      With FDevices[I] do
+        Begin
+          Controller := AddGroup('bus '+IntToStr(Bus),Bus,LIBUSB_SPEED_UNKNOWN,false);
+          Inc(FGroups[Controller].Devices);
+          if (Speed <> LIBUSB_SPEED_LOW) and (Speed <> LIBUSB_SPEED_FULL) then
+            Continue;
+          // the nearest high-speed hub upstream has the TT
+          Child  := Ports[I];
+          Parent := Child;
+          while Pos('.',Parent) > 0 do
+            Begin
+              Child  := Parent;
+              Parent := Copy(Parent,1,LastDelimiter('.',Parent)-1);
+              H := FindDevice(Bus,Parent);
+              if (H < 0) or (FDevices[H].Speed <> LIBUSB_SPEED_HIGH) then
+                Continue;
+              if HubProto[H] = HUB_PROTOCOL_MTT then
+                TT := AddGroup('tt '+FDevices[H].Path+' port '+Copy(Child,Length(Parent)+2,MaxInt),Bus,LIBUSB_SPEED_HIGH,true)
+              else
+                TT := AddGroup('tt '+FDevices[H].Path,Bus,LIBUSB_SPEED_HIGH,true);
+              Inc(FGroups[TT].Devices);
+              Break;
+            End;
+        End;
+    // index for Transfer
+    H := 0;
+    For I := 0 to High(FDevices) do
+      H := Max(H,FDevices[I].Bus);
+    SetLength(FIndex,0);
+    SetLength(FIndex,H+1,128);
+    For I := 0 to High(FIndex) do
+      For J := 0 to 127 do
+        FIndex[I][J] := -1;
+    For I := 0 to High(FDevices) do
+      FIndex[FDevices[I].Bus][FDevices[I].Address and $7F] := I;
+    // keep the counters
+    For I := 0 to High(FDevices) do
+      For J := 0 to High(OldDevices) do
+        if OldDevices[J].Path = FDevices[I].Path then
+          FDevices[I].Counters := OldDevices[J].Counters;
+    For I := 0 to High(FGroups) do
+      For J := 0 to High(OldGroups) do
+        if OldGroups[J].Name = FGroups[I].Name then
+          FGroups[I].Counters := OldGroups[J].Counters;
+  finally
+    LeaveCriticalSection(FLock);
+    libusb_free_device_list(List,1);
+  End;
+End;
+
+(**
+ * Count a transfer and add its pending interval to the busy time
+ *
+ * Transfers overlap and are reported in the order of their completion, so a
+ * long transfer can start before shorter ones which were reported already.
+ * The latest TOPO_WINDOW disjoint intervals are therefore kept and merged
+ * with new ones, older intervals are added to Busy.
+ *)
+Procedure CountTransfer(Var C:TTopoCounters;ASubmit,AComplete:UInt64;ABytes:Int64);
+Var I,J : Integer;
+Begin
+  Inc(C.Transfers);
+  C.Bytes += ABytes;
+  // the time before Closed was already counted
+  if ASubmit < C.Closed then
+    ASubmit := C.Closed;
+  if AComplete <= ASubmit then
+    Exit;
+  // I: first interval which overlaps or touches, J: the first one after those
+  I := C.NumOpen;
+  while (I > 0) and (C.Open[I-1].Stop >= ASubmit) do
+    Dec(I);
+  J := I;
+  while (J < C.NumOpen) and (C.Open[J].Start <= AComplete) do
+    Begin
+      ASubmit   := Min(ASubmit,  C.Open[J].Start);
+      AComplete := Max(AComplete,C.Open[J].Stop);
+      Inc(J);
+    End;
+  if J = I then
+    Begin
+      // a new interval at position I
+      if C.NumOpen = TOPO_WINDOW then
+        Begin
+          if I = 0 then
+            Begin
+              // older than all kept intervals and disjoint from them
+              C.Busy += AComplete - ASubmit;
+              Exit;
+            End;
+          // close the oldest
+          C.Busy  += C.Open[0].Stop - C.Open[0].Start;
+          C.Closed := C.Open[0].Stop;
+          Move(C.Open[1],C.Open[0],(TOPO_WINDOW-1)*SizeOf(TTopoInterval));
+          Dec(C.NumOpen);
+          Dec(I);
+        End;
+      Move(C.Open[I],C.Open[I+1],(C.NumOpen-I)*SizeOf(TTopoInterval));
+      Inc(C.NumOpen);
+    End
+  else if J > I+1 then
+    Begin
+      // several intervals are merged to one
+      Move(C.Open[J],C.Open[I+1],(C.NumOpen-J)*SizeOf(TTopoInterval));
+      C.NumOpen -= J-I-1;
+    End;
+  C.Open[I].Start := ASubmit;
+  C.Open[I].Stop  := AComplete;
+End;
+
+(**
+ * Time in which at least one transfer was pending
+ *)
+Function BusyTime(Const C:TTopoCounters) : UInt64;
+Var I : Integer;
+Begin
+  Result := C.Busy;
+  For I := 0 to C.NumOpen-1 do
+    Result += C.Open[I].Stop - C.Open[I].Start;
+End;
+
+(**
+ * Count a transfer, called by the trace hooks of every thread
+ *)
+Procedure TUsbTopology.Transfer(ADev:Plibusb_device;ASubmit,AComplete:UInt64;AXferType,AEP:Byte;Const Setup:TUsbSetup;Buf:Pointer;ALength,AStatus:LongInt);
+Var ABus,AAddr : Byte;
+    Bytes      : Int64;
+    I          : Integer;
+Begin
+  if ADev = Nil then
+    Exit;
+  ABus  := libusb_get_bus_number(ADev);
+  AAddr := libusb_get_device_address(ADev) and $7F;
+  Bytes := AStatus;
+  if Bytes < 0 then
+    Bytes := 0;
+  EnterCriticalSection(FLock);
+  try
+    if ABus > High(FIndex) then
+      Exit;
+    I := FIndex[ABus][AAddr];
+    if I < 0 then
+      Exit;
+    With FDevices[I] do
+      Begin
+        CountTransfer(Counters,ASubmit,AComplete,Bytes);
+        CountTransfer(FGroups[Controller].Counters,ASubmit,AComplete,Bytes);
+        if TT >= 0 then
+          CountTransfer(FGroups[TT].Counters,ASubmit,AComplete,Bytes);
+      End;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Procedure TUsbTopology.Reset;
+Var I : Integer;
+Begin
+  EnterCriticalSection(FLock);
+  For I := 0 to High(FDevices) do
+    FDevices[I].Counters := Default(TTopoCounters);
+  For I := 0 to High(FGroups) do
+    FGroups[I].Counters := Default(TTopoCounters);
+  LeaveCriticalSection(FLock);
+End;
+
+(**
+ * Find a device by its path ("3-1.4") or by "bus:address" ("3:12")
+ *
+ * @return index of the device, -1 if it isn't known
+ *)
+Function TUsbTopology.Find(Const AName:String) : Integer;
+Var P    : Integer;
+    Bus  : Integer;
+    Addr : Integer;
+    I    : Integer;
+Begin
+  Result := -1;
+  EnterCriticalSection(FLock);
+  try
+    P := Pos(':',AName);
+    if P > 0 then
+      Begin
+        Bus  := StrToIntDef(Copy(AName,1,P-1),-1);
+        Addr := StrToIntDef(Copy(AName,P+1,MaxInt),-1);
+        For I := 0 to High(FDevices) do
+          if (FDevices[I].Bus = Bus) and (FDevices[I].Address = Addr) then
+            Exit(I);
+      End
+    else
+      For I := 0 to High(FDevices) do
+        if FDevices[I].Path = AName then
+          Exit(I);
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Function TUsbTopology.Path(Dev:Integer) : String;
+Begin
+  Result := FDevices[Dev].Path;
+End;
+
+Function TUsbTopology.Device(Dev:Integer) : TTopoDevice;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    Result := FDevices[Dev];
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * The group which limits the bandwidth of a device
+ *)
+Function TUsbTopology.Bottleneck(Dev:Integer) : Integer;
+Begin
+  Result := FDevices[Dev].TT;
+  if Result < 0 then
+    Result := FDevices[Dev].Controller;
+End;
+
+(**
+ * Order devices for concurrent work
+ *
+ * The devices are distributed round-robin over their bottleneck groups (TT
+ * or controller), and consecutive groups are on different controllers if
+ * possible. When the devices are started in this order with a limited
+ * number of workers, every worker lands on the least loaded group.
+ *
+ * @param Devs  indices as returned by Find
+ * @return      positions in Devs in the order to start them
+ *)
+Function TUsbTopology.Schedule(Const Devs:Array of Integer) : TScheduleOrder;
+Var Buckets : TStringList;   // "rank bus name" -> group index
+    Members : Array of TScheduleOrder;
+    Next    : Array of Integer;
+    G,I,N   : Integer;
+    Done    : Boolean;
+Begin
+  SetLength(Result,0);
+  EnterCriticalSection(FLock);
+  Buckets := TStringList.Create;
+  try
+    SetLength(Members,Length(FGroups));
+    For I := 0 to High(Devs) do
+      Begin
+        G := Bottleneck(Devs[I]);
+        N := Length(Members[G]);
+        SetLength(Members[G],N+1);
+        Members[G][N] := I;
+      End;
+    // rank: the n-th used group of its controller
+    Buckets.Sorted := true;
+    For G := 0 to High(FGroups) do
+      if Length(Members[G]) > 0 then
+        Begin
+          N := 0;
+          For I := 0 to G-1 do
+            if (Length(Members[I]) > 0) and (FGroups[I].Bus = FGroups[G].Bus) then
+              Inc(N);
+          Buckets.AddObject(Format('%.4d %.3d %s',[N,FGroups[G].Bus,FGroups[G].Name]),TObject(PtrInt(G)));
+        End;
+    SetLength(Next,Buckets.Count);
+    repeat
+      Done := true;
+      For I := 0 to Buckets.Count-1 do
+        Begin
+          G := PtrInt(Buckets.Objects[I]);
+          if Next[I] >= Length(Members[G]) then
+            Continue;
+          N := Length(Result);
+          SetLength(Result,N+1);
+          Result[N] := Members[G][Next[I]];
+          Inc(Next[I]);
+          Done := false;
+        End;
+    until Done;
+  finally
+    Buckets.Free;
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Function TUsbTopology.Stats(Const C:TTopoCounters) : String;
+Var Busy : UInt64;
+Begin
+  Busy := BusyTime(C);
+  if Busy = 0 then
+    Result := Format('%d transfers, %d bytes',[C.Transfers,C.Bytes])
+  else
+    Result := Format('%d transfers, %d bytes in %.1f ms, %.3f MB/s',[C.Transfers,C.Bytes,Busy/1000.0,C.Bytes/Busy]);
+End;
+
+(**
+ * Print the controllers, their TTs and devices
+ *)
+Procedure TUsbTopology.Report;
+Var G,T,I : Integer;
+
+  Procedure Device(I:Integer;Indent:String);
+  Begin
+    With FDevices[I] do
+      WriteLn(Indent,Format('%-14s %.4x:%.4x %-5s %s%s',[Path,idVendor,idProduct,SpeedName(Speed),
+        Select(IsHub,'hub, ',''),Stats(Counters)]));
+  End;
+
+Begin
+  EnterCriticalSection(FLock);
+  try
+    For G := 0 to High(FGroups) do
+      With FGroups[G] do
+        Begin
+          if IsTT then
+            Continue;
+          WriteLn(Format('%s (%s speed root hub), %d devices: %s',[Name,SpeedName(Speed),Devices,Stats(Counters)]));
+          For I := 0 to High(FDevices) do
+            if (FDevices[I].Controller = G) and (FDevices[I].TT < 0) then
+              Device(I,'  ');
+          For T := 0 to High(FGroups) do
+            if FGroups[T].IsTT and (FGroups[T].Bus = Bus) then
+              Begin
+                WriteLn(Format('  %s, %d devices: %s',[FGroups[T].Name,FGroups[T].Devices,Stats(FGroups[T].Counters)]));
+                For I := 0 to High(FDevices) do
+                  if FDevices[I].TT = T then
+                    Device(I,'    ');
+              End;
+        End;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Function TUsbTopology.AsDict : AnsiString;
+Var I   : Integer;
+    Gs  : AnsiString;
+    Ds  : AnsiString;
+
+  Function CountersDict(Const C:TTopoCounters) : String;
+  Begin
+    Result := Format('transfers %d bytes %d busy_us %d',[C.Transfers,C.Bytes,BusyTime(C)]);
+  End;
+
+Begin
+  EnterCriticalSection(FLock);
+  try
+    Gs := '';
+    For I := 0 to High(FGroups) do
+      With FGroups[I] do
+        Gs += Format(' {name %s type %s bus %d speed %s devices %d %s}',
+          [TclQuote(Name),Select(IsTT,'tt','controller'),Bus,SpeedName(Speed),Devices,CountersDict(Counters)]);
+    Ds := '';
+    For I := 0 to High(FDevices) do
+      With FDevices[I] do
+        Ds += Format(' {path %s bus %d address %d speed %s idVendor 0x%.4x idProduct 0x%.4x hub %d controller %s tt %s %s}',
+          [Path,Bus,Address,SpeedName(Speed),idVendor,idProduct,Ord(IsHub),TclQuote(FGroups[Controller].Name),
+           TclQuote(Select(TT >= 0,FGroups[Max(TT,0)].Name,'')),CountersDict(Counters)]);
+    Result := 'groups {' + Copy(Gs,2,MaxInt) + '} devices {' + Copy(Ds,2,MaxInt) + '}';
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+End.
@@ -0,0 +1,311 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Bulk throughput and latency benchmark for arbitrary USB devices
+ *
+ * One benchmark step transfers data of a fixed size on one or more endpoints
+ * at the same time for a given time. The queue depth is the number of worker
+ * threads per endpoint, each of them issues synchronous transfers back to
+ * back, so up to Depth transfers per endpoint are pending at the USB host
+ * controller at any time.
+ *
+ * OUT payloads are PRBS-31, IN payloads are optionally checked for PRBS-31
+ * bit errors (e.g. for devices which loop OUT back to IN).
+ *)
+Unit UsbBench;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math, LibUsb, USBDeviceDebug, DataBuf, RealTime, Utils;
+
+Const
+  BENCH_MAX_DEPTH    = 32;
+  BENCH_HIST_BUCKETS = 24;    // latency histogram, bucket i: < 2^(i+1) us
+  BENCH_MAX_SAMPLES  = 65536; // latencies kept per worker
+  BENCH_MIN_LATENCY  = 10;    // us, to estimate the number of transfers
+
+Type
+  TBenchStats = record
+    EP        : Byte;
+    Size      : LongInt;
+    Depth     : Integer;
+    Elapsed   : UInt64;   // us
+    Transfers : Int64;
+    Bytes     : Int64;
+    Short     : Int64;    // IN transfers with less than Size bytes
+    Timeouts  : Int64;
+    Errors    : Int64;    // other libusb errors
+    BitErrors : Int64;
+    Checked   : Int64;    // number of checked bits
+    Latencies : Array of LongWord;   // us, sorted, a uniform sample of all transfers
+    MaxLatency: LongWord;            // us
+    Histogram : Array[0..BENCH_HIST_BUCKETS-1] of Int64;
+  End;
+  TBenchResults = Array of TBenchStats;
+
+  { TBenchWorker }
+
+  TBenchWorker = class(TThread)
+  private
+    FDevice   : TUSBDeviceDebug;
+    FDeadline : UInt64;
+    FTimeout  : LongInt;
+    FCheck    : Boolean;
+    FBuf      : AnsiString;
+    FRand     : UInt64;
+  protected
+    Procedure Execute; override;
+  public
+    Stats : TBenchStats;
+    NumLatencies : Integer;
+    Finished : UInt64;   // GetUSec at the end of the last transfer
+    Constructor Create(ADevice:TUSBDeviceDebug;AEP:Byte;ASize:LongInt;ADeadline:UInt64;ATimeout:LongInt;ACheck:Boolean;ASeed:LongWord;ASamples:Integer);
+  End;
+
+Function  RunBench(ADevice:TUSBDeviceDebug;Const AEPs:Array of Byte;ASize:LongInt;ADepth:Integer;ATime:LongInt;ATimeout:LongInt;ACheck:Boolean) : TBenchResults;
+Function  BenchPercentile(Const Stats:TBenchStats;P:Integer) : LongWord;
+Procedure BenchHeader;
+Procedure BenchLine(Const Stats:TBenchStats);
+Procedure BenchHistogram(Const Stats:TBenchStats);
+
+Implementation
+
+{ TBenchWorker }
+
+(**
+ * @param ASamples  number of latencies to keep, the buffer is allocated and
+ *                  touched here, so the real-time loop never allocates memory
+ *)
+Constructor TBenchWorker.Create(ADevice:TUSBDeviceDebug;AEP:Byte;ASize:LongInt;ADeadline:UInt64;ATimeout:LongInt;ACheck:Boolean;ASeed:LongWord;ASamples:Integer);
+Begin
+  FDevice   := ADevice;
+  FDeadline := ADeadline;
+  FTimeout  := ATimeout;
+  FCheck    := ACheck;
+  Stats := Default(TBenchStats);
+  Stats.EP   := AEP;
+  Stats.Size := ASize;
+  SetLength(FBuf,ASize);
+  // every worker sends a different part of the sequence
+  if AEP and LIBUSB_ENDPOINT_IN = 0 then
+    DataPrbs31(PByte(FBuf),ASize,ASeed)
+  else
+    Prefault(PByte(FBuf),ASize);
+  FRand := ASeed;
+  SetLength(Stats.Latencies,Max(1,ASamples));
+  Prefault(@Stats.Latencies[0],Length(Stats.Latencies)*SizeOf(LongWord));
+  inherited Create(false);
+End;
+
+Procedure TBenchWorker.Execute;
+Var T  : UInt64;
+    R  : LongInt;
+    D  : LongWord;
+    I  : Int64;
+    RT : TRealTimeSaved;
+Begin
+  RT := RealTimeEnter;
+  while GetUSec < FDeadline do
+    Begin
+      T := GetUSec;
+      if Stats.EP and LIBUSB_ENDPOINT_IN <> 0 then
+        R := FDevice.BulkIn (Stats.EP,FBuf[1],Stats.Size,FTimeout)
+      else
+        R := FDevice.BulkOut(Stats.EP,FBuf[1],Stats.Size,FTimeout);
+      T := GetUSec - T;
+      if T > High(LongWord) then
+        D := High(LongWord)
+      else
+        D := T;
+      Inc(Stats.Transfers);
+      if R = LIBUSB_ERROR_TIMEOUT then
+        Inc(Stats.Timeouts)
+      else if R < 0 then
+        Inc(Stats.Errors)
+      else
+        Begin
+          Stats.Bytes += R;
+          if R < Stats.Size then
+            Inc(Stats.Short);
+          if FCheck and (Stats.EP and LIBUSB_ENDPOINT_IN <> 0) and (R > 4) then
+            Begin
+              Stats.BitErrors += DataPrbs31Errors(PByte(FBuf),R);
+              Stats.Checked   += 8*R - 31;
+            End;
+        End;
+      Inc(Stats.Histogram[Min(BENCH_HIST_BUCKETS-1,BsrDWord(D or 1))]);
+      Stats.MaxLatency := Max(Stats.MaxLatency,D);
+      if NumLatencies < Length(Stats.Latencies) then
+        Begin
+          Stats.Latencies[NumLatencies] := D;
+          Inc(NumLatencies);
+        End
+      else
+        Begin
+          // keep a uniform sample of all transfers, Random is not thread-safe
+          FRand := FRand * 6364136223846793005 + 1442695040888963407;
+          I := Int64(FRand shr 33) mod Stats.Transfers;
+          if I < NumLatencies then
+            Stats.Latencies[I] := D;
+        End;
+    End;
+  Finished := GetUSec;
+  RealTimeLeave(RT);
+End;
+
+(**
+ * Run one benchmark step
+ *
+ * All endpoints run at the same time, so a device which loops OUT back to IN
+ * is fed while its IN endpoint is read. There is one result per endpoint.
+ *
+ * @param ADepth    number of concurrent transfers per endpoint
+ * @param ATime     duration in ms
+ * @param ATimeout  timeout of every transfer in ms
+ * @param ACheck    check IN data for PRBS-31 bit errors
+ *)
+Function RunBench(ADevice:TUSBDeviceDebug;Const AEPs:Array of Byte;ASize:LongInt;ADepth:Integer;ATime:LongInt;ATimeout:LongInt;ACheck:Boolean) : TBenchResults;
+Var Workers : Array of TBenchWorker;
+    Start   : UInt64;
+    State   : LongWord;
+    Samples : Integer;
+    Error   : String;
+    N       : Array of Integer;
+    E       : Integer;
+    I,J     : Integer;
+Begin
+  if (ADepth < 1) or (ADepth > BENCH_MAX_DEPTH) then
+    raise Exception.CreateFmt('Queue depth must be 1 to %d',[BENCH_MAX_DEPTH]);
+  if ASize < 1 then
+    raise Exception.Create('Invalid transfer size');
+  // worker I transfers on endpoint I div ADepth
+  SetLength(Workers,Length(AEPs)*ADepth);
+  Samples := Min(BENCH_MAX_SAMPLES,Max(1024,Int64(ATime)*1000 div BENCH_MIN_LATENCY));
+  Start := GetUSec;
+  State := $7FFFFFFF;
+  For I := 0 to High(Workers) do
+    Begin
+      Workers[I] := TBenchWorker.Create(ADevice,AEPs[I div ADepth],ASize,Start+ATime*1000,ATimeout,ACheck,State,Samples);
+      State := (State * 69069 + 1) and $7FFFFFFF or 1;
+    End;
+  SetLength(N,Length(AEPs));
+  SetLength(Result,Length(AEPs));
+  For E := 0 to High(AEPs) do
+    Begin
+      N[E] := 0;
+      Result[E] := Default(TBenchStats);
+      Result[E].EP    := AEPs[E];
+      Result[E].Size  := ASize;
+      Result[E].Depth := ADepth;
+    End;
+  Error := '';
+  For I := 0 to High(Workers) do
+    Begin
+      Workers[I].WaitFor;
+      E := I div ADepth;
+      N[E] += Workers[I].NumLatencies;
+      if Workers[I].Finished > Start then
+        Result[E].Elapsed := Max(Result[E].Elapsed,Workers[I].Finished - Start);
+      if Assigned(Workers[I].FatalException) then
+        Error := Exception(Workers[I].FatalException).Message;
+    End;
+  For E := 0 to High(AEPs) do
+    Begin
+      SetLength(Result[E].Latencies,N[E]);
+      N[E] := 0;
+    End;
+  For I := 0 to High(Workers) do
+    With Workers[I] do
+      Begin
+        E := I div ADepth;
+        Result[E].Transfers += Stats.Transfers;
+        Result[E].Bytes     += Stats.Bytes;
+        Result[E].Short     += Stats.Short;
+        Result[E].Timeouts  += Stats.Timeouts;
+        Result[E].Errors    += Stats.Errors;
+        Result[E].BitErrors += Stats.BitErrors;
+        Result[E].Checked   += Stats.Checked;
+        Result[E].MaxLatency := Max(Result[E].MaxLatency,Stats.MaxLatency);
+        For J := 0 to BENCH_HIST_BUCKETS-1 do
+          Result[E].Histogram[J] += Stats.Histogram[J];
+        if NumLatencies > 0 then
+          Move(Stats.Latencies[0],Result[E].Latencies[N[E]],NumLatencies*SizeOf(LongWord));
+        N[E] += NumLatencies;
+        Free;
+      End;
+  if Error > '' then
+    raise Exception.Create(Error);
+  For E := 0 to High(AEPs) do
+    With Result[E] do
+      Begin
+        if N[E] > 0 then
+          SortSamples(Latencies,0,N[E]-1);
+        StreamAdd(StreamCounters('usbbench'),Transfers,Bytes,0,Timeouts,MaxLatency);
+      End;
+End;
+
+Function BenchPercentile(Const Stats:TBenchStats;P:Integer) : LongWord;
+Var N : Integer;
+Begin
+  N := Length(Stats.Latencies);
+  if N = 0 then
+    Exit(0);
+  Result := Stats.Latencies[Min(N-1,(N*P) div 100)];
+End;
+
+Procedure BenchHeader;
+Begin
+  WriteLn('  EP     Size Depth     MB/s  Transfers   p50 [us]   p99 [us]   Max [us]    Short Timeouts   Errors  Bit errors');
+End;
+
+Procedure BenchLine(Const Stats:TBenchStats);
+Var T : Double;
+Begin
+  T := Stats.Elapsed;
+  if T = 0 then
+    T := 1;
+  With Stats do
+    WriteLn(Format('0x%.2x %8d %5d %8.3f %10d %10d %10d %10d %8d %8d %8d  %s',
+      [EP,Size,Depth,Bytes/T,Transfers,
+       BenchPercentile(Stats,50),BenchPercentile(Stats,99),MaxLatency,
+       Short,Timeouts,Errors,
+       Select(Checked > 0,Format('%d (BER %.1e)',[BitErrors,BitErrors/Max(Checked,Int64(1))]),'-')]));
+End;
+
+(**
+ * Print the latency histogram with logarithmic buckets
+ *)
+Procedure BenchHistogram(Const Stats:TBenchStats);
+Var I    : Integer;
+    Peak : Int64;
+Begin
+  Peak := 1;
+  For I := 0 to BENCH_HIST_BUCKETS-1 do
+    Peak := Max(Peak,Stats.Histogram[I]);
+  For I := 0 to BENCH_HIST_BUCKETS-1 do
+    if Stats.Histogram[I] > 0 then
+      WriteLn(Format('  < %8d us %10d %s',[1 shl (I+1),Stats.Histogram[I],
+        StringOfChar('#',(Stats.Histogram[I]*50 + Peak-1) div Peak)]));
+End;
+
+End.
@@ -5,7 +5,7 @@ Unit USBDeviceDebug;
 Interface
 
 Uses
-  Classes, SysUtils, LibUsb, LibUsbOop, FGL;
+  Classes, SysUtils, LibUsb, LibUsbOop, FGL, UsbTrace;
 
 Type
 
@@ -27,13 +27,14 @@ Type
     Procedure Claim(AInterface,AAltSetting:Byte);
     Function BulkIn (EP:Byte;Out      Buf;Length:LongInt;Timeout:LongInt) : LongInt;
     Function BulkOut(EP:Byte;ConstRef Buf;Length:LongInt;Timeout:LongInt) : LongInt;
+    Function ControlMsg(bmRequestType,bRequest:Byte;wValue,wIndex:Word;Var Buf;Length:LongInt;Timeout:LongInt) : LongInt;
     property HaveInterface : Boolean read GetHaveInterface;
   End;
 
 
 Implementation
 
-Uses Utils;
+Uses Utils, UsbEnum;
 
 { TUSBDeviceDebug }
 
@@ -71,17 +72,40 @@ Begin
 End;
 
 Function TUSBDeviceDebug.BulkIn(EP : Byte; Out Buf; Length : LongInt; Timeout : LongInt) : LongInt;
+Var T : UInt64;
 Begin
   if FEndpoints.IndexOf(EP) < 0 then
     raise Exception.CreateFmt('Invalid endpoint number %d',[EP and LIBUSB_ENDPOINT_ADDRESS_MASK]);
+  T := Trace.Submit;
   Result := (FEndpoints[EP] as TLibUsbBulkInEndpoint).Recv(Buf,Length,Timeout);
+  Trace.AddBulk(T,Device,EP,@Buf,Length,Result);
 End;
 
 Function TUSBDeviceDebug.BulkOut(EP : Byte; ConstRef Buf; Length : LongInt; Timeout : LongInt) : LongInt;
+Var T : UInt64;
 Begin
   if FEndpoints.IndexOf(EP) < 0 then
     raise Exception.CreateFmt('Invalid endpoint number %d',[EP and LIBUSB_ENDPOINT_ADDRESS_MASK]);
+  T := Trace.Submit;
   Result := (FEndpoints[EP] as TLibUsbBulkOutEndpoint).Send(Buf,Length,Timeout);
+  Trace.AddBulk(T,Device,EP,@Buf,Length,Result);
+End;
+
+Function TUSBDeviceDebug.ControlMsg(bmRequestType,bRequest:Byte;wValue,wIndex:Word;Var Buf;Length:LongInt;Timeout:LongInt) : LongInt;
+Var T     : UInt64;
+    Setup : TUsbSetup;
+Begin
+  T := Trace.Submit;
+  Result := FControl.ControlMsg(bmRequestType,bRequest,wValue,wIndex,Buf,Length,Timeout);
+  if T <> 0 then
+    Begin
+      Setup.bmRequestType := bmRequestType;
+      Setup.bRequest      := bRequest;
+      Setup.wValue        := wValue;
+      Setup.wIndex        := wIndex;
+      Setup.wLength       := Length;
+      Trace.AddControl(T,Device,Setup,@Buf,Result);
+    End;
 End;
 
 Procedure TUSBDeviceDebug.FreeInterface;
@@ -104,7 +128,7 @@ Begin
   // create objects for all endpoints
   WriteLn('Interface ',AIntf^.bInterfaceNumber,
           ' (Alternate ',AIntf^.bAlternateSetting,')',
-          ' "',FControl.GetString(AIntf^.iInterface),'":');
+          ' "',UsbDescCache.GetString(Self,AIntf^.iInterface),'":');
   NumEp := AIntf^.bNumEndpoints;
   For IEp := 0 to NumEP-1 do
     Begin
@@ -0,0 +1,358 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * In-process USB device enumeration and descriptor cache
+ *
+ * The device list is read with libusb_get_device_list, which doesn't talk to
+ * the devices. The interface tree and the string descriptors of an opened
+ * device are fetched once and kept until the device disappears, i.e. until
+ * its bus number and address are not in the device list anymore (a device
+ * gets a new address whenever it is plugged in or re-enumerates).
+ *
+ * The global UsbDescCache is used by TEZTool and TUSBDeviceDebug.
+ *)
+Unit UsbEnum;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, LibUsb, LibUsbOop, Utils;
+
+Type
+  TUsbEndpointInfo = record
+    Address       : Byte;
+    Attributes    : Byte;
+    MaxPacketSize : Word;
+    Interval      : Byte;
+  End;
+
+  TUsbInterfaceInfo = record
+    Number    : Byte;
+    Alternate : Byte;
+    IfClass   : Byte;
+    SubClass  : Byte;
+    Protocol  : Byte;
+    iInterface: Byte;
+    Endpoints : Array of TUsbEndpointInfo;
+  End;
+
+  { TUsbDeviceInfo }
+
+  TUsbDeviceInfo = class
+  private
+    FStrings     : Array[0..255] of AnsiString;
+    FHaveString  : Array[0..255] of Boolean;
+  public
+    Bus        : Byte;
+    Address    : Byte;
+    Speed      : Integer;
+    Ports      : String;       // port path, e.g. "1.4"
+    Desc       : libusb_device_descriptor;
+    Interfaces : Array of TUsbInterfaceInfo;
+    HaveConfig : Boolean;
+    Function  GetString(Dev:TLibUsbDevice;Index:Byte) : AnsiString;
+    Function  CachedString(Index:Byte) : AnsiString;
+    Function  Dict(WithInterfaces:Boolean) : AnsiString;
+  End;
+
+  { TUsbDescCache }
+
+  TUsbDescCache = class
+  private
+    FDevices : TStringList;    // "bus:address" -> TUsbDeviceInfo
+    FLock    : TRTLCriticalSection;
+    Function  Key(Dev:Plibusb_device) : String;
+    Function  NewInfo(Dev:Plibusb_device) : TUsbDeviceInfo;
+  public
+    Constructor Create;
+    Destructor  Destroy; override;
+    Procedure Refresh(Context:TLibUsbContext);
+    Function  Lookup(Dev:Plibusb_device) : TUsbDeviceInfo;
+    Procedure Load(Context:TLibUsbContext;Dev:TLibUsbDevice);
+    Function  GetString(Dev:TLibUsbDevice;Index:Byte) : AnsiString;
+    Function  List : AnsiString;
+    Procedure Clear;
+  End;
+
+Function SpeedName(Speed:Integer) : String;
+Function PortPath(Dev:Plibusb_device) : String;
+
+Var UsbDescCache : TUsbDescCache;
+
+Implementation
+
+Function SpeedName(Speed:Integer) : String;
+Begin
+  Case Speed of
+    LIBUSB_SPEED_LOW   : Result := 'low';
+    LIBUSB_SPEED_FULL  : Result := 'full';
+    LIBUSB_SPEED_HIGH  : Result := 'high';
+    LIBUSB_SPEED_SUPER : Result := 'super';
+  else
+    Result := 'unknown';
+  End;
+End;
+
+(**
+ * Port numbers from the root hub to the device, e.g. "1.4", '' for a root hub
+ *)
+Function PortPath(Dev:Plibusb_device) : String;
+Var Ports : Array[0..7] of Byte;
+    N,I   : Integer;
+Begin
+  N := libusb_get_port_numbers(Dev,@Ports[0],Length(Ports));
+  Result := '';
+  For I := 0 to N-1 do
+    Begin
+      if I > 0 then Result += '.';
+      Result += IntToStr(Ports[I]);
+    End;
+End;
+
+{ TUsbDeviceInfo }
+
+(**
+ * Get a string descriptor, only the first request goes to the device
+ *)
+Function TUsbDeviceInfo.GetString(Dev:TLibUsbDevice;Index:Byte) : AnsiString;
+Begin
+  if Index = 0 then
+    Exit('');
+  if not FHaveString[Index] then
+    Begin
+      FStrings[Index]    := Dev.Control.GetString(Index);
+      FHaveString[Index] := true;
+    End;
+  Result := FStrings[Index];
+End;
+
+(**
+ * Get a string descriptor if it was fetched before, '' otherwise
+ *)
+Function TUsbDeviceInfo.CachedString(Index:Byte) : AnsiString;
+Begin
+  Result := FStrings[Index];
+End;
+
+Function TUsbDeviceInfo.Dict(WithInterfaces:Boolean) : AnsiString;
+Var I,J : Integer;
+    Eps : AnsiString;
+    Ifs : AnsiString;
+Begin
+  With Desc do
+    Result := Format('bus %d address %d ports %s speed %s idVendor 0x%.4x idProduct 0x%.4x bcdDevice 0x%.4x bcdUSB 0x%.4x class %d subclass %d protocol %d maxpacket0 %d configurations %d',
+      [Bus,Address,TclQuote(Ports),SpeedName(Speed),idVendor,idProduct,bcdDevice,bcdUSB,
+       bDeviceClass,bDeviceSubClass,bDeviceProtocol,bMaxPacketSize0,bNumConfigurations])
+      + ' manufacturer ' + TclQuote(CachedString(Desc.iManufacturer))
+      + ' product '      + TclQuote(CachedString(Desc.iProduct))
+      + ' serial '       + TclQuote(CachedString(Desc.iSerialNumber));
+  if not WithInterfaces then
+    Exit;
+  Ifs := '';
+  For I := 0 to High(Interfaces) do
+    With Interfaces[I] do
+      Begin
+        Eps := '';
+        For J := 0 to High(Endpoints) do
+          With Endpoints[J] do
+            Begin
+              if Eps > '' then Eps += ' ';
+              Eps += Format('{address 0x%.2x type %s maxpacket %d interval %d}',
+                [Address,LowerCase(Select(Attributes and LIBUSB_TRANSFER_TYPE_MASK,['Control','Isochronous','Bulk','Interrupt'])),
+                 MaxPacketSize,Interval]);
+            End;
+        if Ifs > '' then Ifs += ' ';
+        Ifs += Format('{number %d alternate %d class %d subclass %d protocol %d name %s endpoints {%s}}',
+          [Number,Alternate,IfClass,SubClass,Protocol,TclQuote(CachedString(iInterface)),Eps]);
+      End;
+  Result += ' interfaces {' + Ifs + '}';
+End;
+
+{ TUsbDescCache }
+
+Constructor TUsbDescCache.Create;
+Begin
+  inherited Create;
+  InitCriticalSection(FLock);
+  FDevices := TStringList.Create;
+  FDevices.OwnsObjects := true;
+  FDevices.Sorted := true;
+End;
+
+Destructor TUsbDescCache.Destroy;
+Begin
+  FDevices.Free;
+  DoneCriticalSection(FLock);
+  inherited Destroy;
+End;
+
+Function TUsbDescCache.Key(Dev:Plibusb_device) : String;
+Begin
+  Result := Format('%.3d:%.3d',[libusb_get_bus_number(Dev),libusb_get_device_address(Dev)]);
+End;
+
+(**
+ * Create the entry of a device from the data libusb keeps in memory
+ *)
+Function TUsbDescCache.NewInfo(Dev:Plibusb_device) : TUsbDeviceInfo;
+Begin
+  Result := TUsbDeviceInfo.Create;
+  Result.Bus     := libusb_get_bus_number(Dev);
+  Result.Address := libusb_get_device_address(Dev);
+  Result.Speed   := libusb_get_device_speed(Dev);
+  Result.Ports   := PortPath(Dev);
+  libusb_get_device_descriptor(Dev,@Result.Desc);
+End;
+
+(**
+ * Re-read the device list, drop the entries of removed devices
+ *)
+Procedure TUsbDescCache.Refresh(Context:TLibUsbContext);
+Var List  : PPlibusb_device;
+    N,I   : Integer;
+    Found : TStringList;
+    K     : String;
+Begin
+  N := libusb_get_device_list(Context.Context,@List);
+  if N < 0 then
+    raise ELibUsb.Create(N,'libusb_get_device_list');
+  Found := TStringList.Create;
+  EnterCriticalSection(FLock);
+  try
+    Found.Sorted := true;
+    For I := 0 to N-1 do
+      Begin
+        K := Key(List[I]);
+        Found.Add(K);
+        if FDevices.IndexOf(K) < 0 then
+          FDevices.AddObject(K,NewInfo(List[I]));
+      End;
+    For I := FDevices.Count-1 downto 0 do
+      if Found.IndexOf(FDevices[I]) < 0 then
+        FDevices.Delete(I);
+  finally
+    LeaveCriticalSection(FLock);
+    Found.Free;
+    libusb_free_device_list(List,1);
+  End;
+End;
+
+Function TUsbDescCache.Lookup(Dev:Plibusb_device) : TUsbDeviceInfo;
+Var I : Integer;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    I := FDevices.IndexOf(Key(Dev));
+    if I < 0 then
+      I := FDevices.AddObject(Key(Dev),NewInfo(Dev));
+    Result := TUsbDeviceInfo(FDevices.Objects[I]);
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * Fetch the interface tree and all strings of an opened device, only done
+ * once per device
+ *)
+Procedure TUsbDescCache.Load(Context:TLibUsbContext;Dev:TLibUsbDevice);
+Var Info   : TUsbDeviceInfo;
+    Config : Plibusb_config_descriptor;
+    IIf    : Integer;
+    IAlt   : Integer;
+    IEp    : Integer;
+    N      : Integer;
+Begin
+  Info := Lookup(Dev.Device);
+  if Info.HaveConfig then
+    Exit;
+  Config := Context.GetActiveConfigDescriptor(Dev.Device);
+  N := 0;
+  For IIf := 0 to Config^.bNumInterfaces-1 do
+    With Config^._interface^[IIf] do
+      For IAlt := 0 to num_altsetting-1 do
+        With altsetting^[IAlt] do
+          Begin
+            SetLength(Info.Interfaces,N+1);
+            Info.Interfaces[N].Number     := bInterfaceNumber;
+            Info.Interfaces[N].Alternate  := bAlternateSetting;
+            Info.Interfaces[N].IfClass    := bInterfaceClass;
+            Info.Interfaces[N].SubClass   := bInterfaceSubClass;
+            Info.Interfaces[N].Protocol   := bInterfaceProtocol;
+            Info.Interfaces[N].iInterface := iInterface;
+            SetLength(Info.Interfaces[N].Endpoints,bNumEndpoints);
+            For IEp := 0 to bNumEndpoints-1 do
+              With Info.Interfaces[N].Endpoints[IEp] do
+                Begin
+                  Address       := endpoint^[IEp].bEndpointAddress;
+                  Attributes    := endpoint^[IEp].bmAttributes;
+                  MaxPacketSize := endpoint^[IEp].wMaxPacketSize;
+                  Interval      := endpoint^[IEp].bInterval;
+                End;
+            Info.GetString(Dev,iInterface);
+            Inc(N);
+          End;
+  Info.GetString(Dev,Info.Desc.iManufacturer);
+  Info.GetString(Dev,Info.Desc.iProduct);
+  Info.GetString(Dev,Info.Desc.iSerialNumber);
+  Info.HaveConfig := true;
+End;
+
+Function TUsbDescCache.GetString(Dev:TLibUsbDevice;Index:Byte) : AnsiString;
+Begin
+  Result := Lookup(Dev.Device).GetString(Dev,Index);
+End;
+
+(**
+ * All known devices as Tcl list of dicts
+ *)
+Function TUsbDescCache.List : AnsiString;
+Var I : Integer;
+Begin
+  Result := '';
+  EnterCriticalSection(FLock);
+  try
+    For I := 0 to FDevices.Count-1 do
+      Begin
+        if I > 0 then Result += ' ';
+        Result += '{' + TUsbDeviceInfo(FDevices.Objects[I]).Dict(false) + '}';
+      End;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Procedure TUsbDescCache.Clear;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    FDevices.Clear;
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+Initialization
+  UsbDescCache := TUsbDescCache.Create;
+Finalization
+  UsbDescCache.Free;
+End.
@@ -0,0 +1,531 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Persistent counters of the USB communication for long-running fixtures
+ *
+ * TUsbMetrics is hooked into the transfer trace (Trace.Metrics) and counts
+ * every transfer for the device it belongs to (e.g. also the devices of a
+ * gang): transfers and bytes per type and direction, timeouts, stalls, other
+ * errors and a latency histogram. The counters are kept per idVendor:idProduct,
+ * a table indexed by bus and address finds them without a lock. Connected
+ * refreshes the entry of a re-enumerated device. Further counters are the connects, re-enumerations, firmware
+ * downloads, the I2C errors reported by the EZTool firmware and the failed
+ * commands.
+ *
+ * The transfer counters are updated with atomic operations by the main
+ * thread and the job threads, no lock is taken except to add a device. The device records are never
+ * freed before the object itself, so pointers to them stay valid.
+ *
+ * The counters can be written periodically by a background thread in the
+ * Prometheus text exposition format, e.g. for the textfile collector of the
+ * node exporter.
+ *)
+Unit UsbMetrics;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, Math, BaseUnix, LibUsb, UsbTrace, Utils;
+
+Const
+  METRICS_NUM_BUCKETS = 11;
+  { upper bounds of the latency histogram in us, the last bucket is +Inf }
+  MetricsBuckets : Array[0..METRICS_NUM_BUCKETS-1] of LongWord =
+    (50,100,250,500,1000,2500,5000,10000,25000,100000,1000000);
+
+Type
+  TXferKind = (xkControlIn,xkControlOut,xkBulkIn,xkBulkOut);
+  TDeviceCounter = (dcTimeouts,dcStalls,dcErrors,dcI2CNacks,dcI2CBusErrors,
+                    dcConnects,dcReenumerations,dcFirmwareDownloads);
+
+  { TDeviceMetrics }
+
+  TDeviceMetrics = class
+    Device       : String;     // idVendor:idProduct
+    Transfers    : Array[TXferKind] of Int64;
+    Bytes        : Array[TXferKind] of Int64;
+    Counts       : Array[TDeviceCounter] of Int64;
+    LatencySum   : Int64;      // us
+    Buckets      : Array[0..METRICS_NUM_BUCKETS] of Int64;   // not cumulative
+    { state for the detection of re-enumerations and the firmware counters }
+    Bus,Address  : Integer;
+    FwValid      : Boolean;
+    FwNacks      : Word;
+    FwBusErrors  : Word;
+  End;
+
+  TMetricsWriter = class;
+
+  { TUsbMetrics }
+
+  TUsbMetrics = class(TTraceRecorder)
+  private
+    FDevices  : TList;
+    FCurrent  : TDeviceMetrics;
+    FIndex    : Array[Byte,0..127] of TDeviceMetrics;   // bus, address
+    FLock     : TRTLCriticalSection;   // only for adding devices
+    FStart    : UInt64;
+    FPendingReenum : Boolean;
+    FWriter   : TMetricsWriter;
+    FCommandErrors : Int64;
+    Function  GetDevice(Const AUsbID:String) : TDeviceMetrics;
+    Function  FindDevice(ADev:Plibusb_device) : TDeviceMetrics;
+    Function  GetTextFile : String;
+  public
+    Constructor Create;
+    Destructor  Destroy; override;
+    Procedure Transfer(ADev:Plibusb_device;ASubmit,AComplete:UInt64;AXferType,AEP:Byte;Const Setup:TUsbSetup;Buf:Pointer;ALength,AStatus:LongInt); override;
+    Procedure Connected(Const AUsbID:String;ABus,AAddress:Integer);
+    Procedure FirmwareDownload(Const AUsbID:String);
+    Procedure FirmwareStatus(ANacks,ABusErrors:Word);
+    Procedure CommandError;
+    Procedure Reset;
+    Procedure Report;
+    Function  AsDict : AnsiString;
+    Function  Prometheus : AnsiString;
+    Procedure WriteTextFile(Const AFilename:String);
+    Procedure StartTextFile(Const AFilename:String;AInterval:Integer);
+    Procedure StopTextFile;
+    property TextFile : String read GetTextFile;
+  End;
+
+  { TMetricsWriter }
+
+  TMetricsWriter = class(TThread)
+  private
+    FMetrics  : TUsbMetrics;
+    FFilename : String;
+    FInterval : Integer;   // ms
+    FWakeup   : PRTLEvent;
+  protected
+    Procedure Execute; override;
+  public
+    Constructor Create(AMetrics:TUsbMetrics;Const AFilename:String;AInterval:Integer);
+    Destructor  Destroy; override;
+    Procedure Stop;
+  End;
+
+Const
+  XferKindNames : Array[TXferKind] of String = ('control_in','control_out','bulk_in','bulk_out');
+  DeviceCounterNames : Array[TDeviceCounter] of String =
+    ('timeouts','stalls','errors','i2c_nacks','i2c_bus_errors',
+     'connects','reenumerations','firmware_downloads');
+
+Implementation
+
+Const
+  XferKindType : Array[TXferKind] of String = ('control','control','bulk','bulk');
+  XferKindDir  : Array[TXferKind] of String = ('in','out','in','out');
+  DeviceCounterHelp : Array[TDeviceCounter] of String =
+    ('USB transfers which timed out',
+     'USB transfers answered with a stall',
+     'USB transfers failed with other errors',
+     'I2C transfers not acknowledged, reported by the firmware',
+     'I2C bus errors, reported by the firmware',
+     'Connects to the device',
+     'Connects after a re-enumeration of the device',
+     'Firmware downloads to the device');
+
+{ TUsbMetrics }
+
+Constructor TUsbMetrics.Create;
+Begin
+  inherited Create;
+  FDevices := TList.Create;
+  InitCriticalSection(FLock);
+  FStart := GetUSec;
+  // transfers before the first connect (e.g. lsusb)
+  FCurrent := GetDevice('none');
+End;
+
+Destructor TUsbMetrics.Destroy;
+Var I : Integer;
+Begin
+  StopTextFile;
+  For I := 0 to FDevices.Count-1 do
+    TDeviceMetrics(FDevices[I]).Free;
+  FDevices.Free;
+  DoneCriticalSection(FLock);
+  inherited Destroy;
+End;
+
+Function TUsbMetrics.GetDevice(Const AUsbID:String) : TDeviceMetrics;
+Var I : Integer;
+Begin
+  EnterCriticalSection(FLock);
+  try
+    For I := 0 to FDevices.Count-1 do
+      if TDeviceMetrics(FDevices[I]).Device = AUsbID then
+        Exit(TDeviceMetrics(FDevices[I]));
+    Result := TDeviceMetrics.Create;
+    Result.Device  := AUsbID;
+    Result.Bus     := -1;
+    Result.Address := -1;
+    FDevices.Add(Result);
+  finally
+    LeaveCriticalSection(FLock);
+  End;
+End;
+
+(**
+ * Counters of the device at the bus address of ADev, an unknown device is
+ * added with the IDs of its (cached) device descriptor
+ *)
+Function TUsbMetrics.FindDevice(ADev:Plibusb_device) : TDeviceMetrics;
+Var Bus  : Byte;
+    Addr : Byte;
+    Desc : libusb_device_descriptor;
+Begin
+  if ADev = Nil then
+    Exit(FCurrent);
+  Bus  := libusb_get_bus_number(ADev);
+  Addr := libusb_get_device_address(ADev) and $7F;
+  Result := FIndex[Bus,Addr];
+  if Assigned(Result) then
+    Exit;
+  if libusb_get_device_descriptor(ADev,@Desc) <> 0 then
+    Exit(FCurrent);
+  Result := GetDevice(IntToHex(Desc.idVendor,4)+':'+IntToHex(Desc.idProduct,4));
+  FIndex[Bus,Addr] := Result;
+End;
+
+(**
+ * Count a transfer, called by the trace hooks of every thread
+ *)
+Procedure TUsbMetrics.Transfer(ADev:Plibusb_device;ASubmit,AComplete:UInt64;AXferType,AEP:Byte;Const Setup:TUsbSetup;Buf:Pointer;ALength,AStatus:LongInt);
+Var D : TDeviceMetrics;
+    K : TXferKind;
+    T : UInt64;
+    B : Integer;
+Begin
+  D := FindDevice(ADev);
+  if AXferType = TRACE_XFER_CONTROL then
+    K := xkControlIn
+  else
+    K := xkBulkIn;
+  if AEP and LIBUSB_ENDPOINT_IN = 0 then
+    Inc(K);
+  InterLockedIncrement64(D.Transfers[K]);
+  if AStatus >= 0 then
+    InterLockedExchangeAdd64(D.Bytes[K],AStatus)
+  else if AStatus = LIBUSB_ERROR_TIMEOUT then
+    InterLockedIncrement64(D.Counts[dcTimeouts])
+  else if AStatus = LIBUSB_ERROR_PIPE then
+    InterLockedIncrement64(D.Counts[dcStalls])
+  else
+    InterLockedIncrement64(D.Counts[dcErrors]);
+  T := AComplete - ASubmit;
+  InterLockedExchangeAdd64(D.LatencySum,T);
+  B := 0;
+  while (B < METRICS_NUM_BUCKETS) and (T > MetricsBuckets[B]) do
+    Inc(B);
+  InterLockedIncrement64(D.Buckets[B]);
+End;
+
+(**
+ * Switch the counters to the newly connected device
+ *
+ * A connect counts as re-enumeration if a firmware download preceded it or
+ * if the same device shows up with a new bus address. The bus address may
+ * have belonged to another device before, so its index entry is replaced.
+ *)
+Procedure TUsbMetrics.Connected(Const AUsbID:String;ABus,AAddress:Integer);
+Var D : TDeviceMetrics;
+Begin
+  D := GetDevice(AUsbID);
+  Inc(D.Counts[dcConnects]);
+  if FPendingReenum or ((D.Address >= 0) and ((D.Bus <> ABus) or (D.Address <> AAddress))) then
+    Inc(D.Counts[dcReenumerations]);
+  FPendingReenum := false;
+  D.Bus     := ABus;
+  D.Address := AAddress;
+  D.FwValid := false;
+  FCurrent  := D;
+  if (ABus >= 0) and (ABus <= High(Byte)) then
+    FIndex[ABus,AAddress and $7F] := D;
+End;
+
+Procedure TUsbMetrics.FirmwareDownload(Const AUsbID:String);
+Begin
+  Inc(GetDevice(AUsbID).Counts[dcFirmwareDownloads]);
+  FPendingReenum := true;
+End;
+
+(**
+ * Add the I2C error counters of the firmware (see GetStatus), these are 16 bit
+ * counters since the reset of the device, only the increments are added
+ *)
+Procedure TUsbMetrics.FirmwareStatus(ANacks,ABusErrors:Word);
+Var D : TDeviceMetrics;
+Begin
+  D := FCurrent;
+  if D.FwValid then
+    Begin
+      D.Counts[dcI2CNacks]     += Word(ANacks - D.FwNacks);
+      D.Counts[dcI2CBusErrors] += Word(ABusErrors - D.FwBusErrors);
+    End
+  else
+    Begin
+      // first status after connect: all errors since the reset
+      D.Counts[dcI2CNacks]     += ANacks;
+      D.Counts[dcI2CBusErrors] += ABusErrors;
+    End;
+  D.FwNacks     := ANacks;
+  D.FwBusErrors := ABusErrors;
+  D.FwValid     := true;
+End;
+
+Procedure TUsbMetrics.CommandError;
+Begin
+  InterLockedIncrement64(FCommandErrors);
+End;
+
+(**
+ * Clear all counters, the devices stay known
+ *)
+Procedure TUsbMetrics.Reset;
+Var I : Integer;
+    D : TDeviceMetrics;
+    K : TXferKind;
+    C : TDeviceCounter;
+    B : Integer;
+Begin
+  For I := 0 to FDevices.Count-1 do
+    Begin
+      D := TDeviceMetrics(FDevices[I]);
+      For K := Low(TXferKind) to High(TXferKind) do
+        Begin
+          InterLockedExchange64(D.Transfers[K],0);
+          InterLockedExchange64(D.Bytes[K],0);
+        End;
+      For C := Low(TDeviceCounter) to High(TDeviceCounter) do
+        InterLockedExchange64(D.Counts[C],0);
+      InterLockedExchange64(D.LatencySum,0);
+      For B := 0 to METRICS_NUM_BUCKETS do
+        InterLockedExchange64(D.Buckets[B],0);
+    End;
+  InterLockedExchange64(FCommandErrors,0);
+End;
+
+Procedure TUsbMetrics.Report;
+Var I : Integer;
+    D : TDeviceMetrics;
+    K : TXferKind;
+    N : Int64;
+Begin
+  WriteLn('Device      Transfers        Bytes  Timeouts  Stalls  Errors  Mean [us]  I2C NACKs  Connects  Re-enum  Downloads');
+  For I := 0 to FDevices.Count-1 do
+    Begin
+      D := TDeviceMetrics(FDevices[I]);
+      N := 0;
+      For K := Low(TXferKind) to High(TXferKind) do
+        N += D.Transfers[K];
+      if (N = 0) and (D.Counts[dcConnects] = 0) and (D.Counts[dcFirmwareDownloads] = 0) then
+        Continue;
+      WriteLn(Format('%-9s %11d %12d %9d %7d %7d %10d %10d %9d %8d %10d',
+        [D.Device,N,D.Bytes[xkControlIn]+D.Bytes[xkControlOut]+D.Bytes[xkBulkIn]+D.Bytes[xkBulkOut],
+         D.Counts[dcTimeouts],D.Counts[dcStalls],D.Counts[dcErrors],D.LatencySum div Max(N,Int64(1)),
+         D.Counts[dcI2CNacks],D.Counts[dcConnects],D.Counts[dcReenumerations],D.Counts[dcFirmwareDownloads]]));
+    End;
+  WriteLn('Failed commands: ',FCommandErrors);
+End;
+
+(**
+ * All counters as Tcl dict: device -> {counter value ...}
+ *)
+Function TUsbMetrics.AsDict : AnsiString;
+Var I  : Integer;
+    D  : TDeviceMetrics;
+    K  : TXferKind;
+    C  : TDeviceCounter;
+    St : AnsiString;
+Begin
+  Result := 'command_errors ' + IntToStr(FCommandErrors);
+  For I := 0 to FDevices.Count-1 do
+    Begin
+      D := TDeviceMetrics(FDevices[I]);
+      St := '';
+      For K := Low(TXferKind) to High(TXferKind) do
+        St += XferKindNames[K] + '_transfers ' + IntToStr(D.Transfers[K]) + ' '
+            + XferKindNames[K] + '_bytes ' + IntToStr(D.Bytes[K]) + ' ';
+      For C := Low(TDeviceCounter) to High(TDeviceCounter) do
+        St += DeviceCounterNames[C] + ' ' + IntToStr(D.Counts[C]) + ' ';
+      St += 'latency_sum_us ' + IntToStr(D.LatencySum);
+      Result += ' ' + TclQuote(D.Device) + ' {' + St + '}';
+    End;
+End;
+
+(**
+ * Text exposition format of Prometheus
+ *)
+Function TUsbMetrics.Prometheus : AnsiString;
+Var Lines : TStringList;
+    I,B   : Integer;
+    K     : TXferKind;
+    C     : TDeviceCounter;
+    N     : Int64;
+
+  Procedure Header(Const AName,AType,AHelp:String);
+  Begin
+    Lines.Add('# HELP eztool_' + AName + ' ' + AHelp);
+    Lines.Add('# TYPE eztool_' + AName + ' ' + AType);
+  End;
+
+Begin
+  Lines := TStringList.Create;
+  // the writer thread must not see the list of devices while it grows
+  EnterCriticalSection(FLock);
+  try
+    Header('usb_transfers_total','counter','USB transfers');
+    For I := 0 to FDevices.Count-1 do
+      For K := Low(TXferKind) to High(TXferKind) do
+        With TDeviceMetrics(FDevices[I]) do
+          Lines.Add(Format('eztool_usb_transfers_total{device="%s",type="%s",dir="%s"} %d',
+            [Device,XferKindType[K],XferKindDir[K],Transfers[K]]));
+    Header('usb_bytes_total','counter','Bytes transferred over USB');
+    For I := 0 to FDevices.Count-1 do
+      For K := Low(TXferKind) to High(TXferKind) do
+        With TDeviceMetrics(FDevices[I]) do
+          Lines.Add(Format('eztool_usb_bytes_total{device="%s",type="%s",dir="%s"} %d',
+            [Device,XferKindType[K],XferKindDir[K],Bytes[K]]));
+    Header('usb_latency_seconds','histogram','Duration of the USB transfers');
+    For I := 0 to FDevices.Count-1 do
+      With TDeviceMetrics(FDevices[I]) do
+        Begin
+          N := 0;
+          For B := 0 to METRICS_NUM_BUCKETS-1 do
+            Begin
+              N += Buckets[B];
+              Lines.Add(Format('eztool_usb_latency_seconds_bucket{device="%s",le="%g"} %d',
+                [Device,MetricsBuckets[B]/1e6,N]));
+            End;
+          N += Buckets[METRICS_NUM_BUCKETS];
+          Lines.Add(Format('eztool_usb_latency_seconds_bucket{device="%s",le="+Inf"} %d',[Device,N]));
+          Lines.Add(Format('eztool_usb_latency_seconds_sum{device="%s"} %.6f',[Device,LatencySum/1e6]));
+          Lines.Add(Format('eztool_usb_latency_seconds_count{device="%s"} %d',[Device,N]));
+        End;
+    For C := Low(TDeviceCounter) to High(TDeviceCounter) do
+      Begin
+        // timeouts, stalls and errors are USB counters
+        if C <= dcErrors then
+          Header('usb_' + DeviceCounterNames[C] + '_total','counter',DeviceCounterHelp[C])
+        else
+          Header(DeviceCounterNames[C] + '_total','counter',DeviceCounterHelp[C]);
+        For I := 0 to FDevices.Count-1 do
+          With TDeviceMetrics(FDevices[I]) do
+            Lines.Add(Format('eztool_%s%s_total{device="%s"} %d',
+              [Select(C <= dcErrors,'usb_',''),DeviceCounterNames[C],Device,Counts[C]]));
+      End;
+    Header('command_errors_total','counter','Commands which failed');
+    Lines.Add('eztool_command_errors_total ' + IntToStr(FCommandErrors));
+    Header('start_time_seconds','gauge','Start time of eztool since the epoch');
+    Lines.Add(Format('eztool_start_time_seconds %d',[fpTime - Int64((GetUSec - FStart) div 1000000)]));
+    Result := Lines.Text;
+  finally
+    LeaveCriticalSection(FLock);
+    Lines.Free;
+  End;
+End;
+
+(**
+ * Write the metrics to a temporary file and rename it, so the collector
+ * never reads a partial file
+ *)
+Procedure TUsbMetrics.WriteTextFile(Const AFilename:String);
+Var St     : AnsiString;
+    Stream : TFileStream;
+Begin
+  St := Prometheus;
+  Stream := TFileStream.Create(AFilename + '.tmp',fmCreate);
+  try
+    Stream.WriteBuffer(St[1],Length(St));
+  finally
+    Stream.Free;
+  End;
+  if not RenameFile(AFilename + '.tmp',AFilename) then
+    raise Exception.Create('Couldn''t rename '+AFilename+'.tmp');
+End;
+
+Procedure TUsbMetrics.StartTextFile(Const AFilename:String;AInterval:Integer);
+Begin
+  StopTextFile;
+  WriteTextFile(AFilename);   // report errors in the file name immediately
+  FWriter := TMetricsWriter.Create(Self,AFilename,AInterval);
+End;
+
+Procedure TUsbMetrics.StopTextFile;
+Begin
+  if not Assigned(FWriter) then
+    Exit;
+  FWriter.Stop;
+  FreeAndNil(FWriter);
+End;
+
+Function TUsbMetrics.GetTextFile : String;
+Begin
+  if Assigned(FWriter) then
+    Result := FWriter.FFilename
+  else
+    Result := '';
+End;
+
+{ TMetricsWriter }
+
+Constructor TMetricsWriter.Create(AMetrics:TUsbMetrics;Const AFilename:String;AInterval:Integer);
+Begin
+  FMetrics  := AMetrics;
+  FFilename := AFilename;
+  FInterval := AInterval;
+  FWakeup   := RTLEventCreate;
+  inherited Create(false);
+End;
+
+Destructor TMetricsWriter.Destroy;
+Begin
+  RTLEventDestroy(FWakeup);
+  inherited Destroy;
+End;
+
+Procedure TMetricsWriter.Execute;
+Begin
+  while not Terminated do
+    Begin
+      RTLEventWaitFor(FWakeup,FInterval);
+      try
+        FMetrics.WriteTextFile(FFilename);
+      except
+        // e.g. the directory was removed, try again next time
+      End;
+    End;
+End;
+
+(**
+ * Stop the thread, the file is written a last time
+ *)
+Procedure TMetricsWriter.Stop;
+Begin
+  Terminate;
+  RTLEventSetEvent(FWakeup);
+  WaitFor;
+End;
+
+End.
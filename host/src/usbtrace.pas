@@ -0,0 +1,497 @@
+(***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************)
+
+(**
+ * Transfer level tracing of the USB communication
+ *
+ * The device classes report every control and bulk transfer with its submit
+ * and completion time to the global Trace object. The records are stored in a
+ * ring buffer of fixed size, the oldest records are overwritten. Writers
+ * (the main thread and the job threads) only reserve a slot with an atomic
+ * increment, no lock is taken.
+ *
+ * The ring can be saved as pcap file with the link type
+ * LINKTYPE_USB_LINUX (189), i.e. with the same packet headers as usbmon, so
+ * Wireshark shows it like a capture of the kernel.
+ *)
+Unit UsbTrace;
+
+{$mode objfpc}{$H+}
+
+Interface
+
+Uses
+  Classes, SysUtils, LibUsb, Utils;
+
+Const
+  TRACE_DEFAULT_SLOTS   = 4096;
+  TRACE_DEFAULT_SNAPLEN = 64;     // captured payload bytes per transfer
+
+  { usbmon transfer types }
+  TRACE_XFER_CONTROL    = 2;
+  TRACE_XFER_BULK       = 3;
+
+Type
+  TUsbSetup = packed record
+    bmRequestType : Byte;
+    bRequest      : Byte;
+    wValue        : Word;
+    wIndex        : Word;
+    wLength       : Word;
+  End;
+
+  TTraceRecord = record
+    Seq      : Int64;     // 0 while the slot is written
+    Submit   : UInt64;    // timestamps in us
+    Complete : UInt64;
+    XferType : Byte;
+    EP       : Byte;      // including direction bit
+    Bus      : Byte;
+    DevAddr  : Byte;
+    Setup    : TUsbSetup; // only for control transfers
+    Length   : LongInt;   // requested length
+    Status   : LongInt;   // transferred length or libusb error code
+    CapLen   : Integer;
+    Data     : PByte;     // FSnapLen bytes of the ring's payload buffer
+  End;
+
+  (**
+   * Receives every transfer with the complete payload, see Session.pas,
+   * UsbMetrics.pas and Topology.pas
+   *)
+  TTraceRecorder = class
+    Procedure Transfer(ADev:Plibusb_device;ASubmit,AComplete:UInt64;AXferType,AEP:Byte;Const Setup:TUsbSetup;Buf:Pointer;ALength,AStatus:LongInt); virtual; abstract;
+  End;
+
+  { TUsbTrace }
+
+  TUsbTrace = class
+  private
+    FSlots   : Array of TTraceRecord;
+    FPayload : Array of Byte;
+    FSnapLen : Integer;
+    FHead    : Int64;     // number of records ever added
+    FEnabled : Boolean;
+    FStart   : UInt64;
+    FRecorder: TTraceRecorder;
+    FMetrics : TTraceRecorder;
+    FTopology: TTraceRecorder;
+    FProfiling : Boolean;
+    Function  Reserve(Out ASeq:Int64) : Integer;
+    Procedure Publish(Slot:Integer;ASeq:Int64);
+    Procedure Fill(Slot:Integer;ASubmit,AComplete:UInt64;ADev:Plibusb_device;AXferType,AEP:Byte;Buf:Pointer;ALength,AStatus:LongInt);
+    Function  Snapshot(ASeq:Int64;Out Rec:TTraceRecord;Out Data:AnsiString) : Boolean;
+    Function  GetCount : Integer;
+    Function  GetDropped : Int64;
+  public
+    Procedure Start(ASlots,ASnapLen:Integer);
+    Procedure Stop;
+    Procedure Clear;
+    Function  Submit : UInt64; inline;
+    Procedure AddControl(ASubmit:UInt64;ADev:Plibusb_device;Const Setup:TUsbSetup;Buf:Pointer;Status:LongInt);
+    Procedure AddBulk(ASubmit:UInt64;ADev:Plibusb_device;EP:Byte;Buf:Pointer;Length,Status:LongInt);
+    Procedure Dump;
+    Procedure SavePcap(AFilename:String);
+    property Enabled : Boolean read FEnabled;
+    property Recorder: TTraceRecorder read FRecorder write FRecorder;
+    property Metrics : TTraceRecorder read FMetrics write FMetrics;
+    property Topology: TTraceRecorder read FTopology write FTopology;
+    property Profiling : Boolean read FProfiling write FProfiling;
+    property Count   : Integer read GetCount;
+    property Dropped : Int64   read GetDropped;
+  End;
+
+Var
+  Trace : TUsbTrace;
+
+ThreadVar
+  ProfileUsbTime     : UInt64;   // sum of the transfer times, see Profiler.pas
+  ProfileFirstSubmit : UInt64;   // submission of the first transfer
+
+Implementation
+
+Uses BaseUnix;
+
+{ TUsbTrace }
+
+(**
+ * Start tracing, the ring is (re)allocated if its size changes
+ *)
+Procedure TUsbTrace.Start(ASlots,ASnapLen:Integer);
+Var I : Integer;
+Begin
+  if (ASlots < 1) or (ASnapLen < 0) then
+    raise Exception.Create('Invalid trace buffer size');
+  if (ASlots <> Length(FSlots)) or (ASnapLen <> FSnapLen) then
+    Begin
+      FEnabled := false;
+      SetLength(FSlots,0);
+      SetLength(FSlots,ASlots);
+      SetLength(FPayload,ASlots*ASnapLen);
+      FSnapLen := ASnapLen;
+      For I := 0 to ASlots-1 do
+        if ASnapLen > 0 then
+          FSlots[I].Data := @FPayload[I*ASnapLen];
+      FHead := 0;
+    End;
+  if FHead = 0 then
+    FStart := GetUSec;
+  FEnabled := true;
+End;
+
+Procedure TUsbTrace.Stop;
+Begin
+  FEnabled := false;
+End;
+
+Procedure TUsbTrace.Clear;
+Var I : Integer;
+Begin
+  For I := 0 to High(FSlots) do
+    FSlots[I].Seq := 0;
+  FHead  := 0;
+  FStart := GetUSec;
+End;
+
+(**
+ * Timestamp for the submission of a transfer, 0 if neither tracing,
+ * recording, metrics nor profiling is on
+ *)
+Function TUsbTrace.Submit : UInt64;
+Begin
+  if FEnabled or Assigned(FRecorder) or Assigned(FMetrics) or Assigned(FTopology) or FProfiling then
+    Result := GetUSec
+  else
+    Result := 0;
+End;
+
+(**
+ * Reserve the next slot, concurrent writers get different slots
+ *)
+Function TUsbTrace.Reserve(Out ASeq:Int64) : Integer;
+Begin
+  ASeq := InterLockedIncrement64(FHead);
+  Result := (ASeq-1) mod Length(FSlots);
+  FSlots[Result].Seq := 0;
+  WriteBarrier;
+End;
+
+(**
+ * Make a completely written slot visible to the readers
+ *)
+Procedure TUsbTrace.Publish(Slot:Integer;ASeq:Int64);
+Begin
+  WriteBarrier;
+  FSlots[Slot].Seq := ASeq;
+End;
+
+Procedure TUsbTrace.Fill(Slot:Integer;ASubmit,AComplete:UInt64;ADev:Plibusb_device;AXferType,AEP:Byte;Buf:Pointer;ALength,AStatus:LongInt);
+Var N : Integer;
+Begin
+  FSlots[Slot].Complete := AComplete;
+  FSlots[Slot].Submit   := ASubmit;
+  FSlots[Slot].XferType := AXferType;
+  FSlots[Slot].EP       := AEP;
+  FSlots[Slot].Bus      := libusb_get_bus_number(ADev);
+  FSlots[Slot].DevAddr  := libusb_get_device_address(ADev);
+  FSlots[Slot].Length   := ALength;
+  FSlots[Slot].Status   := AStatus;
+  // IN: the received bytes, OUT: the sent bytes
+  if AEP and LIBUSB_ENDPOINT_IN <> 0 then N := AStatus else N := ALength;
+  if N > FSnapLen then N := FSnapLen;
+  if (N < 0) or (Buf = Nil) then N := 0;
+  FSlots[Slot].CapLen   := N;
+  if N > 0 then
+    Move(Buf^,FSlots[Slot].Data^,N);
+End;
+
+Procedure TUsbTrace.AddControl(ASubmit:UInt64;ADev:Plibusb_device;Const Setup:TUsbSetup;Buf:Pointer;Status:LongInt);
+Var Slot : Integer;
+    Seq  : Int64;
+    T    : UInt64;
+Begin
+  if ASubmit = 0 then
+    Exit;
+  T := GetUSec;
+  if FProfiling then
+    Begin
+      ProfileUsbTime += T - ASubmit;
+      if ProfileFirstSubmit = 0 then
+        ProfileFirstSubmit := ASubmit;
+    End;
+  if Assigned(FRecorder) then
+    FRecorder.Transfer(ADev,ASubmit,T,TRACE_XFER_CONTROL,Setup.bmRequestType and LIBUSB_ENDPOINT_DIR_MASK,Setup,Buf,Setup.wLength,Status);
+  if Assigned(FMetrics) then
+    FMetrics.Transfer(ADev,ASubmit,T,TRACE_XFER_CONTROL,Setup.bmRequestType and LIBUSB_ENDPOINT_DIR_MASK,Setup,Buf,Setup.wLength,Status);
+  if Assigned(FTopology) then
+    FTopology.Transfer(ADev,ASubmit,T,TRACE_XFER_CONTROL,Setup.bmRequestType and LIBUSB_ENDPOINT_DIR_MASK,Setup,Buf,Setup.wLength,Status);
+  if not FEnabled then
+    Exit;
+  Slot := Reserve(Seq);
+  Fill(Slot,ASubmit,T,ADev,TRACE_XFER_CONTROL,Setup.bmRequestType and LIBUSB_ENDPOINT_DIR_MASK,Buf,Setup.wLength,Status);
+  FSlots[Slot].Setup := Setup;
+  Publish(Slot,Seq);
+End;
+
+Procedure TUsbTrace.AddBulk(ASubmit:UInt64;ADev:Plibusb_device;EP:Byte;Buf:Pointer;Length,Status:LongInt);
+Var Slot  : Integer;
+    Seq   : Int64;
+    T     : UInt64;
+    Setup : TUsbSetup;
+Begin
+  if ASubmit = 0 then
+    Exit;
+  T := GetUSec;
+  if FProfiling then
+    Begin
+      ProfileUsbTime += T - ASubmit;
+      if ProfileFirstSubmit = 0 then
+        ProfileFirstSubmit := ASubmit;
+    End;
+  FillChar(Setup,SizeOf(Setup),0);
+  if Assigned(FRecorder) then
+    FRecorder.Transfer(ADev,ASubmit,T,TRACE_XFER_BULK,EP,Setup,Buf,Length,Status);
+  if Assigned(FMetrics) then
+    FMetrics.Transfer(ADev,ASubmit,T,TRACE_XFER_BULK,EP,Setup,Buf,Length,Status);
+  if Assigned(FTopology) then
+    FTopology.Transfer(ADev,ASubmit,T,TRACE_XFER_BULK,EP,Setup,Buf,Length,Status);
+  if not FEnabled then
+    Exit;
+  Slot := Reserve(Seq);
+  Fill(Slot,ASubmit,T,ADev,TRACE_XFER_BULK,EP,Buf,Length,Status);
+  FSlots[Slot].Setup := Setup;
+  Publish(Slot,Seq);
+End;
+
+(**
+ * Copy a record, false if it was overwritten in the meantime
+ *)
+Function TUsbTrace.Snapshot(ASeq:Int64;Out Rec:TTraceRecord;Out Data:AnsiString) : Boolean;
+Var Slot : Integer;
+Begin
+  Data := '';
+  Slot := (ASeq-1) mod Length(FSlots);
+  Rec  := FSlots[Slot];
+  ReadBarrier;
+  if Rec.Seq <> ASeq then
+    Exit(false);
+  SetLength(Data,Rec.CapLen);
+  if Rec.CapLen > 0 then
+    Move(Rec.Data^,Data[1],Rec.CapLen);
+  ReadBarrier;
+  Result := (FSlots[Slot].Seq = ASeq);
+End;
+
+Function TUsbTrace.GetCount : Integer;
+Begin
+  if FHead < Length(FSlots) then
+    Result := FHead
+  else
+    Result := Length(FSlots);
+End;
+
+Function TUsbTrace.GetDropped : Int64;
+Begin
+  Result := FHead - Count;
+End;
+
+(**
+ * Print the records as table with the latency of every transfer
+ *)
+Procedure TUsbTrace.Dump;
+Var Seq  : Int64;
+    Rec  : TTraceRecord;
+    Data : AnsiString;
+    Line : String;
+    I    : Integer;
+Begin
+  WriteLn('    Time [us]  Lat. [us]  Type  Dir  EP  Setup                Len  Status  Data');
+  For Seq := FHead-Count+1 to FHead do
+    Begin
+      if not Snapshot(Seq,Rec,Data) then
+        Continue;
+      Line := Format('%13d  %9d  %-4s  %-3s  %2d  ',
+        [Rec.Submit-FStart,Rec.Complete-Rec.Submit,
+         Select(Rec.XferType = TRACE_XFER_CONTROL,'ctrl','bulk'),
+         Select(Rec.EP and LIBUSB_ENDPOINT_IN <> 0,'IN','OUT'),
+         Rec.EP and LIBUSB_ENDPOINT_ADDRESS_MASK]);
+      if Rec.XferType = TRACE_XFER_CONTROL then
+        With Rec.Setup do
+          Line += Format('%.2x %.2x %.4x %.4x %.4x  ',[bmRequestType,bRequest,wValue,wIndex,wLength])
+      else
+        Line += StringOfChar(' ',21);
+      Line += Format('%5d  %6d ',[Rec.Length,Rec.Status]);
+      For I := 1 to Length(Data) do
+        Line += ' ' + IntToHex(Ord(Data[I]),2);
+      WriteLn(Line);
+    End;
+  if Dropped > 0 then
+    WriteLn(Dropped,' older records were overwritten');
+End;
+
+(**
+ * Translate libusb error codes to the errno values usbmon would report
+ *)
+Function UrbStatus(Status:LongInt) : LongInt;
+Begin
+  if Status >= 0 then
+    Exit(0);
+  Case Status of
+    LIBUSB_ERROR_TIMEOUT  : Result := -ESysETIMEDOUT;
+    LIBUSB_ERROR_PIPE     : Result := -ESysEPIPE;
+    LIBUSB_ERROR_OVERFLOW : Result := -ESysEOVERFLOW;
+    LIBUSB_ERROR_NO_DEVICE: Result := -ESysENODEV;
+  else
+    Result := -ESysEIO;
+  End;
+End;
+
+Type
+  { struct usbmon_packet of the Linux kernel, see Documentation/usb/usbmon.txt }
+  TUsbmonPacket = packed record
+    Id       : QWord;
+    EvType   : Char;      // 'S'ubmission, 'C'ompletion
+    XferType : Byte;
+    EPNum    : Byte;
+    DevNum   : Byte;
+    BusNum   : Word;
+    FlagSetup: Char;      // #0 if Setup is valid
+    FlagData : Char;      // #0 if data is present
+    TsSec    : Int64;
+    TsUSec   : LongInt;
+    Status   : LongInt;
+    Length   : LongWord;
+    LenCap   : LongWord;
+    Setup    : TUsbSetup;
+  End;
+
+  TPcapHeader = packed record
+    Magic    : LongWord;
+    Major    : Word;
+    Minor    : Word;
+    ThisZone : LongInt;
+    SigFigs  : LongWord;
+    SnapLen  : LongWord;
+    Network  : LongWord;
+  End;
+
+  TPcapRecord = packed record
+    TsSec    : LongWord;
+    TsUSec   : LongWord;
+    InclLen  : LongWord;
+    OrigLen  : LongWord;
+  End;
+
+(**
+ * Save the ring as pcap file, every transfer gives a submission and a
+ * completion packet
+ *)
+Procedure TUsbTrace.SavePcap(AFilename:String);
+Var Stream : TFileStream;
+    Header : TPcapHeader;
+    Seq    : Int64;
+    Rec    : TTraceRecord;
+    Data   : AnsiString;
+
+  Procedure Packet(Complete:Boolean);
+  Var P   : TUsbmonPacket;
+      R   : TPcapRecord;
+      Ts  : UInt64;
+      Cap : Boolean;
+  Begin
+    FillChar(P,SizeOf(P),0);
+    P.Id       := Rec.Submit xor QWord(Rec.Seq shl 40);   // unique per transfer like an URB address
+    P.XferType := Rec.XferType;
+    P.EPNum    := Rec.EP;
+    P.DevNum   := Rec.DevAddr;
+    P.BusNum   := Rec.Bus;
+    // the payload belongs to the submission for OUT and to the completion for IN
+    Cap := (Rec.EP and LIBUSB_ENDPOINT_IN <> 0) = Complete;
+    if not Complete then
+      Begin
+        Ts := Rec.Submit;
+        P.EvType := 'S';
+        P.Status := -ESysEINPROGRESS;
+        P.Length := Rec.Length;
+        if Rec.XferType = TRACE_XFER_CONTROL then
+          Begin
+            P.FlagSetup := #0;
+            P.Setup     := Rec.Setup;
+          End
+        else
+          P.FlagSetup := '-';
+      End
+    else
+      Begin
+        Ts := Rec.Complete;
+        P.EvType := 'C';
+        P.Status := UrbStatus(Rec.Status);
+        if Rec.Status > 0 then
+          P.Length := Rec.Status;
+        P.FlagSetup := '-';
+      End;
+    if Cap then
+      Begin
+        P.FlagData := #0;
+        P.LenCap   := Length(Data);
+      End
+    else
+      P.FlagData := Select(Complete,'>','<')[1];
+    if not Cap then
+      P.LenCap := 0;
+    P.TsSec  := Ts div 1000000;
+    P.TsUSec := Ts mod 1000000;
+    R.TsSec   := P.TsSec;
+    R.TsUSec  := P.TsUSec;
+    R.InclLen := SizeOf(P) + P.LenCap;
+    R.OrigLen := SizeOf(P) + P.LenCap;
+    Stream.WriteBuffer(R,SizeOf(R));
+    Stream.WriteBuffer(P,SizeOf(P));
+    if P.LenCap > 0 then
+      Stream.WriteBuffer(Data[1],P.LenCap);
+  End;
+
+Begin
+  Stream := TFileStream.Create(AFilename,fmCreate);
+  try
+    Header.Magic    := $A1B2C3D4;   // host byte order, as usbmon's headers
+    Header.Major    := 2;
+    Header.Minor    := 4;
+    Header.ThisZone := 0;
+    Header.SigFigs  := 0;
+    Header.SnapLen  := 65535;
+    Header.Network  := 189;         // LINKTYPE_USB_LINUX
+    Stream.WriteBuffer(Header,SizeOf(Header));
+    For Seq := FHead-Count+1 to FHead do
+      Begin
+        if not Snapshot(Seq,Rec,Data) then
+          Continue;
+        Packet(false);
+        Packet(true);
+      End;
+  finally
+    Stream.Free;
+  End;
+End;
+
+Initialization
+  Trace := TUsbTrace.Create;
+Finalization
+  Trace.Free;
+End.
@@ -5,6 +5,12 @@ Interface
 Uses SysUtils,StrUtils,Classes,BaseUnix,Unix;
 
 Const HexChars = '0123456789ABCDEF';
+      HEXDUMP_LINE_MAX    = 8+2+16*3+2+16+1;   // address, bytes, ASCII column, newline
+      HEXDUMP_BLOCK_LINES = 256;               // lines per write of HexDump
+
+Var HexDumpProfiling : Boolean;    // measure the time spent in HexDump
+ThreadVar HexDumpTime : UInt64;
+          InHexDump   : Boolean;   // its writes are already included, see Profiler
 
 Function HexToInt(St:ShortString):Int64;
 Function Str2Int(St:ShortString):LongInt;
@@ -15,6 +21,8 @@ Function FileSearchGlobList(Glob:AnsiString):TStringList;
 Function GetHeapSize : SizeInt;
 Procedure HexDump(Addr:Integer;Var Buf;Length:SizeUInt);
 Procedure HexDump(Var Buf;Length:SizeUInt);
+Procedure HexDump(Addr:Integer;Var Buf;Length:SizeUInt;Stream:TStream);
+Function HexDumpStr(Addr:Integer;Var Buf;Length:SizeUInt) : AnsiString;
 Function StrHexDump(Var Buf; Length: SizeUInt) : AnsiString;
 Function StrToHex(St:AnsiString):AnsiString;
 Function RemoveFileExt(Filename,Ext:String) : String;
@@ -30,6 +38,10 @@ Function FindFileInPath(AName,APath:String) : String;
 Function Select(B:Boolean;T,F:String):String;
 Function Select(I : Integer; Const S:Array of String) : String;
 Function GetUSec : UInt64;
+Procedure SortSamples(Var A:Array of LongWord;L,R:Integer);
+Function TclQuote(St:AnsiString) : AnsiString;
+Function BinToTcl(Const Buf;Len:SizeInt) : AnsiString;
+Function TclToBin(Const St:AnsiString) : AnsiString;
 
 Implementation
 
@@ -102,27 +114,111 @@ Begin
   Result := Status.CurrHeapUsed;
 End;
 
-Procedure HexDump(Addr:Integer;Var Buf;Length:SizeUInt);
-Var I : SizeUInt;
-    S : ShortString;
+Var HexTable   : Array[Byte] of Array[0..1] of Char;   // initialized below
+    AsciiTable : Array[Byte] of Char;
+
+(**
+ * Render "AAAA: " with 4 address digits, more only if necessary
+ *)
+Function RenderAddr(Addr:SizeUInt;Dest:PChar) : PChar;
+Var I : Integer;
 Begin
-  Write(IntToHex(Addr and $FFF0,4),': ',StringOfChar(' ',3*(Addr and $000F)));
-  S := '';
-  For I := 0 to Length-1 do
+  I := 3;
+  while (I < 7) and (Addr shr (4*(I+1)) <> 0) do
+    Inc(I);
+  For I := I downto 0 do
     Begin
-      Write(IntToHex((PByte(@Buf + I))^,2),' ');
-      if (PByte(@Buf + I)^ >= Ord(' ')) and (PByte(@Buf + I)^ < $80) then
-        S := S + Chr(PByte(@Buf + I)^)
-      else
-        S := S + '.';
-      if ((Addr+I) and $000F = $000F) and (I <> Length-1) then
+      Dest^ := HexChars[(Addr shr (4*I)) and $0F + 1];
+      Inc(Dest);
+    End;
+  Dest[0] := ':';
+  Dest[1] := ' ';
+  Result := Dest + 2;
+End;
+
+(**
+ * Render hex dump lines to Dest
+ *
+ * Dest must provide HEXDUMP_LINE_MAX chars for every (started) 16 byte row.
+ * If Addr doesn't start a row, the first line is indented to keep the columns
+ * aligned.
+ *
+ * @return pointer behind the last char written
+ *)
+Function RenderHexDump(Addr:SizeUInt;P:PByte;Length:SizeUInt;Dest:PChar) : PChar;
+Var Row : SizeUInt;
+    Col : SizeUInt;
+    Num : SizeUInt;
+    I   : Integer;
+Begin
+  while Length > 0 do
+    Begin
+      Row := Addr and not SizeUInt($000F);
+      Col := Addr and $000F;
+      Num := 16 - Col;
+      if Num > Length then
+        Num := Length;
+      Dest := RenderAddr(Row,Dest);
+      FillChar(Dest^,3*Col,' ');
+      Inc(Dest,3*Col);
+      For I := 0 to Num-1 do
         Begin
-          WriteLn('  ',S);
-          S := '';
-          Write(IntToHex((Addr + I+1) and $FFF0,4),': ');
+          Dest[0] := HexTable[P[I]][0];
+          Dest[1] := HexTable[P[I]][1];
+          Dest[2] := ' ';
+          Inc(Dest,3);
         End;
+      Dest[0] := ' ';
+      Dest[1] := ' ';
+      Inc(Dest,2);
+      For I := 0 to Num-1 do
+        Dest[I] := AsciiTable[P[I]];
+      Inc(Dest,Num);
+      Dest^ := ^J;
+      Inc(Dest);
+      Inc(Addr,Num);
+      Inc(P,Num);
+      Dec(Length,Num);
+    End;
+  Result := Dest;
+End;
+
+(**
+ * Print a hex dump with ASCII column to Output
+ *
+ * Blocks of HEXDUMP_BLOCK_LINES lines are rendered into a buffer and written
+ * at once.
+ *)
+Procedure HexDump(Addr:Integer;Var Buf;Length:SizeUInt);
+Var Block : Array[0..HEXDUMP_BLOCK_LINES*HEXDUMP_LINE_MAX] of Char;
+    P     : PByte;
+    A     : SizeUInt;
+    Num   : SizeUInt;
+    T     : UInt64;
+Begin
+  if HexDumpProfiling then
+    Begin
+      T := GetUSec;
+      InHexDump := true;
+    End;
+  P := @Buf;
+  A := Addr;
+  while Length > 0 do
+    Begin
+      Num := HEXDUMP_BLOCK_LINES*16 - (A and $000F);
+      if Num > Length then
+        Num := Length;
+      RenderHexDump(A,P,Num,@Block[0])^ := #0;
+      Write(PChar(@Block[0]));
+      Inc(A,Num);
+      Inc(P,Num);
+      Dec(Length,Num);
+    End;
+  if HexDumpProfiling then
+    Begin
+      HexDumpTime += GetUSec - T;
+      InHexDump := false;
     End;
-  WriteLn('  ',S);
 End;
 
 Procedure HexDump(Var Buf; Length: SizeUInt);
@@ -130,21 +226,70 @@ Begin
   HexDump($0000,Buf,Length);
 End;
 
+(**
+ * Write a hex dump to a stream, e.g. a log file
+ *)
+Procedure HexDump(Addr:Integer;Var Buf;Length:SizeUInt;Stream:TStream);
+Var Block : Array[0..HEXDUMP_BLOCK_LINES*HEXDUMP_LINE_MAX-1] of Char;
+    P     : PByte;
+    A     : SizeUInt;
+    Num   : SizeUInt;
+Begin
+  P := @Buf;
+  A := Addr;
+  while Length > 0 do
+    Begin
+      Num := HEXDUMP_BLOCK_LINES*16 - (A and $000F);
+      if Num > Length then
+        Num := Length;
+      Stream.WriteBuffer(Block,RenderHexDump(A,P,Num,@Block[0]) - PChar(@Block[0]));
+      Inc(A,Num);
+      Inc(P,Num);
+      Dec(Length,Num);
+    End;
+End;
+
+(**
+ * Hex dump with ASCII column as string
+ *)
+Function HexDumpStr(Addr:Integer;Var Buf;Length:SizeUInt) : AnsiString;
+Var Lines : SizeUInt;
+Begin
+  if Length = 0 then Exit('');
+  Lines := ((Addr and $000F) + Length + 15) div 16;
+  SetLength(Result,Lines*HEXDUMP_LINE_MAX);
+  SetLength(Result,RenderHexDump(Addr,@Buf,Length,PChar(Result)) - PChar(Result));
+End;
+
 Function StrHexDump(Var Buf; Length: SizeUInt) : AnsiString;
-Var I : SizeUInt;
+Var I    : SizeUInt;
+    P    : PByte;
+    Dest : PChar;
 Begin
   if Length <= 0 then Exit('');
-  Result := '0000: ';
+  P := @Buf;
+  // "AAAA: " per row, "XX " per byte, ^J at the end
+  SetLength(Result,((Length+15) div 16)*(HEXDUMP_LINE_MAX-16-2) + 1);
+  Dest := PChar(Result);
   For I := 0 to Length-1 do
     Begin
-      Result += IntToHex((PByte(@Buf + I))^,2) + ' ';
-      if (I and $000F = $000F) and (I <> Length-1) then
+      if I and $000F = 0 then
         Begin
-          Result += ^J;
-          Result += IntToHex(I+1,4)+': ';
+          if I > 0 then
+            Begin
+              Dest^ := ^J;
+              Inc(Dest);
+            End;
+          Dest := RenderAddr(I,Dest);
         End;
+      Dest[0] := HexTable[P[I]][0];
+      Dest[1] := HexTable[P[I]][1];
+      Dest[2] := ' ';
+      Inc(Dest,3);
     End;
-  Result += ^J;
+  Dest^ := ^J;
+  Inc(Dest);
+  SetLength(Result,Dest - PChar(Result));
 End;
 
 Function StrToHex(St:AnsiString):AnsiString;
@@ -350,4 +495,159 @@ Begin
   Result := TZ.tv_usec + TZ.tv_sec*1000000;
 End;
 
+(**
+ * Sort A[L..R] in ascending order (quicksort)
+ *)
+Procedure SortSamples(Var A:Array of LongWord;L,R:Integer);
+Var I,J : Integer;
+    P,T : LongWord;
+Begin
+  while L < R do
+    Begin
+      I := L;
+      J := R;
+      P := A[(L+R) div 2];
+      repeat
+        while A[I] < P do Inc(I);
+        while A[J] > P do Dec(J);
+        if I <= J then
+          Begin
+            T := A[I]; A[I] := A[J]; A[J] := T;
+            Inc(I);
+            Dec(J);
+          End;
+      until I > J;
+      // recurse into the smaller part
+      if J - L < R - I then
+        Begin
+          SortSamples(A,L,J);
+          L := I;
+        End
+      else
+        Begin
+          SortSamples(A,I,R);
+          R := J;
+        End;
+    End;
+End;
+
+(**
+ * Quote a string as one element of a Tcl list
+ *)
+Function TclQuote(St:AnsiString) : AnsiString;
+Const Special = [' ',#9,#10,#13,'{','}','[',']','$','"','\',';'];
+Var I     : Integer;
+    Plain : Boolean;
+Begin
+  if St = '' then
+    Exit('{}');
+  Plain := true;
+  For I := 1 to Length(St) do
+    if St[I] in Special then
+      Plain := false;
+  if Plain then
+    Exit(St);
+  if (Pos('{',St) = 0) and (Pos('}',St) = 0) and (Pos('\',St) = 0) then
+    Exit('{'+St+'}');
+  // backslash-escape every special character
+  Result := '';
+  For I := 1 to Length(St) do
+    Case St[I] of
+      #10 : Result += '\n';
+      #13 : Result += '\r';
+      #9  : Result += '\t';
+    else
+      if St[I] in Special then
+        Result += '\';
+      Result += St[I];
+    End;
+End;
+
+(**
+ * Convert binary data to the string representation of a Tcl byte array
+ *
+ * Tcl represents byte B as the character U+00BB in (modified) UTF-8, i.e.
+ * 0x00 as C0 80 and 0x80..0xFF as two bytes. Strings returned to Tcl are
+ * interpreted as UTF-8, so this is needed to pass binary data unchanged.
+ *)
+Function BinToTcl(Const Buf;Len:SizeInt) : AnsiString;
+Var P : PByte;
+    I : SizeInt;
+    N : SizeInt;
+Begin
+  P := @Buf;
+  N := Len;
+  For I := 0 to Len-1 do
+    if (P[I] = 0) or (P[I] >= $80) then
+      Inc(N);
+  SetLength(Result,N);
+  N := 1;
+  For I := 0 to Len-1 do
+    Begin
+      if (P[I] = 0) or (P[I] >= $80) then
+        Begin
+          Result[N]   := Chr($C0 or (P[I] shr 6));
+          Result[N+1] := Chr($80 or (P[I] and $3F));
+          N += 2;
+        End
+      else
+        Begin
+          Result[N] := Chr(P[I]);
+          Inc(N);
+        End;
+    End;
+End;
+
+(**
+ * Convert the string representation of a Tcl byte array to binary data
+ *
+ * The inverse of BinToTcl. Like Tcl, only the low 8 bits of characters
+ * above U+00FF are used.
+ *)
+Function TclToBin(Const St:AnsiString) : AnsiString;
+Var I : SizeInt;
+    N : SizeInt;
+    C : Byte;
+    V : LongWord;
+    K : Integer;
+Begin
+  SetLength(Result,Length(St));
+  I := 1;
+  N := 0;
+  while I <= Length(St) do
+    Begin
+      C := Byte(St[I]);
+      Inc(I);
+      if      C and $E0 = $C0 then Begin V := C and $1F; K := 1; End
+      else if C and $F0 = $E0 then Begin V := C and $0F; K := 2; End
+      else if C and $F8 = $F0 then Begin V := C and $07; K := 3; End
+      else                         Begin V := C;         K := 0; End;
+      while (K > 0) and (I <= Length(St)) and (Byte(St[I]) and $C0 = $80) do
+        Begin
+          V := (V shl 6) or (Byte(St[I]) and $3F);
+          Inc(I);
+          Dec(K);
+        End;
+      Inc(N);
+      Result[N] := Chr(V and $FF);
+    End;
+  SetLength(Result,N);
+End;
+
+Procedure InitTables;
+Var B : Byte;
+Begin
+  For B := 0 to 255 do
+    Begin
+      HexTable[B][0] := HexChars[B shr 4   + 1];
+      HexTable[B][1] := HexChars[B and $0F + 1];
+      if (B >= Ord(' ')) and (B < $80) then
+        AsciiTable[B] := Chr(B)
+      else
+        AsciiTable[B] := '.';
+    End;
+End;
+
+Initialization
+  InitTables;
 End.
@@ -0,0 +1,327 @@
+############################################################################
+#    Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            #
+#                                                                          #
+#    This program is free software; you can redistribute it and/or modify  #
+#    it under the terms of the GNU General Public License as published by  #
+#    the Free Software Foundation; either version 2 of the License, or     #
+#    (at your option) any later version.                                   #
+#                                                                          #
+#    This program is distributed in the hope that it will be useful,       #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of        #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         #
+#    GNU General Public License for more details.                          #
+#                                                                          #
+#    You should have received a copy of the GNU General Public License     #
+#    along with this program; if not, write to the                         #
+#    Free Software Foundation, Inc.,                                       #
+#    59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             #
+############################################################################
+
+# Generate the protocol definitions from commands.def
+#
+# Usage: awk -v out=<kind> -f genproto.awk commands.def > <file>
+#
+#   c-header     firmware/include/protocol.h: opcodes, constants, dispatch
+#                table type and handler prototypes
+#   c-table      firmware/src/cmdtable.c: the dispatch table in __code
+#   pas-const    host/src/protocol.inc: constants and per-opcode tables
+#   pas-decl     host/src/protodecl.inc: stub declarations for TEZToolDevice
+#   pas-impl     host/src/protoimpl.inc: stub implementations
+#
+# Only POSIX awk is used (mawk works too).
+
+function fail(msg) {
+  print "genproto: " msg > "/dev/stderr"
+  Failed = 1
+  exit 1
+}
+
+# parse "0x.." or decimal
+function num(s,   i,v,c) {
+  if (s !~ /^0[xX]/)
+    return s + 0
+  v = 0
+  for (i = 3; i <= length(s); i++) {
+    c = index("0123456789abcdef", tolower(substr(s, i, 1)))
+    if (c == 0)
+      fail("invalid number " s)
+    v = v * 16 + c - 1
+  }
+  return v
+}
+
+# the rest of the line starting at field n
+function rest(n,   i,s) {
+  s = ""
+  for (i = n; i <= NF; i++)
+    s = s (s == "" ? "" : " ") $i
+  return s
+}
+
+function pad(s, n) {
+  while (length(s) < n)
+    s = s " "
+  return s
+}
+
+# append a comment in column 34
+function comment(s, c, text) {
+  if (text == "")
+    return s
+  return pad(s, 33) " " c " " text
+}
+
+# a Pascal array constant, 8 elements per line
+function pas_array(v, n,   i,s) {
+  s = ""
+  for (i = 0; i < n; i++)
+    s = s (i == 0 ? "    " : (i % 8 == 0 ? ",\n    " : ",")) v[i]
+  return s ");"
+}
+
+BEGIN {
+  NConst = 0
+  First = -1
+  Last  = -1
+}
+
+/^[ \t]*(#|$)/ { next }
+
+$1 == "const" {
+  ConstName[NConst] = $2
+  ConstValue[NConst] = num($3)
+  ConstHex[NConst] = ($3 ~ /^0[xX]/)
+  ConstDesc[NConst] = rest(4)
+  NConst++
+  Const[$2] = num($3)
+  next
+}
+
+$1 == "cmd" {
+  if (NF < 9)
+    fail("line " NR ": too few fields")
+  Op = num($2)
+  if (Op in Name)
+    fail("line " NR ": opcode " $2 " defined twice")
+  Name[Op]   = $3
+  if (length("CMD_" $3) > NameWidth)
+    NameWidth = length("CMD_" $3)
+  Setup[Op]  = $4
+  In[Op]     = $5
+  Out[Op]    = $6
+  MaxLen[Op] = num($7)
+  Since[Op]  = num($8)
+  Stub[Op]   = $9
+  Desc[Op]   = rest(10)
+  if (First < 0 || Op < First) First = Op
+  if (Op > Last) Last = Op
+  next
+}
+
+{
+  fail("line " NR ": unknown keyword " $1)
+}
+
+function c_handler(h) {
+  return (h == "-") ? "0" : h
+}
+
+function c_header(   i,Op,Bits,Handlers,Seen,h) {
+  print "/* generated by protocol/genproto.awk from protocol/commands.def, don't edit */"
+  print ""
+  print "#ifndef __PROTOCOL_H"
+  print "#define __PROTOCOL_H"
+  print ""
+  print "#include <stdint.h>"
+  print ""
+  for (i = 0; i < NConst; i++)
+    print comment(sprintf("#define %s %s", pad(ConstName[i], 20),
+                          ConstHex[i] ? sprintf("0x%02X", ConstValue[i]) : ConstValue[i]),
+                  "//", ConstDesc[i])
+  print ""
+  print "/*"
+  print " * Command definition"
+  print " */"
+  for (Op = First; Op <= Last; Op++)
+    if (Op in Name)
+      printf("#define %s 0x%02X%s\n", pad("CMD_" Name[Op], NameWidth), Op,
+             Desc[Op] == "" ? "" : "    // " Desc[Op])
+  print ""
+  printf("#define CMD_TABLE_FIRST   0x%02X\n", First)
+  printf("#define CMD_TABLE_SIZE    %d\n", Last - First + 1)
+  print ""
+  Bits = 0
+  for (Op = First; Op <= Last; Op++)
+    if (Op in Name)
+      Bits += 2 ^ (Op - Const["CAPS_FIRST_OPCODE"])
+  print "// bit n: CAPS_FIRST_OPCODE+n is supported"
+  printf("#define CAPS_OPCODES      0x%06XUL\n", Bits)
+  print "// initializer of TGetCaps.MaxLength"
+  printf("#define CAPS_MAX_LENGTH   {")
+  for (i = 0; i < Const["CAPS_NUM_OPCODES"]; i++) {
+    Op = Const["CAPS_FIRST_OPCODE"] + i
+    printf("%s%s", i ? ", " : " ", (Op in Name) ? sprintf("0x%04X", MaxLen[Op]) : "0")
+  }
+  print " }"
+  print ""
+  print "/**"
+  print " * Handlers of a command, see HandleCmd(), HandleIn() and HandleOut()"
+  print " */"
+  print "typedef void (*TCmdHandler)(void);"
+  print ""
+  print "typedef struct {"
+  print "  TCmdHandler Setup;    // command arrived on EP0"
+  print "  TCmdHandler In;       // host fetched an EP2 IN packet"
+  print "  TCmdHandler Out;      // EP2 OUT packet arrived"
+  print "} TCmdEntry;"
+  print ""
+  print "extern const __code TCmdEntry CmdTable[CMD_TABLE_SIZE];"
+  print ""
+  print "// handlers, defined in commands.c"
+  for (Op = First; Op <= Last; Op++)
+    if (Op in Name) {
+      Handlers[1] = Setup[Op]; Handlers[2] = In[Op]; Handlers[3] = Out[Op]
+      for (i = 1; i <= 3; i++) {
+        h = Handlers[i]
+        if (h != "-" && !(h in Seen)) {
+          Seen[h] = 1
+          print "void " h "(void);"
+        }
+      }
+    }
+  print ""
+  print "#endif  // __PROTOCOL_H"
+}
+
+function c_table(   Op) {
+  print "/* generated by protocol/genproto.awk from protocol/commands.def, don't edit */"
+  print ""
+  print "#include \"protocol.h\""
+  print ""
+  print "/**"
+  print " * Dispatch table, indexed by opcode - CMD_TABLE_FIRST"
+  print " */"
+  print "const __code TCmdEntry CmdTable[CMD_TABLE_SIZE] = {"
+  for (Op = First; Op <= Last; Op++)
+    if (Op in Name)
+      printf("  /* 0x%02X %s */ { %s, %s, %s },\n", Op, pad(Name[Op], 15),
+             c_handler(Setup[Op]), c_handler(In[Op]), c_handler(Out[Op]))
+    else
+      printf("  /* 0x%02X %s */ { 0, 0, 0 },\n", Op, pad("", 15))
+  print "};"
+}
+
+function pas_num(v, hex) {
+  return hex ? sprintf("$%02X", v) : v
+}
+
+function pas_const(   i,Op,N,A) {
+  print "{ generated by protocol/genproto.awk from protocol/commands.def, don't edit }"
+  print ""
+  print "Const"
+  for (i = 0; i < NConst; i++)
+    print comment(sprintf("  %s= %s;", pad(ConstName[i], 21), pas_num(ConstValue[i], ConstHex[i])),
+                  "//", ConstDesc[i])
+  print ""
+  print "Const"
+  for (Op = First; Op <= Last; Op++)
+    if (Op in Name)
+      printf("  %s= $%02X;%s\n", pad("CMD_" Name[Op], NameWidth + 1), Op,
+             Desc[Op] == "" ? "" : "    // " Desc[Op])
+  print ""
+  N = Const["CAPS_NUM_OPCODES"]
+  print "Const"
+  print "  { indexed by opcode - CAPS_FIRST_OPCODE }"
+  for (i = 0; i < N; i++) {
+    Op = Const["CAPS_FIRST_OPCODE"] + i
+    A[i] = "'" ((Op in Name) ? Name[Op] : "") "'"
+  }
+  print "  CmdNames : Array[0..CAPS_NUM_OPCODES-1] of String[15] = ("
+  print pas_array(A, N)
+  for (i = 0; i < N; i++) {
+    Op = Const["CAPS_FIRST_OPCODE"] + i
+    A[i] = (Op in Name) ? sprintf("$%04X", Since[Op]) : "$FFFF"
+  }
+  print "  { first firmware version with the command, $FFFF: unknown }"
+  print "  CmdSince : Array[0..CAPS_NUM_OPCODES-1] of Word = ("
+  print pas_array(A, N)
+  for (i = 0; i < N; i++) {
+    Op = Const["CAPS_FIRST_OPCODE"] + i
+    A[i] = (Op in Name) ? sprintf("$%04X", MaxLen[Op]) : "0"
+  }
+  print "  { maximum wValue, the same as reported with CMD_GET_CAPS }"
+  print "  CmdMaxLength : Array[0..CAPS_NUM_OPCODES-1] of Word = ("
+  print pas_array(A, N)
+}
+
+# split "Name:Type" or "Name()"
+function stub_name(s) {
+  sub(/[:(].*$/, "", s)
+  return s
+}
+
+function pas_decl(   Op,N) {
+  print "    { generated by protocol/genproto.awk from protocol/commands.def, don't edit }"
+  for (Op = First; Op <= Last; Op++)
+    if ((Op in Name) && Stub[Op] != "-") {
+      N = stub_name(Stub[Op])
+      if (Stub[Op] ~ /:/)
+        printf("    Function  %s : %s;\n", N, substr(Stub[Op], index(Stub[Op], ":") + 1))
+      else if (Stub[Op] ~ /\(\)$/)
+        printf("    Procedure %s(Value:Word);\n", N)
+    }
+}
+
+function pas_impl(   Op,N,T) {
+  print "{ generated by protocol/genproto.awk from protocol/commands.def, don't edit }"
+  for (Op = First; Op <= Last; Op++) {
+    if (!(Op in Name) || Stub[Op] == "-")
+      continue
+    N = stub_name(Stub[Op])
+    print ""
+    if (Stub[Op] ~ /:/) {
+      T = substr(Stub[Op], index(Stub[Op], ":") + 1)
+      print "Function TEZToolDevice." N " : " T ";"
+    } else
+      print "Procedure TEZToolDevice." N "(Value:Word);"
+    print "Var R : LongInt;"
+    print "Begin"
+    print "  Require(CMD_" Name[Op] ",'" N "');"
+    print "  EnterCriticalSection(FLock);"
+    print "  try"
+    if (Stub[Op] ~ /:/) {
+      print "    R := SendCommand(CMD_" Name[Op] ",0,0);"
+      print "    if R < 0 then"
+      print "      raise ELibUsb.Create(R,'" N " SendCommand');"
+      print "    R := BulkRecv(Result,SizeOf(Result),100);"
+      print "    if R <> SizeOf(Result) then"
+      print "      raise ELibUsb.Create(R,'" N " EP Recv');"
+    } else {
+      print "    R := SendCommand(CMD_" Name[Op] ",Value,0);"
+      print "    if R < 0 then"
+      print "      raise ELibUsb.Create(R,'" N " SendCommand');"
+    }
+    print "  finally"
+    print "    LeaveCriticalSection(FLock);"
+    print "  End;"
+    print "End;"
+  }
+}
+
+END {
+  # END is executed after exit too
+  if (Failed)
+    exit 1
+  if (First < 0)
+    fail("no commands")
+  if (First < Const["CAPS_FIRST_OPCODE"] || Last >= Const["CAPS_FIRST_OPCODE"] + Const["CAPS_NUM_OPCODES"])
+    fail("opcodes exceed CAPS_FIRST_OPCODE .. CAPS_NUM_OPCODES")
+  if      (out == "c-header")  c_header()
+  else if (out == "c-table")   c_table()
+  else if (out == "pas-const") pas_const()
+  else if (out == "pas-decl")  pas_decl()
+  else if (out == "pas-impl")  pas_impl()
+  else {
+    fail("unknown output \"" out "\"")
+  }
+}